@@ -0,0 +1,161 @@
+// analyses.h
+// Token-level analyses run by `--analyze` through one TokenFanout (see
+// fanout.h), so a file is lexed once however many of them run. Each keeps
+// per-file state, reset by beginFile(), and prints it with report().
+
+#pragma once
+
+#include "fanout.h"
+#include "interner.h"
+
+class TokenAnalysis : public TokenConsumer {
+public:
+    virtual void report(ostream &out) const = 0;
+};
+
+// Token counts by type, and the line the last token is on.
+class TokenMetrics : public TokenAnalysis {
+public:
+    void beginFile(const string &) override {
+        counts_.fill(0);
+        tokens_ = 0;
+        lines_ = 0;
+    }
+
+    void consume(const Token *tokens, size_t count) override {
+        for (size_t i = 0; i < count; ++i) ++counts_[size_t(tokens[i].type)];
+        tokens_ += count;
+        if (count) lines_ = tokens[count - 1].line;
+    }
+
+    void report(ostream &out) const override {
+        out << "  metrics: " << tokens_ << " tokens on " << lines_ << " lines";
+        const char *sep = " (";
+        for (size_t t = 0; t < counts_.size(); ++t) {
+            if (!counts_[t]) continue;
+            out << sep << tokenTypeToString(TokenType(t)) << " " << counts_[t];
+            sep = ", ";
+        }
+        out << (tokens_ ? ")\n" : "\n");
+    }
+
+private:
+    array<size_t, size_t(TokenType::Unknown) + 1> counts_{};
+    size_t tokens_ = 0;
+    int lines_ = 0;
+};
+
+// How often each identifier occurs; reports the most used ones.
+class IdentifierIndex : public TokenAnalysis {
+public:
+    static constexpr size_t kShown = 5;
+
+    void beginFile(const string &) override {
+        names_.clear();
+        counts_.clear();
+    }
+
+    void consume(const Token *tokens, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            if (tokens[i].kind != TokenKind::Identifier) continue;
+            uint32_t id = names_.intern(tokens[i]);
+            if (id == counts_.size()) counts_.push_back(0);
+            ++counts_[id];
+        }
+    }
+
+    void report(ostream &out) const override {
+        vector<pair<string_view, size_t>> top;
+        top.reserve(counts_.size());
+        for (uint32_t id = 0; id < counts_.size(); ++id) top.emplace_back(names_.name(id), counts_[id]);
+        size_t shown = min(kShown, top.size());
+        partial_sort(top.begin(), top.begin() + shown, top.end(), [](const auto &x, const auto &y) {
+            return x.second != y.second ? x.second > y.second : x.first < y.first;
+        });
+        out << "  identifiers: " << counts_.size() << " distinct";
+        for (size_t i = 0; i < shown; ++i) out << (i ? ", " : ", most used: ") << top[i].first << " " << top[i].second;
+        out << "\n";
+    }
+
+private:
+    Interner names_; // views into the source, valid until the next file
+    vector<size_t> counts_; // by interned ID
+};
+
+// FNV-1a over the sequence of token kinds. Names and literal values are
+// left out, so code that differs only in them (a renamed copy) gets the
+// same fingerprint.
+class StructureFingerprint : public TokenAnalysis {
+public:
+    void beginFile(const string &) override { hash_ = kOffset; }
+
+    void consume(const Token *tokens, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            uint16_t k = uint16_t(tokens[i].kind);
+            hash_ = (hash_ ^ (k & 0xFF)) * kPrime;
+            hash_ = (hash_ ^ (k >> 8)) * kPrime;
+        }
+    }
+
+    void report(ostream &out) const override {
+        char text[17];
+        snprintf(text, sizeof text, "%016llx", static_cast<unsigned long long>(hash_));
+        out << "  fingerprint: " << text << "\n";
+    }
+
+private:
+    static constexpr uint64_t kOffset = 14695981039346656037ull, kPrime = 1099511628211ull;
+    uint64_t hash_ = kOffset;
+};
+
+// Likely mistakes visible in the token stream alone: `=` at the top level
+// of an if or while condition, and an if whose body is a lone ';'.
+class TokenLint : public TokenAnalysis {
+public:
+    void beginFile(const string &name) override {
+        name_ = name;
+        warnings_.clear();
+        state_ = Idle;
+    }
+
+    void consume(const Token *tokens, size_t count) override {
+        for (size_t i = 0; i < count; ++i) step(tokens[i]);
+    }
+
+    void report(ostream &out) const override {
+        out << "  lint: " << warnings_.size() << " warning(s)\n";
+        for (const auto &[line, message] : warnings_) out << name_ << ":" << line << ": warning: " << message << "\n";
+    }
+
+private:
+    enum State { Idle, AfterKeyword, InCondition, AfterCondition } state_ = Idle;
+    bool isIf_ = false;
+    int depth_ = 0;
+    string name_;
+    vector<pair<int, string>> warnings_;
+
+    void step(const Token &t) {
+        switch (state_) {
+            case AfterCondition:
+                if (t.kind == TokenKind::DelimSemicolon) warnings_.push_back({t.line, "empty body after if"});
+                state_ = Idle;
+                break;
+            case AfterKeyword:
+                state_ = t.kind == TokenKind::DelimLParen ? InCondition : Idle;
+                depth_ = 1;
+                return;
+            case InCondition:
+                if (t.kind == TokenKind::DelimLParen) ++depth_;
+                if (t.kind == TokenKind::DelimRParen && --depth_ == 0) state_ = isIf_ ? AfterCondition : Idle;
+                if (t.kind == TokenKind::OpAssign && depth_ == 1)
+                    warnings_.push_back({t.line, "assignment in a condition (did you mean '=='?)"});
+                return;
+            case Idle:
+                break;
+        }
+        if (t.kind == TokenKind::KwIf || t.kind == TokenKind::KwWhile) {
+            isIf_ = t.kind == TokenKind::KwIf;
+            state_ = AfterKeyword;
+        }
+    }
+};
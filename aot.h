@@ -0,0 +1,427 @@
+// aot.h
+// Ahead-of-time backend. The bytecode of a program is translated to
+// portable C: one C function per bytecode function, registers as locals,
+// jumps as gotos, and the same wrapping arithmetic, step counting and
+// call-depth and division checks as the VM. The system C compiler ($CC,
+// else cc) turns it into a shared object that is loaded with dlopen.
+//
+// Modules are cached on disk under a hash of the generated C, so a
+// program (or an edit that does not change its bytecode) is compiled once.
+// The cache lives in $TK_CACHE_DIR, else $XDG_CACHE_HOME/tokenizer, else
+// ~/.cache/tokenizer. Where there is no dlopen, or the C compiler fails,
+// AotRunner runs the program in the VM instead and says why.
+
+#pragma once
+
+#include "vm.h"
+#include "pool.h"
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(TK_NO_AOT)
+#include <dlfcn.h>
+#include <unistd.h>
+#define TK_AOT_AVAILABLE 1
+#endif
+
+// What the generated code shares with the host; the C prelude below
+// declares the same layout as tk_ctx.
+struct AotContext {
+    Value *globals;
+    uint64_t steps, maxSteps;
+    uint32_t depth, maxDepth; // depth counts the entry call, like the VM's frames
+    uint32_t status;          // AotStop
+    uint32_t pc;              // the instruction that stopped the program
+    void *host;
+    void (*print)(void *host, Value v, uint32_t type, uint32_t newline);
+    uintptr_t stackLimit;     // native stack below this counts as overflow
+};
+
+enum class AotStop : uint32_t { None, DivisionByZero, CallStackOverflow, StepLimit };
+
+// ---------- C emitter ----------
+
+inline const char *aotPrelude() {
+    return R"(#include <stdint.h>
+typedef union { int64_t i; double f; } tk_value;
+typedef struct {
+    tk_value *globals;
+    uint64_t steps, max_steps;
+    uint32_t depth, max_depth;
+    uint32_t status, pc;
+    void *host;
+    void (*print)(void *, tk_value, uint32_t, uint32_t);
+    uintptr_t stack_limit;
+} tk_ctx;
+static const tk_value tk_zero;
+#define W32(x) ((int64_t)(int32_t)(uint32_t)(uint64_t)(x))
+#define ADD(a, b) ((int64_t)((uint64_t)(a) + (uint64_t)(b)))
+#define SUB(a, b) ((int64_t)((uint64_t)(a) - (uint64_t)(b)))
+#define MUL(a, b) ((int64_t)((uint64_t)(a) * (uint64_t)(b)))
+#define F32(x) ((double)(float)(x))
+#define FAIL(code, at) do { ctx->status = code; ctx->pc = at; return tk_zero; } while (0)
+#define STEP(at) if (++ctx->steps > ctx->max_steps) FAIL(3, at)
+#define ENTER(at) do { char probe_; STEP(at); \
+    if (ctx->depth >= ctx->max_depth || (uintptr_t)&probe_ < ctx->stack_limit) FAIL(2, at); \
+    ++ctx->depth; } while (0)
+static int64_t tk_d2i(double v) {
+    if (v != v) return 0;
+    if (v >= 9223372036854775807.0) return INT64_MAX;
+    if (v <= -9223372036854775808.0) return INT64_MIN;
+    return (int64_t)v;
+}
+)";
+}
+
+// Translate `program` to a C translation unit exporting
+// `tk_value tk_call(tk_ctx *, uint32_t function)`. Function bodies are
+// independent, so with a pool they are written in parallel and then joined
+// in entry order; the text is the same either way.
+inline string emitC(const Program &program, WorkStealingPool *pool = nullptr) {
+    const vector<BytecodeFunction> &fns = program.functions;
+    vector<uint32_t> order;
+    for (uint32_t f = 0; f < fns.size(); ++f)
+        if (fns[f].defined) order.push_back(f);
+    sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return fns[x].entry < fns[y].entry; });
+
+    string c = aotPrelude();
+    auto signature = [&](uint32_t f) {
+        string s = "static tk_value f" + to_string(f) + "(tk_ctx *ctx";
+        for (size_t k = 0; k < fns[f].params.size(); ++k) s += ", tk_value r" + to_string(k);
+        return s + ")";
+    };
+    for (uint32_t f : order) c += signature(f) + ";\n";
+
+    auto r = [](uint32_t reg) { return "r" + to_string(reg); };
+    auto bits = [](int64_t v) {
+        char buf[32];
+        snprintf(buf, sizeof buf, "(int64_t)0x%llxull", static_cast<unsigned long long>(v));
+        return string(buf);
+    };
+    vector<string> bodies(order.size());
+    auto body = [&](size_t k) {
+        TraceScope span("emit C function", "aot");
+        string &c = bodies[k];
+        uint32_t f = order[k];
+        uint32_t begin = fns[f].entry, end = k + 1 < order.size() ? fns[order[k + 1]].entry : uint32_t(program.code.size());
+        c += "\n// " + fns[f].name + "\n" + signature(f) + " {\n    tk_value *const G = ctx->globals;\n";
+        for (uint32_t reg = uint32_t(fns[f].params.size()); reg < fns[f].numRegs; ++reg) c += "    tk_value " + r(reg) + " = tk_zero;\n";
+
+        vector<bool> target(end - begin, false);
+        for (uint32_t pc = begin; pc < end; ++pc) {
+            Op op = program.code[pc].op;
+            if (op == Op::Jmp || op == Op::Loop || op == Op::Jz || op == Op::Jnz) target[program.code[pc].wide() - begin] = true;
+        }
+        for (uint32_t pc = begin; pc < end; ++pc) {
+            const Instr &in = program.code[pc];
+            string at = to_string(pc), A = r(in.a), B = r(in.b), C = r(in.c);
+            if (target[pc - begin]) c += "L" + at + ":\n";
+            string s;
+            auto binary = [&](const string &expr) { s = A + ".i = " + expr + ";"; };
+            auto check = [&] { return "if (" + C + ".i == 0) FAIL(1, " + at + "); "; };
+            switch (in.op) {
+                case Op::Move: s = A + " = " + B + ";"; break;
+                case Op::LoadI: s = A + ".i = " + to_string(int32_t(in.wide())) + ";"; break;
+                case Op::LoadK: s = A + ".i = " + bits(program.constants[in.wide()].i) + ";"; break;
+                case Op::LoadG: s = A + " = G[" + to_string(in.b) + "];"; break;
+                case Op::StoreG: s = "G[" + to_string(in.b) + "] = " + A + ";"; break;
+                case Op::AddI: binary("W32(ADD(" + B + ".i, " + C + ".i))"); break;
+                case Op::AddL: binary("ADD(" + B + ".i, " + C + ".i)"); break;
+                case Op::AddF: s = A + ".f = F32(" + B + ".f + " + C + ".f);"; break;
+                case Op::AddD: s = A + ".f = " + B + ".f + " + C + ".f;"; break;
+                case Op::SubI: binary("W32(SUB(" + B + ".i, " + C + ".i))"); break;
+                case Op::SubL: binary("SUB(" + B + ".i, " + C + ".i)"); break;
+                case Op::SubF: s = A + ".f = F32(" + B + ".f - " + C + ".f);"; break;
+                case Op::SubD: s = A + ".f = " + B + ".f - " + C + ".f;"; break;
+                case Op::MulI: binary("W32(MUL(" + B + ".i, " + C + ".i))"); break;
+                case Op::MulL: binary("MUL(" + B + ".i, " + C + ".i)"); break;
+                case Op::MulF: s = A + ".f = F32(" + B + ".f * " + C + ".f);"; break;
+                case Op::MulD: s = A + ".f = " + B + ".f * " + C + ".f;"; break;
+                case Op::DivI: s = check() + A + ".i = W32(" + B + ".i / " + C + ".i);"; break;
+                case Op::DivL:
+                    s = check() + A + ".i = " + C + ".i == -1 ? SUB(0, " + B + ".i) : " + B + ".i / " + C + ".i;";
+                    break;
+                case Op::DivF: s = A + ".f = F32(" + B + ".f / " + C + ".f);"; break;
+                case Op::DivD: s = A + ".f = " + B + ".f / " + C + ".f;"; break;
+                case Op::ModI: s = check() + A + ".i = " + B + ".i % " + C + ".i;"; break;
+                case Op::ModL: s = check() + A + ".i = " + C + ".i == -1 ? 0 : " + B + ".i % " + C + ".i;"; break;
+                case Op::ShlI: binary("W32((uint64_t)" + B + ".i << (" + C + ".i & 31))"); break;
+                case Op::ShlL: binary("(int64_t)((uint64_t)" + B + ".i << (" + C + ".i & 63))"); break;
+                case Op::ShrI: binary(B + ".i >> (" + C + ".i & 31)"); break;
+                case Op::ShrL: binary(B + ".i >> (" + C + ".i & 63)"); break;
+                case Op::And: binary(B + ".i & " + C + ".i"); break;
+                case Op::Or: binary(B + ".i | " + C + ".i"); break;
+                case Op::Xor: binary(B + ".i ^ " + C + ".i"); break;
+                case Op::Lt: binary(B + ".i < " + C + ".i"); break;
+                case Op::Le: binary(B + ".i <= " + C + ".i"); break;
+                case Op::Eq: binary(B + ".i == " + C + ".i"); break;
+                case Op::Ne: binary(B + ".i != " + C + ".i"); break;
+                case Op::LtD: binary(B + ".f < " + C + ".f"); break;
+                case Op::LeD: binary(B + ".f <= " + C + ".f"); break;
+                case Op::EqD: binary(B + ".f == " + C + ".f"); break;
+                case Op::NeD: binary(B + ".f != " + C + ".f"); break;
+                case Op::NegI: binary("W32(SUB(0, " + B + ".i))"); break;
+                case Op::NegL: binary("SUB(0, " + B + ".i)"); break;
+                case Op::NegD: s = A + ".f = -" + B + ".f;"; break;
+                case Op::Not: binary(B + ".i == 0"); break;
+                case Op::NotD: binary(B + ".f == 0"); break;
+                case Op::BitNot: binary("~" + B + ".i"); break;
+                case Op::IncI: binary("W32(ADD(" + A + ".i, " + to_string(int16_t(in.b)) + "))"); break;
+                case Op::IncL: binary("ADD(" + A + ".i, " + to_string(int16_t(in.b)) + ")"); break;
+                case Op::ToBool: binary(B + ".i != 0"); break;
+                case Op::ToBoolD: binary(B + ".f != 0"); break;
+                case Op::Sext8: binary("(int8_t)(uint8_t)" + B + ".i"); break;
+                case Op::Sext16: binary("(int16_t)(uint16_t)" + B + ".i"); break;
+                case Op::Sext32: binary("W32(" + B + ".i)"); break;
+                case Op::I2F: s = A + ".f = F32((double)" + B + ".i);"; break;
+                case Op::I2D: s = A + ".f = (double)" + B + ".i;"; break;
+                case Op::D2F: s = A + ".f = F32(" + B + ".f);"; break;
+                case Op::D2I: binary("tk_d2i(" + B + ".f)"); break;
+                case Op::Jmp: s = "goto L" + to_string(in.wide()) + ";"; break;
+                case Op::Loop: s = "STEP(" + at + "); goto L" + to_string(in.wide()) + ";"; break;
+                case Op::Jz: s = "if (" + A + ".i == 0) goto L" + to_string(in.wide()) + ";"; break;
+                case Op::Jnz: s = "if (" + A + ".i != 0) goto L" + to_string(in.wide()) + ";"; break;
+                case Op::Call:
+                    s = "ENTER(" + at + "); " + A + " = f" + to_string(in.b) + "(ctx";
+                    for (uint32_t a = 0; a < in.c; ++a) s += ", " + r(in.a + a);
+                    s += "); --ctx->depth; if (ctx->status) return tk_zero;";
+                    break;
+                case Op::Ret: s = "return " + A + ";"; break;
+                case Op::RetV: s = "return tk_zero;"; break;
+                case Op::Print:
+                    s = "ctx->print(ctx->host, " + A + ", " + to_string(in.b) + ", " + to_string(in.c) + ");";
+                    break;
+            }
+            c += "    " + s + "\n";
+        }
+        c += "    return tk_zero;\n}\n";
+    };
+    if (pool) {
+        pool->run(order.size(), body);
+    } else {
+        for (size_t k = 0; k < order.size(); ++k) body(k);
+    }
+    for (const string &b : bodies) c += b;
+
+    c += "\ntk_value tk_call(tk_ctx *ctx, uint32_t function) {\n    switch (function) {\n";
+    for (uint32_t f : order) {
+        c += "        case " + to_string(f) + ": return f" + to_string(f) + "(ctx";
+        for (size_t k = 0; k < fns[f].params.size(); ++k) c += ", tk_zero";
+        c += ");\n";
+    }
+    c += "    }\n    return tk_zero;\n}\n";
+    return c;
+}
+
+// ---------- Module cache and loader ----------
+
+struct AotOptions {
+    bool useCache = true;              // false: always rebuild (to time the C compiler)
+    WorkStealingPool *pool = nullptr;  // writes the C source in parallel
+};
+
+class AotModule {
+public:
+    using Entry = Value (*)(AotContext *, uint32_t);
+
+    AotModule() = default;
+    AotModule(const AotModule &) = delete;
+    AotModule &operator=(const AotModule &) = delete;
+    ~AotModule() {
+#ifdef TK_AOT_AVAILABLE
+        if (handle_) dlclose(handle_);
+#endif
+    }
+
+    // Build (or find in the cache) and load the module for `program`. On
+    // failure error() says why and entry() is null.
+    bool load(const Program &program, const AotOptions &options) {
+        auto start = chrono::steady_clock::now();
+#ifndef TK_AOT_AVAILABLE
+        (void)program;
+        (void)options;
+        error_ = "no dlopen on this platform";
+        return false;
+#else
+        const char *cc = getenv("CC");
+        string compiler = cc && *cc ? cc : "cc";
+        string flags = "-O2 -std=c99 -fPIC -shared -fwrapv -ffp-contract=off -w";
+        string source = emitC(program, options.pool);
+        string dir = cacheDir();
+        if (dir.empty()) {
+            error_ = "no writable cache directory";
+            return false;
+        }
+        char name[40];
+        snprintf(name, sizeof name, "/tk-%016llx.so",
+                 static_cast<unsigned long long>(fnv1a(compiler + " " + flags + "\n" + source)));
+        string path = dir + name;
+
+        cached_ = options.useCache && filesystem::exists(path);
+        if (cached_) TK_PROBE1(aot_cache_hit, path.c_str());
+        else TK_PROBE1(aot_cache_miss, path.c_str());
+        if (!cached_) {
+            string stem = path.substr(0, path.size() - 3) + "-" + to_string(getpid());
+            string cPath = stem + ".c", soPath = stem + ".so", logPath = stem + ".log";
+            {
+                ofstream file(cPath, ios::binary);
+                file << source;
+                if (!file) {
+                    error_ = "cannot write " + cPath;
+                    return false;
+                }
+            }
+            string command = compiler + " " + flags + " -o '" + soPath + "' '" + cPath + "' 2>'" + logPath + "'";
+            int status;
+            {
+                TraceScope span("compile C module", "aot");
+                status = system(command.c_str());
+            }
+            error_code ignored;
+            filesystem::remove(cPath, ignored);
+            if (status != 0) {
+                ifstream log(logPath);
+                string first;
+                getline(log, first);
+                filesystem::remove(logPath, ignored);
+                filesystem::remove(soPath, ignored);
+                error_ = "C compiler failed" + (first.empty() ? string() : ": " + first);
+                return false;
+            }
+            filesystem::remove(logPath, ignored);
+            filesystem::rename(soPath, path, ignored); // atomic, so concurrent runs never see half a file
+        }
+        handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle_) {
+            error_ = string("dlopen failed: ") + dlerror();
+            return false;
+        }
+        entry_ = reinterpret_cast<Entry>(dlsym(handle_, "tk_call"));
+        if (!entry_) error_ = "module has no tk_call";
+        buildMs_ = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        return entry_ != nullptr;
+#endif
+    }
+
+    Entry entry() const { return entry_; }
+    const string &error() const { return error_; }
+    double buildMs() const { return buildMs_; } // generating, compiling (unless cached) and loading
+    bool cached() const { return cached_; }
+
+private:
+    void *handle_ = nullptr;
+    Entry entry_ = nullptr;
+    string error_;
+    double buildMs_ = 0;
+    bool cached_ = false;
+
+    static uint64_t fnv1a(const string &s) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : s) h = (h ^ c) * 0x100000001b3ull;
+        return h;
+    }
+
+    static string cacheDir() {
+        string dir;
+        if (const char *d = getenv("TK_CACHE_DIR"); d && *d) dir = d;
+        else if (const char *x = getenv("XDG_CACHE_HOME"); x && *x) dir = string(x) + "/tokenizer";
+        else if (const char *h = getenv("HOME"); h && *h) dir = string(h) + "/.cache/tokenizer";
+        else dir = (filesystem::temp_directory_path() / "tokenizer").string();
+        error_code ec;
+        filesystem::create_directories(dir, ec);
+        return filesystem::is_directory(dir, ec) ? dir : string();
+    }
+};
+
+// ---------- Runner ----------
+
+// Runs a program through its AOT module, with the VM's interface and
+// results; falls back to the VM when the module cannot be built.
+class AotRunner {
+public:
+    explicit AotRunner(VmOptions options = {}, AotOptions aot = {}) : options_(options), aot_(aot), vm_(options) {}
+
+    RunStatus run(const Program &program, ostream &out) {
+        program_ = &program;
+        sink_ = &out;
+        fallback_.clear();
+        usedVm_ = false;
+        if (!module_.load(program, aot_)) {
+            fallback_ = module_.error();
+            usedVm_ = true;
+            return vm_.run(program, out);
+        }
+        output_.clear();
+        globals_.assign(program.globals.size(), Value{0});
+        steps_ = 0;
+        exitCode_ = 0;
+        error_ = {0, ""};
+        status_ = RunStatus::Ok;
+        // Generated code recurses on the native stack: give it room for
+        // maxCallDepth frames of the largest function.
+        size_t frame = 256;
+        for (const BytecodeFunction &f : program.functions) frame = max<size_t>(frame, 16 * size_t(f.numRegs) + 256);
+        stackSize_ = min<size_t>(max<size_t>(size_t(options_.maxCallDepth) * frame, 8 << 20), size_t(1) << 30);
+        runWithStack(stackSize_, [this] { execute(); });
+        flush();
+        return status_;
+    }
+
+    const Diagnostic &error() const { return usedVm_ ? vm_.error() : error_; }
+    int64_t exitCode() const { return usedVm_ ? vm_.exitCode() : exitCode_; }
+    const vector<Value> &globals() const { return usedVm_ ? vm_.globals() : globals_; }
+    uint64_t steps() const { return usedVm_ ? vm_.steps() : steps_; }
+    const AotModule &module() const { return module_; }
+    const string &fallback() const { return fallback_; } // why the VM ran instead (empty if it did not)
+
+private:
+    VmOptions options_;
+    AotOptions aot_;
+    VM vm_;
+    AotModule module_;
+    const Program *program_ = nullptr;
+    ostream *sink_ = nullptr;
+    string output_, fallback_;
+    vector<Value> globals_;
+    uint64_t steps_ = 0;
+    int64_t exitCode_ = 0;
+    Diagnostic error_{0, ""};
+    RunStatus status_ = RunStatus::Ok;
+    size_t stackSize_ = 0;
+    bool usedVm_ = false;
+
+    void flush() {
+        sink_->write(output_.data(), output_.size());
+        output_.clear();
+    }
+
+    static void print(void *host, Value v, uint32_t type, uint32_t newline) {
+        AotRunner &self = *static_cast<AotRunner *>(host);
+        appendValue(self.output_, v, ValueType(type), self.program_->strings);
+        if (ValueType(type) != ValueType::Void || newline) self.output_ += newline ? '\n' : ' ';
+        if (self.output_.size() >= 64 * 1024) self.flush();
+    }
+
+    void execute() {
+        const Program &program = *program_;
+        char top;
+        uintptr_t limit = uintptr_t(&top) > stackSize_ ? uintptr_t(&top) - stackSize_ + (256 << 10) : 0;
+        AotContext ctx{globals_.data(), 0, options_.maxSteps, 1, options_.maxCallDepth, 0, 0, this, &print, limit};
+        Value result = module_.entry()(&ctx, 0);
+        if (ctx.status == 0 && program.mainFunction >= 0) {
+            result = module_.entry()(&ctx, uint32_t(program.mainFunction));
+            if (ctx.status == 0 && program.functions[program.mainFunction].returnType != ValueType::Void)
+                exitCode_ = result.i;
+        }
+        steps_ = ctx.steps;
+        switch (AotStop(ctx.status)) {
+            case AotStop::None: break;
+            case AotStop::DivisionByZero: fail(RunStatus::RuntimeError, ctx.pc, "division by zero"); break;
+            case AotStop::CallStackOverflow: fail(RunStatus::RuntimeError, ctx.pc, "call stack overflow"); break;
+            case AotStop::StepLimit: fail(RunStatus::StepLimit, ctx.pc, "step limit exceeded"); break;
+        }
+    }
+
+    void fail(RunStatus status, uint32_t pc, const char *message) {
+        status_ = status;
+        error_ = {program_->lines[pc], message};
+    }
+};
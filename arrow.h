@@ -0,0 +1,424 @@
+// arrow.h
+// Token streams in the Apache Arrow IPC stream format, written without an
+// Arrow library, for loading straight into dataframe tools. One row per
+// token:
+//
+//   file    uint32         index of the file in the input list
+//   kind    dictionary     the TokenKind, as int16 indices into a string
+//                          dictionary ("int", "+=", "<identifier>", ...)
+//   offset  uint32         byte offset in the file
+//   length  uint32         length in bytes
+//   line    uint32         line the token ends on
+//   lexeme  utf8_view      (optional) the token text
+//
+// The stream is a Schema message, one DictionaryBatch with the kind names,
+// record batches of up to kBatchRows rows and an end-of-stream marker.
+// Message metadata is flatbuffers, built by the small FlatBuilder below.
+// Lexemes use the view layout: each lexeme is a 16-byte view holding a
+// short one inline or pointing into a data buffer, and the data buffers are
+// the covered byte ranges of the sources themselves, written out as they
+// are with no per-token copy.
+
+#pragma once
+
+#include <unistd.h>
+
+#include "trace.h"
+
+// ---------- Flatbuffers ----------
+
+// Writes a flatbuffer front to back: a table or vector is written before
+// what it refers to, with its offset fields left zero and filled in by
+// link() once the target is written (flatbuffer offsets only point
+// forward). Tables start at 4 mod 8, so their 8-byte fields, which come
+// first, are aligned.
+class FlatBuilder {
+public:
+    struct Field {
+        uint16_t slot;
+        uint8_t size; // 1, 2, 4 or 8; offsets are 4 and written as 0
+        uint64_t value;
+    };
+
+    FlatBuilder() { put(uint32_t(0)); }
+
+    void clear() {
+        bytes_.clear();
+        put(uint32_t(0));
+    }
+
+    size_t table(vector<Field> fields) {
+        stable_sort(fields.begin(), fields.end(), [](const Field &x, const Field &y) { return x.size > y.size; });
+        uint16_t slots = 0, size = 4;
+        for (const Field &f : fields) slots = max<uint16_t>(slots, f.slot + 1);
+        vector<uint16_t> at(slots, 0);
+        for (const Field &f : fields) {
+            at[f.slot] = size;
+            size += f.size;
+        }
+        pad(2);
+        size_t vtable = bytes_.size();
+        put(uint16_t(4 + 2 * slots));
+        put(size);
+        for (uint16_t offset : at) put(offset);
+        while (bytes_.size() % 8 != 4) bytes_ += '\0';
+        size_t table = bytes_.size();
+        put(int32_t(table - vtable));
+        for (const Field &f : fields) bytes_.append(reinterpret_cast<const char *>(&f.value), f.size);
+        return table;
+    }
+
+    // A vector of `count` elements of `size` bytes, aligned to `size`
+    // (at least 4). With no data the elements are zero: offsets to fill in
+    // with linkElement().
+    size_t vec(size_t count, size_t size, const void *data = nullptr) {
+        size_t align = max<size_t>(size, 4);
+        while ((bytes_.size() + 4) % align) bytes_ += '\0';
+        size_t at = bytes_.size();
+        put(uint32_t(count));
+        if (data) bytes_.append(static_cast<const char *>(data), count * size);
+        else bytes_.append(count * size, '\0');
+        return at;
+    }
+
+    size_t str(string_view s) {
+        pad(4);
+        size_t at = bytes_.size();
+        put(uint32_t(s.size()));
+        bytes_.append(s.data(), s.size());
+        bytes_ += '\0';
+        return at;
+    }
+
+    void link(size_t table, uint16_t slot, size_t target) {
+        size_t vtable = table - read<int32_t>(table);
+        setOffset(table + read<uint16_t>(vtable + 4 + 2 * slot), target);
+    }
+    void linkElement(size_t vector, size_t i, size_t target) { setOffset(vector + 4 + 4 * i, target); }
+    void root(size_t table) { setOffset(0, table); }
+
+    // The finished buffer, padded to a multiple of 8.
+    const string &finish() {
+        pad(8);
+        return bytes_;
+    }
+
+private:
+    string bytes_;
+
+    template <class T>
+    void put(T v) { bytes_.append(reinterpret_cast<const char *>(&v), sizeof v); }
+    template <class T>
+    T read(size_t at) const {
+        T v;
+        memcpy(&v, bytes_.data() + at, sizeof v);
+        return v;
+    }
+    void setOffset(size_t at, size_t target) {
+        uint32_t v = uint32_t(target - at);
+        memcpy(&bytes_[at], &v, sizeof v);
+    }
+    void pad(size_t align) {
+        while (bytes_.size() % align) bytes_ += '\0';
+    }
+};
+
+// ---------- Arrow token writer ----------
+
+// The dictionary entry of a kind: its fixed text, or a bracketed name for
+// kinds whose text varies.
+inline string_view arrowKindName(TokenKind k) {
+    switch (k) {
+        case TokenKind::Identifier: return "<identifier>";
+        case TokenKind::LitInt: return "<integer>";
+        case TokenKind::LitFloat: return "<float>";
+        case TokenKind::LitString: return "<string>";
+        case TokenKind::LitChar: return "<char>";
+        case TokenKind::Unknown: return "<unknown>";
+        default: return tokenKindText(k);
+    }
+}
+
+class ArrowTokenWriter {
+public:
+    // 64K rows: large enough that per-batch overhead vanishes, small enough
+    // that a column of a batch stays in cache.
+    static constexpr size_t kBatchRows = 64 * 1024;
+    static constexpr size_t kAlign = 64;
+    // Pieces up to this many bytes in all are gathered before a write(2).
+    static constexpr size_t kGatherBytes = 64 * 1024;
+
+    // `files` names the files by ID; the names go into the schema metadata
+    // as "file.<id>".
+    ArrowTokenWriter(int fd, bool lexemes, vector<string> files)
+        : fd_(fd), lexemes_(lexemes), files_(move(files)) {}
+
+    // Lex `source`, the file with ID `file`, and append its tokens. Returns
+    // false if it is too large (4 GB or more) or the output failed.
+    bool add(uint32_t file, string source) {
+        if (!started_) start();
+        sources_.push_back(move(source));
+        const string &text = sources_.back();
+        {
+            TraceScope span("lex", "lexer");
+            span.arg("bytes", int64_t(text.size()));
+            if (!lexer_.tokenizePacked(text, packed_)) {
+                sources_.pop_back();
+                return false;
+            }
+        }
+        size_t i = 0;
+        for (const PackedToken &t : packed_.raw()) {
+            uint32_t length = uint32_t(t.length == PackedTokens::kLongToken ? packed_.lexeme(i).size() : t.length);
+            file_.push_back(file);
+            kind_.push_back(int16_t(t.kind));
+            offset_.push_back(t.offset);
+            length_.push_back(length);
+            line_.push_back(uint32_t(packed_.line(i)));
+            if (lexemes_) view(text, t.offset, length);
+            if (file_.size() == kBatchRows) batch();
+            ++i;
+        }
+        if (!lexemes_) sources_.clear();
+        return !failed_;
+    }
+
+    // Diagnostics of the last add().
+    const vector<LexWarning> &diagnostics() const { return lexer_.diagnostics(); }
+
+    // Write the last batch and the end-of-stream marker.
+    bool finish() {
+        if (!started_) start();
+        if (!file_.empty()) batch();
+        static const uint32_t eos[2] = {0xFFFFFFFFu, 0};
+        put(eos, sizeof eos);
+        flush();
+        return !failed_;
+    }
+
+private:
+    // A range of one source that the batch's long lexemes point into.
+    struct Segment {
+        const string *source;
+        uint32_t begin, end;
+    };
+    struct View {
+        int32_t length;
+        char data[12]; // the lexeme if it fits, else prefix[4], buffer, offset
+    };
+    struct Buffer {
+        int64_t offset, length;
+    };
+
+    int fd_;
+    bool lexemes_, started_ = false, failed_ = false;
+    vector<string> files_;
+    Lexer lexer_;
+    PackedTokens packed_;
+    deque<string> sources_; // kept until the batches pointing into them are written
+    vector<uint32_t> file_, offset_, length_, line_;
+    vector<int16_t> kind_;
+    vector<View> views_;
+    vector<Segment> segments_;
+    FlatBuilder fb_;
+    string out_;
+
+    void view(const string &text, uint32_t offset, uint32_t length) {
+        View v{int32_t(length), {}};
+        if (length <= 12) {
+            memcpy(v.data, text.data() + offset, length);
+        } else {
+            if (segments_.empty() || segments_.back().source != &text) segments_.push_back({&text, offset, offset});
+            Segment &s = segments_.back();
+            s.end = offset + length;
+            int32_t buffer = int32_t(segments_.size() - 1), at = int32_t(offset - s.begin);
+            memcpy(v.data, text.data() + offset, 4);
+            memcpy(v.data + 4, &buffer, 4);
+            memcpy(v.data + 8, &at, 4);
+        }
+        views_.push_back(v);
+    }
+
+    // ---------- Messages ----------
+
+    enum : uint8_t { kSchema = 1, kDictionaryBatch = 2, kRecordBatch = 3 };
+    enum : uint8_t { kTypeInt = 2, kTypeUtf8 = 5, kTypeUtf8View = 24 };
+
+    // Message { version: V5, header_type, header, bodyLength }; the header
+    // table is linked in by the caller.
+    size_t message(uint8_t type, int64_t bodyLength) {
+        fb_.clear();
+        size_t m = fb_.table({{0, 2, 4}, {1, 1, type}, {2, 4, 0}, {3, 8, uint64_t(bodyLength)}});
+        fb_.root(m);
+        return m;
+    }
+
+    size_t intType(int bits, bool isSigned) { return fb_.table({{0, 4, uint64_t(bits)}, {1, 1, isSigned}}); }
+
+    // Field { name, nullable: false, type_type, type, dictionary, children: [] }
+    void field(size_t fields, size_t i, string_view name, uint8_t type, bool dictionary) {
+        vector<FlatBuilder::Field> slots = {{0, 4, 0}, {2, 1, type}, {3, 4, 0}, {5, 4, 0}};
+        if (dictionary) slots.push_back({4, 4, 0});
+        size_t f = fb_.table(slots);
+        fb_.linkElement(fields, i, f);
+        fb_.link(f, 0, fb_.str(name));
+        fb_.link(f, 3, type == kTypeInt ? intType(32, false) : fb_.table({}));
+        fb_.link(f, 5, fb_.vec(0, 4));
+        if (dictionary) {
+            // DictionaryEncoding { id: 0, indexType: int16 }
+            size_t d = fb_.table({{1, 4, 0}});
+            fb_.link(d, 1, intType(16, true));
+            fb_.link(f, 4, d);
+        }
+    }
+
+    void start() {
+        started_ = true;
+        size_t m = message(kSchema, 0);
+        // Schema { endianness: Little (the default), fields, custom_metadata }
+        size_t schema = fb_.table({{1, 4, 0}, {2, 4, 0}});
+        fb_.link(m, 2, schema);
+        size_t fields = fb_.vec(lexemes_ ? 6 : 5, 4);
+        fb_.link(schema, 1, fields);
+        field(fields, 0, "file", kTypeInt, false);
+        field(fields, 1, "kind", kTypeUtf8, true);
+        field(fields, 2, "offset", kTypeInt, false);
+        field(fields, 3, "length", kTypeInt, false);
+        field(fields, 4, "line", kTypeInt, false);
+        if (lexemes_) field(fields, 5, "lexeme", kTypeUtf8View, false);
+        size_t metadata = fb_.vec(files_.size(), 4);
+        fb_.link(schema, 2, metadata);
+        for (size_t i = 0; i < files_.size(); ++i) {
+            size_t kv = fb_.table({{0, 4, 0}, {1, 4, 0}});
+            fb_.linkElement(metadata, i, kv);
+            fb_.link(kv, 0, fb_.str("file." + to_string(i)));
+            fb_.link(kv, 1, fb_.str(files_[i]));
+        }
+        send({});
+        dictionary();
+    }
+
+    // A message body: buffers laid out back to back, each at a multiple of
+    // kAlign.
+    struct Piece {
+        const void *data;
+        size_t size;
+    };
+
+    vector<Buffer> layout(const vector<Piece> &body, int64_t &bodyLength) {
+        vector<Buffer> buffers;
+        int64_t at = 0;
+        for (const Piece &p : body) {
+            buffers.push_back({at, int64_t(p.size)});
+            at += int64_t((p.size + kAlign - 1) / kAlign * kAlign);
+        }
+        bodyLength = at;
+        return buffers;
+    }
+
+    // RecordBatch { length, nodes, buffers, variadicBufferCounts }, with
+    // every column `rows` long and without nulls.
+    size_t recordBatch(int64_t rows, size_t columns, const vector<Buffer> &buffers, const vector<int64_t> &variadic) {
+        vector<FlatBuilder::Field> slots = {{0, 8, uint64_t(rows)}, {1, 4, 0}, {2, 4, 0}};
+        if (!variadic.empty()) slots.push_back({4, 4, 0});
+        size_t r = fb_.table(slots);
+        vector<Buffer> nodes(columns, Buffer{rows, 0}); // FieldNode { length, null_count }
+        fb_.link(r, 1, fb_.vec(nodes.size(), sizeof(Buffer), nodes.data()));
+        fb_.link(r, 2, fb_.vec(buffers.size(), sizeof(Buffer), buffers.data()));
+        if (!variadic.empty()) fb_.link(r, 4, fb_.vec(variadic.size(), 8, variadic.data()));
+        return r;
+    }
+
+    // The kind names, as dictionary 0.
+    void dictionary() {
+        vector<int32_t> offsets{0};
+        string names;
+        for (size_t k = 0; k < size_t(TokenKind::Count); ++k) {
+            names += arrowKindName(TokenKind(k));
+            offsets.push_back(int32_t(names.size()));
+        }
+        vector<Piece> body = {{nullptr, 0}, {offsets.data(), offsets.size() * 4}, {names.data(), names.size()}};
+        int64_t bodyLength;
+        vector<Buffer> buffers = layout(body, bodyLength);
+        size_t m = message(kDictionaryBatch, bodyLength);
+        // DictionaryBatch { id: 0, data }
+        size_t d = fb_.table({{1, 4, 0}});
+        fb_.link(m, 2, d);
+        fb_.link(d, 1, recordBatch(int64_t(offsets.size() - 1), 1, buffers, {}));
+        send(body);
+    }
+
+    void batch() {
+        TraceScope span("write batch", "io");
+        size_t rows = file_.size();
+        span.arg("rows", int64_t(rows));
+        vector<Piece> body;
+        auto column = [&](const void *data, size_t size) {
+            body.push_back({nullptr, 0}); // no validity bitmap: nothing is null
+            body.push_back({data, size});
+        };
+        column(file_.data(), rows * 4);
+        column(kind_.data(), rows * 2);
+        column(offset_.data(), rows * 4);
+        column(length_.data(), rows * 4);
+        column(line_.data(), rows * 4);
+        vector<int64_t> variadic;
+        if (lexemes_) {
+            column(views_.data(), rows * sizeof(View));
+            for (const Segment &s : segments_) body.push_back({s.source->data() + s.begin, s.end - s.begin});
+            variadic.push_back(int64_t(segments_.size()));
+        }
+        int64_t bodyLength;
+        vector<Buffer> buffers = layout(body, bodyLength);
+        size_t m = message(kRecordBatch, bodyLength);
+        fb_.link(m, 2, recordBatch(int64_t(rows), lexemes_ ? 6 : 5, buffers, variadic));
+        send(body);
+
+        file_.clear(), kind_.clear(), offset_.clear(), length_.clear(), line_.clear();
+        views_.clear();
+        segments_.clear();
+        // Only the source being lexed (the last) can still be pointed into.
+        while (sources_.size() > 1) sources_.pop_front();
+    }
+
+    // ---------- Output ----------
+
+    // An encapsulated message: continuation marker, metadata size, the
+    // metadata flatbuffer (padded to 8 bytes) and the body.
+    void send(const vector<Piece> &body) {
+        const string &meta = fb_.finish();
+        const uint32_t prefix[2] = {0xFFFFFFFFu, uint32_t(meta.size())};
+        put(prefix, sizeof prefix);
+        put(meta.data(), meta.size());
+        static const char zeros[kAlign] = {};
+        for (const Piece &p : body) {
+            put(p.data, p.size);
+            put(zeros, (kAlign - p.size % kAlign) % kAlign);
+        }
+    }
+
+    // Small pieces are gathered in out_; large ones (columns, sources) are
+    // written from where they are.
+    void put(const void *data, size_t size) {
+        if (out_.size() + size <= kGatherBytes) {
+            out_.append(static_cast<const char *>(data), size);
+            return;
+        }
+        flush();
+        write(static_cast<const char *>(data), size);
+    }
+
+    void flush() {
+        write(out_.data(), out_.size());
+        out_.clear();
+    }
+
+    void write(const char *p, size_t size) {
+        while (size && !failed_) {
+            ssize_t put = ::write(fd_, p, size);
+            if (put < 0 && errno == EINTR) continue;
+            if (put <= 0) failed_ = true;
+            else p += put, size -= size_t(put);
+        }
+    }
+};
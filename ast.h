@@ -0,0 +1,249 @@
+// ast.h
+// Flat AST for the C-like subset. Nodes live in one contiguous array and
+// refer to their children by 32-bit index, and to source text by token
+// index, so a tree is a few plain arrays: cheap to walk, and written to disk
+// or read back as raw bytes.
+
+#pragma once
+
+#include "lexer.h"
+
+// 32 bits wide, like every other AstNode field, so a node has no padding
+// bytes: save() writes nodes as they are, and padding would be whatever
+// happened to be in memory.
+enum class NodeKind : uint32_t {
+    Program,  // list: functions, declarations and top-level statements
+    Function, // token: name, typeToken: return type, list: Params, a: body (none for a prototype)
+    Param,    // token: name, typeToken: type
+    DeclStmt, // list: VarDecls sharing one type
+    VarDecl,  // token: name, typeToken: type, a: initializer, b: array size
+    Block,    // list: statements
+    If,       // a: condition, b: then, c: else
+    While,    // a: condition, b: body
+    DoWhile,  // a: condition, b: body
+    For,      // a: init, b: condition, c: step, d: body (all but body optional)
+    Return,   // a: value (optional)
+    Break,
+    Continue,
+    Empty,    // a lone ';'
+    ExprStmt, // a: expression
+    Assign,   // token: = += -= ..., a: target, b: value
+    Binary,   // token: operator, a: left, b: right
+    Unary,    // token: prefix operator, a: operand
+    Postfix,  // token: ++ or --, a: operand
+    Call,     // a: callee, list: arguments
+    Index,    // a: array, b: index
+    Name,     // token: identifier
+    Number,   // token: literal
+    String,
+    Char,
+    Bool,     // token: `true` or `false`
+    Error     // placeholder where parsing failed
+};
+
+inline const char *nodeKindName(NodeKind k) {
+    static const char *const names[] = {
+        "Program", "Function", "Param", "DeclStmt", "VarDecl", "Block", "If", "While",
+        "DoWhile", "For", "Return", "Break", "Continue", "Empty", "ExprStmt", "Assign",
+        "Binary", "Unary", "Postfix", "Call", "Index", "Name", "Number", "String", "Char",
+        "Bool", "Error"
+    };
+    return names[static_cast<int>(k)];
+}
+
+// Index of a node in Ast::nodes. Node 0 is a reserved placeholder, so a
+// zero child index means "no child".
+using NodeId = uint32_t;
+constexpr NodeId kNoNode = 0;
+
+// The most levels a tree may have. The parser stops past it, since the
+// compiler and the evaluator recurse once per level; the compiler checks
+// it again, for trees built some other way. At this many levels the
+// compiler needs about 2.5 MB of stack, a third of a thread's default 8 MB.
+constexpr uint32_t kMaxTreeDepth = 10000;
+
+// One AST node (36 bytes, no pointers). The meaning of each child slot
+// depends on `kind` (see NodeKind); list children are
+// Ast::lists[first .. first + count).
+struct AstNode {
+    NodeKind kind;
+    uint32_t token;
+    uint32_t typeToken;
+    NodeId a, b, c, d;
+    uint32_t first;
+    uint32_t count;
+};
+
+static_assert(is_trivially_copyable<AstNode>::value, "AstNode is saved as raw bytes");
+static_assert(has_unique_object_representations<AstNode>::value && sizeof(AstNode) == 36,
+              "AstNode has no padding bytes");
+
+// Binary format of a saved tree: a fixed header followed by the node and
+// list arrays exactly as they sit in memory (little-endian, 4-byte
+// aligned), so a file mapped into memory can be walked where it lies.
+struct AstFileHeader {
+    char magic[8];
+    uint32_t nodeSize;
+    uint32_t nodeCount;
+    uint32_t listCount;
+    uint32_t root;
+};
+constexpr char kAstMagic[8] = {'T', 'K', 'A', 'S', 'T', '0', '0', '1'};
+
+// Check a tree's arrays: every child, list and token index is in bounds
+// (tokens against `tokenCount`, the size of the token buffer the tree will
+// be used with; 0 skips that check), and every node has at most one parent
+// and the root none, which rules out cycles that would hang a walk.
+inline bool checkAstArrays(const AstNode *nodes, uint32_t nodeCount, const NodeId *lists, uint32_t listCount,
+                           NodeId root, size_t tokenCount) {
+    if (nodeCount == 0 || root >= nodeCount) return false;
+    vector<uint8_t> hasParent(nodeCount, 0);
+    auto adopt = [&](NodeId id) {
+        if (id >= nodeCount) return false;
+        if (id == kNoNode) return true;
+        if (hasParent[id] || id == root) return false;
+        hasParent[id] = 1;
+        return true;
+    };
+    for (uint32_t i = 0; i < nodeCount; ++i) {
+        const AstNode &n = nodes[i];
+        bool ok = n.kind <= NodeKind::Error && size_t(n.first) + n.count <= listCount &&
+                  (tokenCount == 0 || (n.token < tokenCount && n.typeToken < tokenCount)) &&
+                  adopt(n.a) && adopt(n.b) && adopt(n.c) && adopt(n.d);
+        for (uint32_t k = 0; ok && k < n.count; ++k) ok = adopt(lists[n.first + k]);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// A saved tree used in place: open() checks the bytes once (header, size,
+// alignment and every index, as Ast::load() does) and the view then reads
+// nodes and lists straight from them. The bytes, typically a mapped file,
+// must stay put while the view is used. It has Ast's read interface, so
+// walks such as dumpAst() take either.
+struct AstView {
+    const AstNode *nodes = nullptr;
+    const NodeId *lists = nullptr;
+    uint32_t nodeCount = 0;
+    uint32_t listCount = 0;
+    NodeId root = kNoNode;
+
+    const AstNode &operator[](NodeId id) const { return nodes[id]; }
+    NodeId child(const AstNode &n, uint32_t k) const { return lists[n.first + k]; }
+
+    // `data` must be 4-byte aligned, as mmap() and malloc() return it.
+    bool open(const char *data, size_t size, size_t tokenCount) {
+        *this = AstView{};
+        AstFileHeader h;
+        if (!readHeader(data, size, h) || reinterpret_cast<uintptr_t>(data) % alignof(AstNode) != 0) return false;
+        auto nodeArray = reinterpret_cast<const AstNode *>(data + sizeof(h));
+        auto listArray = reinterpret_cast<const NodeId *>(data + sizeof(h) + size_t(h.nodeCount) * sizeof(AstNode));
+        if (!checkAstArrays(nodeArray, h.nodeCount, listArray, h.listCount, h.root, tokenCount)) return false;
+        nodes = nodeArray;
+        lists = listArray;
+        nodeCount = h.nodeCount;
+        listCount = h.listCount;
+        root = h.root;
+        return true;
+    }
+
+    // Read and check the header of `size` bytes at `data`, including that
+    // the arrays it announces fill the rest exactly.
+    static bool readHeader(const char *data, size_t size, AstFileHeader &h) {
+        if (size < sizeof(h)) return false;
+        memcpy(&h, data, sizeof(h));
+        if (memcmp(h.magic, kAstMagic, sizeof(kAstMagic)) != 0 || h.nodeSize != sizeof(AstNode)) return false;
+        return size == sizeof(h) + size_t(h.nodeCount) * sizeof(AstNode) + size_t(h.listCount) * sizeof(NodeId);
+    }
+};
+
+struct Ast {
+    vector<AstNode> nodes{AstNode{}}; // nodes[0] is the kNoNode placeholder
+    vector<NodeId> lists;             // child lists, referenced by (first, count)
+    NodeId root = kNoNode;
+
+    const AstNode &operator[](NodeId id) const { return nodes[id]; }
+    NodeId child(const AstNode &n, uint32_t k) const { return lists[n.first + k]; }
+
+    void clear() {
+        nodes.assign(1, AstNode{});
+        lists.clear();
+        root = kNoNode;
+    }
+
+    // Write the tree in the AstFileHeader format, for AstView or load().
+    void save(ostream &out) const {
+        AstFileHeader h{};
+        memcpy(h.magic, kAstMagic, sizeof(kAstMagic));
+        h.nodeSize = sizeof(AstNode);
+        h.nodeCount = static_cast<uint32_t>(nodes.size());
+        h.listCount = static_cast<uint32_t>(lists.size());
+        h.root = root;
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(AstNode));
+        out.write(reinterpret_cast<const char *>(lists.data()), lists.size() * sizeof(NodeId));
+    }
+
+    // Copy a saved tree out of `data` (any alignment), with the same checks
+    // as AstView::open(). On failure the tree is left empty.
+    bool load(const char *data, size_t size, size_t tokenCount) {
+        AstFileHeader h;
+        if (!AstView::readHeader(data, size, h) || h.nodeCount == 0) {
+            clear();
+            return false;
+        }
+        nodes.resize(h.nodeCount);
+        lists.resize(h.listCount);
+        memcpy(nodes.data(), data + sizeof(h), size_t(h.nodeCount) * sizeof(AstNode));
+        memcpy(lists.data(), data + sizeof(h) + size_t(h.nodeCount) * sizeof(AstNode), size_t(h.listCount) * sizeof(NodeId));
+        root = h.root;
+        if (!checkAstArrays(nodes.data(), h.nodeCount, lists.data(), h.listCount, root, tokenCount)) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+};
+
+// Print the AST as an indented tree, one node per line. The walk keeps its
+// own stack, so no tree is too deep to print (a loaded tree is not limited
+// by the parser's depth cap). `Tree` is an Ast or an AstView.
+template <typename Tree>
+void dumpAst(const Tree &ast, NodeId root, const vector<Token> &tokens, ostream &out, int indent = 0) {
+    vector<pair<NodeId, int>> stack{{root, indent}}; // node and its indent, next to print on top
+    vector<NodeId> children;
+    string pad;
+    while (!stack.empty()) {
+        auto [id, depth] = stack.back();
+        stack.pop_back();
+        if (id == kNoNode) continue;
+        const AstNode &n = ast[id];
+        pad.assign(size_t(depth) * 2, ' ');
+        out << pad << nodeKindName(n.kind);
+        switch (n.kind) {
+            case NodeKind::Program: case NodeKind::Block: case NodeKind::Empty: case NodeKind::Break:
+            case NodeKind::Continue: case NodeKind::ExprStmt: case NodeKind::Call: case NodeKind::Index:
+            case NodeKind::Error:
+                break;
+            case NodeKind::Function: case NodeKind::Param: case NodeKind::VarDecl:
+                out << " " << tokens[n.typeToken].lexeme << " " << tokens[n.token].lexeme;
+                break;
+            default:
+                out << " " << tokens[n.token].lexeme;
+                break;
+        }
+        out << "\n";
+        // Children in source order: a function's parameters precede its
+        // body, a call's callee precedes its arguments. They are pushed
+        // last first.
+        children.clear();
+        if (n.kind == NodeKind::Function) {
+            for (uint32_t k = 0; k < n.count; ++k) children.push_back(ast.child(n, k));
+        }
+        for (NodeId child : {n.a, n.b, n.c, n.d}) children.push_back(child);
+        if (n.kind != NodeKind::Function) {
+            for (uint32_t k = 0; k < n.count; ++k) children.push_back(ast.child(n, k));
+        }
+        for (size_t k = children.size(); k-- > 0;) stack.push_back({children[k], depth + 1});
+    }
+}
@@ -0,0 +1,983 @@
+// bytecode.h
+// Register bytecode for the C-like subset, and the compiler that produces
+// it from a parsed file. Each function gets a window of registers (its
+// parameters first, then locals, then temporaries); instructions name
+// registers directly, so `x = y + 1` is one LoadI and one Add rather than
+// a run of stack pushes. Types are resolved at compile time: every
+// arithmetic instruction exists once per operand class (I = int, L = long,
+// F = float, D = double) and conversions are explicit instructions.
+
+#pragma once
+
+#include "resolver.h"
+#include "folder.h"
+#include "runtime.h"
+
+// Every opcode, in dispatch-table order. Operands (see Instr):
+//   Move a=b                      LoadI a=imm32        LoadK a=constants[k32]
+//   LoadG a=globals[b]            StoreG globals[b]=a
+//   Add.. Sub.. Mul.. Div.. Mod.. Shl.. Shr.. And Or Xor Lt.. Le.. Eq.. Ne..   a = b op c
+//   Neg.. Not NotD BitNot ToBool ToBoolD Sext8/16/32 I2F I2D D2F D2I          a = op b
+//   IncI IncL a += (int16)b       Jmp/Loop -> t32      Jz/Jnz a -> t32
+//   Call base=a, function b, c args (result in a)      Ret a   RetV
+//   Print a as ValueType b, then a newline if c (else a space)
+// Loop is a backward jump that also counts a step (see VmOptions).
+#define TK_OPCODES(X)                                                                        \
+    X(Move) X(LoadI) X(LoadK) X(LoadG) X(StoreG)                                             \
+    X(AddI) X(AddL) X(AddF) X(AddD) X(SubI) X(SubL) X(SubF) X(SubD)                          \
+    X(MulI) X(MulL) X(MulF) X(MulD) X(DivI) X(DivL) X(DivF) X(DivD)                          \
+    X(ModI) X(ModL) X(ShlI) X(ShlL) X(ShrI) X(ShrL) X(And) X(Or) X(Xor)                      \
+    X(Lt) X(Le) X(Eq) X(Ne) X(LtD) X(LeD) X(EqD) X(NeD)                                      \
+    X(NegI) X(NegL) X(NegD) X(Not) X(NotD) X(BitNot) X(IncI) X(IncL)                         \
+    X(ToBool) X(ToBoolD) X(Sext8) X(Sext16) X(Sext32) X(I2F) X(I2D) X(D2F) X(D2I)            \
+    X(Jmp) X(Loop) X(Jz) X(Jnz) X(Call) X(Ret) X(RetV) X(Print)
+
+enum class Op : uint16_t {
+#define TK_OP_ENUM(name) name,
+    TK_OPCODES(TK_OP_ENUM)
+#undef TK_OP_ENUM
+};
+
+inline const char *opName(Op op) {
+    static const char *const names[] = {
+#define TK_OP_NAME(name) #name,
+        TK_OPCODES(TK_OP_NAME)
+#undef TK_OP_NAME
+    };
+    return names[static_cast<int>(op)];
+}
+
+// One 8-byte instruction. Jump targets, immediates and constant indices
+// take 32 bits, stored across b (low half) and c (high half).
+struct Instr {
+    Op op;
+    uint16_t a, b, c;
+
+    uint32_t wide() const { return b | uint32_t(c) << 16; }
+};
+
+static_assert(sizeof(Instr) == 8, "instructions are 8 bytes");
+
+struct BytecodeFunction {
+    string name;
+    ValueType returnType = ValueType::Void;
+    vector<ValueType> params;
+    uint32_t entry = 0;   // first instruction in Program::code
+    uint32_t numRegs = 1; // register window size, parameters included
+    bool defined = false;
+};
+
+struct GlobalInfo {
+    string name;
+    ValueType type;
+};
+
+// A compiled file. functions[0] is the top level of the script: global
+// initializers and statements, in source order.
+struct Program {
+    vector<Instr> code;
+    vector<int> lines;          // source line of each instruction
+    vector<Value> constants;
+    vector<string> strings{""}; // string literals; index 0 is ""
+    vector<GlobalInfo> globals;
+    vector<BytecodeFunction> functions;
+    int32_t mainFunction = -1;  // main(), run after the top level if defined
+
+    void clear() { *this = Program(); }
+};
+
+// ---------- Compiler ----------
+
+class Compiler {
+public:
+    static constexpr uint32_t kMaxRegisters = 65535;
+
+    // Compile a parsed file into `out`. Returns false, with diagnostics,
+    // if the file uses anything outside the supported subset (arrays,
+    // named types other than string, ...). Names are bound through the
+    // Resolver, so scoping follows the same rules as --defuse.
+    bool compile(const Ast &ast, const vector<Token> &tokens, Program &out) {
+        ast_ = &ast;
+        tokens_ = &tokens;
+        out_ = &out;
+        out.clear();
+        diagnostics_.clear();
+        constantIndex_.clear();
+        stringIndex_.clear();
+        tooDeep_ = false;
+
+        resolver_.resolve(ast, tokens, table_);
+        symbolAt_.assign(tokens.size(), Resolver::kUnresolved);
+        for (const SymbolUse &u : table_.uses) symbolAt_[u.token] = u.symbol;
+        for (uint32_t s = 0; s < table_.symbols.size(); ++s) symbolAt_[table_.symbols[s].token] = s;
+        bindings_.assign(table_.symbols.size(), Binding{});
+
+        out.functions.push_back({"<script>", ValueType::Void, {}, 0, 1, true});
+        const AstNode &program = ast[ast.root];
+        vector<pair<uint32_t, NodeId>> bodies;
+        for (uint32_t k = 0; k < program.count; ++k) {
+            NodeId id = ast.child(program, k);
+            if (ast[id].kind == NodeKind::Function) declareFunction(id, bodies);
+        }
+
+        beginFunction(0);
+        for (uint32_t k = 0; k < program.count; ++k) {
+            NodeId id = ast.child(program, k);
+            if (ast[id].kind != NodeKind::Function) statement(id);
+        }
+        endFunction();
+
+        for (auto [index, id] : bodies) compileFunction(index, id);
+        stable_sort(diagnostics_.begin(), diagnostics_.end(),
+                    [](const Diagnostic &x, const Diagnostic &y) { return x.line < y.line; });
+        return diagnostics_.empty();
+    }
+
+    const vector<Diagnostic> &diagnostics() const { return diagnostics_; }
+
+private:
+    struct Operand {
+        uint32_t reg;
+        ValueType type;
+    };
+
+    // What a resolver symbol compiled to.
+    struct Binding {
+        enum Kind : uint8_t { None, Global, Local, Function } kind = None;
+        ValueType type = ValueType::Void;
+        uint32_t index = 0; // global slot, register or function index
+    };
+
+    struct LoopLabels {
+        vector<uint32_t> breaks;
+        vector<uint32_t> continues;
+    };
+
+    const Ast *ast_ = nullptr;
+    const vector<Token> *tokens_ = nullptr;
+    Program *out_ = nullptr;
+    Resolver resolver_;
+    DefUseTable table_;
+    vector<uint32_t> symbolAt_; // by token: the symbol it declares or uses
+    vector<Binding> bindings_;  // by symbol
+    vector<Diagnostic> diagnostics_;
+    unordered_map<uint64_t, uint32_t> constantIndex_;
+    unordered_map<string, uint32_t> stringIndex_;
+
+    // State of the function being compiled.
+    uint32_t function_ = 0;
+    uint32_t freeReg_ = 0; // registers below this are locals or live temporaries
+    uint32_t maxReg_ = 0;
+    vector<LoopLabels> loops_;
+    int line_ = 1;
+    uint32_t depth_ = 0;   // expr() calls in progress
+    bool tooDeep_ = false; // the depth error has been reported
+
+    const AstNode &node(NodeId id) const { return (*ast_)[id]; }
+    const Token &tok(uint32_t i) const { return (*tokens_)[i]; }
+
+    void error(const string &message) { diagnostics_.push_back({line_, message}); }
+
+    // ----- emission -----
+
+    uint32_t emit(Op op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+        out_->code.push_back({op, uint16_t(a), uint16_t(b), uint16_t(c)});
+        out_->lines.push_back(line_);
+        return static_cast<uint32_t>(out_->code.size() - 1);
+    }
+
+    uint32_t emitWide(Op op, uint32_t a, uint32_t wide) { return emit(op, a, wide & 0xFFFF, wide >> 16); }
+
+    uint32_t here() const { return static_cast<uint32_t>(out_->code.size()); }
+
+    void patch(uint32_t at, uint32_t target) {
+        out_->code[at].b = uint16_t(target & 0xFFFF);
+        out_->code[at].c = uint16_t(target >> 16);
+    }
+
+    uint32_t newTemp() {
+        if (freeReg_ >= kMaxRegisters) {
+            if (maxReg_ <= kMaxRegisters) error("function needs too many registers");
+            maxReg_ = kMaxRegisters + 1;
+            return 0;
+        }
+        uint32_t r = freeReg_++;
+        maxReg_ = max(maxReg_, freeReg_);
+        return r;
+    }
+
+    uint32_t target(int want) { return want >= 0 ? uint32_t(want) : newTemp(); }
+
+    // `v`, moved into `want` if a destination was requested.
+    Operand into(Operand v, int want) {
+        if (want < 0 || v.reg == uint32_t(want) || v.type == ValueType::Void) return v;
+        emit(Op::Move, want, v.reg);
+        return {uint32_t(want), v.type};
+    }
+
+    uint32_t constant(Value v) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        auto it = constantIndex_.find(bits);
+        if (it != constantIndex_.end()) return it->second;
+        uint32_t k = static_cast<uint32_t>(out_->constants.size());
+        out_->constants.push_back(v);
+        constantIndex_.emplace(bits, k);
+        return k;
+    }
+
+    Operand loadInteger(int64_t v, ValueType type, int want) {
+        uint32_t dst = target(want);
+        if (v >= INT32_MIN && v <= INT32_MAX) {
+            emitWide(Op::LoadI, dst, static_cast<uint32_t>(static_cast<int32_t>(v)));
+        } else {
+            Value k;
+            k.i = v;
+            emitWide(Op::LoadK, dst, constant(k));
+        }
+        return {dst, type};
+    }
+
+    Operand loadDouble(double v, ValueType type, int want) {
+        Value k;
+        k.f = v;
+        uint32_t dst = target(want);
+        emitWide(Op::LoadK, dst, constant(k));
+        return {dst, type};
+    }
+
+    // ----- declarations -----
+
+    // The type named at token `t`; reports unsupported types.
+    ValueType declaredType(uint32_t t, bool allowVoid) {
+        bool ok;
+        ValueType type = valueTypeOf(tok(t).lexeme, ok);
+        if (!ok) error("unsupported type '" + string(tok(t).lexeme) + "'");
+        else if (type == ValueType::Void && !allowVoid) error("variable of type void");
+        return type;
+    }
+
+    void declareFunction(NodeId id, vector<pair<uint32_t, NodeId>> &bodies) {
+        const AstNode &n = node(id);
+        line_ = tok(n.token).line;
+        uint32_t sym = symbolAt_[n.token];
+        if (sym == Resolver::kUnresolved) return;
+        BytecodeFunction fn;
+        fn.name = string(tok(n.token).lexeme);
+        fn.returnType = declaredType(n.typeToken, true);
+        for (uint32_t k = 0; k < n.count; ++k) fn.params.push_back(declaredType(node(ast_->child(n, k)).typeToken, false));
+
+        Binding &b = bindings_[sym];
+        if (b.kind == Binding::None) {
+            if (out_->functions.size() > 0xFFFF) {
+                error("too many functions");
+                return;
+            }
+            b = {Binding::Function, fn.returnType, static_cast<uint32_t>(out_->functions.size())};
+            out_->functions.push_back(fn);
+        } else if (b.kind != Binding::Function || out_->functions[b.index].params != fn.params ||
+                   out_->functions[b.index].returnType != fn.returnType) {
+            error("conflicting declaration of '" + fn.name + "'");
+            return;
+        }
+        if (n.a == kNoNode) return;
+        BytecodeFunction &target = out_->functions[b.index];
+        if (target.defined) {
+            error("redefinition of '" + fn.name + "'");
+            return;
+        }
+        target.defined = true;
+        bodies.push_back({b.index, id});
+        if (fn.name == "main") {
+            if (!fn.params.empty()) error("main() must not take parameters");
+            else if (!isIntegerType(fn.returnType) && fn.returnType != ValueType::Void) error("main() must return an integer");
+            else out_->mainFunction = static_cast<int32_t>(b.index);
+        }
+    }
+
+    void beginFunction(uint32_t index) {
+        function_ = index;
+        freeReg_ = maxReg_ = 0;
+        loops_.clear();
+        out_->functions[index].entry = here();
+    }
+
+    // Falling off the end returns zero (or nothing, for void).
+    void endFunction() {
+        BytecodeFunction &fn = out_->functions[function_];
+        if (fn.returnType == ValueType::Void) {
+            emit(Op::RetV);
+        } else {
+            uint32_t r = newTemp();
+            emitWide(Op::LoadI, r, 0);
+            emit(Op::Ret, r);
+        }
+        fn.numRegs = max<uint32_t>(maxReg_, 1);
+    }
+
+    void compileFunction(uint32_t index, NodeId id) {
+        const AstNode &n = node(id);
+        beginFunction(index);
+        for (uint32_t k = 0; k < n.count; ++k) {
+            const AstNode &param = node(ast_->child(n, k));
+            uint32_t sym = symbolAt_[param.token];
+            uint32_t reg = newTemp();
+            if (sym != Resolver::kUnresolved) bindings_[sym] = {Binding::Local, out_->functions[index].params[k], reg};
+        }
+        // The body's outermost block shares the parameters' scope.
+        const AstNode &body = node(n.a);
+        for (uint32_t k = 0; k < body.count; ++k) statement(ast_->child(body, k));
+        endFunction();
+    }
+
+    // Does the subtree at `id` use symbol `sym`?
+    bool mentions(NodeId id, uint32_t sym) const {
+        if (id == kNoNode) return false;
+        const AstNode &n = node(id);
+        if (n.kind == NodeKind::Name && symbolAt_[n.token] == sym) return true;
+        for (NodeId child : {n.a, n.b, n.c, n.d})
+            if (mentions(child, sym)) return true;
+        for (uint32_t k = 0; k < n.count; ++k)
+            if (mentions(ast_->child(n, k), sym)) return true;
+        return false;
+    }
+
+    // Does the subtree at `id` assign to or increment the local in `reg`?
+    bool modifiesLocal(NodeId id, uint32_t reg) const {
+        if (id == kNoNode) return false;
+        const AstNode &n = node(id);
+        bool modifies = n.kind == NodeKind::Assign || n.kind == NodeKind::Postfix ||
+                        (n.kind == NodeKind::Unary && (tok(n.token).lexeme == "++" || tok(n.token).lexeme == "--"));
+        if (modifies && node(n.a).kind == NodeKind::Name) {
+            uint32_t sym = symbolAt_[node(n.a).token];
+            if (sym != Resolver::kUnresolved && bindings_[sym].kind == Binding::Local && bindings_[sym].index == reg)
+                return true;
+        }
+        for (NodeId child : {n.a, n.b, n.c, n.d})
+            if (modifiesLocal(child, reg)) return true;
+        for (uint32_t k = 0; k < n.count; ++k)
+            if (modifiesLocal(ast_->child(n, k), reg)) return true;
+        return false;
+    }
+
+    void declareVariable(NodeId id) {
+        const AstNode &n = node(id);
+        line_ = tok(n.token).line;
+        ValueType type = declaredType(n.typeToken, false);
+        if (n.b != kNoNode) error("arrays are not supported");
+        uint32_t sym = symbolAt_[n.token];
+        if (sym == Resolver::kUnresolved) return;
+        Binding &b = bindings_[sym];
+
+        if (table_.symbols[sym].kind == SymbolKind::Global) {
+            if (out_->globals.size() > 0xFFFF) {
+                error("too many globals");
+                return;
+            }
+            b = {Binding::Global, type, static_cast<uint32_t>(out_->globals.size())};
+            out_->globals.push_back({string(tok(n.token).lexeme), type});
+            if (n.a != kNoNode) {
+                uint32_t mark = freeReg_;
+                Operand v = convert(expr(n.a), type, -1);
+                emit(Op::StoreG, v.reg, b.index);
+                freeReg_ = mark;
+            }
+            return;
+        }
+
+        uint32_t reg = newTemp();
+        b = {Binding::Local, type, reg};
+        // Locals start at zero; one that reads itself in its initializer
+        // (`int x = x + 1;`) must be zeroed before the initializer runs.
+        if (n.a == kNoNode || mentions(n.a, sym)) emitWide(Op::LoadI, reg, 0);
+        if (n.a != kNoNode) convert(expr(n.a, reg), type, reg);
+        freeReg_ = reg + 1;
+    }
+
+    // ----- statements -----
+
+    void statement(NodeId id) {
+        if (id == kNoNode) return;
+        const AstNode &n = node(id);
+        line_ = tok(n.token).line;
+        uint32_t mark = freeReg_;
+        switch (n.kind) {
+            case NodeKind::DeclStmt:
+                for (uint32_t k = 0; k < n.count; ++k) declareVariable(ast_->child(n, k));
+                return; // the new locals stay allocated
+            case NodeKind::Block:
+                for (uint32_t k = 0; k < n.count; ++k) statement(ast_->child(n, k));
+                break;
+            case NodeKind::ExprStmt:
+                effect(n.a);
+                break;
+            case NodeKind::If: {
+                uint32_t skip = jumpIfFalse(n.a);
+                body(n.b);
+                if (n.c != kNoNode) {
+                    uint32_t end = emit(Op::Jmp);
+                    patch(skip, here());
+                    body(n.c);
+                    patch(end, here());
+                } else {
+                    patch(skip, here());
+                }
+                break;
+            }
+            case NodeKind::While: {
+                uint32_t top = here();
+                uint32_t exit = jumpIfFalse(n.a);
+                loops_.emplace_back();
+                body(n.b);
+                setContinueTarget(here());
+                loopBack(n, top);
+                patch(exit, here());
+                closeLoop();
+                break;
+            }
+            case NodeKind::DoWhile: {
+                uint32_t top = here();
+                loops_.emplace_back();
+                body(n.b);
+                setContinueTarget(here());
+                uint32_t exit = jumpIfFalse(n.a);
+                loopBack(n, top);
+                patch(exit, here());
+                closeLoop();
+                break;
+            }
+            case NodeKind::For: {
+                statement(n.a); // init; its declarations live until the loop ends
+                uint32_t top = here();
+                int64_t exit = n.b != kNoNode ? int64_t(jumpIfFalse(n.b)) : -1;
+                loops_.emplace_back();
+                body(n.d);
+                setContinueTarget(here());
+                if (n.c != kNoNode) {
+                    line_ = tok(node(n.c).token).line;
+                    uint32_t stepMark = freeReg_;
+                    effect(n.c);
+                    freeReg_ = stepMark;
+                }
+                loopBack(n, top);
+                if (exit >= 0) patch(uint32_t(exit), here());
+                closeLoop();
+                break;
+            }
+            case NodeKind::Return: {
+                const BytecodeFunction &fn = out_->functions[function_];
+                if (n.a == kNoNode) {
+                    if (fn.returnType != ValueType::Void) error("'" + fn.name + "' must return a value");
+                    else emit(Op::RetV);
+                } else if (fn.returnType == ValueType::Void) {
+                    error(function_ == 0 ? "return with a value at top level"
+                                         : "void function '" + fn.name + "' returns a value");
+                } else {
+                    Operand v = convert(expr(n.a), fn.returnType, -1);
+                    emit(Op::Ret, v.reg);
+                }
+                break;
+            }
+            case NodeKind::Break:
+                if (loops_.empty()) error("break outside a loop");
+                else loops_.back().breaks.push_back(emit(Op::Jmp));
+                break;
+            case NodeKind::Continue:
+                if (loops_.empty()) error("continue outside a loop");
+                else loops_.back().continues.push_back(emit(Op::Jmp));
+                break;
+            case NodeKind::Empty:
+            case NodeKind::Error:
+                break;
+            default:
+                error("unsupported statement");
+                break;
+        }
+        freeReg_ = mark;
+    }
+
+    // The body of if/while/for: a declaration there would have no scope.
+    void body(NodeId id) {
+        if (id != kNoNode && node(id).kind == NodeKind::DeclStmt) {
+            line_ = tok(node(id).token).line;
+            error("a declaration is not allowed here");
+            return;
+        }
+        statement(id);
+    }
+
+    void setContinueTarget(uint32_t at) {
+        for (uint32_t j : loops_.back().continues) patch(j, at);
+    }
+
+    // The back edge of loop `n`. Every iteration, however it ends, passes
+    // through this one Loop, so steps (and step-limit errors, reported on
+    // the loop's line) are the same as in the tree evaluator.
+    void loopBack(const AstNode &n, uint32_t top) {
+        line_ = tok(n.token).line;
+        emitWide(Op::Loop, 0, top);
+    }
+
+    void closeLoop() {
+        for (uint32_t j : loops_.back().breaks) patch(j, here());
+        loops_.pop_back();
+    }
+
+    // Emit a conditional jump taken when `cond` is false; returns it for patching.
+    uint32_t jumpIfFalse(NodeId cond) {
+        uint32_t mark = freeReg_;
+        Operand v = expr(cond);
+        if (isFloatingType(v.type)) {
+            uint32_t t = newTemp();
+            emit(Op::ToBoolD, t, v.reg);
+            v.reg = t;
+        } else if (!isIntegerType(v.type)) {
+            error(string("a condition must be a number, not ") + valueTypeName(v.type));
+        }
+        freeReg_ = mark;
+        return emit(Op::Jz, v.reg);
+    }
+
+    // An expression evaluated for its side effects only.
+    void effect(NodeId id) {
+        if (id == kNoNode) return;
+        const AstNode &n = node(id);
+        if (n.kind == NodeKind::Postfix) { // the old value is not needed
+            line_ = tok(n.token).line;
+            increment(n.a, tok(n.token).lexeme == "++" ? 1 : -1, true, -1);
+            return;
+        }
+        expr(id);
+    }
+
+    // ----- expressions -----
+
+    // Compile `id` and return where its value is. With `want` >= 0 the
+    // value ends up in that register, written only after every operand has
+    // been read, so `want` may be a local the expression itself uses.
+    Operand expr(NodeId id, int want = -1) {
+        // expr() recurses per level: a tree deeper than the parser allows
+        // is reported once instead of overflowing the stack.
+        if (depth_ >= kMaxTreeDepth) {
+            if (!tooDeep_) error("expression nested too deeply");
+            tooDeep_ = true;
+            return loadInteger(0, ValueType::Int, want);
+        }
+        ++depth_;
+        Operand v = exprAt(id, want);
+        --depth_;
+        return v;
+    }
+
+    Operand exprAt(NodeId id, int want) {
+        const AstNode &n = node(id);
+        line_ = tok(n.token).line;
+        const Token &t = tok(n.token);
+        switch (n.kind) {
+            case NodeKind::Number: {
+                ConstValue v;
+                if (!decodeNumber(t.lexeme, v)) {
+                    error("invalid number '" + string(t.lexeme) + "'");
+                    return loadInteger(0, ValueType::Int, want);
+                }
+                if (v.isFloat) return loadDouble(v.f, ValueType::Double, want);
+                return loadInteger(v.i, v.type(), want);
+            }
+            case NodeKind::Char:
+                return loadInteger(decodeCharLiteral(t.lexeme), ValueType::Char, want);
+            case NodeKind::Bool:
+                return loadInteger(t.lexeme == "true", ValueType::Bool, want);
+            case NodeKind::String: {
+                string text = decodeStringLiteral(t.lexeme);
+                auto it = stringIndex_.find(text);
+                uint32_t index = it != stringIndex_.end() ? it->second : static_cast<uint32_t>(out_->strings.size());
+                if (it == stringIndex_.end()) {
+                    stringIndex_.emplace(text, index);
+                    out_->strings.push_back(move(text));
+                }
+                return loadInteger(index, ValueType::String, want);
+            }
+            case NodeKind::Name: {
+                const Binding *b = variable(n.token);
+                if (!b) return loadInteger(0, ValueType::Int, want);
+                if (b->kind == Binding::Local) return into({b->index, b->type}, want);
+                uint32_t dst = target(want);
+                emit(Op::LoadG, dst, b->index);
+                return {dst, b->type};
+            }
+            case NodeKind::Assign: return assign(n, want);
+            case NodeKind::Binary: return binary(n, want);
+            case NodeKind::Unary: return unary(n, want);
+            case NodeKind::Postfix: return increment(n.a, t.lexeme == "++" ? 1 : -1, false, want);
+            case NodeKind::Call: return call(n, want);
+            case NodeKind::Index:
+                error("arrays are not supported");
+                return loadInteger(0, ValueType::Int, want);
+            case NodeKind::Error:
+                return loadInteger(0, ValueType::Int, want);
+            default:
+                error("unsupported expression");
+                return loadInteger(0, ValueType::Int, want);
+        }
+    }
+
+    // The variable named by token `t`, or null (with a diagnostic).
+    const Binding *variable(uint32_t t) {
+        uint32_t sym = symbolAt_[t];
+        string name(tok(t).lexeme);
+        if (sym == Resolver::kUnresolved) {
+            error("'" + name + "' is not declared");
+            return nullptr;
+        }
+        const Binding &b = bindings_[sym];
+        if (b.kind == Binding::Function) {
+            error("function '" + name + "' used as a value");
+            return nullptr;
+        }
+        if (b.kind == Binding::None) return nullptr; // its declaration was already reported
+        return &b;
+    }
+
+    // Integer types a value of type `from` converts to without any change.
+    static bool widens(ValueType from, ValueType to) {
+        return isIntegerType(from) && isIntegerType(to) && to != ValueType::Bool && from <= to;
+    }
+
+    // Convert `v` to type `to`, into `want` if given.
+    Operand convert(Operand v, ValueType to, int want) {
+        if (v.type == to || widens(v.type, to)) return into({v.reg, to}, want);
+        if (!isArithmeticType(v.type) || !isArithmeticType(to)) {
+            error(string("cannot convert ") + valueTypeName(v.type) + " to " + valueTypeName(to));
+            return into({v.reg, to}, want);
+        }
+        if (v.type == ValueType::Float && to == ValueType::Double) return into({v.reg, to}, want);
+        uint32_t dst = target(want);
+        if (isFloatingType(to)) {
+            emit(isFloatingType(v.type) ? Op::D2F : to == ValueType::Float ? Op::I2F : Op::I2D, dst, v.reg);
+            return {dst, to};
+        }
+        if (to == ValueType::Bool) {
+            emit(isFloatingType(v.type) ? Op::ToBoolD : Op::ToBool, dst, v.reg);
+            return {dst, to};
+        }
+        uint32_t src = v.reg;
+        if (isFloatingType(v.type)) {
+            emit(Op::D2I, dst, src);
+            src = dst;
+        }
+        switch (to) {
+            case ValueType::Char: emit(Op::Sext8, dst, src); break;
+            case ValueType::Short: emit(Op::Sext16, dst, src); break;
+            case ValueType::Int: emit(Op::Sext32, dst, src); break;
+            default: if (src != dst) emit(Op::Move, dst, src); break;
+        }
+        return {dst, to};
+    }
+
+    // The opcode for `op` on operands of class `t` (Int, Long, Float or
+    // Double), or reports that the operator does not apply.
+    Op arithmeticOp(string_view op, ValueType t) {
+        int cls = t == ValueType::Int ? 0 : t == ValueType::Long ? 1 : t == ValueType::Float ? 2 : 3;
+        static const Op add[] = {Op::AddI, Op::AddL, Op::AddF, Op::AddD};
+        static const Op sub[] = {Op::SubI, Op::SubL, Op::SubF, Op::SubD};
+        static const Op mul[] = {Op::MulI, Op::MulL, Op::MulF, Op::MulD};
+        static const Op div[] = {Op::DivI, Op::DivL, Op::DivF, Op::DivD};
+        switch (op[0]) {
+            case '+': return add[cls];
+            case '-': return sub[cls];
+            case '*': return mul[cls];
+            case '/': return div[cls];
+            default: break;
+        }
+        if (cls < 2) {
+            switch (op[0]) {
+                case '%': return cls ? Op::ModL : Op::ModI;
+                case '<': return cls ? Op::ShlL : Op::ShlI;
+                case '>': return cls ? Op::ShrL : Op::ShrI;
+                case '&': return Op::And;
+                case '|': return Op::Or;
+                case '^': return Op::Xor;
+                default: break;
+            }
+        }
+        error("invalid operands to '" + string(op) + "'");
+        return Op::Move;
+    }
+
+    // `l op r` for an arithmetic, bitwise or shift operator (op without
+    // any trailing '='). Registers from `mark` up are free to reuse.
+    Operand arithmetic(string_view op, Operand l, Operand r, uint32_t mark, int want) {
+        if (!isArithmeticType(l.type) || !isArithmeticType(r.type)) {
+            error("invalid operands to '" + string(op) + "'");
+            freeReg_ = mark;
+            return {target(want), ValueType::Int};
+        }
+        bool shift = op == "<<" || op == ">>";
+        // A shift has the type of its (promoted) left operand.
+        ValueType t = shift ? commonType(l.type, ValueType::Int) : commonType(l.type, r.type);
+        l = convert(l, t, -1);
+        if (!shift) r = convert(r, t, -1);
+        else if (!isIntegerType(r.type)) error("invalid operands to '" + string(op) + "'");
+        Op code = arithmeticOp(op, t);
+        freeReg_ = mark;
+        uint32_t dst = target(want);
+        emit(code, dst, l.reg, r.reg);
+        return {dst, t};
+    }
+
+    Operand binary(const AstNode &n, int want) {
+        string_view op = tok(n.token).lexeme;
+        if (op == "&&" || op == "||") return logical(n, op == "&&", want);
+
+        uint32_t mark = freeReg_;
+        Operand l = expr(n.a);
+        // Operands are evaluated left to right: a left value still held in
+        // a local's register (a read of it, or an assignment to it) is
+        // copied if the right side assigns to that local.
+        if (l.reg < mark && modifiesLocal(n.b, l.reg)) l = into(l, newTemp());
+        Operand r = expr(n.b);
+        line_ = tok(n.token).line;
+        if (op == "<" || op == ">" || op == "<=" || op == ">=" || op == "==" || op == "!=") {
+            if (!isArithmeticType(l.type) || !isArithmeticType(r.type)) {
+                error("invalid operands to '" + string(op) + "'");
+                freeReg_ = mark;
+                return {target(want), ValueType::Int};
+            }
+            ValueType t = commonType(l.type, r.type);
+            l = convert(l, t, -1);
+            r = convert(r, t, -1);
+            bool fp = isFloatingType(t);
+            freeReg_ = mark;
+            uint32_t dst = target(want);
+            if (op[0] == '>') swap(l, r); // a > b is b < a
+            Op code = op.size() == 1 && op[0] != '=' ? (fp ? Op::LtD : Op::Lt)
+                    : op[0] == '<' || op[0] == '>'   ? (fp ? Op::LeD : Op::Le)
+                    : op[0] == '='                   ? (fp ? Op::EqD : Op::Eq)
+                                                     : (fp ? Op::NeD : Op::Ne);
+            emit(code, dst, l.reg, r.reg);
+            return {dst, ValueType::Int};
+        }
+        return arithmetic(op, l, r, mark, want);
+    }
+
+    // && and ||: the right side only runs if the left does not decide.
+    Operand logical(const AstNode &n, bool isAnd, int want) {
+        uint32_t dst = newTemp();
+        uint32_t mark = freeReg_;
+        truth(expr(n.a), dst);
+        uint32_t skip = emit(isAnd ? Op::Jz : Op::Jnz, dst);
+        freeReg_ = mark;
+        truth(expr(n.b), dst);
+        patch(skip, here());
+        freeReg_ = mark;
+        return into({dst, ValueType::Int}, want);
+    }
+
+    // dst = (v != 0)
+    void truth(Operand v, uint32_t dst) {
+        if (!isArithmeticType(v.type)) error(string("a condition must be a number, not ") + valueTypeName(v.type));
+        emit(isFloatingType(v.type) ? Op::ToBoolD : Op::ToBool, dst, v.reg);
+    }
+
+    Operand unary(const AstNode &n, int want) {
+        string_view op = tok(n.token).lexeme;
+        if (op == "++" || op == "--") return increment(n.a, op == "++" ? 1 : -1, true, want);
+
+        uint32_t mark = freeReg_;
+        Operand v = expr(n.a);
+        line_ = tok(n.token).line;
+        if (!isArithmeticType(v.type)) {
+            error("invalid operand to '" + string(op) + "'");
+            return {target(want), ValueType::Int};
+        }
+        ValueType t = commonType(v.type, ValueType::Int);
+        if (op == "+") return convert(v, t, want);
+        if (op == "!") {
+            freeReg_ = mark;
+            uint32_t dst = target(want);
+            emit(isFloatingType(v.type) ? Op::NotD : Op::Not, dst, v.reg);
+            return {dst, ValueType::Int};
+        }
+        if (op == "~" && isFloatingType(t)) {
+            error("invalid operand to '~'");
+            return {target(want), ValueType::Int};
+        }
+        v = convert(v, t, -1);
+        freeReg_ = mark;
+        uint32_t dst = target(want);
+        Op code = op == "~" ? Op::BitNot : t == ValueType::Int ? Op::NegI : t == ValueType::Long ? Op::NegL : Op::NegD;
+        emit(code, dst, v.reg);
+        return {dst, t};
+    }
+
+    // The variable assigned by `x = ...`, `x++`, ...; reports other targets.
+    const Binding *assignable(NodeId target) {
+        if (node(target).kind != NodeKind::Name) {
+            error("cannot assign to this expression");
+            return nullptr;
+        }
+        return variable(node(target).token);
+    }
+
+    // ++x / --x (prefix) or x++ / x-- (postfix, the result is the old value).
+    Operand increment(NodeId targetNode, int delta, bool prefix, int want) {
+        const Binding *b = assignable(targetNode);
+        if (!b) return loadInteger(0, ValueType::Int, want);
+        if (!isArithmeticType(b->type) || b->type == ValueType::Bool) {
+            error(string("cannot increment a ") + valueTypeName(b->type));
+            return loadInteger(0, ValueType::Int, want);
+        }
+        uint32_t reg = b->index;
+        if (b->kind == Binding::Global) {
+            reg = newTemp();
+            emit(Op::LoadG, reg, b->index);
+        }
+        Operand old{reg, b->type};
+        if (!prefix) {
+            old.reg = newTemp();
+            emit(Op::Move, old.reg, reg);
+        }
+        switch (b->type) {
+            case ValueType::Int: emit(Op::IncI, reg, uint16_t(int16_t(delta))); break;
+            case ValueType::Long: emit(Op::IncL, reg, uint16_t(int16_t(delta))); break;
+            case ValueType::Char:
+            case ValueType::Short:
+                emit(Op::IncL, reg, uint16_t(int16_t(delta)));
+                emit(b->type == ValueType::Char ? Op::Sext8 : Op::Sext16, reg, reg);
+                break;
+            default: {
+                Operand one = loadDouble(delta, ValueType::Double, -1);
+                emit(b->type == ValueType::Float ? Op::AddF : Op::AddD, reg, reg, one.reg);
+                break;
+            }
+        }
+        if (b->kind == Binding::Global) emit(Op::StoreG, reg, b->index);
+        return into(prefix ? Operand{reg, b->type} : old, want);
+    }
+
+    Operand assign(const AstNode &n, int want) {
+        string_view op = tok(n.token).lexeme;
+        const Binding *b = assignable(n.a);
+        if (!b) {
+            expr(n.b);
+            return loadInteger(0, ValueType::Int, want);
+        }
+        ValueType type = b->type;
+        bool local = b->kind == Binding::Local;
+        uint32_t index = b->index;
+        uint32_t mark = freeReg_;
+        Operand result;
+        if (op == "=") {
+            result = local ? convert(expr(n.b, index), type, index) : convert(expr(n.b), type, -1);
+        } else {
+            if (type == ValueType::String) error("invalid operands to '" + string(op) + "'");
+            Operand cur{index, type};
+            // The target is read before the right side runs (see binary()).
+            if (!local || modifiesLocal(n.b, index)) {
+                cur.reg = newTemp();
+                emit(local ? Op::Move : Op::LoadG, cur.reg, index);
+            }
+            Operand r = expr(n.b);
+            line_ = tok(n.token).line;
+            uint32_t dst = local ? index : cur.reg;
+            Operand v = arithmetic(op.substr(0, op.size() - 1), cur, r, max(mark, cur.reg + 1), dst);
+            result = convert(v, type, dst);
+        }
+        if (!local) emit(Op::StoreG, result.reg, index);
+        freeReg_ = max(mark, result.reg + 1);
+        return into(result, want);
+    }
+
+    Operand call(const AstNode &n, int want) {
+        const AstNode &callee = node(n.a);
+        if (callee.kind != NodeKind::Name) {
+            error("only named functions can be called");
+            return loadInteger(0, ValueType::Int, want);
+        }
+        string name(tok(callee.token).lexeme);
+        uint32_t sym = symbolAt_[callee.token];
+        if (sym == Resolver::kUnresolved && name == "print") return print(n);
+        if (sym == Resolver::kUnresolved || bindings_[sym].kind != Binding::Function) {
+            if (sym == Resolver::kUnresolved) error("'" + name + "' is not declared");
+            else error("'" + name + "' is not a function");
+            return loadInteger(0, ValueType::Int, want);
+        }
+        uint32_t index = bindings_[sym].index;
+        const BytecodeFunction &fn = out_->functions[index];
+        if (fn.params.size() != n.count) {
+            error("'" + name + "' takes " + to_string(fn.params.size()) + " argument(s), not " + to_string(n.count));
+        }
+        if (!fn.defined) error("'" + name + "' is declared but never defined");
+
+        // Arguments go to consecutive registers, which become the callee's
+        // parameters; the result comes back in the first one.
+        uint32_t base = freeReg_;
+        for (uint32_t k = 0; k < max<uint32_t>(n.count, 1); ++k) newTemp();
+        uint32_t top = freeReg_;
+        for (uint32_t k = 0; k < n.count; ++k) {
+            Operand v = expr(ast_->child(n, k), base + k);
+            if (k < fn.params.size()) convert(v, fn.params[k], base + k);
+            freeReg_ = top;
+        }
+        line_ = tok(n.token).line;
+        emit(Op::Call, base, index, n.count);
+        freeReg_ = base + 1;
+        return into({base, fn.returnType}, want);
+    }
+
+    // Builtin print(a, b, ...): the values separated by spaces, then a newline.
+    Operand print(const AstNode &n) {
+        for (uint32_t k = 0; k < n.count; ++k) {
+            uint32_t mark = freeReg_;
+            Operand v = expr(ast_->child(n, k));
+            if (v.type == ValueType::Void) error("cannot print a void value");
+            line_ = tok(n.token).line;
+            emit(Op::Print, v.reg, static_cast<uint32_t>(v.type), k + 1 == n.count);
+            freeReg_ = mark;
+        }
+        if (n.count == 0) emit(Op::Print, 0, static_cast<uint32_t>(ValueType::Void), 1);
+        return {0, ValueType::Void};
+    }
+};
+
+// ---------- Disassembly ----------
+
+inline void dumpBytecode(const Program &program, ostream &out) {
+    for (size_t f = 0; f < program.functions.size(); ++f) {
+        const BytecodeFunction &fn = program.functions[f];
+        if (!fn.defined) continue;
+        out << fn.name << " (" << fn.params.size() << " params, " << fn.numRegs << " registers):\n";
+        size_t end = program.code.size();
+        for (const BytecodeFunction &other : program.functions)
+            if (other.defined && other.entry > fn.entry) end = min<size_t>(end, other.entry);
+        for (size_t i = fn.entry; i < end; ++i) {
+            const Instr &in = program.code[i];
+            out << "  " << right << setw(5) << i << "  line " << left << setw(5) << program.lines[i] << " "
+                << setw(8) << opName(in.op);
+            switch (in.op) {
+                case Op::LoadI: out << "r" << in.a << ", " << int32_t(in.wide()); break;
+                case Op::LoadK: {
+                    Value k = program.constants[in.wide()];
+                    out << "r" << in.a << ", k" << in.wide() << " (" << k.i << " / " << k.f << ")";
+                    break;
+                }
+                case Op::LoadG: out << "r" << in.a << ", " << program.globals[in.b].name; break;
+                case Op::StoreG: out << program.globals[in.b].name << ", r" << in.a; break;
+                case Op::IncI: case Op::IncL: out << "r" << in.a << ", " << int16_t(in.b); break;
+                case Op::Jmp: case Op::Loop: out << "-> " << in.wide(); break;
+                case Op::Jz: case Op::Jnz: out << "r" << in.a << " -> " << in.wide(); break;
+                case Op::Call: out << "r" << in.a << ", " << program.functions[in.b].name << ", " << in.c; break;
+                case Op::Ret: out << "r" << in.a; break;
+                case Op::RetV: break;
+                case Op::Print: out << "r" << in.a << ", " << valueTypeName(ValueType(in.b)) << (in.c ? ", newline" : ""); break;
+                case Op::Move: case Op::NegI: case Op::NegL: case Op::NegD: case Op::Not: case Op::NotD:
+                case Op::BitNot: case Op::ToBool: case Op::ToBoolD: case Op::Sext8: case Op::Sext16:
+                case Op::Sext32: case Op::I2F: case Op::I2D: case Op::D2F: case Op::D2I:
+                    out << "r" << in.a << ", r" << in.b;
+                    break;
+                default: out << "r" << in.a << ", r" << in.b << ", r" << in.c; break;
+            }
+            out << "\n";
+        }
+    }
+}
@@ -0,0 +1,433 @@
+// evaluator.h
+// Tree-walking evaluator for the C-like subset: runs a program straight
+// from its AST. It is the reference the faster engines are tested against
+// (`--diff`), so it favours being obviously right over being fast: every
+// expression is evaluated to a typed value, converted with the rules in
+// runtime.h, and variables are looked up through the Resolver's def-use
+// table. It only runs programs that Compiler accepted, and counts steps and
+// reports errors exactly where the VM does.
+
+#pragma once
+
+#include "vm.h"
+
+class TreeEvaluator {
+public:
+    explicit TreeEvaluator(VmOptions options = {}) : options_(options) {}
+
+    // Run the top level, then main() if defined; see VM::run.
+    RunStatus run(const Ast &ast, const vector<Token> &tokens, ostream &out) {
+        ast_ = &ast;
+        tokens_ = &tokens;
+        output_.clear();
+        strings_.assign(1, "");
+        steps_ = 0;
+        depth_ = 1;
+        exitCode_ = 0;
+        status_ = RunStatus::Ok;
+        error_ = {0, ""};
+
+        resolver_.resolve(ast, tokens, table_);
+        symbolAt_.assign(tokens.size(), Resolver::kUnresolved);
+        for (const SymbolUse &u : table_.uses) symbolAt_[u.token] = u.symbol;
+        for (uint32_t s = 0; s < table_.symbols.size(); ++s) symbolAt_[table_.symbols[s].token] = s;
+        values_.assign(table_.symbols.size(), TypedValue{});
+        functions_.assign(table_.symbols.size(), kNoNode);
+        locals_.assign(table_.symbols.size(), {});
+        literals_.clear();
+        globalSymbols_.clear();
+
+        const AstNode &program = ast[ast.root];
+        uint32_t mainFunction = Resolver::kUnresolved;
+        for (uint32_t k = 0; k < program.count; ++k) {
+            NodeId id = ast.child(program, k);
+            const AstNode &n = ast[id];
+            if (n.kind == NodeKind::Function && n.a != kNoNode) {
+                uint32_t sym = symbolAt_[n.token];
+                functions_[sym] = id;
+                collectLocals(id, locals_[sym]);
+                if (tok(n.token).lexeme == "main") mainFunction = sym;
+            }
+            if (n.kind == NodeKind::DeclStmt) {
+                for (uint32_t v = 0; v < n.count; ++v) {
+                    const AstNode &var = node(ast.child(n, v));
+                    uint32_t sym = symbolAt_[var.token];
+                    values_[sym] = {Value{0}, typeAt(tok(var.typeToken))};
+                    globalSymbols_.push_back(sym);
+                }
+            }
+        }
+
+        // Every interpreted call is a few native frames; a few KB each.
+        size_t stack = min<size_t>(max<size_t>(size_t(options_.maxCallDepth) * 4096, 8 << 20), size_t(1) << 30);
+        runWithStack(stack, [&] {
+            for (uint32_t k = 0; k < program.count && status_ == RunStatus::Ok; ++k) {
+                NodeId id = ast.child(program, k);
+                if (ast[id].kind == NodeKind::Function) continue;
+                if (exec(id) == Flow::Return) break;
+            }
+            if (status_ == RunStatus::Ok && mainFunction != Resolver::kUnresolved) {
+                depth_ = 0; // main runs as the bottom call, like the top level
+                TypedValue result = invoke(mainFunction, nullptr);
+                if (status_ == RunStatus::Ok && result.type != ValueType::Void) exitCode_ = result.v.i;
+            }
+        });
+        out.write(output_.data(), output_.size());
+        return status_;
+    }
+
+    const Diagnostic &error() const { return error_; }
+    int64_t exitCode() const { return exitCode_; }
+    uint64_t steps() const { return steps_; }
+    const vector<string> &strings() const { return strings_; }
+
+    // Final values of the globals, in declaration order (as Program::globals).
+    vector<Value> globals() const {
+        vector<Value> out;
+        for (uint32_t sym : globalSymbols_) out.push_back(values_[sym].v);
+        return out;
+    }
+
+private:
+    struct TypedValue {
+        Value v{0};
+        ValueType type = ValueType::Void;
+    };
+
+    enum class Flow { Normal, Break, Continue, Return, Stop };
+
+    VmOptions options_;
+    const Ast *ast_ = nullptr;
+    const vector<Token> *tokens_ = nullptr;
+    Resolver resolver_;
+    DefUseTable table_;
+    vector<uint32_t> symbolAt_;     // by token: the symbol it declares or uses
+    vector<TypedValue> values_;     // by symbol: the live instance of each variable
+    vector<NodeId> functions_;      // by symbol: the function's definition
+    vector<vector<uint32_t>> locals_; // by function symbol: see collectLocals()
+    unordered_map<uint32_t, uint32_t> literals_; // string literal token -> strings_ index
+    vector<uint32_t> globalSymbols_;
+    vector<string> strings_;
+    string output_;
+    TypedValue returned_;
+    uint64_t steps_ = 0;
+    uint32_t depth_ = 1;
+    int64_t exitCode_ = 0;
+    RunStatus status_ = RunStatus::Ok;
+    Diagnostic error_{0, ""};
+
+    const AstNode &node(NodeId id) const { return (*ast_)[id]; }
+    const Token &tok(uint32_t i) const { return (*tokens_)[i]; }
+    bool stopped() const { return status_ != RunStatus::Ok; }
+
+    void fail(RunStatus status, uint32_t token, const char *message) {
+        if (stopped()) return;
+        status_ = status;
+        error_ = {tok(token).line, message};
+    }
+
+    bool step(uint32_t token) {
+        if (++steps_ > options_.maxSteps) fail(RunStatus::StepLimit, token, "step limit exceeded");
+        return !stopped();
+    }
+
+    static ValueType typeAt(const Token &t) {
+        bool ok;
+        return valueTypeOf(t.lexeme, ok);
+    }
+
+    static bool truthy(TypedValue x) { return isFloatingType(x.type) ? x.v.f != 0 : x.v.i != 0; }
+
+    static TypedValue converted(TypedValue x, ValueType to) {
+        if (x.type == to || to == ValueType::String) return {x.v, to};
+        return {convertValue(x.v, x.type, to), to};
+    }
+
+    // ----- statements -----
+
+    Flow exec(NodeId id) {
+        if (id == kNoNode) return Flow::Normal;
+        const AstNode &n = node(id);
+        switch (n.kind) {
+            case NodeKind::DeclStmt:
+                for (uint32_t k = 0; k < n.count && !stopped(); ++k) {
+                    const AstNode &var = node(ast_->child(n, k));
+                    uint32_t sym = symbolAt_[var.token];
+                    ValueType type = typeAt(tok(var.typeToken));
+                    values_[sym] = {Value{0}, type}; // zero first: the initializer may read it
+                    if (var.a != kNoNode) values_[sym] = converted(eval(var.a), type);
+                }
+                break;
+            case NodeKind::Block:
+                for (uint32_t k = 0; k < n.count; ++k) {
+                    Flow f = exec(ast_->child(n, k));
+                    if (f != Flow::Normal) return f;
+                }
+                break;
+            case NodeKind::ExprStmt:
+                eval(n.a);
+                break;
+            case NodeKind::If: {
+                bool taken = truthy(eval(n.a));
+                if (stopped()) return Flow::Stop;
+                return taken ? exec(n.b) : exec(n.c);
+            }
+            case NodeKind::While:
+                for (;;) {
+                    bool taken = truthy(eval(n.a));
+                    if (stopped()) return Flow::Stop;
+                    if (!taken) break;
+                    Flow f = exec(n.b);
+                    if (f == Flow::Break) break;
+                    if (f == Flow::Return || f == Flow::Stop) return f;
+                    if (!step(n.token)) return Flow::Stop;
+                }
+                break;
+            case NodeKind::DoWhile:
+                for (;;) {
+                    Flow f = exec(n.b);
+                    if (f == Flow::Break) break;
+                    if (f == Flow::Return || f == Flow::Stop) return f;
+                    bool taken = truthy(eval(n.a));
+                    if (stopped()) return Flow::Stop;
+                    if (!taken) break;
+                    if (!step(n.token)) return Flow::Stop;
+                }
+                break;
+            case NodeKind::For: {
+                if (exec(n.a) == Flow::Stop) return Flow::Stop;
+                for (;;) {
+                    if (n.b != kNoNode) {
+                        bool taken = truthy(eval(n.b));
+                        if (stopped()) return Flow::Stop;
+                        if (!taken) break;
+                    }
+                    Flow f = exec(n.d);
+                    if (f == Flow::Break) break;
+                    if (f == Flow::Return || f == Flow::Stop) return f;
+                    if (n.c != kNoNode) eval(n.c);
+                    if (stopped() || !step(n.token)) return Flow::Stop;
+                }
+                break;
+            }
+            case NodeKind::Return:
+                returned_ = n.a != kNoNode ? eval(n.a) : TypedValue{};
+                return stopped() ? Flow::Stop : Flow::Return;
+            case NodeKind::Break: return Flow::Break;
+            case NodeKind::Continue: return Flow::Continue;
+            default: break;
+        }
+        return stopped() ? Flow::Stop : Flow::Normal;
+    }
+
+    // ----- calls -----
+
+    // Symbols whose values a call of `fn` overwrites: its parameters and
+    // every local declared in its body.
+    void collectLocals(NodeId id, vector<uint32_t> &out) const {
+        if (id == kNoNode) return;
+        const AstNode &n = node(id);
+        if (n.kind == NodeKind::VarDecl || n.kind == NodeKind::Param) out.push_back(symbolAt_[n.token]);
+        for (NodeId child : {n.a, n.b, n.c, n.d}) collectLocals(child, out);
+        for (uint32_t k = 0; k < n.count; ++k) collectLocals(ast_->child(n, k), out);
+    }
+
+    // Call function `sym` with already evaluated arguments. Each variable
+    // has one live instance in values_, so the caller's instances of the
+    // callee's locals (recursion) are saved and restored.
+    TypedValue invoke(uint32_t sym, const vector<TypedValue> *args) {
+        const AstNode &fn = node(functions_[sym]);
+        const vector<uint32_t> &locals = locals_[sym];
+        vector<TypedValue> saved;
+        saved.reserve(locals.size());
+        for (uint32_t sym : locals) saved.push_back(values_[sym]);
+
+        for (uint32_t k = 0; k < fn.count; ++k) {
+            const AstNode &param = node(ast_->child(fn, k));
+            values_[symbolAt_[param.token]] = converted((*args)[k], typeAt(tok(param.typeToken)));
+        }
+        ValueType returnType = typeAt(tok(fn.typeToken));
+        ++depth_;
+        Flow f = exec(fn.a);
+        --depth_;
+        TypedValue result{Value{0}, returnType};
+        if (f == Flow::Return && returnType != ValueType::Void) result = converted(returned_, returnType);
+
+        for (size_t k = 0; k < locals.size(); ++k) values_[locals[k]] = saved[k];
+        return result;
+    }
+
+    TypedValue call(const AstNode &n) {
+        const AstNode &callee = node(n.a);
+        uint32_t sym = symbolAt_[callee.token];
+        if (sym == Resolver::kUnresolved) { // the print() builtin
+            for (uint32_t k = 0; k < n.count; ++k) {
+                TypedValue v = eval(ast_->child(n, k));
+                if (stopped()) return {};
+                appendValue(output_, v.v, v.type, strings_);
+                output_ += k + 1 == n.count ? '\n' : ' ';
+            }
+            if (n.count == 0) output_ += '\n';
+            return {};
+        }
+        vector<TypedValue> args;
+        for (uint32_t k = 0; k < n.count; ++k) {
+            args.push_back(eval(ast_->child(n, k)));
+            if (stopped()) return {};
+        }
+        if (!step(n.token)) return {};
+        if (depth_ >= options_.maxCallDepth) {
+            fail(RunStatus::RuntimeError, n.token, "call stack overflow");
+            return {};
+        }
+        return invoke(sym, &args);
+    }
+
+    // ----- expressions -----
+
+    TypedValue eval(NodeId id) {
+        const AstNode &n = node(id);
+        const Token &t = tok(n.token);
+        switch (n.kind) {
+            case NodeKind::Number: {
+                ConstValue c;
+                decodeNumber(t.lexeme, c);
+                TypedValue r;
+                if (c.isFloat) {
+                    r.v.f = c.f;
+                    r.type = ValueType::Double;
+                } else {
+                    r.v.i = c.i;
+                    r.type = c.type();
+                }
+                return r;
+            }
+            case NodeKind::Char: return {Value{decodeCharLiteral(t.lexeme)}, ValueType::Char};
+            case NodeKind::Bool: return {Value{t.lexeme == "true"}, ValueType::Bool};
+            case NodeKind::String: {
+                auto [it, added] = literals_.emplace(n.token, static_cast<uint32_t>(strings_.size()));
+                if (added) strings_.push_back(decodeStringLiteral(t.lexeme));
+                return {Value{it->second}, ValueType::String};
+            }
+            case NodeKind::Name: return values_[symbolAt_[n.token]];
+            case NodeKind::Assign: return assign(n);
+            case NodeKind::Binary: return binary(n);
+            case NodeKind::Unary: return unary(n);
+            case NodeKind::Postfix: return increment(n, n.a, false);
+            case NodeKind::Call: return call(n);
+            default: return {};
+        }
+    }
+
+    // l op r for + - * / % << >> & | ^, on operands already evaluated.
+    TypedValue arithmetic(string_view op, TypedValue l, TypedValue r, uint32_t token) {
+        bool shift = op == "<<" || op == ">>";
+        ValueType t = shift ? commonType(l.type, ValueType::Int) : commonType(l.type, r.type);
+        Value a = converted(l, t).v;
+        Value b = converted(r, shift ? ValueType::Long : t).v;
+        TypedValue out{Value{0}, t};
+        if (isFloatingType(t)) {
+            switch (op[0]) {
+                case '+': out.v.f = a.f + b.f; break;
+                case '-': out.v.f = a.f - b.f; break;
+                case '*': out.v.f = a.f * b.f; break;
+                default: out.v.f = a.f / b.f; break;
+            }
+            if (t == ValueType::Float) out.v.f = roundToFloat(out.v.f);
+            return out;
+        }
+        int bits = t == ValueType::Int ? 32 : 64;
+        int64_t x = a.i, y = b.i;
+        switch (op[0]) {
+            case '+': out.v.i = wrapAdd(x, y); break;
+            case '-': out.v.i = wrapSub(x, y); break;
+            case '*': out.v.i = wrapMul(x, y); break;
+            case '/':
+            case '%':
+                if (y == 0) {
+                    fail(RunStatus::RuntimeError, token, "division by zero");
+                    return out;
+                }
+                out.v.i = op[0] == '/' ? wrapDiv(x, y) : wrapMod(x, y);
+                break;
+            case '<': out.v.i = shiftLeft(x, y, bits); break;
+            case '>': out.v.i = shiftRight(x, y, bits); break;
+            case '&': out.v.i = x & y; break;
+            case '|': out.v.i = x | y; break;
+            default: out.v.i = x ^ y; break;
+        }
+        out.v.i = narrowInteger(out.v.i, t);
+        return out;
+    }
+
+    TypedValue binary(const AstNode &n) {
+        string_view op = tok(n.token).lexeme;
+        TypedValue l = eval(n.a);
+        if (stopped()) return {};
+        if (op == "&&" || op == "||") {
+            bool decided = truthy(l) == (op == "||");
+            if (decided) return {Value{op == "||"}, ValueType::Int};
+            TypedValue r = eval(n.b);
+            return {Value{truthy(r)}, ValueType::Int};
+        }
+        TypedValue r = eval(n.b);
+        if (stopped()) return {};
+        if (op == "<" || op == ">" || op == "<=" || op == ">=" || op == "==" || op == "!=") {
+            ValueType t = commonType(l.type, r.type);
+            Value a = converted(l, t).v, b = converted(r, t).v;
+            int c = isFloatingType(t) ? (a.f < b.f ? -1 : a.f > b.f ? 1 : a.f == b.f ? 0 : 2)
+                                      : (a.i < b.i ? -1 : a.i > b.i ? 1 : 0);
+            bool result = op == "<"    ? c == -1
+                        : op == ">"    ? c == 1
+                        : op == "<="   ? c == -1 || c == 0
+                        : op == ">="   ? c == 1 || c == 0
+                        : op == "=="   ? c == 0
+                                       : c != 0; // 2: unordered (NaN)
+            return {Value{result}, ValueType::Int};
+        }
+        return arithmetic(op, l, r, n.token);
+    }
+
+    TypedValue unary(const AstNode &n) {
+        string_view op = tok(n.token).lexeme;
+        if (op == "++" || op == "--") return increment(n, n.a, true);
+        TypedValue v = eval(n.a);
+        if (stopped()) return {};
+        if (op == "!") return {Value{!truthy(v)}, ValueType::Int};
+        ValueType t = commonType(v.type, ValueType::Int);
+        TypedValue x = converted(v, t);
+        if (op == "-") {
+            if (isFloatingType(t)) x.v.f = -x.v.f;
+            else x.v.i = narrowInteger(wrapSub(0, x.v.i), t);
+        } else if (op == "~") {
+            x.v.i = ~x.v.i;
+        }
+        return x;
+    }
+
+    TypedValue increment(const AstNode &n, NodeId target, bool prefix) {
+        TypedValue &var = values_[symbolAt_[node(target).token]];
+        TypedValue old = var;
+        int delta = tok(n.token).lexeme == "++" ? 1 : -1;
+        if (isFloatingType(var.type)) {
+            var.v.f += delta;
+            if (var.type == ValueType::Float) var.v.f = roundToFloat(var.v.f);
+        } else {
+            var.v.i = narrowInteger(wrapAdd(var.v.i, delta), var.type);
+        }
+        return prefix ? var : old;
+    }
+
+    TypedValue assign(const AstNode &n) {
+        string_view op = tok(n.token).lexeme;
+        uint32_t sym = symbolAt_[node(n.a).token];
+        ValueType type = values_[sym].type;
+        TypedValue cur = values_[sym]; // read before the right side runs
+        TypedValue r = eval(n.b);
+        if (stopped()) return {};
+        TypedValue result = op == "=" ? r : arithmetic(op.substr(0, op.size() - 1), cur, r, n.token);
+        if (stopped()) return {};
+        values_[sym] = converted(result, type);
+        return values_[sym];
+    }
+};
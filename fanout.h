@@ -0,0 +1,132 @@
+// fanout.h
+// One lexing pass, many readers. A TokenFanout lexes a file once and hands
+// the tokens, in batches, to every registered TokenConsumer: either inline
+// (each batch goes to the consumers in turn on the lexing thread) or with a
+// thread per consumer reading a broadcast ring. In the ring, a batch slot is
+// reused only after every consumer's cursor has passed it, so the lexer
+// runs at most kRingSlots batches ahead of the slowest consumer.
+
+#pragma once
+
+#include "trace.h"
+
+// A reader of the token stream. Each file is bracketed by beginFile() and
+// endFile(), which run on the same thread as its consume() calls.
+class TokenConsumer {
+public:
+    virtual ~TokenConsumer() = default;
+    virtual void beginFile(const string &name) { (void)name; }
+    virtual void consume(const Token *tokens, size_t count) = 0;
+    virtual void endFile() {}
+};
+
+class TokenFanout {
+public:
+    static constexpr size_t kBatchTokens = 1024;
+    static constexpr size_t kRingSlots = 8;
+
+    void add(TokenConsumer &consumer) { consumers_.push_back(&consumer); }
+    void setThreaded(bool threaded) { threaded_ = threaded; }
+    size_t consumers() const { return consumers_.size(); }
+
+    // Lex `code` once and feed every consumer all of its tokens.
+    LexStatus run(Lexer &lexer, string_view code, const string &name) {
+        return threaded_ && consumers_.size() > 1 ? runThreaded(lexer, code, name) : runInline(lexer, code, name);
+    }
+
+private:
+    vector<TokenConsumer *> consumers_;
+    bool threaded_ = false;
+
+    LexStatus runInline(Lexer &lexer, string_view code, const string &name) {
+        for (TokenConsumer *c : consumers_) c->beginFile(name);
+        vector<Token> batch;
+        batch.reserve(kBatchTokens);
+        auto flush = [&] {
+            TK_PROBE2(fanout_batch, batch.size(), consumers_.size());
+            TraceScope span("consume batch", "fanout");
+            span.arg("tokens", int64_t(batch.size()));
+            for (TokenConsumer *c : consumers_) c->consume(batch.data(), batch.size());
+            batch.clear();
+        };
+        LexStatus status = lexer.tokenizeStream(code, [&](Token &&t) {
+            batch.push_back(t);
+            if (batch.size() == kBatchTokens) flush();
+        });
+        if (!batch.empty()) flush();
+        for (TokenConsumer *c : consumers_) c->endFile();
+        return status;
+    }
+
+    // Slots hold batches [published - kRingSlots, published); consumer k has
+    // read the first cursor[k] of them.
+    struct Ring {
+        mutex lock;
+        condition_variable published, released;
+        vector<vector<Token>> slots{kRingSlots};
+        uint64_t head = 0;
+        vector<uint64_t> cursor;
+        bool done = false;
+    };
+
+    LexStatus runThreaded(Lexer &lexer, string_view code, const string &name) {
+        Ring ring;
+        ring.cursor.assign(consumers_.size(), 0);
+        auto read = [&](size_t k) {
+            if (Trace::enabled()) Trace::threadName("consumer " + to_string(k));
+            TokenConsumer &c = *consumers_[k];
+            TraceScope span("consume file", "fanout");
+            c.beginFile(name);
+            for (;;) {
+                unique_lock<mutex> hold(ring.lock);
+                auto ready = [&] { return ring.cursor[k] < ring.head || ring.done; };
+                if (!ready()) {
+                    TraceScope wait("wait for batch", "fanout", Trace::kMinWaitNs);
+                    ring.published.wait(hold, ready);
+                }
+                if (ring.cursor[k] == ring.head) break;
+                const vector<Token> &batch = ring.slots[ring.cursor[k] % kRingSlots];
+                hold.unlock();
+                c.consume(batch.data(), batch.size());
+                hold.lock();
+                ++ring.cursor[k];
+                ring.released.notify_one();
+            }
+            c.endFile();
+        };
+        vector<thread> readers;
+        for (size_t k = 0; k < consumers_.size(); ++k) readers.emplace_back(read, k);
+
+        vector<Token> batch;
+        batch.reserve(kBatchTokens);
+        auto publish = [&] {
+            TK_PROBE2(fanout_batch, batch.size(), consumers_.size());
+            unique_lock<mutex> hold(ring.lock);
+            auto hasSlot = [&] { return ring.head - *min_element(ring.cursor.begin(), ring.cursor.end()) < kRingSlots; };
+            if (!hasSlot()) {
+                // Backpressure: the slowest consumer is kRingSlots batches behind.
+                TraceScope wait("wait for free slot", "fanout", Trace::kMinWaitNs);
+                ring.released.wait(hold, hasSlot);
+            }
+            // The slot's previous batch has been read by everyone; swapping
+            // gives its buffer back to the lexer for reuse.
+            ring.slots[ring.head % kRingSlots].swap(batch);
+            ++ring.head;
+            ring.published.notify_all();
+            hold.unlock();
+            batch.clear();
+        };
+        LexStatus status = lexer.tokenizeStream(code, [&](Token &&t) {
+            batch.push_back(t);
+            if (batch.size() == kBatchTokens) publish();
+        });
+        if (!batch.empty()) publish();
+        {
+            lock_guard<mutex> hold(ring.lock);
+            ring.done = true;
+        }
+        ring.published.notify_all();
+        for (thread &t : readers) t.join();
+        return status;
+    }
+};
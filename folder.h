@@ -0,0 +1,361 @@
+// folder.h
+// Constant folding on the token stream: arithmetic on Number literals
+// (`1.2e-3 * 1000 + .45`) is evaluated and replaced by a single Number
+// token, before any parsing. Only subexpressions that the parser would
+// also see as one subtree are folded, so e.g. `x - 1 + 2` is left alone
+// while `x + 2 * 3` becomes `x + 6`.
+
+#pragma once
+
+#include "parser.h"
+#include "runtime.h"
+
+// The value of a numeric literal, with the type the engines give it: an
+// integer (no '.' or exponent) is an int if it fits in 32 bits and a long
+// otherwise, everything else is a double.
+struct ConstValue {
+    bool isFloat;
+    bool isLong; // an integer of type long rather than int
+    int64_t i;
+    double f;
+
+    ValueType type() const { return isFloat ? ValueType::Double : isLong ? ValueType::Long : ValueType::Int; }
+
+    double asDouble() const { return isFloat ? f : static_cast<double>(i); }
+};
+
+// Decode a Number lexeme. Integers with a leading 0 are octal, as in C.
+// Returns false for literals that do not fit (they are then left unfolded).
+inline bool decodeNumber(string_view s, ConstValue &out) {
+    const char *first = s.data(), *last = s.data() + s.size();
+    if (s.find_first_of(".eE") != string_view::npos) {
+        out.isFloat = true;
+        auto r = from_chars(first, last, out.f);
+        return r.ec == errc() && r.ptr == last && isfinite(out.f);
+    }
+    out.isFloat = false;
+    int base = s.size() > 1 && s[0] == '0' ? 8 : 10;
+    auto r = from_chars(first, last, out.i, base);
+    out.isLong = out.i < INT32_MIN || out.i > INT32_MAX;
+    return r.ec == errc() && r.ptr == last;
+}
+
+// Shortest text that reads back as the same value and still lexes as the
+// same kind of literal (floats always keep a '.' or an exponent).
+inline string formatConstValue(const ConstValue &v) {
+    char buf[64];
+    auto r = v.isFloat ? to_chars(buf, buf + sizeof(buf), v.f) : to_chars(buf, buf + sizeof(buf), v.i);
+    string text(buf, r.ptr);
+    if (v.isFloat && text.find_first_of(".e") == string::npos) text += ".0";
+    return text;
+}
+
+class ConstantFolder {
+public:
+    static constexpr int kMaxDepth = 256;
+
+    // Write `tokens` with constant subexpressions folded to `out`. Folded
+    // lexemes are allocated from `arena`, so the arena must live as long as
+    // `out` (use the Lexer's arena). Returns the number of tokens removed.
+    size_t fold(const vector<Token> &tokens, vector<Token> &out, Arena &arena) {
+        tokens_ = &tokens;
+        out_ = &out;
+        arena_ = &arena;
+        out.clear();
+        out.reserve(tokens.size());
+
+        size_t n = tokens.size();
+        size_t i = 0;
+        while (i < n) {
+            nodes_.clear();
+            size_t p = i;
+            int root = canStart(i) ? parseExpr(p, kLowestPrec, 0) : -1;
+            if (root < 0) {
+                out.push_back(tokens[i++]);
+                continue;
+            }
+            emit(root);
+            i = p;
+        }
+        return n - out.size();
+    }
+
+private:
+    static constexpr int kLowestPrec = 10; // + and - (see binaryPrecedence)
+    static constexpr int kUnaryPrec = 12;
+    static constexpr int kAtomPrec = 13;   // literals and parenthesized groups
+
+    // A constant subexpression found by the local parse, covering tokens
+    // [begin, end). `op` is the operator token for Binary/Unary.
+    struct Expr {
+        enum Kind { Atom, Unary, Binary, Paren } kind;
+        uint32_t begin, end, op;
+        int lhs, rhs; // child indices into nodes_ (-1 if unused)
+        int prec;
+        uint32_t height; // levels below and including this node
+        int8_t state; // 0 = not evaluated, 1 = constant, -1 = not foldable
+        ConstValue value;
+    };
+
+    const vector<Token> *tokens_ = nullptr;
+    vector<Token> *out_ = nullptr;
+    Arena *arena_ = nullptr;
+    vector<Expr> nodes_;
+
+    const Token &tok(size_t i) const { return (*tokens_)[i]; }
+
+    bool isSign(size_t i) const {
+        return i < tokens_->size() && (tok(i).kind == TokenKind::OpAdd || tok(i).kind == TokenKind::OpSub);
+    }
+
+    bool isArithmetic(size_t i) const {
+        if (i >= tokens_->size()) return false;
+        switch (tok(i).kind) {
+            case TokenKind::OpAdd: case TokenKind::OpSub: case TokenKind::OpMul: case TokenKind::OpDiv: case TokenKind::OpMod:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The last token already written: the left neighbour of whatever is
+    // emitted next.
+    const Token *previous() const { return out_->empty() ? nullptr : &out_->back(); }
+
+    // Tokens after which a '+' or '-' is binary, and '(' is a call or cast.
+    static bool endsOperand(const Token *t) {
+        if (!t) return false;
+        switch (t->type) {
+            case TokenType::Number: case TokenType::Identifier: case TokenType::String: case TokenType::Char:
+                return true;
+            default:
+                return t->kind == TokenKind::DelimRParen || t->kind == TokenKind::DelimRBracket ||
+                       t->kind == TokenKind::OpInc || t->kind == TokenKind::OpDec;
+        }
+    }
+
+    bool canStart(size_t i) const {
+        const Token &t = tok(i);
+        const Token *prev = previous();
+        if (t.type == TokenType::Number) return true;
+        if (isSign(i)) return !endsOperand(prev);
+        // Only a grouping '(' may disappear: not one after `if`, `while`, a
+        // callee, a cast, ...
+        if (t.kind == TokenKind::DelimLParen) {
+            if (!prev) return true;
+            switch (prev->kind) {
+                case TokenKind::OpInc: case TokenKind::OpDec: return false;
+                case TokenKind::KwReturn: case TokenKind::KwCase: return true;
+                case TokenKind::DelimLParen: case TokenKind::DelimComma: case TokenKind::DelimLBracket:
+                case TokenKind::DelimLBrace: case TokenKind::DelimSemicolon: case TokenKind::DelimRBrace:
+                    return true;
+                default: return prev->type == TokenType::Operator;
+            }
+        }
+        return false;
+    }
+
+    // The height of a node over `lhs` and `rhs`. evaluate() and emit()
+    // recurse once per level, so an expression is cut short before it gets
+    // taller than kMaxTreeDepth (ast.h); the rest is folded separately.
+    uint32_t heightOver(int lhs, int rhs) const {
+        uint32_t h = 0;
+        if (lhs >= 0) h = nodes_[lhs].height;
+        if (rhs >= 0) h = max(h, nodes_[rhs].height);
+        return h + 1;
+    }
+
+    int addNode(Expr e) {
+        e.height = heightOver(e.lhs, e.rhs);
+        nodes_.push_back(e);
+        return static_cast<int>(nodes_.size() - 1);
+    }
+
+    // Precedence climbing over + - * / % with prefix + -, literals and
+    // parentheses. Returns -1 (restoring p) if no constant expression starts
+    // at p; a binary operator whose right side is not constant ends the
+    // expression before that operator.
+    int parseExpr(size_t &p, int minPrec, int depth) {
+        int lhs = parsePrefix(p, depth);
+        if (lhs < 0) return -1;
+        while (isArithmetic(p)) {
+            int prec = binaryPrecedence(tok(p).kind);
+            if (prec < minPrec) break;
+            size_t save = p++;
+            int rhs = parseExpr(p, prec + 1, depth + 1);
+            if (rhs < 0 || heightOver(lhs, rhs) > kMaxTreeDepth) {
+                p = save;
+                break;
+            }
+            lhs = addNode({Expr::Binary, nodes_[lhs].begin, static_cast<uint32_t>(p), static_cast<uint32_t>(save),
+                           lhs, rhs, prec, 0, 0, {}});
+        }
+        return lhs;
+    }
+
+    int parsePrefix(size_t &p, int depth) {
+        if (depth > kMaxDepth || p >= tokens_->size()) return -1;
+        size_t start = p;
+        const Token &t = tok(p);
+        if (t.type == TokenType::Number) {
+            ++p;
+            return addNode({Expr::Atom, uint32_t(start), uint32_t(p), uint32_t(start), -1, -1, kAtomPrec, 0, 0, {}});
+        }
+        if (isSign(p)) {
+            ++p;
+            int child = parsePrefix(p, depth + 1);
+            if (child < 0 || heightOver(child, -1) > kMaxTreeDepth) {
+                p = start;
+                return -1;
+            }
+            return addNode({Expr::Unary, uint32_t(start), uint32_t(p), uint32_t(start), child, -1, kUnaryPrec, 0, 0, {}});
+        }
+        if (t.kind == TokenKind::DelimLParen) {
+            ++p;
+            int inner = parseExpr(p, kLowestPrec, depth + 1);
+            if (inner < 0 || p >= tokens_->size() || tok(p).kind != TokenKind::DelimRParen ||
+                heightOver(inner, -1) > kMaxTreeDepth) {
+                p = start;
+                return -1;
+            }
+            ++p;
+            return addNode({Expr::Paren, uint32_t(start), uint32_t(p), uint32_t(start), inner, -1, kAtomPrec, 0, 0, {}});
+        }
+        return -1;
+    }
+
+    // ----- evaluation -----
+
+    bool evaluate(int id) {
+        Expr &e = nodes_[id];
+        if (e.state == 0) e.state = compute(e) ? 1 : -1;
+        return e.state > 0;
+    }
+
+    bool compute(Expr &e) {
+        switch (e.kind) {
+            case Expr::Atom:
+                return decodeNumber(tok(e.begin).lexeme, e.value);
+            case Expr::Paren:
+                if (!evaluate(e.lhs)) return false;
+                e.value = nodes_[e.lhs].value;
+                return true;
+            case Expr::Unary: {
+                if (!evaluate(e.lhs)) return false;
+                ConstValue v = nodes_[e.lhs].value;
+                if (tok(e.op).kind == TokenKind::OpSub) {
+                    if (v.isFloat) v.f = -v.f;
+                    else v.i = v.isLong ? wrapSub(0, v.i) : wrapInt32(wrapSub(0, v.i));
+                }
+                e.value = v;
+                return readsBack(v);
+            }
+            case Expr::Binary: {
+                bool l = evaluate(e.lhs), r = evaluate(e.rhs);
+                if (!l || !r) return false;
+                return apply(tok(e.op).lexeme[0], nodes_[e.lhs].value, nodes_[e.rhs].value, e.value);
+            }
+        }
+        return false;
+    }
+
+    // A folded integer is written as a plain literal, whose type comes from
+    // its value: a long that fits in 32 bits would read back as an int.
+    static bool readsBack(const ConstValue &v) { return v.isFloat || v.isLong == (v.i < INT32_MIN || v.i > INT32_MAX); }
+
+    // Arithmetic as the engines do it (see runtime.h): int wraps in 32
+    // bits and long in 64. Refuses division by zero (a runtime error), %
+    // on doubles, infinite or NaN results, and results that would not
+    // read back with their type.
+    static bool apply(char op, const ConstValue &a, const ConstValue &b, ConstValue &out) {
+        if (a.isFloat || b.isFloat) {
+            double x = a.asDouble(), y = b.asDouble(), r;
+            switch (op) {
+                case '+': r = x + y; break;
+                case '-': r = x - y; break;
+                case '*': r = x * y; break;
+                case '/': r = x / y; break;
+                default: return false;
+            }
+            out = {true, false, 0, r};
+            return isfinite(r);
+        }
+        int64_t x = a.i, y = b.i, r;
+        switch (op) {
+            case '+': r = wrapAdd(x, y); break;
+            case '-': r = wrapSub(x, y); break;
+            case '*': r = wrapMul(x, y); break;
+            case '/':
+            case '%':
+                if (y == 0) return false;
+                r = op == '/' ? wrapDiv(x, y) : wrapMod(x, y);
+                break;
+            default: return false;
+        }
+        bool isLong = a.isLong || b.isLong;
+        out = {false, isLong, isLong ? r : wrapInt32(r), 0};
+        return readsBack(out);
+    }
+
+    // ----- emission -----
+
+    // Would the parser see tokens [e.begin, e.end) as one subtree, given the
+    // tokens around it? The left neighbour must bind less tightly than e's
+    // top operator (a prefix operator, or a ')' that may end a cast, binds
+    // tighter than any binary one), and the right neighbour no tighter,
+    // since the operators are left associative.
+    bool isolated(const Expr &e) const {
+        const Token *left = previous();
+        if (left && left->type == TokenType::Operator) {
+            bool prefix = !(out_->size() >= 2 && endsOperand(&(*out_)[out_->size() - 2])) ||
+                          left->kind == TokenKind::OpNot || left->kind == TokenKind::OpTilde ||
+                          left->kind == TokenKind::OpInc || left->kind == TokenKind::OpDec;
+            int prec = binaryPrecedence(left->kind);
+            if (prefix ? e.prec < kUnaryPrec : prec >= e.prec) return false;
+        } else if (left && left->kind == TokenKind::DelimRParen) {
+            if (e.prec < kUnaryPrec) return false;
+        }
+        if (e.end < tokens_->size()) {
+            const Token &right = tok(e.end);
+            if (right.type == TokenType::Operator) {
+                if (right.kind == TokenKind::OpInc || right.kind == TokenKind::OpDec) return false;
+                if (binaryPrecedence(right.kind) > e.prec) return false;
+            } else if (right.kind == TokenKind::DelimLParen || right.kind == TokenKind::DelimLBracket) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Write node `id`: as one folded Number if it is constant and isolated,
+    // otherwise as its parts with their own subtrees folded where possible.
+    void emit(int id) {
+        const Expr &e = nodes_[id];
+        if (e.kind == Expr::Atom) {
+            out_->push_back(tok(e.begin));
+            return;
+        }
+        if (evaluate(id) && isolated(e)) {
+            string text = formatConstValue(e.value);
+            TokenKind kind = e.value.isFloat ? TokenKind::LitFloat : TokenKind::LitInt;
+            out_->push_back(Token{arena_->copy(text), TokenType::Number, tok(e.begin).line, 0, kind});
+            return;
+        }
+        switch (e.kind) {
+            case Expr::Unary:
+                out_->push_back(tok(e.op));
+                emit(e.lhs);
+                break;
+            case Expr::Paren:
+                out_->push_back(tok(e.op));
+                emit(e.lhs);
+                out_->push_back(tok(e.end - 1));
+                break;
+            default:
+                emit(e.lhs);
+                out_->push_back(tok(e.op));
+                emit(e.rhs);
+                break;
+        }
+    }
+};
@@ -0,0 +1,241 @@
+// frames.h
+// Many documents on one input stream, so a service can lex a stream of
+// small snippets in one process instead of starting one per snippet. Two
+// framings are read:
+//
+//   length  each document is preceded by its size in bytes, in decimal,
+//           on a line of its own: "11\nint x = 1;\n" (the document is the
+//           11 bytes "int x = 1;\n"; any bytes may follow). A document
+//           may be at most kMaxFrameSize bytes.
+//   nul     documents are separated by a '\0' byte; a final document need
+//           not be terminated
+//
+// The reader keeps one buffer for the whole stream and hands out views
+// into it, so after warm-up a document costs no allocation. Results go to a
+// FrameWriter, which formats into a reused buffer and writes it out in
+// large blocks. Both use read(2)/write(2) directly: a read returns as soon
+// as any input is there, so a client can send one document and wait.
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+enum class Framing { Length, Nul };
+
+class FrameReader {
+public:
+    static constexpr size_t kReadSize = 64 * 1024;
+    // The largest length a header may give. The buffer only grows as bytes
+    // arrive, so a header alone never allocates its size.
+    static constexpr size_t kMaxFrameSize = size_t(256) << 20;
+
+    FrameReader(int fd, Framing framing) : fd_(fd), framing_(framing) {}
+
+    // Called before every read of the input, which may block: a writer
+    // flushes here, so a client waiting for results before it sends more
+    // input gets them.
+    void onRead(function<void()> hook) { onRead_ = move(hook); }
+
+    // The next document, as a view valid until the next call. Returns false
+    // at the end of the input, or on a malformed frame (error() is then set).
+    bool next(string_view &doc) {
+        return framing_ == Framing::Length ? nextLength(doc) : nextNul(doc);
+    }
+
+    const string &error() const { return error_; }
+
+private:
+    int fd_;
+    Framing framing_;
+    function<void()> onRead_;
+    vector<char> buffer_;
+    size_t begin_ = 0, end_ = 0; // unread bytes are buffer_[begin_, end_)
+    bool eof_ = false;
+    string error_;
+
+    // Append whatever input is available (at least a byte, unless the input
+    // has ended) after the unread bytes, moving them to the front of the
+    // buffer first, and doubling the buffer when less than kReadSize is
+    // free. Returns false at the end of the input.
+    bool fill() {
+        if (eof_) return false;
+        if (begin_) {
+            memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (buffer_.size() < end_ + kReadSize) buffer_.resize(max(end_ + kReadSize, 2 * buffer_.size()));
+        if (onRead_) onRead_();
+        TraceScope span("read input", "io");
+        ssize_t got;
+        do {
+            got = read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+        } while (got < 0 && errno == EINTR);
+        span.arg("bytes", got);
+        if (got <= 0) {
+            if (got < 0) error_ = strerror(errno);
+            eof_ = true;
+            return false;
+        }
+        end_ += size_t(got);
+        return true;
+    }
+
+    // A header is a decimal byte count and a newline (a '\r' is ignored).
+    // Blank lines between documents are skipped.
+    bool nextLength(string_view &doc) {
+        size_t size = 0, digits = 0, i = begin_;
+        bool newline = false;
+        while (!newline) {
+            if (i == end_) {
+                size_t scanned = i - begin_;
+                if (!fill()) break;
+                i = begin_ + scanned;
+                continue;
+            }
+            char c = buffer_[i++];
+            if (c == '\n') {
+                newline = digits != 0;
+                if (!digits) begin_ = i;
+            } else if (c == '\r') {
+                continue;
+            } else if (c < '0' || c > '9' || ++digits > 10) {
+                return fail("bad frame header (expected a byte count and a newline)");
+            } else {
+                size = size * 10 + size_t(c - '0');
+            }
+        }
+        if (!newline) return digits ? fail("truncated frame header") : false;
+        if (size > kMaxFrameSize) return fail("frame too large (the limit is 256 MB)");
+        begin_ = i;
+        while (end_ - begin_ < size)
+            if (!fill()) return fail("truncated document");
+        doc = string_view(buffer_.data() + begin_, size);
+        begin_ += size;
+        return true;
+    }
+
+    bool nextNul(string_view &doc) {
+        size_t scanned = 0;
+        for (;;) {
+            const char *start = buffer_.data() + begin_;
+            const void *nul = scanned < end_ - begin_ ? memchr(start + scanned, '\0', end_ - begin_ - scanned) : nullptr;
+            if (nul) {
+                size_t size = size_t(static_cast<const char *>(nul) - start);
+                doc = string_view(start, size);
+                begin_ += size + 1;
+                return true;
+            }
+            scanned = end_ - begin_;
+            if (!fill()) break;
+        }
+        if (begin_ == end_) return false;
+        doc = string_view(buffer_.data() + begin_, end_ - begin_);
+        begin_ = end_;
+        return true;
+    }
+
+    bool fail(const char *message) {
+        if (error_.empty()) error_ = message;
+        return false;
+    }
+};
+
+// Per-document results:
+//
+//   # <id> <tokens> <warnings>
+//   <line>\t<type>\t<lexeme>       one per token
+//   ! <line>\t<message>            one per lexer warning
+//
+// In lexemes, '\\', '\t', '\n' and '\r' are escaped C-style, so every
+// record is one line.
+class FrameWriter {
+public:
+    static constexpr size_t kFlushSize = 64 * 1024;
+
+    explicit FrameWriter(int fd) : fd_(fd) { buffer_.reserve(2 * kFlushSize); }
+    ~FrameWriter() { flush(); }
+
+    void document(uint64_t id, const vector<Token> &tokens, const vector<LexWarning> &diagnostics) {
+        buffer_ += "# ";
+        number(id);
+        buffer_ += ' ';
+        number(tokens.size());
+        buffer_ += ' ';
+        number(diagnostics.size());
+        buffer_ += '\n';
+        for (const Token &t : tokens) {
+            number(uint64_t(t.line));
+            buffer_ += '\t';
+            buffer_ += tokenTypeToString(t.type);
+            buffer_ += '\t';
+            escaped(t.lexeme);
+            buffer_ += '\n';
+            if (buffer_.size() >= kFlushSize) flush();
+        }
+        for (const LexWarning &d : diagnostics) {
+            buffer_ += "! ";
+            number(uint64_t(d.line));
+            buffer_ += '\t';
+            escaped(d.message);
+            buffer_ += '\n';
+        }
+        if (buffer_.size() >= kFlushSize) flush();
+    }
+
+    // Returns false if the output could not be written (e.g. a closed pipe).
+    bool flush() {
+        TraceScope span("write output", "io");
+        span.arg("bytes", int64_t(buffer_.size()));
+        const char *p = buffer_.data();
+        size_t left = buffer_.size();
+        while (left) {
+            ssize_t put = write(fd_, p, left);
+            if (put < 0 && errno == EINTR) continue;
+            if (put <= 0) {
+                failed_ = true;
+                break;
+            }
+            p += put;
+            left -= size_t(put);
+        }
+        buffer_.clear();
+        return !failed_;
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    int fd_;
+    bool failed_ = false;
+    string buffer_;
+
+    void number(uint64_t n) {
+        char text[20];
+        auto [end, ec] = to_chars(text, text + sizeof text, n);
+        (void)ec;
+        buffer_.append(text, end);
+    }
+
+    void escaped(string_view s) {
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            char c = s[i], e;
+            switch (c) {
+                case '\\': e = '\\'; break;
+                case '\t': e = 't'; break;
+                case '\n': e = 'n'; break;
+                case '\r': e = 'r'; break;
+                default: continue;
+            }
+            buffer_.append(s.data() + run, i - run);
+            buffer_ += '\\';
+            buffer_ += e;
+            run = i + 1;
+        }
+        buffer_.append(s.data() + run, s.size() - run);
+    }
+};
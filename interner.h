@@ -0,0 +1,59 @@
+// interner.h
+// Identifier interning: maps each distinct name to a dense ID, using the
+// hash the lexer computed while scanning the identifier, so no name is
+// hashed twice. Shared by the resolver and the identifier counters.
+
+#pragma once
+
+#include "lexer.h"
+
+// Maps identifier text to dense IDs 0, 1, 2, ... The stored names are views
+// into the source buffer, so the source must outlive the interner.
+class Interner {
+public:
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    uint32_t intern(string_view s, uint32_t hash) {
+        if ((names_.size() + 1) * 2 > slots_.size()) grow();
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot &slot = slots_[i];
+            if (slot.id == kNone) {
+                slot = {hash, static_cast<uint32_t>(names_.size())};
+                names_.push_back(s);
+                return slot.id;
+            }
+            if (slot.hash == hash && names_[slot.id] == s) return slot.id;
+        }
+    }
+
+    uint32_t intern(const Token &t) { return intern(t.lexeme, t.hash ? t.hash : hashString(t.lexeme)); }
+
+    string_view name(uint32_t id) const { return names_[id]; }
+    size_t size() const { return names_.size(); }
+
+    void clear() {
+        names_.clear();
+        fill(slots_.begin(), slots_.end(), Slot{0, kNone});
+    }
+
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t id;
+    };
+    vector<Slot> slots_;
+    vector<string_view> names_;
+
+    void grow() {
+        vector<Slot> old = move(slots_);
+        slots_.assign(max<size_t>(old.size() * 2, 64), Slot{0, kNone});
+        size_t mask = slots_.size() - 1;
+        for (const Slot &slot : old) {
+            if (slot.id == kNone) continue;
+            size_t i = slot.hash & mask;
+            while (slots_[i].id != kNone) i = (i + 1) & mask;
+            slots_[i] = slot;
+        }
+    }
+};
@@ -0,0 +1,1368 @@
+// ir.h
+// SSA middle end for the bytecode. Each function's bytecode is lifted to
+// SSA form (registers become values and Moves disappear), optimized by
+// constant propagation, common subexpression elimination and dead code
+// elimination, given registers by a linear-scan allocator and lowered back
+// to bytecode. The result is an ordinary Program, so the VM, the JIT and
+// --diff run it unchanged.
+//
+// Storage follows ast.h: all instructions of a function live in one flat
+// vector and are named by 32-bit ids (an instruction's id is also the id of
+// the value it defines). Blocks, predecessor lists, block contents and the
+// variable-length operand lists of phis and calls are flat arrays as well.
+//
+// The optimizations keep what the engines can observe: every print, global
+// store, call, loop back-edge (a step) and division that may fault stays,
+// in order; only register traffic and pure computation change.
+
+#pragma once
+
+#include "bytecode.h"
+#include "pool.h"
+
+enum class IrOp : uint8_t { Nop, Const, Param, Phi, Unary, Binary, LoadG, StoreG, Call, Print, Jmp, Br, Ret, RetV };
+
+struct IrInstr {
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    IrOp op = IrOp::Nop;
+    Op code = Op::Move;  // Unary/Binary: the bytecode operation
+    uint16_t aux = 0;    // Param: index. Unary: the IncI/IncL step. LoadG/StoreG:
+                         // global. Call: function. Print: type | newline << 8.
+                         // Jmp: 1 for a loop back-edge (emitted as Loop).
+    uint32_t a = kNone;  // operands; Phi/Call: first entry in IrFunction::operands
+    uint32_t b = kNone;  // Phi/Call: operand count
+    uint32_t block = 0;
+    int line = 0;
+    Value k{0};          // Const
+};
+
+struct IrBlock {
+    uint32_t begin = 0, end = 0;            // IrFunction::schedule[begin, end): phis first
+    uint32_t predBegin = 0, predCount = 0;  // IrFunction::preds; phi operands follow this order
+    uint32_t succ[2] = {IrInstr::kNone, IrInstr::kNone}; // Br: succ[0] if the condition is nonzero
+    bool live = true;
+};
+
+struct IrFunction {
+    uint32_t index = 0; // in Program::functions
+    vector<IrInstr> instrs;
+    vector<uint32_t> operands;
+    vector<IrBlock> blocks; // block 0 is the prologue: parameters only
+    vector<uint32_t> preds;
+    vector<uint32_t> schedule;
+    vector<uint32_t> layout; // live blocks in reverse postorder
+    vector<uint32_t> reg;    // per value, after register allocation
+
+    uint32_t pred(const IrBlock &b, uint32_t k) const { return preds[b.predBegin + k]; }
+    const IrInstr &terminator(const IrBlock &b) const { return instrs[schedule[b.end - 1]]; }
+};
+
+// Call f(slot) for every value operand of `in`.
+template <class F>
+inline void forEachUse(IrFunction &fn, IrInstr &in, F f) {
+    switch (in.op) {
+        case IrOp::Binary: f(in.a); f(in.b); break;
+        case IrOp::Unary: case IrOp::StoreG: case IrOp::Print: case IrOp::Br: case IrOp::Ret: f(in.a); break;
+        case IrOp::Phi: case IrOp::Call:
+            for (uint32_t k = 0; k < in.b; ++k) f(fn.operands[in.a + k]);
+            break;
+        default: break;
+    }
+}
+
+// The value an arithmetic instruction gives for constant operands, exactly
+// as the VM computes it. False when it would fault (division by zero).
+inline bool foldOp(Op op, Value x, Value y, int16_t step, Value &out) {
+    int64_t a = x.i, b = y.i;
+    switch (op) {
+        case Op::AddI: out.i = wrapInt32(wrapAdd(a, b)); break;
+        case Op::AddL: out.i = wrapAdd(a, b); break;
+        case Op::AddF: out.f = roundToFloat(x.f + y.f); break;
+        case Op::AddD: out.f = x.f + y.f; break;
+        case Op::SubI: out.i = wrapInt32(wrapSub(a, b)); break;
+        case Op::SubL: out.i = wrapSub(a, b); break;
+        case Op::SubF: out.f = roundToFloat(x.f - y.f); break;
+        case Op::SubD: out.f = x.f - y.f; break;
+        case Op::MulI: out.i = wrapInt32(wrapMul(a, b)); break;
+        case Op::MulL: out.i = wrapMul(a, b); break;
+        case Op::MulF: out.f = roundToFloat(x.f * y.f); break;
+        case Op::MulD: out.f = x.f * y.f; break;
+        case Op::DivI: if (b == 0) return false; out.i = wrapInt32(wrapDiv(a, b)); break;
+        case Op::DivL: if (b == 0) return false; out.i = wrapDiv(a, b); break;
+        case Op::DivF: out.f = roundToFloat(x.f / y.f); break;
+        case Op::DivD: out.f = x.f / y.f; break;
+        case Op::ModI: case Op::ModL: if (b == 0) return false; out.i = wrapMod(a, b); break;
+        case Op::ShlI: out.i = wrapInt32(shiftLeft(a, b, 32)); break;
+        case Op::ShlL: out.i = shiftLeft(a, b, 64); break;
+        case Op::ShrI: out.i = shiftRight(a, b, 32); break;
+        case Op::ShrL: out.i = shiftRight(a, b, 64); break;
+        case Op::And: out.i = a & b; break;
+        case Op::Or: out.i = a | b; break;
+        case Op::Xor: out.i = a ^ b; break;
+        case Op::Lt: out.i = a < b; break;
+        case Op::Le: out.i = a <= b; break;
+        case Op::Eq: out.i = a == b; break;
+        case Op::Ne: out.i = a != b; break;
+        case Op::LtD: out.i = x.f < y.f; break;
+        case Op::LeD: out.i = x.f <= y.f; break;
+        case Op::EqD: out.i = x.f == y.f; break;
+        case Op::NeD: out.i = x.f != y.f; break;
+        case Op::NegI: out.i = wrapInt32(wrapSub(0, a)); break;
+        case Op::NegL: out.i = wrapSub(0, a); break;
+        case Op::NegD: out.f = -x.f; break;
+        case Op::Not: out.i = a == 0; break;
+        case Op::NotD: out.i = x.f == 0; break;
+        case Op::BitNot: out.i = ~a; break;
+        case Op::IncI: out.i = wrapInt32(wrapAdd(a, step)); break;
+        case Op::IncL: out.i = wrapAdd(a, step); break;
+        case Op::ToBool: out.i = a != 0; break;
+        case Op::ToBoolD: out.i = x.f != 0; break;
+        case Op::Sext8: out.i = narrowInteger(a, ValueType::Char); break;
+        case Op::Sext16: out.i = narrowInteger(a, ValueType::Short); break;
+        case Op::Sext32: out.i = wrapInt32(a); break;
+        case Op::I2F: out.f = roundToFloat(static_cast<double>(a)); break;
+        case Op::I2D: out.f = static_cast<double>(a); break;
+        case Op::D2F: out.f = roundToFloat(x.f); break;
+        case Op::D2I: out.i = doubleToInteger(x.f); break;
+        default: return false;
+    }
+    return true;
+}
+
+class IrOptimizer {
+public:
+    struct PassStats {
+        const char *name;
+        double ms = 0;
+        size_t changed = 0; // instructions removed or rewritten
+        size_t instrs = 0;  // IR size afterwards, over all functions
+        size_t blocks = 0;
+    };
+
+    // Optimize every function of `program` into `out`. With `dump`, each
+    // function's final IR (with its registers) is printed there. With a
+    // pool, functions are optimized in parallel; the result is the same.
+    void optimize(const Program &program, Program &out, ostream *dump = nullptr, WorkStealingPool *pool = nullptr) {
+        out.clear();
+        out.strings = program.strings;
+        out.globals = program.globals;
+        out.functions = program.functions;
+        out.mainFunction = program.mainFunction;
+        constantIndex_.clear();
+        stats_ = passStats();
+        registersBefore_ = registersAfter_ = 0;
+
+        const vector<BytecodeFunction> &fns = program.functions;
+        vector<uint32_t> order;
+        for (uint32_t f = 0; f < fns.size(); ++f)
+            if (fns[f].defined) order.push_back(f);
+        sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return fns[x].entry < fns[y].entry; });
+
+        // Each function is optimized by its own worker into its own piece
+        // of code (entry 0, private constants), then the pieces are linked
+        // in order.
+        struct Piece {
+            Program code;
+            vector<PassStats> stats;
+            string dump;
+            uint32_t numRegs = 0;
+        };
+        vector<Piece> pieces(order.size());
+        auto optimizeOne = [&](size_t k) {
+            TraceScope span("optimize function", "ir");
+            uint32_t f = order[k];
+            IrOptimizer w;
+            w.program_ = &program;
+            w.begin_ = fns[f].entry;
+            w.end_ = k + 1 < order.size() ? fns[order[k + 1]].entry : uint32_t(program.code.size());
+            w.stats_ = passStats();
+            Piece &piece = pieces[k];
+            IrFunction fn;
+            w.pass(0, fn, [&] { return w.build(f, fn); });
+            w.pass(1, fn, [&] { return w.propagateConstants(fn); });
+            w.pass(2, fn, [&] { return w.eliminateCommonSubexpressions(fn); });
+            w.pass(3, fn, [&] { return w.eliminateDeadCode(fn); });
+            w.pass(4, fn, [&] { return w.allocateRegisters(fn); });
+            if (dump) {
+                ostringstream text;
+                w.dumpFunction(fn, text);
+                piece.dump = text.str();
+            }
+            w.pass(5, fn, [&] { piece.numRegs = w.emit(fn, piece.code); return size_t(0); });
+            piece.stats = move(w.stats_);
+        };
+        if (pool) pool->run(order.size(), optimizeOne);
+        else for (size_t k = 0; k < order.size(); ++k) optimizeOne(k);
+
+        for (size_t k = 0; k < order.size(); ++k) {
+            const Piece &piece = pieces[k];
+            uint32_t f = order[k], base = uint32_t(out.code.size());
+            for (Instr in : piece.code.code) {
+                switch (in.op) {
+                    case Op::Jmp: case Op::Loop: case Op::Jz: case Op::Jnz: setWide(in, in.wide() + base); break;
+                    case Op::LoadK: setWide(in, constant(out, piece.code.constants[in.wide()])); break;
+                    default: break;
+                }
+                out.code.push_back(in);
+            }
+            out.lines.insert(out.lines.end(), piece.code.lines.begin(), piece.code.lines.end());
+            out.functions[f].entry = base;
+            out.functions[f].numRegs = piece.numRegs;
+            registersBefore_ += fns[f].numRegs;
+            registersAfter_ += piece.numRegs;
+            for (size_t i = 0; i < stats_.size(); ++i) {
+                stats_[i].ms += piece.stats[i].ms;
+                stats_[i].changed += piece.stats[i].changed;
+                stats_[i].instrs += piece.stats[i].instrs;
+                stats_[i].blocks += piece.stats[i].blocks;
+            }
+            if (dump) *dump << piece.dump;
+        }
+    }
+
+    const vector<PassStats> &stats() const { return stats_; }
+
+    // Per-pass time and IR size, then the bytecode before and after.
+    void report(const Program &before, const Program &after, ostream &out) const {
+        out << "pass            ms   changed    instrs    blocks\n";
+        for (const PassStats &s : stats_) {
+            out << left << setw(10) << s.name << right << fixed << setprecision(3) << setw(10) << s.ms << setw(10)
+                << s.changed << setw(10) << s.instrs << setw(10) << s.blocks << "\n";
+        }
+        out << "bytecode: " << before.code.size() << " -> " << after.code.size() << " instructions, "
+            << registersBefore_ << " -> " << registersAfter_ << " registers\n";
+    }
+
+private:
+    static constexpr uint32_t kNone = IrInstr::kNone;
+
+    const Program *program_ = nullptr;
+    uint32_t begin_ = 0, end_ = 0; // the bytecode of the function being optimized
+    vector<PassStats> stats_;
+    unordered_map<int64_t, uint32_t> constantIndex_;
+    size_t registersBefore_ = 0, registersAfter_ = 0;
+
+    // SSA construction state (Braun et al., "Simple and Efficient
+    // Construction of Static Single Assignment Form").
+    uint32_t numRegs_ = 0;
+    vector<uint32_t> defs_; // [block * numRegs_ + register]: current value
+    vector<bool> sealed_, filled_;
+    vector<vector<pair<uint32_t, uint32_t>>> incomplete_; // (register, phi)
+    vector<vector<uint32_t>> phisOf_, bodyOf_;
+    uint32_t undef_ = kNone;
+
+    vector<uint32_t> forward_; // value replaced by another (kNone: not replaced)
+
+    // Positions for register allocation: instruction i uses its operands at
+    // 2i and defines its value at 2i + 1.
+    vector<uint32_t> start_, end2_, blockStart_, blockEnd_, position_;
+    vector<uint32_t> callBase_; // per call: the first register of the callee's window
+
+    static vector<PassStats> passStats() {
+        vector<PassStats> stats;
+        for (const char *name : {"build", "constprop", "cse", "dce", "regalloc", "emit"}) stats.push_back({name});
+        return stats;
+    }
+
+    static void setWide(Instr &in, uint32_t v) {
+        in.b = uint16_t(v & 0xFFFF);
+        in.c = uint16_t(v >> 16);
+    }
+
+    template <class F>
+    void pass(size_t id, IrFunction &fn, F run) {
+        auto start = chrono::steady_clock::now();
+        stats_[id].changed += run();
+        stats_[id].ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            for (uint32_t i = blk.begin; i < blk.end; ++i) stats_[id].instrs += fn.instrs[fn.schedule[i]].op != IrOp::Nop;
+        }
+        stats_[id].blocks += fn.layout.size();
+    }
+
+    uint32_t add(IrFunction &fn, IrInstr in) {
+        fn.instrs.push_back(in);
+        return uint32_t(fn.instrs.size() - 1);
+    }
+
+    // ---------- SSA construction ----------
+
+    uint32_t &def(uint32_t block, uint32_t reg) { return defs_[size_t(block) * numRegs_ + reg]; }
+
+    uint32_t newPhi(IrFunction &fn, uint32_t block) {
+        IrInstr in;
+        in.op = IrOp::Phi;
+        in.block = block;
+        in.a = uint32_t(fn.operands.size());
+        in.b = fn.blocks[block].predCount;
+        fn.operands.resize(fn.operands.size() + in.b, kNone);
+        uint32_t id = add(fn, in);
+        phisOf_[block].push_back(id);
+        return id;
+    }
+
+    uint32_t read(IrFunction &fn, uint32_t reg, uint32_t block) {
+        if (def(block, reg) != kNone) return def(block, reg);
+        uint32_t v;
+        const IrBlock &b = fn.blocks[block];
+        if (b.predCount == 0) {
+            v = undef_; // never written (the compiler does not read such registers)
+        } else if (!sealed_[block]) {
+            v = newPhi(fn, block);
+            incomplete_[block].push_back({reg, v});
+        } else if (b.predCount == 1) {
+            v = read(fn, reg, fn.pred(b, 0));
+        } else {
+            v = newPhi(fn, block);
+            def(block, reg) = v;
+            addPhiOperands(fn, reg, v);
+        }
+        def(block, reg) = v;
+        return v;
+    }
+
+    void addPhiOperands(IrFunction &fn, uint32_t reg, uint32_t phi) {
+        uint32_t block = fn.instrs[phi].block;
+        for (uint32_t k = 0; k < fn.blocks[block].predCount; ++k) {
+            uint32_t v = read(fn, reg, fn.pred(fn.blocks[block], k));
+            fn.operands[fn.instrs[phi].a + k] = v;
+        }
+    }
+
+    void sealIfReady(IrFunction &fn, uint32_t block) {
+        if (sealed_[block]) return;
+        const IrBlock &b = fn.blocks[block];
+        for (uint32_t k = 0; k < b.predCount; ++k)
+            if (!filled_[fn.pred(b, k)]) return;
+        sealed_[block] = true;
+        for (auto [reg, phi] : incomplete_[block]) addPhiOperands(fn, reg, phi);
+        incomplete_[block].clear();
+    }
+
+    size_t build(uint32_t f, IrFunction &fn) {
+        const Program &p = *program_;
+        const BytecodeFunction &bf = p.functions[f];
+        uint32_t begin = begin_, end = end_;
+        fn = IrFunction();
+        fn.index = f;
+        numRegs_ = max<uint32_t>(bf.numRegs, 1);
+
+        // Bytecode basic blocks, in code order.
+        auto isJump = [](Op op) { return op == Op::Jmp || op == Op::Loop || op == Op::Jz || op == Op::Jnz; };
+        vector<bool> leader(end - begin + 1, false);
+        leader[0] = true;
+        for (uint32_t pc = begin; pc < end; ++pc) {
+            const Instr &in = p.code[pc];
+            if (isJump(in.op)) leader[in.wide() - begin] = true;
+            if (isJump(in.op) || in.op == Op::Ret || in.op == Op::RetV) leader[pc + 1 - begin] = true;
+        }
+        vector<uint32_t> starts, blockOf(end - begin, 0);
+        for (uint32_t pc = begin; pc < end; ++pc) {
+            if (leader[pc - begin]) starts.push_back(pc);
+            blockOf[pc - begin] = uint32_t(starts.size() - 1);
+        }
+        size_t m = starts.size();
+        auto blockEnd = [&](size_t k) { return k + 1 < m ? starts[k + 1] : end; };
+        vector<array<uint32_t, 2>> succ(m, {kNone, kNone});
+        for (size_t k = 0; k < m; ++k) {
+            uint32_t last = blockEnd(k) - 1;
+            const Instr &in = p.code[last];
+            uint32_t next = last + 1 < end ? blockOf[last + 1 - begin] : kNone;
+            switch (in.op) {
+                case Op::Jmp: case Op::Loop: succ[k] = {blockOf[in.wide() - begin], kNone}; break;
+                case Op::Jz: succ[k] = {next, blockOf[in.wide() - begin]}; break;
+                case Op::Jnz: succ[k] = {blockOf[in.wide() - begin], next}; break;
+                case Op::Ret: case Op::RetV: break;
+                default: succ[k] = {next, kNone}; break;
+            }
+            if (succ[k][0] == succ[k][1]) succ[k][1] = kNone;
+        }
+
+        // Reverse postorder of the reachable blocks; IR block 1 + i is the
+        // i-th of them, after the prologue.
+        vector<uint32_t> post, irBlock(m, kNone);
+        vector<uint8_t> seen(m, 0);
+        vector<pair<uint32_t, int>> stack{{0, 0}};
+        seen[0] = 1;
+        while (!stack.empty()) {
+            auto &[k, next] = stack.back();
+            if (next < 2) {
+                uint32_t s = succ[k][next++];
+                if (s != kNone && !seen[s]) {
+                    seen[s] = 1;
+                    stack.push_back({s, 0});
+                }
+                continue;
+            }
+            post.push_back(k);
+            stack.pop_back();
+        }
+        reverse(post.begin(), post.end());
+        for (size_t i = 0; i < post.size(); ++i) irBlock[post[i]] = uint32_t(i + 1);
+
+        size_t n = post.size() + 1;
+        fn.blocks.assign(n, IrBlock());
+        fn.blocks[0].succ[0] = 1;
+        for (size_t i = 0; i < post.size(); ++i)
+            for (int s = 0; s < 2; ++s)
+                if (succ[post[i]][s] != kNone) fn.blocks[i + 1].succ[s] = irBlock[succ[post[i]][s]];
+        rebuildPreds(fn);
+
+        defs_.assign(n * numRegs_, kNone);
+        sealed_.assign(n, false);
+        filled_.assign(n, false);
+        incomplete_.assign(n, {});
+        phisOf_.assign(n, {});
+        bodyOf_.assign(n, {});
+
+        // The prologue defines the parameters and the value of registers
+        // that are read before being written.
+        IrInstr zero;
+        zero.op = IrOp::Const;
+        zero.line = p.lines[bf.entry];
+        undef_ = add(fn, zero);
+        bodyOf_[0].push_back(undef_);
+        for (uint32_t k = 0; k < bf.params.size(); ++k) {
+            IrInstr param;
+            param.op = IrOp::Param;
+            param.aux = uint16_t(k);
+            param.line = p.lines[bf.entry];
+            def(0, k) = add(fn, param);
+            bodyOf_[0].push_back(def(0, k));
+        }
+        IrInstr enter;
+        enter.op = IrOp::Jmp;
+        bodyOf_[0].push_back(add(fn, enter));
+        sealed_[0] = filled_[0] = true;
+
+        for (uint32_t b = 1; b < n; ++b) {
+            sealIfReady(fn, b);
+            uint32_t k = post[b - 1];
+            fill(fn, b, starts[k], blockEnd(k));
+            filled_[b] = true;
+            for (uint32_t s : fn.blocks[b].succ)
+                if (s != kNone) sealIfReady(fn, s);
+        }
+
+        fn.schedule.clear();
+        for (uint32_t b = 0; b < n; ++b) {
+            fn.blocks[b].begin = uint32_t(fn.schedule.size());
+            for (uint32_t id : phisOf_[b]) fn.instrs[id].block = b;
+            for (uint32_t id : bodyOf_[b]) fn.instrs[id].block = b;
+            fn.schedule.insert(fn.schedule.end(), phisOf_[b].begin(), phisOf_[b].end());
+            fn.schedule.insert(fn.schedule.end(), bodyOf_[b].begin(), bodyOf_[b].end());
+            fn.blocks[b].end = uint32_t(fn.schedule.size());
+        }
+        computeLayout(fn);
+        forward_.assign(fn.instrs.size(), kNone);
+        return simplifyPhis(fn);
+    }
+
+    // Translate bytecode [from, to) into block `b`.
+    void fill(IrFunction &fn, uint32_t b, uint32_t from, uint32_t to) {
+        const Program &p = *program_;
+        auto emitTo = [&](IrInstr in, int line) {
+            in.block = b;
+            in.line = line;
+            uint32_t id = add(fn, in);
+            bodyOf_[b].push_back(id);
+            return id;
+        };
+        bool terminated = false;
+        for (uint32_t pc = from; pc < to; ++pc) {
+            const Instr &in = p.code[pc];
+            int line = p.lines[pc];
+            IrInstr ir;
+            switch (in.op) {
+                case Op::Move: def(b, in.a) = read(fn, in.b, b); break;
+                case Op::LoadI: case Op::LoadK:
+                    ir.op = IrOp::Const;
+                    ir.k = in.op == Op::LoadI ? Value{int32_t(in.wide())} : p.constants[in.wide()];
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+                case Op::LoadG:
+                    ir.op = IrOp::LoadG;
+                    ir.aux = in.b;
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+                case Op::StoreG:
+                    ir.op = IrOp::StoreG;
+                    ir.aux = in.b;
+                    ir.a = read(fn, in.a, b);
+                    emitTo(ir, line);
+                    break;
+                case Op::IncI: case Op::IncL:
+                    ir.op = IrOp::Unary;
+                    ir.code = in.op;
+                    ir.aux = in.b;
+                    ir.a = read(fn, in.a, b);
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+                case Op::Jmp: case Op::Loop:
+                    ir.op = IrOp::Jmp;
+                    ir.aux = in.op == Op::Loop;
+                    emitTo(ir, line);
+                    terminated = true;
+                    break;
+                case Op::Jz: case Op::Jnz:
+                    if (fn.blocks[b].succ[1] == kNone) { // both ways lead to the same block
+                        ir.op = IrOp::Jmp;
+                    } else {
+                        ir.op = IrOp::Br;
+                        ir.a = read(fn, in.a, b);
+                    }
+                    emitTo(ir, line);
+                    terminated = true;
+                    break;
+                case Op::Call: {
+                    ir.op = IrOp::Call;
+                    ir.aux = in.b;
+                    ir.a = uint32_t(fn.operands.size());
+                    ir.b = in.c;
+                    fn.operands.resize(fn.operands.size() + in.c);
+                    for (uint32_t k = 0; k < in.c; ++k) fn.operands[ir.a + k] = read(fn, in.a + k, b);
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+                }
+                case Op::Ret:
+                    ir.op = IrOp::Ret;
+                    ir.a = read(fn, in.a, b);
+                    emitTo(ir, line);
+                    terminated = true;
+                    break;
+                case Op::RetV:
+                    ir.op = IrOp::RetV;
+                    emitTo(ir, line);
+                    terminated = true;
+                    break;
+                case Op::Print:
+                    ir.op = IrOp::Print;
+                    ir.aux = uint16_t(in.b | in.c << 8);
+                    ir.a = read(fn, in.a, b);
+                    emitTo(ir, line);
+                    break;
+                case Op::Not: case Op::NotD: case Op::NegI: case Op::NegL: case Op::NegD: case Op::BitNot:
+                case Op::ToBool: case Op::ToBoolD: case Op::Sext8: case Op::Sext16: case Op::Sext32:
+                case Op::I2F: case Op::I2D: case Op::D2F: case Op::D2I:
+                    ir.op = IrOp::Unary;
+                    ir.code = in.op;
+                    ir.a = read(fn, in.b, b);
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+                default:
+                    ir.op = IrOp::Binary;
+                    ir.code = in.op;
+                    ir.a = read(fn, in.b, b);
+                    ir.b = read(fn, in.c, b);
+                    def(b, in.a) = emitTo(ir, line);
+                    break;
+            }
+        }
+        if (!terminated) {
+            IrInstr jmp;
+            jmp.op = IrOp::Jmp;
+            emitTo(jmp, p.lines[to - 1]);
+        }
+    }
+
+    // ---------- CFG helpers ----------
+
+    static size_t successorCount(const IrFunction &fn, const IrBlock &b) {
+        const IrInstr &t = fn.terminator(b);
+        return t.op == IrOp::Jmp ? 1 : t.op == IrOp::Br ? 2 : 0;
+    }
+
+    // Recompute predecessor lists from the live blocks' terminators (or
+    // their succ[] during construction), keeping phi operands in step.
+    void rebuildPreds(IrFunction &fn) {
+        size_t n = fn.blocks.size();
+        bool built = !fn.schedule.empty();
+        vector<vector<uint32_t>> preds(n);
+        for (uint32_t b = 0; b < n; ++b) {
+            const IrBlock &blk = fn.blocks[b];
+            if (!blk.live) continue;
+            size_t count = built ? successorCount(fn, blk) : 2;
+            for (size_t s = 0; s < count; ++s)
+                if (blk.succ[s] != kNone) preds[blk.succ[s]].push_back(b);
+        }
+        vector<uint32_t> flat;
+        for (uint32_t b = 0; b < n; ++b) {
+            IrBlock &blk = fn.blocks[b];
+            if (built) {
+                // Keep each phi's operands for the remaining predecessors.
+                for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                    IrInstr &phi = fn.instrs[fn.schedule[i]];
+                    if (phi.op != IrOp::Phi) continue;
+                    uint32_t first = uint32_t(fn.operands.size());
+                    for (uint32_t p : preds[b]) {
+                        uint32_t k = 0;
+                        while (fn.preds[blk.predBegin + k] != p) ++k;
+                        fn.operands.push_back(fn.operands[phi.a + k]);
+                    }
+                    phi.a = first;
+                    phi.b = uint32_t(preds[b].size());
+                }
+            }
+            blk.predBegin = uint32_t(flat.size());
+            blk.predCount = uint32_t(preds[b].size());
+            flat.insert(flat.end(), preds[b].begin(), preds[b].end());
+        }
+        fn.preds = move(flat);
+    }
+
+    void computeLayout(IrFunction &fn) {
+        vector<uint32_t> post;
+        vector<uint8_t> seen(fn.blocks.size(), 0);
+        vector<pair<uint32_t, size_t>> stack{{0, 0}};
+        seen[0] = 1;
+        while (!stack.empty()) {
+            auto &[b, next] = stack.back();
+            if (next < successorCount(fn, fn.blocks[b])) {
+                uint32_t s = fn.blocks[b].succ[next++];
+                if (!seen[s]) {
+                    seen[s] = 1;
+                    stack.push_back({s, 0});
+                }
+                continue;
+            }
+            post.push_back(b);
+            stack.pop_back();
+        }
+        fn.layout.assign(post.rbegin(), post.rend());
+        for (uint32_t b = 0; b < fn.blocks.size(); ++b) fn.blocks[b].live = seen[b];
+    }
+
+    uint32_t resolve(uint32_t v) {
+        uint32_t r = v;
+        while (forward_[r] != kNone) r = forward_[r];
+        while (forward_[v] != kNone) {
+            uint32_t next = forward_[v];
+            forward_[v] = r;
+            v = next;
+        }
+        return r;
+    }
+
+    void applyForwarding(IrFunction &fn) {
+        for (uint32_t b : fn.layout)
+            for (uint32_t i = fn.blocks[b].begin; i < fn.blocks[b].end; ++i)
+                forEachUse(fn, fn.instrs[fn.schedule[i]], [&](uint32_t &v) { v = resolve(v); });
+    }
+
+    // Remove phis whose operands are all one value (or the phi itself).
+    size_t simplifyPhis(IrFunction &fn) {
+        size_t removed = 0;
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (uint32_t b : fn.layout) {
+                for (uint32_t i = fn.blocks[b].begin; i < fn.blocks[b].end; ++i) {
+                    uint32_t id = fn.schedule[i];
+                    IrInstr &phi = fn.instrs[id];
+                    if (phi.op != IrOp::Phi) continue;
+                    uint32_t same = kNone;
+                    bool trivial = true;
+                    for (uint32_t k = 0; k < phi.b && trivial; ++k) {
+                        uint32_t v = resolve(fn.operands[phi.a + k]);
+                        if (v == id || v == same) continue;
+                        if (same != kNone) trivial = false;
+                        same = v;
+                    }
+                    if (!trivial) continue;
+                    forward_[id] = same == kNone ? undef_ : same;
+                    phi.op = IrOp::Nop;
+                    ++removed;
+                    changed = true;
+                }
+            }
+        }
+        applyForwarding(fn);
+        return removed;
+    }
+
+    // ---------- Constant propagation ----------
+
+    // Sparse conditional constant propagation (Wegman and Zadeck), run
+    // densely over the blocks until nothing changes: values start unknown
+    // and only become constant or varying, and only edges that can be
+    // taken contribute to phis.
+    size_t propagateConstants(IrFunction &fn) {
+        enum : uint8_t { Unknown, Constant, Varying };
+        size_t n = fn.instrs.size();
+        vector<uint8_t> state(n, Unknown);
+        vector<Value> value(n, Value{0});
+        vector<bool> reached(fn.blocks.size(), false), edge(fn.preds.size(), false);
+        reached[0] = true;
+        bool changed = true;
+        auto markEdge = [&](uint32_t from, uint32_t to) {
+            const IrBlock &t = fn.blocks[to];
+            for (uint32_t k = 0; k < t.predCount; ++k) {
+                if (fn.pred(t, k) != from || edge[t.predBegin + k]) continue;
+                edge[t.predBegin + k] = true;
+                reached[to] = true;
+                changed = true;
+            }
+        };
+        auto lower = [&](uint32_t id, uint8_t s, Value v) {
+            if (s == Unknown || state[id] == Varying) return;
+            if (s == Constant && state[id] == Constant && value[id].i == v.i) return;
+            if (state[id] == Constant || s == Varying) state[id] = Varying;
+            else state[id] = Constant, value[id] = v;
+            changed = true;
+        };
+        while (changed) {
+            changed = false;
+            for (uint32_t b : fn.layout) {
+                if (!reached[b]) continue;
+                const IrBlock &blk = fn.blocks[b];
+                for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                    uint32_t id = fn.schedule[i];
+                    const IrInstr &in = fn.instrs[id];
+                    switch (in.op) {
+                        case IrOp::Const: lower(id, Constant, in.k); break;
+                        case IrOp::Param: case IrOp::LoadG: case IrOp::Call: lower(id, Varying, {}); break;
+                        case IrOp::Phi: {
+                            uint8_t s = Unknown;
+                            Value v{0};
+                            for (uint32_t k = 0; k < in.b && s != Varying; ++k) {
+                                if (!edge[blk.predBegin + k]) continue;
+                                uint32_t o = fn.operands[in.a + k];
+                                if (state[o] == Unknown) continue;
+                                if (state[o] == Varying || (s == Constant && value[o].i != v.i)) s = Varying;
+                                else s = Constant, v = value[o];
+                            }
+                            lower(id, s, v);
+                            break;
+                        }
+                        case IrOp::Unary: case IrOp::Binary: {
+                            uint8_t sa = state[in.a], sb = in.op == IrOp::Binary ? state[in.b] : uint8_t(Constant);
+                            if (sa == Varying || sb == Varying) {
+                                lower(id, Varying, {});
+                            } else if (sa == Constant && sb == Constant) {
+                                Value r;
+                                Value y = in.op == IrOp::Binary ? value[in.b] : Value{0};
+                                if (foldOp(in.code, value[in.a], y, int16_t(in.aux), r)) lower(id, Constant, r);
+                                else lower(id, Varying, {});
+                            }
+                            break;
+                        }
+                        case IrOp::Jmp: markEdge(b, blk.succ[0]); break;
+                        case IrOp::Br:
+                            if (state[in.a] == Varying) {
+                                markEdge(b, blk.succ[0]);
+                                markEdge(b, blk.succ[1]);
+                            } else if (state[in.a] == Constant) {
+                                markEdge(b, blk.succ[value[in.a].i != 0 ? 0 : 1]);
+                            }
+                            break;
+                        default: break;
+                    }
+                }
+            }
+        }
+
+        size_t rewritten = 0;
+        for (uint32_t b : fn.layout) {
+            IrBlock &blk = fn.blocks[b];
+            if (!reached[b]) {
+                blk.live = false;
+                rewritten += blk.end - blk.begin;
+                continue;
+            }
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                IrInstr &in = fn.instrs[id];
+                bool computed = in.op == IrOp::Unary || in.op == IrOp::Binary || in.op == IrOp::Phi;
+                if (computed && state[id] == Constant) {
+                    in.op = IrOp::Const;
+                    in.k = value[id];
+                    ++rewritten;
+                } else if (in.op == IrOp::Br && state[in.a] == Constant) {
+                    in.op = IrOp::Jmp;
+                    in.aux = 0;
+                    blk.succ[0] = blk.succ[value[in.a].i != 0 ? 0 : 1];
+                    blk.succ[1] = kNone;
+                    ++rewritten;
+                }
+            }
+        }
+        // Phis that became constants move out of the phi group.
+        for (uint32_t b : fn.layout) {
+            IrBlock &blk = fn.blocks[b];
+            if (!blk.live) continue;
+            stable_partition(fn.schedule.begin() + blk.begin, fn.schedule.begin() + blk.end,
+                             [&](uint32_t id) { return fn.instrs[id].op == IrOp::Phi; });
+        }
+        rebuildPreds(fn);
+        computeLayout(fn);
+        return rewritten + simplifyPhis(fn);
+    }
+
+    // ---------- Common subexpressions ----------
+
+    struct ExprKey {
+        IrOp op;
+        Op code;
+        uint16_t aux;
+        uint32_t a, b;
+        int64_t k;
+
+        bool operator==(const ExprKey &o) const {
+            return op == o.op && code == o.code && aux == o.aux && a == o.a && b == o.b && k == o.k;
+        }
+    };
+    struct ExprKeyHash {
+        size_t operator()(const ExprKey &e) const {
+            uint64_t h = uint64_t(e.op) << 56 ^ uint64_t(e.code) << 40 ^ uint64_t(e.aux) << 24;
+            h ^= (uint64_t(e.a) << 32 | e.b) * 0x9E3779B97F4A7C15ull;
+            h ^= uint64_t(e.k) * 0xC2B2AE3D27D4EB4Full;
+            return size_t(h ^ h >> 29);
+        }
+    };
+
+    // Immediate dominators (Cooper, Harvey and Kennedy), by layout order.
+    vector<uint32_t> dominators(const IrFunction &fn) {
+        vector<uint32_t> rpo(fn.blocks.size(), kNone), idom(fn.blocks.size(), kNone);
+        for (uint32_t i = 0; i < fn.layout.size(); ++i) rpo[fn.layout[i]] = i;
+        idom[fn.layout[0]] = fn.layout[0];
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i = 1; i < fn.layout.size(); ++i) {
+                uint32_t b = fn.layout[i], best = kNone;
+                const IrBlock &blk = fn.blocks[b];
+                for (uint32_t k = 0; k < blk.predCount; ++k) {
+                    uint32_t p = fn.pred(blk, k);
+                    if (idom[p] == kNone) continue;
+                    if (best == kNone) {
+                        best = p;
+                        continue;
+                    }
+                    uint32_t x = p, y = best;
+                    while (x != y) {
+                        while (rpo[x] > rpo[y]) x = idom[x];
+                        while (rpo[y] > rpo[x]) y = idom[y];
+                    }
+                    best = x;
+                }
+                if (idom[b] != best) {
+                    idom[b] = best;
+                    changed = true;
+                }
+            }
+        }
+        return idom;
+    }
+
+    // Constants move to the prologue, which dominates everything: each
+    // distinct one is then loaded once per call instead of per use.
+    void hoistConstants(IrFunction &fn) {
+        vector<uint32_t> schedule, hoisted;
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            for (uint32_t i = blk.begin; i < blk.end; ++i)
+                if (b != 0 && fn.instrs[fn.schedule[i]].op == IrOp::Const) hoisted.push_back(fn.schedule[i]);
+        }
+        for (uint32_t b : fn.layout) {
+            IrBlock &blk = fn.blocks[b];
+            uint32_t begin = uint32_t(schedule.size());
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                IrInstr &in = fn.instrs[id];
+                if (b == 0 && i + 1 == blk.end) {
+                    for (uint32_t c : hoisted) fn.instrs[c].block = 0;
+                    schedule.insert(schedule.end(), hoisted.begin(), hoisted.end());
+                }
+                if (in.op == IrOp::Nop || (b != 0 && in.op == IrOp::Const)) continue;
+                schedule.push_back(id);
+            }
+            blk.begin = begin;
+            blk.end = uint32_t(schedule.size());
+        }
+        fn.schedule = move(schedule);
+    }
+
+    // Global value numbering over the dominator tree: a pure computation
+    // that a dominating instruction already made is replaced by that one.
+    size_t eliminateCommonSubexpressions(IrFunction &fn) {
+        hoistConstants(fn);
+        vector<uint32_t> idom = dominators(fn);
+        vector<vector<uint32_t>> children(fn.blocks.size());
+        for (size_t i = 1; i < fn.layout.size(); ++i) children[idom[fn.layout[i]]].push_back(fn.layout[i]);
+
+        unordered_map<ExprKey, uint32_t, ExprKeyHash> table;
+        vector<ExprKey> added;
+        vector<pair<uint32_t, size_t>> stack{{fn.layout[0], SIZE_MAX}}; // (block, undo mark; SIZE_MAX = enter)
+        size_t replaced = 0;
+        while (!stack.empty()) {
+            auto [b, mark] = stack.back();
+            stack.pop_back();
+            if (mark != SIZE_MAX) {
+                while (added.size() > mark) {
+                    table.erase(added.back());
+                    added.pop_back();
+                }
+                continue;
+            }
+            stack.push_back({b, added.size()});
+            const IrBlock &blk = fn.blocks[b];
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                IrInstr &in = fn.instrs[id];
+                forEachUse(fn, in, [&](uint32_t &v) { v = resolve(v); });
+                if (in.op != IrOp::Const && in.op != IrOp::Unary && in.op != IrOp::Binary) continue;
+                ExprKey key{in.op, in.code, in.aux, in.a, in.b, in.op == IrOp::Const ? in.k.i : 0};
+                if (in.op == IrOp::Binary && isCommutative(in.code) && key.a > key.b) swap(key.a, key.b);
+                auto [it, inserted] = table.emplace(key, id);
+                if (inserted) {
+                    added.push_back(key);
+                } else {
+                    forward_[id] = it->second;
+                    in.op = IrOp::Nop;
+                    ++replaced;
+                }
+            }
+            for (uint32_t c : children[b]) stack.push_back({c, SIZE_MAX});
+        }
+        applyForwarding(fn);
+        return replaced;
+    }
+
+    // Only integer operations: reordering float operands could change
+    // which NaN comes out.
+    static bool isCommutative(Op op) {
+        switch (op) {
+            case Op::AddI: case Op::AddL: case Op::MulI: case Op::MulL: case Op::And: case Op::Or: case Op::Xor:
+            case Op::Eq: case Op::Ne:
+                return true;
+            default: return false;
+        }
+    }
+
+    // ---------- Dead code ----------
+
+    // Keep what the program can observe and everything that feeds it;
+    // integer division stays unless its divisor is a nonzero constant.
+    size_t eliminateDeadCode(IrFunction &fn) {
+        vector<bool> live(fn.instrs.size(), false);
+        vector<uint32_t> work;
+        for (uint32_t b : fn.layout) {
+            for (uint32_t i = fn.blocks[b].begin; i < fn.blocks[b].end; ++i) {
+                uint32_t id = fn.schedule[i];
+                const IrInstr &in = fn.instrs[id];
+                bool root = false;
+                switch (in.op) {
+                    case IrOp::StoreG: case IrOp::Call: case IrOp::Print: case IrOp::Jmp: case IrOp::Br:
+                    case IrOp::Ret: case IrOp::RetV:
+                        root = true;
+                        break;
+                    case IrOp::Binary:
+                        if (in.code == Op::DivI || in.code == Op::DivL || in.code == Op::ModI || in.code == Op::ModL) {
+                            const IrInstr &d = fn.instrs[in.b];
+                            root = d.op != IrOp::Const || d.k.i == 0;
+                        }
+                        break;
+                    default: break;
+                }
+                if (root) {
+                    live[id] = true;
+                    work.push_back(id);
+                }
+            }
+        }
+        while (!work.empty()) {
+            uint32_t id = work.back();
+            work.pop_back();
+            forEachUse(fn, fn.instrs[id], [&](uint32_t &v) {
+                if (!live[v]) {
+                    live[v] = true;
+                    work.push_back(v);
+                }
+            });
+        }
+        size_t removed = 0;
+        for (uint32_t b : fn.layout) {
+            IrBlock &blk = fn.blocks[b];
+            uint32_t out = blk.begin;
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                IrInstr &in = fn.instrs[id];
+                if (in.op == IrOp::Nop) continue;
+                if (!live[id]) {
+                    in.op = IrOp::Nop;
+                    ++removed;
+                    continue;
+                }
+                fn.schedule[out++] = id;
+            }
+            blk.end = out; // the unused tail of the range is left behind
+        }
+        return removed;
+    }
+
+    // ---------- Register allocation ----------
+
+    static bool definesValue(const IrInstr &in) {
+        switch (in.op) {
+            case IrOp::Const: case IrOp::Param: case IrOp::Phi: case IrOp::Unary: case IrOp::Binary:
+            case IrOp::LoadG: case IrOp::Call:
+                return true;
+            default: return false;
+        }
+    }
+
+    // Linear scan (Poletto and Sarkar) over one live interval per value,
+    // from its definition to its last use along the block layout. Registers
+    // are VM registers, so nothing is ever spilled; parameters keep the
+    // registers the calling convention puts them in.
+    size_t allocateRegisters(IrFunction &fn) {
+        size_t n = fn.instrs.size();
+        start_.assign(n, kNone);
+        end2_.assign(n, 0);
+        position_.assign(n, 0);
+        blockStart_.assign(fn.blocks.size(), 0);
+        blockEnd_.assign(fn.blocks.size(), 0);
+        fn.reg.assign(n, kNone);
+
+        uint32_t index = 0;
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            blockStart_[b] = 2 * index++;
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                const IrInstr &in = fn.instrs[id];
+                if (in.op == IrOp::Phi) {
+                    start_[id] = blockStart_[b] + 1;
+                    continue;
+                }
+                position_[id] = 2 * index++;
+                if (definesValue(in)) start_[id] = in.op == IrOp::Param ? 0 : position_[id] + 1;
+            }
+            blockEnd_[b] = 2 * (index - 1) + 1;
+        }
+        for (uint32_t id = 0; id < n; ++id) end2_[id] = start_[id];
+
+        // Liveness by walking back from each use to the definition.
+        vector<uint32_t> useCount(n + 1, 0), uses, blockMark(fn.blocks.size(), kNone), work;
+        vector<pair<uint32_t, uint32_t>> useList; // (value, block where it must be live at the end, or use position)
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                IrInstr &in = fn.instrs[id];
+                if (in.op == IrOp::Phi) {
+                    for (uint32_t k = 0; k < in.b; ++k) useList.push_back({fn.operands[in.a + k], fn.pred(blk, k) | 0x80000000u});
+                } else {
+                    forEachUse(fn, in, [&](uint32_t &v) { useList.push_back({v, id}); });
+                }
+            }
+        }
+        sort(useList.begin(), useList.end());
+        auto liveIn = [&](uint32_t v, uint32_t b) {
+            work.assign(1, b);
+            while (!work.empty()) {
+                uint32_t x = work.back();
+                work.pop_back();
+                if (x == fn.instrs[v].block || blockMark[x] == v) continue;
+                blockMark[x] = v;
+                const IrBlock &blk = fn.blocks[x];
+                for (uint32_t k = 0; k < blk.predCount; ++k) {
+                    uint32_t p = fn.pred(blk, k);
+                    end2_[v] = max(end2_[v], blockEnd_[p]);
+                    work.push_back(p);
+                }
+            }
+        };
+        for (auto [v, where] : useList) {
+            if (where & 0x80000000u) {
+                uint32_t p = where & 0x7FFFFFFFu;
+                end2_[v] = max(end2_[v], blockEnd_[p]);
+                liveIn(v, p);
+            } else {
+                end2_[v] = max(end2_[v], position_[where]);
+                liveIn(v, fn.instrs[where].block);
+            }
+        }
+
+        vector<uint32_t> order;
+        uint32_t params = uint32_t(program_->functions[fn.index].params.size());
+        priority_queue<pair<uint32_t, uint32_t>, vector<pair<uint32_t, uint32_t>>, greater<>> active; // (end, reg)
+        set<uint32_t> free, busy;
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                const IrInstr &in = fn.instrs[id];
+                if (in.op == IrOp::Param) {
+                    fn.reg[id] = in.aux;
+                    busy.insert(in.aux);
+                    active.push({end2_[id], in.aux});
+                } else if (definesValue(in)) {
+                    order.push_back(id);
+                }
+            }
+        }
+        for (uint32_t r = 0; r < params; ++r)
+            if (!busy.count(r)) free.insert(r);
+        stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return start_[x] < start_[y]; });
+        callBase_.assign(n, 0);
+        uint32_t next = params;
+        for (uint32_t id : order) {
+            while (!active.empty() && active.top().first < start_[id]) {
+                free.insert(active.top().second);
+                busy.erase(active.top().second);
+                active.pop();
+            }
+            uint32_t r;
+            if (fn.instrs[id].op == IrOp::Call) {
+                // What is still active lives across the call; the callee's
+                // registers start right above it, where the result lands.
+                r = busy.empty() ? 0 : *busy.rbegin() + 1;
+                callBase_[id] = r;
+                free.erase(r);
+                next = max(next, r + 1);
+                for (uint32_t k = next; k < r + fn.instrs[id].b; ++k) free.insert(k);
+                next = max(next, r + fn.instrs[id].b);
+            } else if (free.empty()) {
+                r = next++;
+            } else {
+                r = *free.begin();
+                free.erase(free.begin());
+            }
+            fn.reg[id] = r;
+            busy.insert(r);
+            active.push({end2_[id], r});
+        }
+        numRegs_ = max<uint32_t>(next, 1);
+        return 0;
+    }
+
+    // ---------- Lowering ----------
+
+    struct Emitter {
+        Program &out;
+        int line = 0;
+
+        void op(Op code, uint32_t a, uint32_t b = 0, uint32_t c = 0) {
+            out.code.push_back({code, uint16_t(a), uint16_t(b), uint16_t(c)});
+            out.lines.push_back(line);
+        }
+        void wide(Op code, uint32_t a, uint32_t v) { op(code, a, v & 0xFFFF, v >> 16); }
+    };
+
+    // Copy registers as one parallel assignment, breaking cycles through
+    // `scratch`. Returns true if the scratch register was used.
+    static bool parallelMove(vector<pair<uint32_t, uint32_t>> moves, Emitter &e, uint32_t scratch) {
+        bool usedScratch = false;
+        moves.erase(remove_if(moves.begin(), moves.end(), [](auto &m) { return m.first == m.second; }), moves.end());
+        while (!moves.empty()) {
+            bool progress = false;
+            for (size_t i = 0; i < moves.size(); ++i) {
+                uint32_t dst = moves[i].first;
+                bool read = any_of(moves.begin(), moves.end(), [&](auto &m) { return m.second == dst; });
+                if (read) continue;
+                e.op(Op::Move, dst, moves[i].second);
+                moves.erase(moves.begin() + i);
+                progress = true;
+                break;
+            }
+            if (progress) continue;
+            uint32_t dst = moves[0].first;
+            e.op(Op::Move, scratch, dst);
+            usedScratch = true;
+            for (auto &m : moves)
+                if (m.second == dst) m.second = scratch;
+        }
+        return usedScratch;
+    }
+
+    vector<pair<uint32_t, uint32_t>> edgeMoves(const IrFunction &fn, uint32_t from, uint32_t to) const {
+        vector<pair<uint32_t, uint32_t>> moves;
+        const IrBlock &t = fn.blocks[to];
+        uint32_t k = 0;
+        while (fn.pred(t, k) != from) ++k;
+        for (uint32_t i = t.begin; i < t.end; ++i) {
+            const IrInstr &phi = fn.instrs[fn.schedule[i]];
+            if (phi.op != IrOp::Phi) break;
+            moves.push_back({fn.reg[fn.schedule[i]], fn.reg[fn.operands[phi.a + k]]});
+        }
+        return moves;
+    }
+
+    uint32_t constant(Program &out, Value v) {
+        auto [it, inserted] = constantIndex_.emplace(v.i, uint32_t(out.constants.size()));
+        if (inserted) out.constants.push_back(v);
+        return it->second;
+    }
+
+    // Lower `fn` into `out`, which holds only this function's code; returns
+    // the size of its register window.
+    uint32_t emit(IrFunction &fn, Program &out) {
+        uint32_t numRegs = numRegs_, scratch = numRegs_;
+        vector<size_t> label(fn.blocks.size(), 0);
+        vector<pair<size_t, uint32_t>> fixups; // (instruction, target block)
+        Emitter e{out};
+        bool usedScratch = false;
+        auto moves = [&](uint32_t from, uint32_t to) {
+            usedScratch |= parallelMove(edgeMoves(fn, from, to), e, scratch);
+        };
+        auto jump = [&](Op code, uint32_t a, uint32_t block) {
+            fixups.push_back({out.code.size(), block});
+            e.op(code, a);
+        };
+
+        for (size_t li = 0; li < fn.layout.size(); ++li) {
+            uint32_t b = fn.layout[li], next = li + 1 < fn.layout.size() ? fn.layout[li + 1] : kNone;
+            const IrBlock &blk = fn.blocks[b];
+            label[b] = out.code.size();
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                const IrInstr &in = fn.instrs[id];
+                uint32_t r = fn.reg[id];
+                e.line = in.line;
+                switch (in.op) {
+                    case IrOp::Nop: case IrOp::Phi: case IrOp::Param: break;
+                    case IrOp::Const:
+                        if (in.k.i == int64_t(int32_t(in.k.i))) e.wide(Op::LoadI, r, uint32_t(in.k.i));
+                        else e.wide(Op::LoadK, r, constant(out, in.k));
+                        break;
+                    case IrOp::Unary:
+                        if (in.code == Op::IncI || in.code == Op::IncL) {
+                            if (fn.reg[in.a] != r) e.op(Op::Move, r, fn.reg[in.a]);
+                            e.op(in.code, r, in.aux);
+                        } else {
+                            e.op(in.code, r, fn.reg[in.a]);
+                        }
+                        break;
+                    case IrOp::Binary: e.op(in.code, r, fn.reg[in.a], fn.reg[in.b]); break;
+                    case IrOp::LoadG: e.op(Op::LoadG, r, in.aux); break;
+                    case IrOp::StoreG: e.op(Op::StoreG, fn.reg[in.a], in.aux); break;
+                    case IrOp::Call: {
+                        uint32_t base = callBase_[id];
+                        vector<pair<uint32_t, uint32_t>> args;
+                        for (uint32_t k = 0; k < in.b; ++k) args.push_back({base + k, fn.reg[fn.operands[in.a + k]]});
+                        usedScratch |= parallelMove(args, e, scratch);
+                        e.op(Op::Call, base, in.aux, in.b);
+                        break;
+                    }
+                    case IrOp::Print: e.op(Op::Print, fn.reg[in.a], in.aux & 0xFF, in.aux >> 8); break;
+                    case IrOp::Ret: e.op(Op::Ret, fn.reg[in.a]); break;
+                    case IrOp::RetV: e.op(Op::RetV, 0); break;
+                    case IrOp::Jmp:
+                        moves(b, blk.succ[0]);
+                        if (in.aux) jump(Op::Loop, 0, blk.succ[0]);
+                        else if (blk.succ[0] != next) jump(Op::Jmp, 0, blk.succ[0]);
+                        break;
+                    case IrOp::Br: {
+                        uint32_t c = fn.reg[in.a], t = blk.succ[0], f = blk.succ[1];
+                        bool plainT = edgeMoves(fn, b, t).empty(), plainF = edgeMoves(fn, b, f).empty();
+                        if (plainT && (f == next || !plainF)) {
+                            jump(Op::Jnz, c, t);
+                            moves(b, f);
+                            if (f != next) jump(Op::Jmp, 0, f);
+                        } else if (plainF) {
+                            jump(Op::Jz, c, f);
+                            moves(b, t);
+                            if (t != next) jump(Op::Jmp, 0, t);
+                        } else {
+                            size_t skip = out.code.size();
+                            e.op(Op::Jz, c);
+                            moves(b, t);
+                            jump(Op::Jmp, 0, t);
+                            setWide(out.code[skip], uint32_t(out.code.size()));
+                            moves(b, f);
+                            if (f != next) jump(Op::Jmp, 0, f);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+        for (auto [at, block] : fixups) setWide(out.code[at], uint32_t(label[block]));
+        numRegs = max(numRegs, usedScratch ? scratch + 1 : 1u);
+        if (numRegs > Compiler::kMaxRegisters) return copyFunction(fn.index, out);
+        return numRegs;
+    }
+
+    // Fall back to the original bytecode of function `f` (when the
+    // optimized one would need more registers than an instruction names).
+    uint32_t copyFunction(uint32_t f, Program &out) {
+        const Program &p = *program_;
+        out.code.clear();
+        out.lines.clear();
+        for (uint32_t pc = begin_; pc < end_; ++pc) {
+            Instr in = p.code[pc];
+            switch (in.op) {
+                case Op::Jmp: case Op::Loop: case Op::Jz: case Op::Jnz: setWide(in, in.wide() - begin_); break;
+                case Op::LoadK: setWide(in, constant(out, p.constants[in.wide()])); break;
+                default: break;
+            }
+            out.code.push_back(in);
+            out.lines.push_back(p.lines[pc]);
+        }
+        return p.functions[f].numRegs;
+    }
+
+    // ---------- Dump ----------
+
+    void dumpFunction(const IrFunction &fn, ostream &out) const {
+        const Program &p = *program_;
+        out << "function " << p.functions[fn.index].name << " (" << p.functions[fn.index].params.size()
+            << " params, " << numRegs_ << " registers):\n";
+        auto val = [&](uint32_t v) {
+            string s = "v" + to_string(v);
+            if (v < fn.reg.size() && fn.reg[v] != kNone) s += ":r" + to_string(fn.reg[v]);
+            return s;
+        };
+        for (uint32_t b : fn.layout) {
+            const IrBlock &blk = fn.blocks[b];
+            out << "  b" << b << ":";
+            if (blk.predCount) {
+                out << "  ; preds";
+                for (uint32_t k = 0; k < blk.predCount; ++k) out << " b" << fn.pred(blk, k);
+            }
+            out << "\n";
+            for (uint32_t i = blk.begin; i < blk.end; ++i) {
+                uint32_t id = fn.schedule[i];
+                const IrInstr &in = fn.instrs[id];
+                if (in.op == IrOp::Nop) continue;
+                out << "    ";
+                if (definesValue(in)) out << val(id) << " = ";
+                switch (in.op) {
+                    case IrOp::Const:
+                        out << "const " << in.k.i;
+                        if (in.k.i != int64_t(int32_t(in.k.i))) out << " / " << in.k.f;
+                        break;
+                    case IrOp::Param: out << "param " << in.aux; break;
+                    case IrOp::Phi:
+                        out << "phi";
+                        for (uint32_t k = 0; k < in.b; ++k)
+                            out << (k ? ", " : " ") << val(fn.operands[in.a + k]) << " from b" << fn.pred(blk, k);
+                        break;
+                    case IrOp::Unary:
+                        out << opName(in.code) << " " << val(in.a);
+                        if (in.code == Op::IncI || in.code == Op::IncL) out << ", " << int16_t(in.aux);
+                        break;
+                    case IrOp::Binary: out << opName(in.code) << " " << val(in.a) << ", " << val(in.b); break;
+                    case IrOp::LoadG: out << "load " << p.globals[in.aux].name; break;
+                    case IrOp::StoreG: out << "store " << p.globals[in.aux].name << ", " << val(in.a); break;
+                    case IrOp::Call:
+                        out << "call " << p.functions[in.aux].name << "(";
+                        for (uint32_t k = 0; k < in.b; ++k) out << (k ? ", " : "") << val(fn.operands[in.a + k]);
+                        out << ")";
+                        break;
+                    case IrOp::Print:
+                        out << "print " << val(in.a) << " as " << valueTypeName(ValueType(in.aux & 0xFF))
+                            << (in.aux >> 8 ? ", newline" : "");
+                        break;
+                    case IrOp::Jmp: out << (in.aux ? "loop b" : "jmp b") << blk.succ[0]; break;
+                    case IrOp::Br: out << "br " << val(in.a) << ", b" << blk.succ[0] << ", b" << blk.succ[1]; break;
+                    case IrOp::Ret: out << "ret " << val(in.a); break;
+                    case IrOp::RetV: out << "ret"; break;
+                    case IrOp::Nop: break;
+                }
+                out << "\n";
+            }
+        }
+    }
+};
@@ -0,0 +1,661 @@
+// jit.h
+// Template JIT for the register bytecode on x86-64. When a function gets hot
+// in the VM (its entry or one of its loop headers has been reached
+// jitThreshold times), each of its instructions is replaced by a fixed
+// machine code template. The templates work on the VM's own register window
+// in memory, so control can pass between native code and the interpreter at
+// any instruction boundary:
+// - Native code is entered at a function's entry, or at a loop header in the
+//   middle of a running call (on-stack replacement needs nothing more).
+// - An instruction without a template (print, or a call to a function that
+//   has one) is a side exit: native code records its pc and returns, and the
+//   VM interprets from there.
+// - Functions whose whole call tree has templates call each other natively.
+// - Steps, the call depth limit and division by zero are checked exactly as
+//   the VM checks them, so --diff holds the JIT to the same results.
+//
+// Code is assembled into a buffer and copied to fresh mmap'd pages, which
+// are then made executable (never writable and executable at once). On
+// other platforms, or with -DTK_NO_JIT, available() is false and the VM
+// only interprets.
+
+#pragma once
+
+#include "bytecode.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && !defined(TK_NO_JIT)
+#define TK_JIT_AVAILABLE 1
+#include <sys/mman.h>
+#endif
+
+// State shared with native code, which addresses the fields by offset.
+struct JitContext {
+    Value *globals;
+    uint64_t steps;
+    uint64_t maxSteps;
+    uint64_t depth; // call depth of the function being entered
+    uint64_t maxDepth;
+    uint32_t exitPc; // the instruction native code stopped at
+};
+
+// Why native code returned to the VM.
+enum class JitExit : int { Return, SideExit, DivisionByZero, CallStackOverflow, StepLimit };
+
+// ---------- x86-64 encoding ----------
+
+enum X64Reg : int { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes: the low nibble of Jcc and SETcc.
+enum X64Cond : uint8_t {
+    CondB = 0x2, CondAE = 0x3, CondE = 0x4, CondNE = 0x5, CondBE = 0x6, CondA = 0x7,
+    CondP = 0xA, CondNP = 0xB, CondL = 0xC, CondLE = 0xE
+};
+
+class X64Assembler {
+public:
+    vector<uint8_t> code;
+
+    size_t size() const { return code.size(); }
+    void byte(uint8_t b) { code.push_back(b); }
+    void dword(uint32_t v) {
+        for (int k = 0; k < 4; ++k) byte(uint8_t(v >> (8 * k)));
+    }
+    void qword(uint64_t v) {
+        for (int k = 0; k < 8; ++k) byte(uint8_t(v >> (8 * k)));
+    }
+
+    // `op reg, [base + disp32]`. `prefix` is an SSE prefix (0x66, 0xF2,
+    // 0xF3) or 0, `w` selects 64-bit operands. For opcodes with an /digit
+    // extension, pass the digit as `reg`.
+    void mem(uint8_t prefix, bool w, initializer_list<uint8_t> opcode, int reg, int base, int32_t disp) {
+        start(prefix, w, reg, base, opcode);
+        byte(uint8_t(0x80 | (reg & 7) << 3 | (base & 7)));
+        if ((base & 7) == RSP) byte(0x24); // SIB: no index
+        dword(uint32_t(disp));
+    }
+    // `op reg, rm` on registers.
+    void rr(uint8_t prefix, bool w, initializer_list<uint8_t> opcode, int reg, int rm) {
+        start(prefix, w, reg, rm, opcode);
+        byte(uint8_t(0xC0 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    void push(int r) {
+        if (r & 8) byte(0x41);
+        byte(uint8_t(0x50 + (r & 7)));
+    }
+    void pop(int r) {
+        if (r & 8) byte(0x41);
+        byte(uint8_t(0x58 + (r & 7)));
+    }
+    void movImm64(int r, uint64_t v) {
+        byte(uint8_t(0x48 | r >> 3));
+        byte(uint8_t(0xB8 + (r & 7)));
+        qword(v);
+    }
+    void movEaxImm(uint32_t v) {
+        byte(0xB8);
+        dword(v);
+    }
+    void setcc(X64Cond c, int r) { rr(0, false, {0x0F, uint8_t(0x90 | c)}, 0, r); }
+    void ret() { byte(0xC3); }
+
+    // Jumps and calls with a 32-bit displacement. They return the offset
+    // of the displacement, to be filled in by patch() or bind().
+    size_t jmp() {
+        byte(0xE9);
+        return hole();
+    }
+    size_t jcc(X64Cond c) {
+        byte(0x0F);
+        byte(uint8_t(0x80 | c));
+        return hole();
+    }
+    size_t call() {
+        byte(0xE8);
+        return hole();
+    }
+    void patch(size_t at, size_t target) {
+        uint32_t rel = uint32_t(int32_t(int64_t(target) - int64_t(at + 4)));
+        for (int k = 0; k < 4; ++k) code[at + k] = uint8_t(rel >> (8 * k));
+    }
+    void bind(size_t at) { patch(at, size()); }
+
+private:
+    void start(uint8_t prefix, bool w, int reg, int rm, initializer_list<uint8_t> opcode) {
+        if (prefix) byte(prefix);
+        uint8_t rex = uint8_t(0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0));
+        if (rex != 0x40) byte(rex);
+        for (uint8_t b : opcode) byte(b);
+    }
+    size_t hole() {
+        dword(0);
+        return size() - 4;
+    }
+};
+
+// ---------- JIT ----------
+
+class Jit {
+public:
+    // Deepest chain of native calls allowed. Each one takes 16 bytes of the
+    // machine stack; with a larger VmOptions::maxCallDepth, calls are left
+    // to the VM.
+    static constexpr uint64_t kMaxNativeDepth = 100000;
+
+    static bool available() {
+#ifdef TK_JIT_AVAILABLE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    Jit(const Program &program, uint32_t threshold, uint64_t maxCallDepth)
+        : program_(program), threshold_(threshold), maxDepth_(maxCallDepth) {
+        analyze();
+        emitTrampoline();
+    }
+
+    ~Jit() {
+#ifdef TK_JIT_AVAILABLE
+        for (auto [p, n] : mappings_) munmap(p, n);
+#endif
+    }
+
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    // Native code that continues from instruction `pc`, a function entry or
+    // loop header; nullptr means keep interpreting. The function is compiled
+    // once `pc` has been reached `threshold` times.
+    const void *entry(uint32_t pc) {
+        if (const void *p = native_[pc]) return p;
+        uint32_t f = functionAt_[pc];
+        if (state_[f] != NotCompiled || ++hot_[pc] < threshold_) return nullptr;
+        compile(f);
+        return native_[pc];
+    }
+
+    // Registers that native code entered at `pc` may use, counted from the
+    // start of the current window, when the function runs at call `depth`.
+    size_t windowSize(uint32_t pc, uint64_t depth) const {
+        uint32_t f = functionAt_[pc];
+        if (!callsNatively_[f]) return program_.functions[f].numRegs;
+        return size_t(maxDepth_ - min(depth, maxDepth_) + 1) * maxRegs_;
+    }
+
+    // Run native code from `entry` on the register window `regs`.
+    JitExit run(const void *entry, Value *regs, JitContext &ctx) const {
+#ifdef TK_JIT_AVAILABLE
+        using Trampoline = int (*)(Value *, JitContext *, const void *);
+        return JitExit(reinterpret_cast<Trampoline>(trampoline_)(regs, &ctx, entry));
+#else
+        (void)entry, (void)regs;
+        ctx.exitPc = 0;
+        return JitExit::SideExit;
+#endif
+    }
+
+    size_t compiledFunctions() const { return compiled_; }
+    size_t codeBytes() const { return codeBytes_; }
+
+private:
+    enum State : uint8_t { NotCompiled, Compiled, Failed };
+
+    // Native register roles. rbx, rbp and r12-r15 are callee-saved in the
+    // System V ABI, so the trampoline saves them once.
+    static constexpr int kRegs = RBX;     // current register window
+    static constexpr int kCtx = R12;      // JitContext
+    static constexpr int kGlobals = R13;
+    static constexpr int kDepth = R14;
+    static constexpr int kSteps = R15;
+    static constexpr int kMaxSteps = RBP;
+
+    const Program &program_;
+    uint32_t threshold_;
+    uint64_t maxDepth_;
+    bool nativeCalls_ = false;
+    uint32_t maxRegs_ = 1;
+    vector<uint32_t> functionAt_;     // per instruction
+    vector<uint32_t> begin_, end_;    // per function: its instructions
+    vector<bool> selfContained_;      // every instruction in its call tree has a template
+    vector<bool> callsNatively_;
+    vector<State> state_;
+    vector<uint32_t> hot_;            // per instruction: times reached
+    vector<const void *> native_;     // per instruction: native entry point
+    vector<const uint8_t *> functionCode_;
+    const uint8_t *trampoline_ = nullptr;
+    vector<pair<void *, size_t>> mappings_;
+    size_t compiled_ = 0;
+    size_t codeBytes_ = 0;
+
+    static int32_t slot(uint32_t reg) { return int32_t(reg * sizeof(Value)); }
+
+    bool nativeCall(const Instr &in) const { return nativeCalls_ && selfContained_[in.b]; }
+
+    void analyze() {
+        const vector<BytecodeFunction> &fns = program_.functions;
+        size_t n = program_.code.size();
+        functionAt_.assign(n, 0);
+        hot_.assign(n, 0);
+        native_.assign(n, nullptr);
+        begin_.assign(fns.size(), 0);
+        end_.assign(fns.size(), 0);
+        state_.assign(fns.size(), NotCompiled);
+        functionCode_.assign(fns.size(), nullptr);
+        nativeCalls_ = maxDepth_ <= kMaxNativeDepth;
+
+        // Each function's code is contiguous, in some order.
+        vector<uint32_t> order;
+        for (uint32_t f = 0; f < fns.size(); ++f) {
+            maxRegs_ = max(maxRegs_, fns[f].numRegs);
+            if (fns[f].defined) order.push_back(f);
+            else state_[f] = Failed;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return fns[x].entry < fns[y].entry; });
+        for (size_t k = 0; k < order.size(); ++k) {
+            uint32_t f = order[k];
+            begin_[f] = fns[f].entry;
+            end_[f] = k + 1 < order.size() ? fns[order[k + 1]].entry : uint32_t(n);
+            for (uint32_t pc = begin_[f]; pc < end_[f]; ++pc) functionAt_[pc] = f;
+        }
+
+        selfContained_.assign(fns.size(), false);
+        for (uint32_t f : order) {
+            selfContained_[f] = true;
+            for (uint32_t pc = begin_[f]; pc < end_[f]; ++pc) {
+                Op op = program_.code[pc].op;
+                if (op == Op::Print || (op == Op::Call && !nativeCalls_)) selfContained_[f] = false;
+            }
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (uint32_t f : order) {
+                if (!selfContained_[f]) continue;
+                for (uint32_t pc = begin_[f]; pc < end_[f]; ++pc) {
+                    const Instr &in = program_.code[pc];
+                    if (in.op == Op::Call && !selfContained_[in.b]) {
+                        selfContained_[f] = false;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+        callsNatively_.assign(fns.size(), false);
+        for (uint32_t f : order)
+            for (uint32_t pc = begin_[f]; pc < end_[f]; ++pc)
+                if (program_.code[pc].op == Op::Call && nativeCall(program_.code[pc])) callsNatively_[f] = true;
+    }
+
+    // Copy code to new pages and make them executable. nullptr on failure.
+    const uint8_t *install(const vector<uint8_t> &code) {
+#ifdef TK_JIT_AVAILABLE
+        size_t page = 4096, size = (code.size() + page - 1) / page * page;
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+        memcpy(p, code.data(), code.size());
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, size);
+            return nullptr;
+        }
+        mappings_.push_back({p, size});
+        codeBytes_ += code.size();
+        return static_cast<const uint8_t *>(p);
+#else
+        (void)code;
+        return nullptr;
+#endif
+    }
+
+    // int trampoline(Value *regs, JitContext *ctx, const void *entry):
+    // load the register roles, call `entry`, save the step count.
+    void emitTrampoline() {
+        X64Assembler a;
+        for (int r : {RBP, RBX, R12, R13, R14, R15}) a.push(r);
+        a.rr(0, true, {0x89}, RDI, kRegs);
+        a.rr(0, true, {0x89}, RSI, kCtx);
+        a.mem(0, true, {0x8B}, kGlobals, kCtx, offsetof(JitContext, globals));
+        a.mem(0, true, {0x8B}, kDepth, kCtx, offsetof(JitContext, depth));
+        a.mem(0, true, {0x8B}, kSteps, kCtx, offsetof(JitContext, steps));
+        a.mem(0, true, {0x8B}, kMaxSteps, kCtx, offsetof(JitContext, maxSteps));
+        a.rr(0, false, {0xFF}, 2, RDX); // call rdx
+        a.mem(0, true, {0x89}, kSteps, kCtx, offsetof(JitContext, steps));
+        for (int r : {R15, R14, R13, R12, RBX, RBP}) a.pop(r);
+        a.ret();
+        trampoline_ = install(a.code);
+        if (!trampoline_) fill(state_.begin(), state_.end(), Failed);
+    }
+
+    // Compile function `f` along with every function it calls natively
+    // that has no code yet, so all native calls have a target.
+    void compile(uint32_t f) {
+        vector<uint32_t> batch{f};
+        vector<bool> inBatch(program_.functions.size(), false);
+        inBatch[f] = true;
+        for (size_t k = 0; k < batch.size(); ++k) {
+            for (uint32_t pc = begin_[batch[k]]; pc < end_[batch[k]]; ++pc) {
+                const Instr &in = program_.code[pc];
+                if (in.op == Op::Call && nativeCall(in) && state_[in.b] == NotCompiled && !inBatch[in.b]) {
+                    inBatch[in.b] = true;
+                    batch.push_back(in.b);
+                }
+            }
+        }
+
+        X64Assembler a;
+        vector<size_t> label(program_.code.size(), 0);
+        vector<pair<size_t, uint32_t>> jumps, calls; // (displacement, target pc / function)
+        for (uint32_t g : batch) emitFunction(a, g, label, jumps, calls);
+        for (auto [at, pc] : jumps) a.patch(at, label[pc]);
+        for (auto [at, g] : calls) a.patch(at, label[begin_[g]]);
+
+        const uint8_t *base = install(a.code);
+        for (uint32_t g : batch) {
+            state_[g] = base ? Compiled : Failed;
+            if (!base) continue;
+            ++compiled_;
+            functionCode_[g] = base + label[begin_[g]];
+            native_[begin_[g]] = functionCode_[g];
+            for (uint32_t pc = begin_[g]; pc < end_[g]; ++pc) {
+                const Instr &in = program_.code[pc];
+                if (in.op == Op::Loop) native_[in.wide()] = base + label[in.wide()];
+            }
+        }
+    }
+
+    void load(X64Assembler &a, int r, uint32_t reg) { a.mem(0, true, {0x8B}, r, kRegs, slot(reg)); }
+    void store(X64Assembler &a, uint32_t reg, int r) { a.mem(0, true, {0x89}, r, kRegs, slot(reg)); }
+    void loadDouble(X64Assembler &a, uint32_t reg) { a.mem(0xF2, false, {0x0F, 0x10}, 0, kRegs, slot(reg)); }
+    void storeDouble(X64Assembler &a, uint32_t reg) { a.mem(0xF2, false, {0x0F, 0x11}, 0, kRegs, slot(reg)); }
+    void wrapInt32(X64Assembler &a) { a.rr(0, true, {0x63}, RAX, RAX); }           // movsxd rax, eax
+    void roundToFloat(X64Assembler &a) {
+        a.rr(0xF2, false, {0x0F, 0x5A}, 0, 0); // cvtsd2ss xmm0, xmm0
+        a.rr(0xF3, false, {0x0F, 0x5A}, 0, 0); // cvtss2sd xmm0, xmm0
+    }
+    void zeroExtendAl(X64Assembler &a) { a.rr(0, false, {0x0F, 0xB6}, RAX, RAX); } // movzx eax, al
+
+    // al = flags say c1 and c2 (or c1 or c2), as 0 or 1 in rax.
+    void setBoth(X64Assembler &a, X64Cond c1, X64Cond c2, bool both) {
+        a.setcc(c1, RAX);
+        a.setcc(c2, RCX);
+        a.rr(0, false, {uint8_t(both ? 0x20 : 0x08)}, RCX, RAX);
+        zeroExtendAl(a);
+    }
+
+    // Return `status` to the VM, stopped at `pc`.
+    void exitTo(X64Assembler &a, uint32_t pc, JitExit status) {
+        a.mem(0, false, {0xC7}, 0, kCtx, offsetof(JitContext, exitPc));
+        a.dword(pc);
+        a.movEaxImm(uint32_t(status));
+        a.ret();
+    }
+
+    // ++steps, leaving through a stub if that passes maxSteps.
+    void countStep(X64Assembler &a, uint32_t pc, vector<tuple<size_t, uint32_t, JitExit>> &stubs) {
+        a.rr(0, true, {0xFF}, 0, kSteps);
+        a.rr(0, true, {0x39}, kMaxSteps, kSteps);
+        stubs.emplace_back(a.jcc(CondA), pc, JitExit::StepLimit);
+    }
+
+    void emitFunction(X64Assembler &a, uint32_t f, vector<size_t> &label, vector<pair<size_t, uint32_t>> &jumps,
+                      vector<pair<size_t, uint32_t>> &calls) {
+        vector<tuple<size_t, uint32_t, JitExit>> stubs; // rare exits, placed after the body
+        for (uint32_t pc = begin_[f]; pc < end_[f]; ++pc) {
+            label[pc] = a.size();
+            const Instr &in = program_.code[pc];
+            switch (in.op) {
+                case Op::Move:
+                    load(a, RAX, in.b);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::LoadI:
+                    a.mem(0, true, {0xC7}, 0, kRegs, slot(in.a));
+                    a.dword(in.wide());
+                    break;
+                case Op::LoadK:
+                    a.movImm64(RAX, uint64_t(program_.constants[in.wide()].i));
+                    store(a, in.a, RAX);
+                    break;
+                case Op::LoadG:
+                    a.mem(0, true, {0x8B}, RAX, kGlobals, slot(in.b));
+                    store(a, in.a, RAX);
+                    break;
+                case Op::StoreG:
+                    load(a, RAX, in.a);
+                    a.mem(0, true, {0x89}, RAX, kGlobals, slot(in.b));
+                    break;
+
+                case Op::AddI: case Op::AddL: case Op::SubI: case Op::SubL: case Op::MulI: case Op::MulL:
+                case Op::And: case Op::Or: case Op::Xor: {
+                    load(a, RAX, in.b);
+                    switch (in.op) {
+                        case Op::AddI: case Op::AddL: a.mem(0, true, {0x03}, RAX, kRegs, slot(in.c)); break;
+                        case Op::SubI: case Op::SubL: a.mem(0, true, {0x2B}, RAX, kRegs, slot(in.c)); break;
+                        case Op::MulI: case Op::MulL: a.mem(0, true, {0x0F, 0xAF}, RAX, kRegs, slot(in.c)); break;
+                        case Op::And: a.mem(0, true, {0x23}, RAX, kRegs, slot(in.c)); break;
+                        case Op::Or: a.mem(0, true, {0x0B}, RAX, kRegs, slot(in.c)); break;
+                        default: a.mem(0, true, {0x33}, RAX, kRegs, slot(in.c)); break;
+                    }
+                    if (in.op == Op::AddI || in.op == Op::SubI || in.op == Op::MulI) wrapInt32(a);
+                    store(a, in.a, RAX);
+                    break;
+                }
+                case Op::AddF: case Op::AddD: case Op::SubF: case Op::SubD:
+                case Op::MulF: case Op::MulD: case Op::DivF: case Op::DivD: {
+                    uint8_t code = in.op == Op::AddF || in.op == Op::AddD   ? 0x58
+                                   : in.op == Op::SubF || in.op == Op::SubD ? 0x5C
+                                   : in.op == Op::MulF || in.op == Op::MulD ? 0x59
+                                                                            : 0x5E;
+                    loadDouble(a, in.b);
+                    a.mem(0xF2, false, {0x0F, code}, 0, kRegs, slot(in.c));
+                    if (in.op == Op::AddF || in.op == Op::SubF || in.op == Op::MulF || in.op == Op::DivF)
+                        roundToFloat(a);
+                    storeDouble(a, in.a);
+                    break;
+                }
+                case Op::DivI: case Op::DivL: case Op::ModI: case Op::ModL: {
+                    bool mod = in.op == Op::ModI || in.op == Op::ModL;
+                    bool wide = in.op == Op::DivL || in.op == Op::ModL;
+                    load(a, RCX, in.c);
+                    a.rr(0, true, {0x85}, RCX, RCX);
+                    stubs.emplace_back(a.jcc(CondE), pc, JitExit::DivisionByZero);
+                    load(a, RAX, in.b);
+                    // int operands are sign-extended, so a 64-bit idiv
+                    // cannot trap on them; long needs x / -1 by hand.
+                    size_t normal = 0, done = 0;
+                    if (wide) {
+                        a.rr(0, true, {0x83}, 7, RCX);
+                        a.byte(0xFF);
+                        normal = a.jcc(CondNE);
+                        if (mod) a.rr(0, false, {0x31}, RAX, RAX);
+                        else a.rr(0, true, {0xF7}, 3, RAX);
+                        done = a.jmp();
+                        a.bind(normal);
+                    }
+                    a.byte(0x48);
+                    a.byte(0x99);                         // cqo
+                    a.rr(0, true, {0xF7}, 7, RCX);        // idiv rcx
+                    if (mod) a.rr(0, true, {0x89}, RDX, RAX);
+                    else if (!wide) wrapInt32(a);
+                    if (wide) a.bind(done);
+                    store(a, in.a, RAX);
+                    break;
+                }
+                case Op::ShlI: case Op::ShlL: case Op::ShrI: case Op::ShrL: {
+                    bool narrow = in.op == Op::ShlI || in.op == Op::ShrI;
+                    load(a, RCX, in.c);
+                    if (narrow) {
+                        a.rr(0, false, {0x83}, 4, RCX); // and ecx, 31
+                        a.byte(31);
+                    }
+                    load(a, RAX, in.b);
+                    a.rr(0, true, {0xD3}, in.op == Op::ShlI || in.op == Op::ShlL ? 4 : 7, RAX);
+                    if (in.op == Op::ShlI) wrapInt32(a);
+                    store(a, in.a, RAX);
+                    break;
+                }
+
+                case Op::Lt: case Op::Le: case Op::Eq: case Op::Ne:
+                    load(a, RAX, in.b);
+                    a.mem(0, true, {0x3B}, RAX, kRegs, slot(in.c));
+                    a.setcc(in.op == Op::Lt ? CondL : in.op == Op::Le ? CondLE : in.op == Op::Eq ? CondE : CondNE, RAX);
+                    zeroExtendAl(a);
+                    store(a, in.a, RAX);
+                    break;
+                // ucomisd sets ZF, PF and CF on NaN: "above" and "above or
+                // equal" are false then, equality needs PF clear.
+                case Op::LtD: case Op::LeD:
+                    loadDouble(a, in.c);
+                    a.mem(0x66, false, {0x0F, 0x2E}, 0, kRegs, slot(in.b));
+                    a.setcc(in.op == Op::LtD ? CondA : CondAE, RAX);
+                    zeroExtendAl(a);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::EqD: case Op::NeD:
+                    loadDouble(a, in.b);
+                    a.mem(0x66, false, {0x0F, 0x2E}, 0, kRegs, slot(in.c));
+                    if (in.op == Op::EqD) setBoth(a, CondE, CondNP, true);
+                    else setBoth(a, CondNE, CondP, false);
+                    store(a, in.a, RAX);
+                    break;
+
+                case Op::NegI: case Op::NegL:
+                    load(a, RAX, in.b);
+                    a.rr(0, true, {0xF7}, 3, RAX);
+                    if (in.op == Op::NegI) wrapInt32(a);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::NegD:
+                    load(a, RAX, in.b);
+                    a.rr(0, true, {0x0F, 0xBA}, 7, RAX); // btc rax, 63
+                    a.byte(63);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::Not: case Op::ToBool:
+                    a.mem(0, true, {0x83}, 7, kRegs, slot(in.b));
+                    a.byte(0);
+                    a.setcc(in.op == Op::Not ? CondE : CondNE, RAX);
+                    zeroExtendAl(a);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::NotD: case Op::ToBoolD:
+                    a.rr(0x66, false, {0x0F, 0x57}, 0, 0); // xorpd xmm0, xmm0
+                    a.mem(0x66, false, {0x0F, 0x2E}, 0, kRegs, slot(in.b));
+                    if (in.op == Op::NotD) setBoth(a, CondE, CondNP, true);
+                    else setBoth(a, CondNE, CondP, false);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::BitNot:
+                    load(a, RAX, in.b);
+                    a.rr(0, true, {0xF7}, 2, RAX);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::IncI:
+                    load(a, RAX, in.a);
+                    a.rr(0, true, {0x81}, 0, RAX);
+                    a.dword(uint32_t(int32_t(int16_t(in.b))));
+                    wrapInt32(a);
+                    store(a, in.a, RAX);
+                    break;
+                case Op::IncL:
+                    a.mem(0, true, {0x81}, 0, kRegs, slot(in.a));
+                    a.dword(uint32_t(int32_t(int16_t(in.b))));
+                    break;
+
+                case Op::Sext8: case Op::Sext16: case Op::Sext32:
+                    if (in.op == Op::Sext32) a.mem(0, true, {0x63}, RAX, kRegs, slot(in.b));
+                    else a.mem(0, true, {0x0F, uint8_t(in.op == Op::Sext8 ? 0xBE : 0xBF)}, RAX, kRegs, slot(in.b));
+                    store(a, in.a, RAX);
+                    break;
+                case Op::I2F: case Op::I2D:
+                    a.mem(0xF2, true, {0x0F, 0x2A}, 0, kRegs, slot(in.b)); // cvtsi2sd
+                    if (in.op == Op::I2F) roundToFloat(a);
+                    storeDouble(a, in.a);
+                    break;
+                case Op::D2F:
+                    loadDouble(a, in.b);
+                    roundToFloat(a);
+                    storeDouble(a, in.a);
+                    break;
+                case Op::D2I: {
+                    // cvttsd2si gives INT64_MIN for NaN and out-of-range
+                    // values; fix those up as doubleToInteger() does.
+                    loadDouble(a, in.b);
+                    a.rr(0xF2, true, {0x0F, 0x2C}, RAX, 0);
+                    a.movImm64(RCX, uint64_t(INT64_MIN));
+                    a.rr(0, true, {0x39}, RCX, RAX);
+                    size_t exact = a.jcc(CondNE);
+                    a.rr(0x66, false, {0x0F, 0x2E}, 0, 0);
+                    size_t number = a.jcc(CondNP);
+                    a.rr(0, false, {0x31}, RAX, RAX);
+                    size_t nan = a.jmp();
+                    a.bind(number);
+                    a.rr(0x66, false, {0x0F, 0x57}, 1, 1);
+                    a.rr(0x66, false, {0x0F, 0x2E}, 0, 1);
+                    size_t negative = a.jcc(CondBE);
+                    a.rr(0, true, {0xF7}, 2, RAX); // INT64_MAX
+                    for (size_t at : {exact, nan, negative}) a.bind(at);
+                    store(a, in.a, RAX);
+                    break;
+                }
+
+                case Op::Jmp:
+                    jumps.emplace_back(a.jmp(), in.wide());
+                    break;
+                case Op::Loop:
+                    countStep(a, pc, stubs);
+                    jumps.emplace_back(a.jmp(), in.wide());
+                    break;
+                case Op::Jz: case Op::Jnz:
+                    a.mem(0, true, {0x83}, 7, kRegs, slot(in.a));
+                    a.byte(0);
+                    jumps.emplace_back(a.jcc(in.op == Op::Jz ? CondE : CondNE), in.wide());
+                    break;
+
+                case Op::Call: {
+                    if (!nativeCall(in)) {
+                        exitTo(a, pc, JitExit::SideExit);
+                        break;
+                    }
+                    countStep(a, pc, stubs);
+                    a.mem(0, true, {0x3B}, kDepth, kCtx, offsetof(JitContext, maxDepth));
+                    stubs.emplace_back(a.jcc(CondAE), pc, JitExit::CallStackOverflow);
+                    a.rr(0, true, {0xFF}, 0, kDepth);
+                    a.push(kRegs);
+                    a.mem(0, true, {0x8D}, kRegs, kRegs, slot(in.a)); // the callee's window
+                    if (functionCode_[in.b]) {
+                        a.movImm64(RAX, uint64_t(reinterpret_cast<uintptr_t>(functionCode_[in.b])));
+                        a.rr(0, false, {0xFF}, 2, RAX);
+                    } else {
+                        calls.emplace_back(a.call(), in.b);
+                    }
+                    a.pop(kRegs);
+                    a.rr(0, true, {0xFF}, 1, kDepth);
+                    a.rr(0, false, {0x85}, RAX, RAX); // a callee's exit status goes straight up
+                    size_t ok = a.jcc(CondE);
+                    a.ret();
+                    a.bind(ok);
+                    break;
+                }
+                case Op::Ret:
+                    load(a, RAX, in.a);
+                    store(a, 0, RAX); // the caller's result register
+                    a.rr(0, false, {0x31}, RAX, RAX);
+                    a.ret();
+                    break;
+                case Op::RetV:
+                    a.rr(0, false, {0x31}, RAX, RAX);
+                    a.ret();
+                    break;
+                default: // print
+                    exitTo(a, pc, JitExit::SideExit);
+                    break;
+            }
+        }
+        for (auto [at, pc, status] : stubs) {
+            a.bind(at);
+            exitTo(a, pc, status);
+        }
+    }
+};
@@ -0,0 +1,950 @@
+// lexer.h
+// Lexical analysis for the C-like subset: token types, classification
+// helpers and the reentrant Lexer. Header-only so that main.cpp and the
+// later stages (parser, ...) build with a single `g++ main.cpp`.
+
+#pragma once
+
+#include <bits/stdc++.h>
+
+#include "probes.h"
+using namespace std;
+
+// ---------- Token types ----------
+enum class TokenType {
+    Keyword,
+    Identifier,
+    Number,
+    Operator,
+    Delimiter,
+    String,
+    Char,
+    Unknown
+};
+
+inline string_view tokenTypeToString(TokenType t) {
+    switch (t) {
+        case TokenType::Keyword: return "Keyword";
+        case TokenType::Identifier: return "Identifier";
+        case TokenType::Number: return "Number";
+        case TokenType::Operator: return "Operator";
+        case TokenType::Delimiter: return "Delimiter";
+        case TokenType::String: return "String";
+        case TokenType::Char: return "Char";
+        default: return "Unknown";
+    }
+}
+
+// ---------- Token kinds ----------
+
+// The exact kind of a token: which keyword, operator or delimiter it is, or
+// which kind of literal. The lexer assigns it while matching the token, so
+// later stages switch on an integer instead of comparing lexemes. Kinds are
+// grouped in TokenType order (keywords first, Unknown last), which makes
+// the coarse type a range check (tokenTypeOf).
+enum class TokenKind : uint16_t {
+    // Keyword: types, then the rest as in isKeyword()'s table
+    KwInt, KwFloat, KwDouble, KwChar, KwLong, KwShort, KwBool, KwVoid,
+    KwIf, KwElse, KwFor, KwWhile, KwDo, KwReturn, KwSwitch, KwCase, KwBreak, KwContinue,
+    KwClass, KwStruct, KwPublic, KwPrivate, KwProtected,
+    KwInclude, KwNamespace, KwUsing,
+    // Identifier
+    Identifier,
+    // Number: no '.' or exponent, or with one
+    LitInt, LitFloat,
+    // Operator
+    OpShlAssign, OpShrAssign, OpEq, OpNe, OpLe, OpGe, OpInc, OpDec,
+    OpAddAssign, OpSubAssign, OpMulAssign, OpDivAssign, OpModAssign, OpShl, OpShr, OpAndAnd, OpOrOr,
+    OpAdd, OpSub, OpMul, OpDiv, OpMod, OpAssign, OpLt, OpGt, OpNot, OpAnd, OpOr, OpXor, OpTilde,
+    // Delimiter
+    DelimSemicolon, DelimComma, DelimLParen, DelimRParen, DelimLBrace, DelimRBrace, DelimLBracket, DelimRBracket,
+    // String, Char, Unknown
+    LitString, LitChar, Unknown,
+    Count
+};
+
+constexpr TokenType tokenTypeOf(TokenKind k) {
+    return k < TokenKind::Identifier   ? TokenType::Keyword
+         : k == TokenKind::Identifier  ? TokenType::Identifier
+         : k <= TokenKind::LitFloat    ? TokenType::Number
+         : k <= TokenKind::OpTilde     ? TokenType::Operator
+         : k <= TokenKind::DelimRBracket ? TokenType::Delimiter
+         : k == TokenKind::LitString   ? TokenType::String
+         : k == TokenKind::LitChar     ? TokenType::Char
+                                       : TokenType::Unknown;
+}
+
+// Source text of a keyword, operator or delimiter kind; "" for the others.
+constexpr const char *tokenKindText(TokenKind k) {
+    constexpr const char *text[] = {
+        "int", "float", "double", "char", "long", "short", "bool", "void",
+        "if", "else", "for", "while", "do", "return", "switch", "case", "break", "continue",
+        "class", "struct", "public", "private", "protected",
+        "include", "namespace", "using",
+        "",
+        "", "",
+        "<<=", ">>=", "==", "!=", "<=", ">=", "++", "--",
+        "+=", "-=", "*=", "/=", "%=", "<<", ">>", "&&", "||",
+        "+", "-", "*", "/", "%", "=", "<", ">", "!", "&", "|", "^", "~",
+        ";", ",", "(", ")", "{", "}", "[", "]",
+        "", "", "",
+    };
+    static_assert(size(text) == size_t(TokenKind::Count), "one entry per TokenKind");
+    return text[size_t(k)];
+}
+
+// A simple Token struct with lexeme, type and line number.
+// The lexeme is not copied: it points into the source the lexer was given.
+// Identifiers and keywords also carry the hash computed while scanning them,
+// so later stages (interning, fingerprinting) never rehash the lexeme.
+// `type` is always tokenTypeOf(kind); it is kept for the many callers that
+// only need the category.
+struct Token {
+    string_view lexeme; // view into the source buffer
+    TokenType type;
+    int line;
+    uint32_t hash = 0;
+    TokenKind kind = TokenKind::Unknown;
+};
+
+// ---------- Classification helpers ----------
+
+// FNV-1a, fed one byte at a time by the identifier scanner.
+constexpr uint32_t kHashSeed = 2166136261u;
+
+constexpr uint32_t hashStep(uint32_t h, char c) {
+    return (h ^ static_cast<unsigned char>(c)) * 16777619u;
+}
+
+constexpr uint32_t hashString(string_view s) {
+    uint32_t h = kHashSeed;
+    for (char c : s) h = hashStep(h, c);
+    return h;
+}
+
+// Keyword lookup keyed by a precomputed identifier hash: an open-addressing
+// table of (hash, kind) pairs, so a lookup costs one probe and, only on a
+// hash hit, one string compare. Returns TokenKind::Identifier for any
+// other word. The table is built at compile time, so the first lookup
+// costs no more than the others.
+struct KeywordSlot {
+    uint32_t hash;
+    TokenKind kind;
+};
+constexpr size_t kKeywordSlots = 64; // power of two, > 2x keyword count
+
+constexpr array<KeywordSlot, kKeywordSlots> makeKeywordTable() {
+    array<KeywordSlot, kKeywordSlots> t{};
+    for (KeywordSlot &slot : t) slot = {0, TokenKind::Identifier};
+    for (uint16_t k = 0; k < uint16_t(TokenKind::Identifier); ++k) {
+        uint32_t h = hashString(tokenKindText(TokenKind(k)));
+        size_t idx = h & (kKeywordSlots - 1);
+        while (t[idx].kind != TokenKind::Identifier) idx = (idx + 1) & (kKeywordSlots - 1);
+        t[idx] = {h, TokenKind(k)};
+    }
+    return t;
+}
+
+constexpr array<KeywordSlot, kKeywordSlots> kKeywordTable = makeKeywordTable();
+
+inline TokenKind keywordKind(string_view s, uint32_t hash) {
+    const auto &table = kKeywordTable;
+    for (size_t idx = hash & (kKeywordSlots - 1); table[idx].kind != TokenKind::Identifier; idx = (idx + 1) & (kKeywordSlots - 1)) {
+        if (table[idx].hash == hash && s == tokenKindText(table[idx].kind)) return table[idx].kind;
+    }
+    return TokenKind::Identifier;
+}
+
+inline bool isKeyword(string_view s, uint32_t hash) {
+    return keywordKind(s, hash) != TokenKind::Identifier;
+}
+
+inline bool isKeyword(string_view s) {
+    return isKeyword(s, hashString(s));
+}
+
+// Kind of the delimiter `c`, or TokenKind::Unknown.
+inline TokenKind delimiterKind(char c) {
+    switch (c) {
+        case ';': return TokenKind::DelimSemicolon;
+        case ',': return TokenKind::DelimComma;
+        case '(': return TokenKind::DelimLParen;
+        case ')': return TokenKind::DelimRParen;
+        case '{': return TokenKind::DelimLBrace;
+        case '}': return TokenKind::DelimRBrace;
+        case '[': return TokenKind::DelimLBracket;
+        case ']': return TokenKind::DelimRBracket;
+        default: return TokenKind::Unknown;
+    }
+}
+
+// Length of the longest operator starting at s[i], or 0 if there is none,
+// with its kind in `kind`: the operators are <<= >>= == != <= >= ++ -- +=
+// -= *= /= %= << >> && || and + - * / % = < > ! & | ^ ~, decided from at
+// most three bytes without building any temporary strings.
+inline size_t matchOperator(string_view s, size_t i, TokenKind &kind) {
+    using K = TokenKind;
+    char c0 = s[i];
+    char c1 = i + 1 < s.size() ? s[i + 1] : '\0';
+    char c2 = i + 2 < s.size() ? s[i + 2] : '\0';
+    auto pick = [&](K k, size_t len) {
+        kind = k;
+        return len;
+    };
+    switch (c0) {
+        case '<':
+        case '>': {
+            bool lt = c0 == '<';
+            if (c1 == c0) return c2 == '=' ? pick(lt ? K::OpShlAssign : K::OpShrAssign, 3) // <<= >>=
+                                           : pick(lt ? K::OpShl : K::OpShr, 2);            // << >>
+            return c1 == '=' ? pick(lt ? K::OpLe : K::OpGe, 2) : pick(lt ? K::OpLt : K::OpGt, 1);
+        }
+        case '+':
+            return c1 == '+' ? pick(K::OpInc, 2) : c1 == '=' ? pick(K::OpAddAssign, 2) : pick(K::OpAdd, 1);
+        case '-':
+            return c1 == '-' ? pick(K::OpDec, 2) : c1 == '=' ? pick(K::OpSubAssign, 2) : pick(K::OpSub, 1);
+        case '&': return c1 == '&' ? pick(K::OpAndAnd, 2) : pick(K::OpAnd, 1);
+        case '|': return c1 == '|' ? pick(K::OpOrOr, 2) : pick(K::OpOr, 1);
+        case '=': return c1 == '=' ? pick(K::OpEq, 2) : pick(K::OpAssign, 1);
+        case '!': return c1 == '=' ? pick(K::OpNe, 2) : pick(K::OpNot, 1);
+        case '*': return c1 == '=' ? pick(K::OpMulAssign, 2) : pick(K::OpMul, 1);
+        case '/': return c1 == '=' ? pick(K::OpDivAssign, 2) : pick(K::OpDiv, 1);
+        case '%': return c1 == '=' ? pick(K::OpModAssign, 2) : pick(K::OpMod, 1);
+        case '^': return pick(K::OpXor, 1);
+        case '~': return pick(K::OpTilde, 1);
+        default: return 0;
+    }
+}
+
+inline size_t matchOperator(string_view s, size_t i) {
+    TokenKind kind;
+    return matchOperator(s, i, kind);
+}
+
+inline bool isDelimiter(char c) {
+    return delimiterKind(c) != TokenKind::Unknown;
+}
+
+inline bool isOperatorString(string_view s) {
+    return !s.empty() && matchOperator(s, 0) == s.size();
+}
+
+// Byte classes for the scanner: one table lookup instead of the
+// locale-aware <cctype> calls. Matches the "C" locale.
+enum CharClass : uint8_t {
+    CC_Space = 1,
+    CC_Digit = 2,
+    CC_Alpha = 4, // letters and '_'
+};
+
+constexpr array<uint8_t, 256> makeCharClassTable() {
+    array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+        if (c == ' ' || (c >= '\t' && c <= '\r')) t[c] = CC_Space;
+        else if (c >= '0' && c <= '9') t[c] = CC_Digit;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') t[c] = CC_Alpha;
+    }
+    return t;
+}
+
+constexpr array<uint8_t, 256> kCharClass = makeCharClassTable();
+
+inline bool hasClass(char c, uint8_t cls) {
+    return kCharClass[static_cast<unsigned char>(c)] & cls;
+}
+
+// ---------- Tokenizer implementation ----------
+
+// Helper: peek ahead safely
+inline char peekChar(string_view s, size_t i, int offset = 0) {
+    size_t idx = i + offset;
+    return idx < s.size() ? s[idx] : '\0';
+}
+
+// Parse a character literal starting at i (where s[i] == '\'')
+// Returns the lexeme and advances index (by reference) and updates line count for embedded newlines.
+// `closed` tells whether the closing quote was found.
+inline string_view parseCharLiteral(string_view s, size_t &i, int &line, bool &closed) {
+    // Assumes s[i] == '\''
+    size_t start = i;
+    size_t n = s.size();
+    ++i; // opening '
+    closed = false;
+
+    if (i >= n) return s.substr(start, i - start); // malformed, return what we have
+
+    if (s[i] == '\\') {
+        // escaped sequence: include backslash and next char if any (an
+        // escaped newline still ends a source line)
+        ++i;
+        if (i < n && s[i++] == '\n') ++line;
+    } else {
+        // normal character (could be anything except newline)
+        // newline inside char literal - malformed, but include and bump line
+        if (s[i] == '\n') ++line;
+        ++i;
+    }
+
+    // Consume closing quote if present
+    if (i < n && s[i] == '\'') {
+        ++i;
+        closed = true;
+    }
+
+    return s.substr(start, i - start);
+}
+
+// Parse string literal starting at i (s[i] == '"')
+inline string_view parseStringLiteral(string_view s, size_t &i, int &line, bool &closed) {
+    size_t start = i;
+    size_t n = s.size();
+    ++i; // opening quote
+    closed = false;
+
+    while (i < n) {
+        char c = s[i];
+        ++i;
+        if (c == '\\') {
+            // escaped char - include next char without interpretation
+            // (but an escaped newline is still counted)
+            if (i < n && s[i++] == '\n') ++line;
+            continue;
+        }
+        if (c == '"') { // end of string
+            closed = true;
+            break;
+        }
+        if (c == '\n') ++line; // count lines inside string
+    }
+
+    return s.substr(start, i - start);
+}
+
+// Parse a number (supports: 123, 12.34, .45, 1e10, 1.2e-3). `kind` is
+// LitFloat if it has a fraction or an exponent, else LitInt.
+inline string_view parseNumber(string_view s, size_t &i, TokenKind &kind) {
+    size_t start = i;
+    size_t n = s.size();
+
+    kind = TokenKind::LitInt;
+    // Integer part (optional if starts with .)
+    while (i < n && hasClass(s[i], CC_Digit)) ++i;
+
+    // Fractional part
+    if (i < n && s[i] == '.') {
+        kind = TokenKind::LitFloat;
+        ++i;
+        // digits after dot
+        while (i < n && hasClass(s[i], CC_Digit)) ++i;
+    }
+
+    // Exponent part
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        size_t save = i;
+        ++i;
+        if (i < n && (s[i] == '+' || s[i] == '-')) ++i;
+        bool expDigits = false;
+        while (i < n && hasClass(s[i], CC_Digit)) {
+            expDigits = true;
+            ++i;
+        }
+        // rollback exponent if no digits followed
+        if (!expDigits) i = save;
+        else kind = TokenKind::LitFloat;
+    }
+
+    // Note: If lexeme is just "." (no digits) then it's not a number.
+    return s.substr(start, i - start);
+}
+
+// Set from any thread to ask a running Lexer to stop early.
+struct CancelToken {
+    atomic<bool> cancelled{false};
+    void cancel() { cancelled.store(true, memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(memory_order_relaxed); }
+};
+
+// Per-request options for a Lexer.
+struct LexerOptions {
+    size_t maxTokens = 0;                 // stop after this many tokens per call (0 = unlimited)
+    const CancelToken *cancel = nullptr;  // polled every checkInterval bytes
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    size_t checkInterval = 64 * 1024;     // bytes of input between cancel/deadline checks
+};
+
+enum class LexStatus {
+    Complete,
+    Cancelled,
+    DeadlineExceeded,
+    TokenLimit
+};
+
+// Where a run stopped. Pass the same state back to continue: a default
+// constructed state starts at the beginning of the input.
+struct LexState {
+    size_t pos = 0;
+    int line = 1;
+    LexStatus status = LexStatus::Complete;
+};
+
+// An error or warning from the parser or a later pass.
+struct Diagnostic {
+    int line;
+    string message;
+};
+
+// Something suspicious the lexer found (unterminated literal or comment).
+// The message is static text, so recording a warning never allocates once
+// the Lexer's warning buffer has grown.
+struct LexWarning {
+    int line;
+    const char *message;
+};
+
+// Bump allocator for per-request data that does not live in the source
+// (AST nodes, synthesized lexemes, ...). Objects placed here must be
+// trivially destructible. reset() keeps the blocks for the next request.
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 64 * 1024) : blockSize_(blockSize) {}
+
+    void *allocate(size_t size, size_t align = alignof(max_align_t)) {
+        while (block_ < blocks_.size()) {
+            size_t offset = (used_ + align - 1) & ~(align - 1);
+            if (offset + size <= blocks_[block_].size) {
+                used_ = offset + size;
+                return blocks_[block_].data.get() + offset;
+            }
+            ++block_;
+            used_ = 0;
+        }
+        size_t bytes = max(blockSize_, size + align);
+        blocks_.push_back({unique_ptr<char[]>(new char[bytes]), bytes});
+        block_ = blocks_.size() - 1;
+        used_ = 0;
+        return allocate(size, align);
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args) {
+        static_assert(is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+    }
+
+    string_view copy(string_view s) {
+        char *p = static_cast<char *>(allocate(s.size(), 1));
+        memcpy(p, s.data(), s.size());
+        return string_view(p, s.size());
+    }
+
+    void reset() {
+        block_ = 0;
+        used_ = 0;
+    }
+
+private:
+    struct Block {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+    vector<Block> blocks_;
+    size_t block_ = 0; // block currently being filled
+    size_t used_ = 0;  // bytes used in that block
+    size_t blockSize_;
+};
+
+// ---------- Segmented storage ----------
+
+// Fixed-size memory blocks shared by every Segmented container. Freed
+// blocks are kept (up to kMaxFree) for the next container instead of going
+// back to the heap. Thread-safe, so parallel producers can share it.
+class BlockPool {
+public:
+    static constexpr size_t kBlockBytes = 64 * 1024;
+    static constexpr size_t kMaxFree = 1024; // 64 MB
+
+    static BlockPool &shared() {
+        static BlockPool *pool = new BlockPool; // never destroyed: containers may outlive statics
+        return *pool;
+    }
+
+    char *take() {
+        {
+            lock_guard<mutex> hold(lock_);
+            if (!free_.empty()) {
+                char *b = free_.back();
+                free_.pop_back();
+                return b;
+            }
+        }
+        return new char[kBlockBytes];
+    }
+
+    void give(char *block) {
+        {
+            lock_guard<mutex> hold(lock_);
+            if (free_.size() < kMaxFree) {
+                free_.push_back(block);
+                return;
+            }
+        }
+        delete[] block;
+    }
+
+private:
+    mutex lock_;
+    vector<char *> free_;
+};
+
+// A sequence of trivially copyable T in BlockPool blocks. Appending never
+// moves an element and never needs more than one free block, however
+// large the sequence grows. Elements stay indexable in O(1) while every
+// block but the last is full; splice() can break that (its blocks are
+// taken over by pointer, partly filled or not), after which indexing does
+// a binary search over the blocks.
+template <class T>
+class Segmented {
+    static_assert(is_trivially_copyable<T>::value && is_trivially_destructible<T>::value,
+                  "Segmented elements are copied as bytes and never destroyed");
+
+public:
+    static constexpr size_t kPerBlock = BlockPool::kBlockBytes / sizeof(T);
+
+    Segmented() = default;
+    Segmented(const Segmented &) = delete;
+    Segmented &operator=(const Segmented &) = delete;
+    Segmented(Segmented &&other) noexcept { swap(other); }
+    Segmented &operator=(Segmented &&other) noexcept {
+        clear();
+        swap(other);
+        return *this;
+    }
+    ~Segmented() { clear(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t bytes() const { return blocks_.size() * BlockPool::kBlockBytes; }
+
+    void push_back(const T &value) {
+        if (blocks_.empty() || blocks_.back().count == kPerBlock) {
+            blocks_.push_back({reinterpret_cast<T *>(BlockPool::shared().take()), 0, size_});
+        }
+        Block &b = blocks_.back();
+        b.data[b.count++] = value;
+        ++size_;
+    }
+
+    T &operator[](size_t i) { return const_cast<T &>(as_const(*this)[i]); }
+    const T &operator[](size_t i) const {
+        if (uniform_) return blocks_[i / kPerBlock].data[i % kPerBlock];
+        auto it = upper_bound(blocks_.begin(), blocks_.end(), i, [](size_t k, const Block &b) { return k < b.first; });
+        const Block &b = *--it;
+        return b.data[i - b.first];
+    }
+    const T &back() const { return blocks_.back().data[blocks_.back().count - 1]; }
+
+    // Blocks in order, for loops that want plain arrays.
+    size_t blockCount() const { return blocks_.size(); }
+    const T *blockData(size_t b) const { return blocks_[b].data; }
+    size_t blockSize(size_t b) const { return blocks_[b].count; }
+    size_t blockFirst(size_t b) const { return blocks_[b].first; } // index of its first element
+
+    // Call f(data, count, first) for every block, spread over `pool` (a
+    // WorkStealingPool, or anything with the same run(count, task)).
+    template <class Pool, class F>
+    void forEachBlock(Pool &pool, F &&f) const {
+        pool.run(blocks_.size(), [&](size_t b) { f(blocks_[b].data, blocks_[b].count, blocks_[b].first); });
+    }
+
+    // Append all of `other`'s elements by taking over its blocks; `other`
+    // is left empty. Costs one pointer per block, not one copy per element.
+    void splice(Segmented &&other) {
+        if (other.empty()) return;
+        if (!blocks_.empty() && blocks_.back().count != kPerBlock) uniform_ = false;
+        uniform_ = uniform_ && other.uniform_;
+        for (Block b : other.blocks_) {
+            b.first += size_;
+            blocks_.push_back(b);
+        }
+        size_ += other.size_;
+        other.blocks_.clear();
+        other.size_ = 0;
+        other.uniform_ = true;
+    }
+
+    // Give every block back to the pool.
+    void clear() {
+        for (const Block &b : blocks_) BlockPool::shared().give(reinterpret_cast<char *>(b.data));
+        blocks_.clear();
+        size_ = 0;
+        uniform_ = true;
+    }
+
+    // Random-access iteration (an index into the container).
+    class const_iterator {
+    public:
+        using iterator_category = random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        const_iterator(const Segmented *c, size_t i) : c_(c), i_(i) {}
+        reference operator*() const { return (*c_)[i_]; }
+        pointer operator->() const { return &(*c_)[i_]; }
+        reference operator[](difference_type k) const { return (*c_)[i_ + k]; }
+        const_iterator &operator++() { ++i_; return *this; }
+        const_iterator &operator--() { --i_; return *this; }
+        const_iterator operator++(int) { return {c_, i_++}; }
+        const_iterator operator--(int) { return {c_, i_--}; }
+        const_iterator &operator+=(difference_type k) { i_ += k; return *this; }
+        const_iterator &operator-=(difference_type k) { i_ -= k; return *this; }
+        const_iterator operator+(difference_type k) const { return {c_, i_ + k}; }
+        const_iterator operator-(difference_type k) const { return {c_, i_ - k}; }
+        difference_type operator-(const const_iterator &o) const { return difference_type(i_) - difference_type(o.i_); }
+        bool operator==(const const_iterator &o) const { return i_ == o.i_; }
+        bool operator!=(const const_iterator &o) const { return i_ != o.i_; }
+        bool operator<(const const_iterator &o) const { return i_ < o.i_; }
+        bool operator>(const const_iterator &o) const { return i_ > o.i_; }
+        bool operator<=(const const_iterator &o) const { return i_ <= o.i_; }
+        bool operator>=(const const_iterator &o) const { return i_ >= o.i_; }
+
+    private:
+        const Segmented *c_;
+        size_t i_;
+    };
+
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, size_}; }
+
+private:
+    struct Block {
+        T *data;
+        size_t count;
+        size_t first;
+    };
+    vector<Block> blocks_;
+    size_t size_ = 0;
+    bool uniform_ = true; // every block but the last is full
+
+    void swap(Segmented &other) {
+        blocks_.swap(other.blocks_);
+        std::swap(size_, other.size_);
+        std::swap(uniform_, other.uniform_);
+    }
+};
+
+// ---------- Packed tokens ----------
+
+// One token in 8 bytes: where it starts in the source, its kind and its
+// length. A length of kLongToken or more is kept in PackedTokens' overflow
+// table instead. There is no line number: PackedTokens::line() derives it
+// from an index of the source's newlines, built on first use.
+struct PackedToken {
+    uint32_t offset;
+    uint16_t kind; // a TokenKind
+    uint16_t length;
+};
+
+static_assert(sizeof(PackedToken) == 8, "PackedToken is meant to be 8 bytes");
+
+// Tokens of one source in packed form, about a quarter of the size of a
+// vector<Token>, kept in Segmented blocks so a huge input never needs one
+// contiguous array or a copy on growth. Like Token lexemes, the tokens
+// refer to the source, which must outlive them. Sources of 4 GB or more do
+// not fit 32-bit offsets.
+class PackedTokens {
+public:
+    static constexpr uint16_t kLongToken = 0xFFFF;
+
+    // Start over for `source`. Returns false if it is too large.
+    bool reset(string_view source) {
+        source_ = source;
+        tokens_.clear();
+        overflow_.clear();
+        newlines_.clear();
+        indexed_ = false;
+        return source.size() <= UINT32_MAX;
+    }
+
+    // Append a token whose lexeme is a view into the source.
+    void push(string_view lexeme, TokenKind kind) {
+        size_t offset = size_t(lexeme.data() - source_.data());
+        uint16_t length = uint16_t(min<size_t>(lexeme.size(), kLongToken));
+        if (length == kLongToken) overflow_.push_back({uint32_t(tokens_.size()), uint32_t(lexeme.size())});
+        tokens_.push_back({uint32_t(offset), uint16_t(kind), length});
+    }
+
+    size_t size() const { return tokens_.size(); }
+    bool empty() const { return tokens_.empty(); }
+    size_t bytes() const { return tokens_.bytes() + overflow_.capacity() * 8; }
+    const Segmented<PackedToken> &raw() const { return tokens_; }
+
+    TokenKind kind(size_t i) const { return TokenKind(tokens_[i].kind); }
+    TokenType type(size_t i) const { return tokenTypeOf(kind(i)); }
+
+    string_view lexeme(size_t i) const { return source_.substr(tokens_[i].offset, length(i)); }
+
+    // The line the token ends on, as the lexer reports it (a string
+    // literal spanning lines belongs to its last one). The first call
+    // builds the newline index, so it must not race with other calls.
+    int line(size_t i) const {
+        if (!indexed_) indexNewlines();
+        size_t end = tokens_[i].offset + length(i);
+        return 1 + int(lower_bound(newlines_.begin(), newlines_.end(), uint32_t(end)) - newlines_.begin());
+    }
+
+    // The token in the unpacked form the parser takes.
+    Token token(size_t i) const {
+        TokenKind k = kind(i);
+        string_view text = lexeme(i);
+        TokenType t = tokenTypeOf(k);
+        uint32_t hash = t == TokenType::Keyword || t == TokenType::Identifier ? hashString(text) : 0;
+        return Token{text, t, line(i), hash, k};
+    }
+
+private:
+    string_view source_;
+    Segmented<PackedToken> tokens_;
+    vector<pair<uint32_t, uint32_t>> overflow_; // (token index, length), by index
+    mutable vector<uint32_t> newlines_;          // offsets of every '\n'
+    mutable bool indexed_ = false;
+
+    size_t length(size_t i) const {
+        if (tokens_[i].length != kLongToken) return tokens_[i].length;
+        auto it = lower_bound(overflow_.begin(), overflow_.end(), make_pair(uint32_t(i), uint32_t(0)));
+        return it->second;
+    }
+
+    void indexNewlines() const {
+        const char *p = source_.data(), *end = p + source_.size();
+        while (p != end && (p = static_cast<const char *>(memchr(p, '\n', size_t(end - p))))) {
+            newlines_.push_back(uint32_t(p - source_.data()));
+            ++p;
+        }
+        indexed_ = true;
+    }
+};
+
+// A reentrant lexer. The keyword/operator tables are immutable statics shared
+// by every instance; everything per-request (options, token buffer,
+// diagnostics, arena) lives in the object. Keep one Lexer per thread and
+// reuse it: after warm-up a request allocates nothing, since tokens are
+// views into the caller's source and the buffers keep their capacity.
+class Lexer {
+public:
+    explicit Lexer(LexerOptions options = {}) : options_(options) {}
+
+    const LexerOptions &options() const { return options_; }
+    void setOptions(const LexerOptions &options) { options_ = options; }
+
+    // Tokenize `code`. The tokens reference `code`, which must outlive them;
+    // the returned vector is reused by the next call.
+    const vector<Token> &tokenize(string_view code) {
+        LexState state;
+        return tokenize(code, state);
+    }
+
+    // Tokenize from `state` until the input ends or an option stops the run
+    // (state.status says which). Returns only the tokens of this call; call
+    // again with the same state to resume after a cancel, deadline or limit.
+    const vector<Token> &tokenize(string_view code, LexState &state) {
+        tokens_.clear();
+        tokenizeStream(code, [&](Token &&t) { tokens_.push_back(t); }, state);
+        return tokens_;
+    }
+
+    // Streaming form: calls emit(Token&&) for every token as soon as it is
+    // recognised, so consumers (e.g. the --match automaton) can run without
+    // waiting for the whole token vector.
+    template <typename Emit>
+    LexStatus tokenizeStream(string_view code, Emit &&emit) {
+        LexState state;
+        return tokenizeStream(code, emit, state);
+    }
+
+    template <typename Emit>
+    LexStatus tokenizeStream(string_view code, Emit &&emit, LexState &state);
+
+    // Tokenize `code` into segmented storage: like tokenize(), but the
+    // tokens are appended to `out` in BlockPool blocks, never moved.
+    LexStatus tokenize(string_view code, Segmented<Token> &out, LexState &state) {
+        return tokenizeStream(code, [&](Token &&t) { out.push_back(t); }, state);
+    }
+
+    // Tokenize `code` into `out` in packed form (8 bytes a token, no
+    // vector<Token> in between). Returns false if `code` is 4 GB or more.
+    bool tokenizePacked(string_view code, PackedTokens &out) {
+        if (!out.reset(code)) return false;
+        tokenizeStream(code, [&](Token &&t) { out.push(t.lexeme, t.kind); });
+        return true;
+    }
+
+    // Diagnostics and arena contents of the current request (a request
+    // starts whenever a run begins at position 0).
+    const vector<LexWarning> &diagnostics() const { return diagnostics_; }
+    Arena &arena() { return arena_; }
+
+private:
+    LexerOptions options_;
+    vector<Token> tokens_;
+    vector<LexWarning> diagnostics_;
+    Arena arena_;
+};
+
+template <typename Emit>
+LexStatus Lexer::tokenizeStream(string_view code, Emit &&emit, LexState &state) {
+    if (state.pos == 0) {
+        diagnostics_.clear();
+        arena_.reset();
+    }
+
+    size_t n = code.size();
+    size_t i = state.pos;
+    int line = state.line;
+    size_t count = 0;
+    TK_PROBE2(tokenize_entry, n, i);
+    auto push = [&](string_view lexeme, TokenKind kind, int tokLine, uint32_t hash = 0) {
+        emit(Token{lexeme, tokenTypeOf(kind), tokLine, hash, kind});
+        ++count;
+    };
+
+    // Cancellation and the deadline are polled only when the scan crosses the
+    // next checkpoint, so an unbounded run pays a single compare per token.
+    // A token is never split: a huge literal or comment finishes first.
+    const bool polling = options_.cancel || options_.deadline != chrono::steady_clock::time_point::max();
+    const size_t interval = max<size_t>(options_.checkInterval, 1);
+    size_t nextCheck = polling ? i + interval : SIZE_MAX;
+    LexStatus status = LexStatus::Complete;
+
+    while (i < n) {
+        if (i >= nextCheck) {
+            nextCheck = i + interval;
+            if (options_.cancel && options_.cancel->isCancelled()) {
+                status = LexStatus::Cancelled;
+                break;
+            }
+            if (chrono::steady_clock::now() >= options_.deadline) {
+                status = LexStatus::DeadlineExceeded;
+                break;
+            }
+        }
+        if (options_.maxTokens && count >= options_.maxTokens) {
+            status = LexStatus::TokenLimit;
+            break;
+        }
+        char c = code[i];
+
+        // Whitespace handling: track line numbers
+        if (hasClass(c, CC_Space)) {
+            if (c == '\n') ++line;
+            ++i;
+            continue;
+        }
+
+        // Comments: single-line // or multi-line /* */ - skip entirely.
+        // Both jump straight to the terminator with find(), so even an
+        // unterminated comment costs one linear pass.
+        if (c == '/' && peekChar(code, i, 1) == '/') {
+            // single-line comment
+            size_t end = code.find('\n', i + 2);
+            i = end == string_view::npos ? n : end;
+            continue; // next loop will consume newline and increment line
+        }
+
+        if (c == '/' && peekChar(code, i, 1) == '*') {
+            // multi-line comment
+            size_t end = code.find("*/", i + 2);
+            if (end == string_view::npos) {
+                diagnostics_.push_back({line, "unterminated comment"});
+                end = n;
+            } else {
+                end += 2; // skip closing */
+            }
+            line += static_cast<int>(std::count(code.begin() + i, code.begin() + end, '\n'));
+            i = end;
+            continue;
+        }
+
+        // Char literal
+        if (c == '\'') {
+            int startLine = line;
+            bool closed;
+            string_view lex = parseCharLiteral(code, i, line, closed);
+            if (!closed) diagnostics_.push_back({startLine, "unterminated char literal"});
+            push(lex, TokenKind::LitChar, line);
+            continue;
+        }
+
+        // String literal
+        if (c == '"') {
+            int startLine = line;
+            bool closed;
+            string_view lex = parseStringLiteral(code, i, line, closed);
+            if (!closed) diagnostics_.push_back({startLine, "unterminated string literal"});
+            push(lex, TokenKind::LitString, line);
+            continue;
+        }
+
+        // Identifier or keyword: start with letter or underscore
+        if (hasClass(c, CC_Alpha)) {
+            // Hash while scanning so each byte is read once; the hash is then
+            // reused for the keyword lookup (which also gives the kind) and
+            // stored on the token.
+            size_t start = i;
+            uint32_t h = kHashSeed;
+            while (i < n && hasClass(code[i], CC_Alpha | CC_Digit)) {
+                h = hashStep(h, code[i]);
+                ++i;
+            }
+            string_view id = code.substr(start, i - start);
+            push(id, keywordKind(id, h), line, h);
+            continue;
+        }
+
+        // Number: starts with digit, or a dot followed by digit. Either way
+        // parseNumber() consumes at least one digit, so this always succeeds
+        // and a run of bare dots never enters it.
+        if (hasClass(c, CC_Digit) || (c == '.' && hasClass(peekChar(code, i, 1), CC_Digit))) {
+            TokenKind kind;
+            string_view number = parseNumber(code, i, kind);
+            push(number, kind, line);
+            continue;
+        }
+
+        // Operators: longest match (3, then 2, then 1)
+        TokenKind kind;
+        if (size_t len = matchOperator(code, i, kind)) {
+            push(code.substr(i, len), kind, line);
+            i += len;
+            continue;
+        }
+
+        // Delimiters
+        if ((kind = delimiterKind(c)) != TokenKind::Unknown) {
+            push(code.substr(i, 1), kind, line);
+            ++i;
+            continue;
+        }
+
+        // Unknown single character (capture and move on)
+        push(code.substr(i, 1), TokenKind::Unknown, line);
+        ++i;
+    }
+
+    state.pos = i;
+    state.line = line;
+    state.status = status;
+    TK_PROBE3(tokenize_exit, count, int(status), i);
+    return status;
+}
+
+// Convenience wrapper for one-off use: returns vector of Token (lexeme/type/line).
+// The lexemes are views into `code`, so `code` must outlive the tokens; a
+// temporary string would leave them dangling and is refused.
+inline vector<Token> tokenize(const string &code) {
+    vector<Token> tokens;
+    Lexer().tokenizeStream(code, [&](Token &&t) { tokens.push_back(t); });
+    return tokens;
+}
+vector<Token> tokenize(string &&code) = delete;
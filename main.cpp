@@ -6,304 +6,997 @@
 // identifiers, and comments. It also reports line numbers and uses a
 // TokenType enum for clearer code.
 
-#include <bits/stdc++.h>
-using namespace std;
-
-// ---------- Token types ----------
-enum class TokenType {
-    Keyword,
-    Identifier,
-    Number,
-    Operator,
-    Delimiter,
-    String,
-    Char,
-    Unknown
-};
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "parser.h"
+#include "resolver.h"
+#include "folder.h"
+#include "evaluator.h"
+#include "ir.h"
+#include "aot.h"
+#include "pipeline.h"
+#include "analyses.h"
+#include "visitors.h"
+#include "frames.h"
+#include "arrow.h"
+#include "match.h"
 
-static string tokenTypeToString(TokenType t) {
-    switch (t) {
-        case TokenType::Keyword: return "Keyword";
-        case TokenType::Identifier: return "Identifier";
-        case TokenType::Number: return "Number";
-        case TokenType::Operator: return "Operator";
-        case TokenType::Delimiter: return "Delimiter";
-        case TokenType::String: return "String";
-        case TokenType::Char: return "Char";
-        default: return "Unknown";
+// Write all of `text` to `fd`; false on an error (e.g. a closed pipe).
+static bool writeAll(int fd, string_view text) {
+    while (!text.empty()) {
+        ssize_t put = write(fd, text.data(), text.size());
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return false;
+        text.remove_prefix(size_t(put));
     }
+    return true;
 }
 
-// A simple Token struct with lexeme, type and line number
-struct Token {
-    string lexeme;
-    TokenType type;
-    int line;
-};
-
-// ---------- Classification helpers ----------
-
-bool isKeyword(const string &s) {
-    static const unordered_set<string> keywords = {
-        // types
-        "int", "float", "double", "char", "long", "short", "bool", "void",
-        // control
-        "if", "else", "for", "while", "do", "return", "switch", "case", "break", "continue",
-        // declarations / OOP
-        "class", "struct", "public", "private", "protected",
-        // preprocessor / namespaces
-        "include", "namespace", "using",
-    };
-    return keywords.find(s) != keywords.end();
+// Read a whole file (or stdin for "-") into `out`. Plain read(2) into the
+// string, sized from fstat() when the input is a regular file: no stream
+// buffers to set up, and no copy out of a stringstream.
+static bool readSource(const string &filename, string &out) {
+    TraceScope span("read file", "io");
+    int fd = filename == "-" ? 0 : open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "Error: could not open '" << filename << "' for reading.\n";
+        return false;
+    }
+    struct stat info;
+    size_t size = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) ? size_t(info.st_size) : 0;
+    out.resize(size + 1);
+    size_t used = 0;
+    for (;;) {
+        if (used == out.size()) out.resize(out.size() * 2);
+        ssize_t got = read(fd, out.data() + used, out.size() - used);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        used += size_t(got);
+    }
+    out.resize(used);
+    if (fd != 0) close(fd);
+    span.arg("bytes", int64_t(out.size()));
+    return true;
 }
 
-bool isDelimiter(char c) {
-    static const string delims = ";,(){}[]";
-    return delims.find(c) != string::npos;
-}
+// --match PATTERN [files...]: print `file:line: lexemes` for every match.
+static int runMatch(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " --match PATTERN [file...]\n";
+        return 1;
+    }
+    TokenPattern pattern;
+    string error;
+    if (!compilePattern(argv[2], pattern, error)) {
+        cerr << "Error: invalid pattern: " << error << "\n";
+        return 1;
+    }
 
-// Operators set (single, double and some triple-length like <<=)
-bool isOperatorString(const string &s) {
-    static const unordered_set<string> ops = {
-        // triple and double char operators
-        "<<=", ">>=",
-        "==", "!=", "<=", ">=", "++", "--", "+=", "-=", "*=", "/=", "%=", "<<", ">>",
-        "&&", "||",
-        // single char operators
-        "+", "-", "*", "/", "%", "=", "<", ">", "!", "&", "|", "^", "~"
-    };
-    return ops.find(s) != ops.end();
-}
+    vector<string> files(argv + 3, argv + argc);
+    if (files.empty()) files.push_back("-");
 
-// ---------- Tokenizer implementation ----------
+    int status = 0;
+    Lexer lexer; // reused across files
+    for (const string &filename : files) {
+        string source;
+        if (!readSource(filename, source)) {
+            status = 1;
+            continue;
+        }
+        if (!mayMatch(pattern, source)) continue;
 
-// Helper: peek ahead safely
-inline char peekChar(const string &s, size_t i, int offset = 0) {
-    size_t idx = i + offset;
-    return idx < s.size() ? s[idx] : '\0';
+        const string shownName = filename == "-" ? "<stdin>" : filename;
+        TokenMatcher matcher(pattern, [&](const vector<Token> &m) {
+            cout << shownName << ":" << m.front().line << ":";
+            for (const Token &t : m) cout << " " << t.lexeme;
+            cout << "\n";
+        });
+        TK_PROBE2(file_start, filename.c_str(), source.size());
+        lexer.tokenizeStream(source, [&](Token &&t) { matcher.push(t); });
+        matcher.finish();
+        TK_PROBE1(file_end, filename.c_str());
+    }
+    return status;
 }
 
-// Parse a character literal starting at i (where s[i] == '\'')
-// Returns the lexeme and advances index (by reference) and updates line count for embedded newlines.
-static string parseCharLiteral(const string &s, size_t &i, int &line) {
-    // Assumes s[i] == '\''
-    string lexeme;
-    size_t n = s.size();
-    lexeme.push_back(s[i]); // opening '
-    ++i;
-
-    if (i >= n) return lexeme; // malformed, return what we have
-
-    if (s[i] == '\\') {
-        // escaped sequence: include backslash and next char if any
-        lexeme.push_back(s[i]);
-        ++i;
-        if (i < n) {
-            lexeme.push_back(s[i]);
-            ++i;
+// --analyze [--threads] [files...]: run every analysis in analyses.h over
+// each file from a single lexing pass. With --threads each analysis reads
+// the token stream on its own thread (see fanout.h).
+static int runAnalyze(int argc, char **argv) {
+    vector<string> files(argv + 2, argv + argc);
+    bool threaded = !files.empty() && files[0] == "--threads";
+    if (threaded) files.erase(files.begin());
+    if (files.empty()) files.push_back("-");
+
+    TokenMetrics metrics;
+    IdentifierIndex identifiers;
+    StructureFingerprint fingerprint;
+    TokenLint lint;
+    TokenAnalysis *const analyses[] = {&metrics, &identifiers, &fingerprint, &lint};
+    TokenFanout fanout;
+    for (TokenAnalysis *a : analyses) fanout.add(*a);
+    fanout.setThreaded(threaded);
+
+    int status = 0;
+    Lexer lexer;
+    for (const string &filename : files) {
+        string source;
+        if (!readSource(filename, source)) {
+            status = 1;
+            continue;
         }
-    } else {
-        // normal character (could be anything except newline)
-        if (s[i] == '\n') {
-            // newline inside char literal - malformed, but include and bump line
-            ++line;
-            lexeme.push_back(s[i]);
-            ++i;
-        } else {
-            lexeme.push_back(s[i]);
-            ++i;
+        const string shownName = filename == "-" ? "<stdin>" : filename;
+        TK_PROBE2(file_start, filename.c_str(), source.size());
+        {
+            TraceScope span("lex and analyze", "fanout");
+            fanout.run(lexer, source, shownName);
         }
+        cout << shownName << ":\n";
+        for (const TokenAnalysis *a : analyses) a->report(cout);
+        TK_PROBE1(file_end, filename.c_str());
     }
+    return status;
+}
 
-    // Consume closing quote if present
-    if (i < n && s[i] == '\'') {
-        lexeme.push_back(s[i]);
-        ++i;
+// --frames [--nul] [--time] [file]: lex a stream of framed documents (see
+// frames.h) from the file or stdin, and write each one's tokens, tagged
+// with its document ID (0, 1, ... in input order), to stdout. --time
+// reports the per-document cost on stderr.
+static int runFrames(int argc, char **argv) {
+    Framing framing = Framing::Length;
+    bool timed = false;
+    string filename = "-";
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--nul") framing = Framing::Nul;
+        else if (arg == "--time") timed = true;
+        else filename = arg;
+    }
+    int fd = filename == "-" ? 0 : open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: could not open '" << filename << "' for reading.\n";
+        return 1;
     }
 
-    return lexeme;
+    FrameReader reader(fd, framing);
+    FrameWriter writer(1);
+    reader.onRead([&] { writer.flush(); });
+    Lexer lexer; // tokens, diagnostics and arena are reused across documents
+    uint64_t documents = 0;
+    size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+    string_view doc;
+    while (!writer.failed() && reader.next(doc)) {
+        TK_PROBE2(document_start, documents, doc.size());
+        const vector<Token> &tokens = lexer.tokenize(doc);
+        writer.document(documents, tokens, lexer.diagnostics());
+        TK_PROBE1(document_end, documents);
+        ++documents;
+        bytes += doc.size();
+    }
+    writer.flush();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (fd != 0) close(fd);
+
+    if (timed) {
+        cerr << documents << " documents, " << bytes << " bytes in " << fixed << setprecision(3) << seconds * 1e3
+             << " ms (" << setprecision(2) << (documents ? seconds * 1e6 / documents : 0.0) << " us per document)\n";
+    }
+    if (!reader.error().empty()) {
+        cerr << "Error: document " << documents << ": " << reader.error() << "\n";
+        return 1;
+    }
+    return writer.failed() ? 1 : 0;
 }
 
-// Parse string literal starting at i (s[i] == '"')
-static string parseStringLiteral(const string &s, size_t &i, int &line) {
-    string lexeme;
-    size_t n = s.size();
-    lexeme.push_back(s[i]); // opening quote
-    ++i;
-
-    while (i < n) {
-        char c = s[i];
-        lexeme.push_back(c);
-        ++i;
-        if (c == '\\') {
-            // escaped char - include next char without interpretation
-            if (i < n) {
-                lexeme.push_back(s[i]);
-                ++i;
-            }
+// --arrow [--lexemes] [files...]: write the tokens of every file to stdout
+// as an Arrow IPC stream (see arrow.h); --lexemes adds the token text.
+static int runArrow(int argc, char **argv) {
+    vector<string> files(argv + 2, argv + argc);
+    bool lexemes = !files.empty() && files[0] == "--lexemes";
+    if (lexemes) files.erase(files.begin());
+    if (files.empty()) files.push_back("-");
+
+    ArrowTokenWriter writer(1, lexemes, files);
+    int status = 0;
+    for (size_t id = 0; id < files.size(); ++id) {
+        string source;
+        if (!readSource(files[id], source)) {
+            status = 1;
             continue;
         }
-        if (c == '"') break; // end of string
-        if (c == '\n') ++line; // count lines inside string
+        TK_PROBE2(file_start, files[id].c_str(), source.size());
+        if (!writer.add(uint32_t(id), move(source))) {
+            cerr << "Error: '" << files[id] << "': input too large (4 GB or more), or output failed\n";
+            return 1;
+        }
+        for (const LexWarning &d : writer.diagnostics()) cerr << "Warning: " << files[id] << ":" << d.line << ": " << d.message << "\n";
+        TK_PROBE1(file_end, files[id].c_str());
     }
-
-    return lexeme;
+    if (!writer.finish()) {
+        cerr << "Error: could not write the Arrow stream\n";
+        return 1;
+    }
+    return status;
 }
 
-// Parse a number (supports: 123, 12.34, .45, 1e10, 1.2e-3)
-static string parseNumber(const string &s, size_t &i) {
-    string lexeme;
-    size_t n = s.size();
-    bool hasDigits = false;
-
-    // Integer part (optional if starts with .)
-    while (i < n && isdigit(static_cast<unsigned char>(s[i]))) {
-        hasDigits = true;
-        lexeme.push_back(s[i]);
-        ++i;
-    }
-
-    // Fractional part
-    if (i < n && s[i] == '.') {
-        lexeme.push_back('.');
-        ++i;
-        // digits after dot
-        while (i < n && isdigit(static_cast<unsigned char>(s[i]))) {
-            hasDigits = true;
-            lexeme.push_back(s[i]);
-            ++i;
-        }
+// --startup-bench FILE [runs]: time whole runs of this binary printing
+// FILE's token table, from spawn to exit, to see what a tiny input costs.
+// An empty input (/dev/null) is timed too: the part of a run that is
+// process start-up and exit rather than lexing.
+static int runStartupBench(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " --startup-bench FILE [runs]\n";
+        return 1;
     }
+    const char *filename = argv[2];
+    const int runs = argc > 3 ? max(1, atoi(argv[3])) : 200;
+    char self[4096];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+    if (length > 0) self[length] = '\0';
+    else snprintf(self, sizeof self, "%s", argv[0]);
 
-    // Exponent part
-    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
-        size_t save = i;
-        lexeme.push_back(s[i]);
-        ++i;
-        if (i < n && (s[i] == '+' || s[i] == '-')) {
-            lexeme.push_back(s[i]);
-            ++i;
-        }
-        bool expDigits = false;
-        while (i < n && isdigit(static_cast<unsigned char>(s[i]))) {
-            expDigits = true;
-            lexeme.push_back(s[i]);
-            ++i;
-        }
-        if (!expDigits) {
-            // rollback exponent if no digits followed
-            i = save;
-            lexeme.erase(lexeme.size() - 1); // remove the 'e' or 'E'
+    posix_spawn_file_actions_t quiet;
+    posix_spawn_file_actions_init(&quiet);
+    posix_spawn_file_actions_addopen(&quiet, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&quiet, 2, "/dev/null", O_WRONLY, 0);
+    // Microseconds per run, sorted; empty if a run failed.
+    auto time = [&](const char *input) {
+        vector<double> us;
+        char *args[] = {self, const_cast<char *>(input), nullptr};
+        for (int run = 0; run < runs; ++run) {
+            auto start = chrono::steady_clock::now();
+            pid_t pid;
+            int status;
+            if (posix_spawn(&pid, self, &quiet, nullptr, args, environ) != 0 || waitpid(pid, &status, 0) != pid ||
+                !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                return vector<double>{};
+            us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
         }
+        sort(us.begin(), us.end());
+        return us;
+    };
+    vector<double> empty = time("/dev/null"), full = time(filename);
+    posix_spawn_file_actions_destroy(&quiet);
+    if (empty.empty() || full.empty()) {
+        cerr << "Error: a run of '" << self << "' on '" << filename << "' failed\n";
+        return 1;
     }
 
-    // Note: If lexeme is just "." (no digits) then it's not a number.
-    return lexeme;
+    struct stat info;
+    cout << filename << ": " << (stat(filename, &info) == 0 ? int64_t(info.st_size) : int64_t(-1)) << " bytes, " << runs
+         << " runs\n";
+    cout << fixed << setprecision(0);
+    auto row = [&](const char *name, const vector<double> &us) {
+        cout << left << setw(16) << name << right << " min " << setw(6) << us.front() << " us  median " << setw(6)
+             << us[us.size() / 2] << " us  p90 " << setw(6) << us[us.size() * 9 / 10] << " us\n";
+    };
+    row("empty input", empty);
+    row("token table", full);
+    double median = full[full.size() / 2];
+    cout << "median " << (median < 1000 ? "under" : "over") << " the 1 ms target\n";
+    return 0;
 }
 
-// Main tokenize function: returns vector of Token (lexeme/type/line)
-vector<Token> tokenize(const string &code) {
-    vector<Token> tokens;
-    size_t n = code.size();
-    size_t i = 0;
-    int line = 1;
+// The benchmarks below report the fastest of kRounds runs of each pass, in
+// milliseconds.
+static const int kRounds = 5;
+
+template <typename Pass> static double best(Pass &&pass) {
+    double ms = 1e300;
+    for (int round = 0; round < kRounds; ++round) {
+        auto start = chrono::steady_clock::now();
+        pass();
+        ms = min(ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    return ms;
+}
 
-    while (i < n) {
-        char c = code[i];
+// --visit-bench [file]: time the built-in visitor plugins (visitors.h) over
+// the file's tokens: each alone, all three fused into one dispatch, and all
+// three registered at runtime behind virtual calls.
+static int runVisitBench(int argc, char **argv) {
+    string source;
+    if (!readSource(argc > 2 ? argv[2] : "-", source)) return 1;
+    Lexer lexer;
+    const vector<Token> &tokens = lexer.tokenize(source);
+    // Each pass's result is stored through a volatile, so the pass is not
+    // optimized away.
+    volatile size_t sink = 0;
+    auto alone = [&](auto plugin, auto result) {
+        return best([&] {
+            FusedVisitor<decltype(plugin)> v;
+            v.visit(tokens.data(), tokens.size());
+            sink = result(v.template get<decltype(plugin)>());
+        });
+    };
 
-        // Whitespace handling: track line numbers
-        if (isspace(static_cast<unsigned char>(c))) {
-            if (c == '\n') ++line;
-            ++i;
-            continue;
+    double counter = alone(TokenCounter{}, [](const TokenCounter &p) { return p.tokens; });
+    double lines = alone(LineCounter{}, [](const LineCounter &p) { return p.lines; });
+    double histogram = alone(IdentifierHistogram{}, [](const IdentifierHistogram &p) { return p.counts.size(); });
+    FusedVisitor<TokenCounter, LineCounter, IdentifierHistogram> fused;
+    double fusedMs = best([&] {
+        fused = {};
+        fused.visit(tokens.data(), tokens.size());
+    });
+    VirtualPlugin<TokenCounter> vc;
+    VirtualPlugin<LineCounter> vl;
+    VirtualPlugin<IdentifierHistogram> vh;
+    double virtualMs = best([&] {
+        vc = {}, vl = {}, vh = {};
+        DynamicVisitor dynamic;
+        dynamic.add(vc);
+        dynamic.add(vl);
+        dynamic.add(vh);
+        for (const Token &t : tokens) dynamic.visit(t);
+    });
+    if (fused.get<TokenCounter>().tokens != vc.plugin().tokens || fused.get<LineCounter>().lines != vl.plugin().lines ||
+        fused.get<IdentifierHistogram>().counts != vh.plugin().counts) {
+        cerr << "Error: fused and virtual visitors disagree\n";
+        return 1;
+    }
+
+    cout << tokens.size() << " tokens, " << fused.get<LineCounter>().lines << " lines, "
+         << fused.get<IdentifierHistogram>().counts.size() << " distinct identifiers (best of " << kRounds << ")\n";
+    cout << fixed << setprecision(3);
+    auto row = [&](const char *name, double ms) {
+        cout << left << setw(28) << name << right << setw(10) << ms << " ms  " << setprecision(2)
+             << ms / histogram << "x the costliest alone\n" << setprecision(3);
+    };
+    row("token counter alone", counter);
+    row("line counter alone", lines);
+    row("identifier histogram alone", histogram);
+    row("all three, one pass each", counter + lines + histogram);
+    row("all three, fused", fusedMs);
+    row("all three, virtual calls", virtualMs);
+    return 0;
+}
+
+// --reuse-bench [file] [requests]: lex the file as that many requests (by
+// default, enough for about 4 MB of input), with a new Lexer per request
+// and with one Lexer reused, whose buffers and arena carry over.
+static int runReuseBench(int argc, char **argv) {
+    string source;
+    if (!readSource(argc > 2 ? argv[2] : "-", source)) return 1;
+    size_t requests = argc > 3 ? size_t(atoll(argv[3])) : max<size_t>(1, (4 << 20) / max<size_t>(1, source.size()));
+    volatile size_t sink = 0;
+    double freshMs = best([&] {
+        for (size_t i = 0; i < requests; ++i) {
+            Lexer lexer;
+            sink = lexer.tokenize(source).size();
         }
+    });
+    Lexer reused;
+    double reusedMs = best([&] {
+        for (size_t i = 0; i < requests; ++i) sink = reused.tokenize(source).size();
+    });
+
+    cout << requests << " requests of " << source.size() << " bytes, " << reused.tokenize(source).size()
+         << " tokens each (best of " << kRounds << ")\n";
+    cout << fixed << setprecision(3);
+    auto row = [&](const char *name, double ms) {
+        cout << left << setw(28) << name << right << setw(10) << ms * 1000 / requests << " us per request\n";
+    };
+    row("new Lexer per request", freshMs);
+    row("one Lexer reused", reusedMs);
+    return 0;
+}
+
+// --adversarial-bench [MB]: lex generated inputs of about that size (8 MB
+// by default) that once sent the lexer down slow paths, next to ordinary
+// code, and print the throughput of each. Tokens are counted as they are
+// streamed, so the figures are the lexer's alone.
+static int runAdversarialBench(int argc, char **argv) {
+    size_t size = size_t(argc > 2 ? max(1.0, atof(argv[2])) : 8.0) << 20;
+    auto repeat = [&](string_view unit, string_view prefix = "", string_view suffix = "") {
+        string s(prefix);
+        while (s.size() + unit.size() + suffix.size() <= size) s += unit;
+        return s + string(suffix);
+    };
+    const pair<const char *, string> inputs[] = {
+        {"ordinary code", repeat("int f(int a) { while (a >= 10) a -= .5e1; s = \"x\\ty\"; return a * 2; }\n")},
+        {"a+b*c, one line", repeat("a+b*c+")},
+        {"unknown bytes '@'", string(size, '@')},
+        {"run of '.'", string(size, '.')},
+        {"run of '<'", string(size, '<')},
+        {"one string literal", repeat("x", "\"", "\"")},
+        {"escapes in a string", repeat("\\\\", "\"", "\"")},
+        {"unterminated comment", repeat("x", "/*")},
+        {"'ab' repeated", repeat("'ab'ab")},
+    };
+
+    Lexer lexer;
+    cout << left << setw(24) << "input" << right << setw(10) << "MB/s" << setw(12) << "tokens" << setw(12)
+         << "warnings" << setw(12) << "ns/token" << "\n";
+    cout << fixed;
+    for (const auto &[name, source] : inputs) {
+        size_t tokens = 0;
+        auto start = chrono::steady_clock::now();
+        lexer.tokenizeStream(source, [&](Token &&) { ++tokens; });
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << left << setw(24) << name << right << setprecision(1) << setw(10) << source.size() / seconds / 1e6
+             << setw(12) << tokens << setw(12) << lexer.diagnostics().size() << setprecision(2) << setw(12);
+        // A handful of huge tokens has no meaningful cost per token.
+        if (tokens >= 1000) cout << seconds * 1e9 / tokens << "\n";
+        else cout << "-" << "\n";
+    }
+    return 0;
+}
+
+// The layout the flat Ast replaced, kept for --ast-bench: one heap node per
+// tree node, children by pointer.
+struct PointerNode {
+    NodeKind kind;
+    uint32_t token;
+    PointerNode *a = nullptr, *b = nullptr, *c = nullptr, *d = nullptr;
+    vector<PointerNode *> list;
+};
+
+// --ast-bench [file]: parse the file, then time saving the flat Ast, loading
+// it back (checked against the original), mapping the saved file as an
+// AstView, and walking each against the same tree built from heap nodes.
+static int runAstBench(int argc, char **argv) {
+    string source;
+    if (!readSource(argc > 2 ? argv[2] : "-", source)) return 1;
+    Lexer lexer;
+    const vector<Token> &tokens = lexer.tokenize(source);
+
+    Ast ast;
+    double parseMs = best([&] { Parser(tokens, ast).parseProgram(); });
+    string saved;
+    double saveMs = best([&] {
+        ostringstream out;
+        ast.save(out);
+        saved = move(out).str();
+    });
+    Ast loaded;
+    bool ok = true;
+    double loadMs = best([&] { ok = ok && loaded.load(saved.data(), saved.size(), tokens.size()); });
+    if (!ok || loaded.root != ast.root || loaded.nodes.size() != ast.nodes.size() || loaded.lists != ast.lists ||
+        memcmp(loaded.nodes.data(), ast.nodes.data(), ast.nodes.size() * sizeof(AstNode)) != 0) {
+        cerr << "Error: the loaded AST differs from the saved one\n";
+        return 1;
+    }
 
-        // Comments: single-line // or multi-line /* */ - skip entirely
-        if (c == '/' && peekChar(code, i, 1) == '/') {
-            // single-line comment
-            i += 2;
-            while (i < n && code[i] != '\n') ++i;
-            continue; // next loop will consume newline and increment line
+    // The same tree from heap nodes, allocated one by one in tree order.
+    vector<unique_ptr<PointerNode>> heap;
+    heap.reserve(ast.nodes.size());
+    vector<pair<NodeId, PointerNode **>> build{{ast.root, nullptr}};
+    PointerNode *pointerRoot = nullptr;
+    while (!build.empty()) {
+        auto [id, slot] = build.back();
+        build.pop_back();
+        const AstNode &n = ast[id];
+        heap.push_back(make_unique<PointerNode>());
+        PointerNode *p = heap.back().get();
+        p->kind = n.kind;
+        p->token = n.token;
+        *(slot ? slot : &pointerRoot) = p;
+        p->list.resize(n.count);
+        for (uint32_t k = n.count; k-- > 0;) build.push_back({ast.child(n, k), &p->list[k]});
+        for (auto [child, to] : {pair{n.d, &p->d}, {n.c, &p->c}, {n.b, &p->b}, {n.a, &p->a}})
+            if (child != kNoNode) build.push_back({child, to});
+    }
+
+    // Each walk visits every node in tree order with its own stack and
+    // sums what it reads, so both do the same work.
+    volatile uint64_t sink = 0;
+    uint64_t flatSum = 0, pointerSum = 0;
+    vector<NodeId> flatStack;
+    auto walkFlat = [&](const auto &tree) {
+        uint64_t sum = 0;
+        flatStack.assign(1, tree.root);
+        while (!flatStack.empty()) {
+            const AstNode &n = tree[flatStack.back()];
+            flatStack.pop_back();
+            sum += n.token + uint32_t(n.kind);
+            for (uint32_t k = n.count; k-- > 0;) flatStack.push_back(tree.child(n, k));
+            for (NodeId child : {n.d, n.c, n.b, n.a})
+                if (child != kNoNode) flatStack.push_back(child);
         }
+        return sum;
+    };
+    double flatMs = best([&] { sink = flatSum = walkFlat(loaded); });
 
-        if (c == '/' && peekChar(code, i, 1) == '*') {
-            // multi-line comment
-            i += 2;
-            while (i + 1 < n && !(code[i] == '*' && code[i+1] == '/')) {
-                if (code[i] == '\n') ++line;
-                ++i;
-            }
-            if (i + 1 < n) i += 2; // skip closing */
-            continue;
+    // The saved tree mapped from a file and used where it lies.
+    string dir = getenv("TMPDIR") && *getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    string path = dir + "/tk-ast-XXXXXX";
+    int fd = mkstemp(path.data());
+    if (fd < 0 || !writeAll(fd, saved)) {
+        cerr << "Error: could not write a temporary file in " << dir << "\n";
+        if (fd >= 0) close(fd), unlink(path.c_str());
+        return 1;
+    }
+    unlink(path.c_str());
+    AstView view;
+    void *mapped = MAP_FAILED;
+    uint64_t mappedSum = 0;
+    double mapMs = best([&] {
+        if (mapped != MAP_FAILED) munmap(mapped, saved.size());
+        mapped = mmap(nullptr, saved.size(), PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = mapped != MAP_FAILED && view.open(static_cast<const char *>(mapped), saved.size(), tokens.size());
+    });
+    close(fd);
+    if (!ok) {
+        cerr << "Error: the mapped AST failed its checks\n";
+        return 1;
+    }
+    double mappedMs = best([&] { sink = mappedSum = walkFlat(view); });
+    vector<const PointerNode *> pointerStack;
+    double pointerMs = best([&] {
+        uint64_t sum = 0;
+        pointerStack.assign(1, pointerRoot);
+        while (!pointerStack.empty()) {
+            const PointerNode *p = pointerStack.back();
+            pointerStack.pop_back();
+            sum += p->token + uint32_t(p->kind);
+            for (size_t k = p->list.size(); k-- > 0;) pointerStack.push_back(p->list[k]);
+            for (const PointerNode *child : {p->d, p->c, p->b, p->a})
+                if (child) pointerStack.push_back(child);
         }
+        sink = pointerSum = sum;
+    });
+    munmap(mapped, saved.size());
+    if (flatSum != pointerSum || flatSum != mappedSum) {
+        cerr << "Error: the flat and pointer trees differ\n";
+        return 1;
+    }
 
-        // Char literal
-        if (c == '\'') {
-            string lex = parseCharLiteral(code, i, line);
-            tokens.push_back({lex, TokenType::Char, line});
+    size_t pointerBytes = 0;
+    for (const auto &p : heap) pointerBytes += sizeof(PointerNode) + p->list.capacity() * sizeof(PointerNode *);
+    cout << heap.size() << " nodes from " << tokens.size() << " tokens; flat tree " << saved.size()
+         << " bytes saved, pointer tree about " << pointerBytes << " bytes (best of " << kRounds << ")\n";
+    cout << fixed << setprecision(3);
+    auto row = [&](const char *name, double ms) { cout << left << setw(28) << name << right << setw(10) << ms << " ms\n"; };
+    row("parse", parseMs);
+    row("save flat tree", saveMs);
+    row("load flat tree (checked)", loadMs);
+    row("map flat tree (checked)", mapMs);
+    row("walk flat tree", flatMs);
+    row("walk mapped flat tree", mappedMs);
+    row("walk pointer tree", pointerMs);
+    return 0;
+}
+
+// --parse [--fold] [files...]: lex (and optionally constant-fold) and parse
+// each file, report syntax errors on stderr and end-to-end throughput on
+// stdout. --ast prints the tree instead.
+static int runParse(int argc, char **argv, bool dump) {
+    vector<string> files(argv + 2, argv + argc);
+    bool fold = !files.empty() && files[0] == "--fold";
+    if (fold) files.erase(files.begin());
+    if (files.empty()) files.push_back("-");
+
+    int status = 0;
+    size_t bytes = 0, tokenCount = 0, nodes = 0;
+    chrono::steady_clock::duration elapsed{};
+    Lexer lexer; // lexer and AST buffers are reused across files
+    Ast ast;
+    ConstantFolder folder;
+    vector<Token> folded;
+    for (const string &filename : files) {
+        string source;
+        if (!readSource(filename, source)) {
+            status = 1;
             continue;
         }
+        TK_PROBE2(file_start, filename.c_str(), source.size());
+        auto start = chrono::steady_clock::now();
+        const vector<Token> *lexed;
+        {
+            TraceScope span("lex", "lexer");
+            lexed = &lexer.tokenize(source);
+            if (fold) {
+                folder.fold(*lexed, folded, lexer.arena());
+                lexed = &folded;
+            }
+            span.arg("tokens", int64_t(lexed->size()));
+        }
+        const vector<Token> &tokens = *lexed;
+        Parser parser(tokens, ast);
+        NodeId program;
+        {
+            TraceScope span("parse", "parse");
+            program = parser.parseProgram();
+        }
+        elapsed += chrono::steady_clock::now() - start;
 
-        // String literal
-        if (c == '"') {
-            string lex = parseStringLiteral(code, i, line);
-            tokens.push_back({lex, TokenType::String, line});
-            continue;
+        bytes += source.size();
+        tokenCount += tokens.size();
+        nodes += parser.nodeCount();
+        const string shownName = filename == "-" ? "<stdin>" : filename;
+        for (const Diagnostic &d : parser.diagnostics()) {
+            cerr << shownName << ":" << d.line << ": error: " << d.message << "\n";
+            status = 1;
         }
+        if (dump) dumpAst(ast, program, tokens, cout);
+        TK_PROBE1(file_end, filename.c_str());
+    }
 
-        // Identifier or keyword: start with letter or underscore
-        if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
-            string id;
-            while (i < n && (isalnum(static_cast<unsigned char>(code[i])) || code[i] == '_')) {
-                id.push_back(code[i]);
-                ++i;
-            }
-            if (isKeyword(id)) tokens.push_back({id, TokenType::Keyword, line});
-            else tokens.push_back({id, TokenType::Identifier, line});
+    if (!dump) {
+        double seconds = chrono::duration<double>(elapsed).count();
+        cout << files.size() << " file(s), " << bytes << " bytes, " << tokenCount << " tokens, "
+             << nodes << " AST nodes in " << fixed << setprecision(3) << seconds * 1000 << " ms ("
+             << (seconds > 0 ? bytes / seconds / 1e6 : 0.0) << " MB/s)\n";
+    }
+    return status;
+}
+
+// --defuse [files...]: print each file's def-use table.
+static int runDefUse(int argc, char **argv) {
+    vector<string> files(argv + 2, argv + argc);
+    if (files.empty()) files.push_back("-");
+
+    int status = 0;
+    Lexer lexer; // all stages keep their buffers across files
+    Ast ast;
+    Resolver resolver;
+    DefUseTable table;
+    for (const string &filename : files) {
+        string source;
+        if (!readSource(filename, source)) {
+            status = 1;
             continue;
         }
+        TK_PROBE2(file_start, filename.c_str(), source.size());
+        const vector<Token> &tokens = lexer.tokenize(source);
+        Parser parser(tokens, ast);
+        parser.parseProgram();
+        resolver.resolve(ast, tokens, table);
 
-        // Number: starts with digit, or a dot followed by digit
-        if (isdigit(static_cast<unsigned char>(c)) || (c == '.' && isdigit(static_cast<unsigned char>(peekChar(code, i, 1))))) {
-            string num = parseNumber(code, i);
-            if (!num.empty() && (any_of(num.begin(), num.end(), ::isdigit))) {
-                tokens.push_back({num, TokenType::Number, line});
-                continue;
-            }
-            // If parseNumber failed (just a dot), fall through to operator/delimiter handling
+        const string shownName = filename == "-" ? "<stdin>" : filename;
+        for (const Diagnostic &d : parser.diagnostics()) {
+            cerr << shownName << ":" << d.line << ": error: " << d.message << "\n";
+            status = 1;
+        }
+        for (const Diagnostic &d : resolver.diagnostics()) {
+            cerr << shownName << ":" << d.line << ": warning: " << d.message << "\n";
         }
+        cout << shownName << ":\n";
+        printDefUse(table, tokens, cout);
+        TK_PROBE1(file_end, filename.c_str());
+    }
+    return status;
+}
 
-        // Operators: try longest match (3, then 2, then 1)
-        bool matchedOp = false;
-        for (int len = 3; len >= 1; --len) {
-            string s;
-            for (int k = 0; k < len; ++k) {
-                char ch = peekChar(code, i, k);
-                if (ch == '\0') { s.clear(); break; }
-                s.push_back(ch);
-            }
-            if (!s.empty() && isOperatorString(s)) {
-                tokens.push_back({s, TokenType::Operator, line});
-                i += s.size();
-                matchedOp = true;
-                break;
+// ---------- Running programs (--run, --bytecode, --ir, --diff, --bench) ----------
+
+// --run [options] [file]: compile the file and run it. print() output goes
+// to stdout, followed by the final value of every global; the exit status
+// is main()'s return value if there is a main(). Options:
+//   --engine=vm|jit|aot|tree  bytecode VM (default, see vm.h), the VM with
+//                      the native code JIT (jit.h), C compiled ahead of
+//                      time (aot.h) or the tree-walking reference
+//                      evaluator (evaluator.h)
+//   --jit-threshold=N  times a function or loop runs before it is compiled
+//   --max-steps=N      stop after N loop iterations and calls
+//   --opt              run the bytecode through the SSA optimizer (ir.h)
+//   --time             compile and run times on stderr (with --opt, the
+//                      optimizer's per-pass report too)
+//   --jobs=N           threads for parsing, optimizing and writing C
+//                      (default: one per hardware thread; see pipeline.h)
+// --bytecode [file] prints the compiled bytecode instead of running it.
+// --ir [file] prints each function's optimized SSA form and the pass report.
+// --diff [options] [file] runs every engine and compares what they did;
+// --bench [options] [file] times every engine against the tree evaluator,
+// and says after how many runs the AOT engine's C build pays for itself.
+// --scale [file] times the parallel stages of the pipeline at 1 to 64
+// threads and checks that every thread count produces the same output.
+
+static const char *const kEngines[] = {"tree", "vm", "jit", "aot"};
+
+struct RunArgs {
+    string engine = "vm";
+    VmOptions options;
+    bool timed = false;
+    bool optimize = false;
+    AotOptions aot;
+    unsigned jobs = 0;
+    string filename = "-";
+};
+
+static bool parseRunArgs(int argc, char **argv, RunArgs &args) {
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--time") {
+            args.timed = true;
+        } else if (arg == "--opt") {
+            args.optimize = true;
+        } else if (arg.rfind("--engine=", 0) == 0) {
+            args.engine = arg.substr(9);
+            if (find(begin(kEngines), end(kEngines), args.engine) == end(kEngines)) {
+                cerr << "Error: unknown engine '" << args.engine << "'\n";
+                return false;
             }
+        } else if (arg.rfind("--jit-threshold=", 0) == 0) {
+            args.options.jitThreshold = uint32_t(strtoul(arg.c_str() + 16, nullptr, 10));
+        } else if (arg.rfind("--jobs=", 0) == 0) {
+            args.jobs = unsigned(strtoul(arg.c_str() + 7, nullptr, 10));
+        } else if (arg.rfind("--max-steps=", 0) == 0) {
+            args.options.maxSteps = strtoull(arg.c_str() + 12, nullptr, 10);
+        } else {
+            args.filename = arg;
         }
-        if (matchedOp) continue;
+    }
+    return true;
+}
 
-        // Delimiters
-        if (isDelimiter(c)) {
-            tokens.push_back({string(1, c), TokenType::Delimiter, line});
-            ++i;
-            continue;
+// What one engine did with a program, in a form that can be compared.
+struct EngineRun {
+    RunStatus status;
+    Diagnostic error;
+    int64_t exitCode;
+    uint64_t steps;
+    double ms;
+    size_t nativeFunctions = 0, nativeBytes = 0; // jit engine only
+    double buildMs = 0;                          // aot engine only: C generation, compile and load
+    bool cached = false;
+    string fallback{};                           // why aot ran in the VM
+};
+
+static void printGlobals(const Program &program, const vector<Value> &values, const vector<string> &strings,
+                         ostream &out) {
+    string text;
+    for (size_t g = 0; g < program.globals.size(); ++g) {
+        text = program.globals[g].name + " = ";
+        appendValue(text, values[g], program.globals[g].type, strings, true);
+        out << text << "\n";
+    }
+}
+
+static EngineRun runEngine(const string &engine, const Program &program, const Ast &ast,
+                           const vector<Token> &tokens, const RunArgs &args, ostream &out) {
+    const VmOptions &options = args.options;
+    auto start = chrono::steady_clock::now();
+    auto finish = [&](RunStatus status, auto &runner, const vector<string> &strings) {
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (status == RunStatus::Ok) printGlobals(program, runner.globals(), strings, out);
+        return EngineRun{status, runner.error(), runner.exitCode(), runner.steps(), ms};
+    };
+    if (engine == "tree") {
+        TreeEvaluator evaluator(options);
+        RunStatus status = evaluator.run(ast, tokens, out);
+        return finish(status, evaluator, evaluator.strings());
+    }
+    if (engine == "aot") {
+        AotRunner runner(options, args.aot);
+        RunStatus status = runner.run(program, out);
+        EngineRun r = finish(status, runner, program.strings);
+        r.buildMs = runner.module().buildMs();
+        r.ms -= r.buildMs;
+        r.cached = runner.module().cached();
+        r.fallback = runner.fallback();
+        return r;
+    }
+    VmOptions vmOptions = options;
+    vmOptions.jit = engine == "jit";
+    VM vm(vmOptions);
+    RunStatus status = vm.run(program, out);
+    EngineRun r = finish(status, vm, program.strings);
+    if (vm.jit()) {
+        r.nativeFunctions = vm.jit()->compiledFunctions();
+        r.nativeBytes = vm.jit()->codeBytes();
+    }
+    return r;
+}
+
+enum class RunMode { Run, Bytecode, Ir, Diff, Bench };
+
+static int runProgram(int argc, char **argv, RunMode mode) {
+    RunArgs args;
+    if (!parseRunArgs(argc, argv, args)) return 1;
+    const string shownName = args.filename == "-" ? "<stdin>" : args.filename;
+
+    string source;
+    if (!readSource(args.filename, source)) return 1;
+    auto start = chrono::steady_clock::now();
+    WorkStealingPool pool(args.jobs);
+    args.aot.pool = &pool;
+    Lexer lexer;
+    const vector<Token> *lexed;
+    {
+        TraceScope span("lex", "lexer");
+        lexed = &lexer.tokenize(source);
+    }
+    const vector<Token> &tokens = *lexed;
+    Ast ast;
+    vector<Diagnostic> diagnostics;
+    {
+        TraceScope span("parse", "parse");
+        parseParallel(tokens, ast, pool, diagnostics);
+    }
+    bool failed = false;
+    for (const Diagnostic &d : diagnostics) {
+        cerr << shownName << ":" << d.line << ": error: " << d.message << "\n";
+        failed = true;
+    }
+    Program program;
+    Compiler compiler;
+    if (!failed) {
+        TraceScope span("compile to bytecode", "compile");
+        if (!compiler.compile(ast, tokens, program)) {
+            for (const Diagnostic &d : compiler.diagnostics()) cerr << shownName << ":" << d.line << ": error: " << d.message << "\n";
+            failed = true;
+        }
+    }
+    if (failed) return 1;
+    if (args.optimize || mode == RunMode::Ir) {
+        IrOptimizer optimizer;
+        Program optimized;
+        {
+            TraceScope span("optimize", "ir");
+            optimizer.optimize(program, optimized, mode == RunMode::Ir ? &cout : nullptr, &pool);
+        }
+        if (mode == RunMode::Ir) {
+            optimizer.report(program, optimized, cout);
+            return 0;
+        }
+        if (args.timed) optimizer.report(program, optimized, cerr);
+        program = move(optimized);
+    }
+    double compileMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    if (mode == RunMode::Bytecode) {
+        dumpBytecode(program, cout);
+        return 0;
+    }
+    if (mode == RunMode::Run) {
+        EngineRun r = runEngine(args.engine, program, ast, tokens, args, cout);
+        if (r.status != RunStatus::Ok) {
+            cout.flush();
+            cerr << shownName << ":" << r.error.line << ": runtime error: " << r.error.message << "\n";
+            return 1;
         }
+        if (args.timed) {
+            cerr << fixed << setprecision(3) << "compile " << compileMs << " ms, run " << r.ms << " ms, "
+                 << r.steps << " steps";
+            if (args.engine == "jit") cerr << ", " << r.nativeFunctions << " functions compiled (" << r.nativeBytes << " bytes)";
+            if (args.engine == "aot" && r.fallback.empty())
+                cerr << ", C build " << r.buildMs << " ms" << (r.cached ? " (cached)" : "");
+            else if (args.engine == "aot")
+                cerr << ", ran in the VM (" << r.fallback << ")";
+            cerr << "\n";
+        }
+        return static_cast<int>(r.exitCode);
+    }
 
-        // Unknown single character (capture and move on)
-        tokens.push_back({string(1, c), TokenType::Unknown, line});
-        ++i;
+    // --diff / --bench: every engine, with output captured. The tree
+    // evaluator runs first and is the reference. --bench always builds the
+    // AOT module afresh, so its cost is measured.
+    if (mode == RunMode::Bench) args.aot.useCache = false;
+    vector<EngineRun> runs;
+    vector<string> outputs;
+    for (const char *engine : kEngines) {
+        ostringstream out;
+        runs.push_back(runEngine(engine, program, ast, tokens, args, out));
+        outputs.push_back(out.str());
+    }
+    int status = 0;
+    for (size_t e = 1; e < runs.size(); ++e) {
+        const EngineRun &ref = runs[0], &r = runs[e];
+        string problem;
+        if (r.status != ref.status || r.error.line != ref.error.line || r.error.message != ref.error.message) {
+            problem = "stopped differently (line " + to_string(r.error.line) + ": " + r.error.message +
+                      " vs line " + to_string(ref.error.line) + ": " + ref.error.message + ")";
+        } else if (outputs[e] != outputs[0]) {
+            size_t at = mismatch(outputs[0].begin(), outputs[0].end(), outputs[e].begin(), outputs[e].end()).first -
+                        outputs[0].begin();
+            size_t line = count(outputs[0].begin(), outputs[0].begin() + at, '\n') + 1;
+            problem = "output differs at line " + to_string(line);
+        } else if (r.exitCode != ref.exitCode) {
+            problem = "exit codes differ (" + to_string(r.exitCode) + " vs " + to_string(ref.exitCode) + ")";
+        } else if (r.steps != ref.steps) {
+            problem = "step counts differ (" + to_string(r.steps) + " vs " + to_string(ref.steps) + ")";
+        }
+        if (!problem.empty()) {
+            cerr << shownName << ": " << kEngines[e] << " disagrees with " << kEngines[0] << ": " << problem << "\n";
+            status = 1;
+        }
+    }
+    if (mode == RunMode::Diff) {
+        if (status == 0) cout << shownName << ": " << runs.size() << " engines agree (" << runs[0].steps << " steps)\n";
+        return status;
     }
+    cout << fixed << setprecision(3);
+    for (size_t e = 0; e < runs.size(); ++e) {
+        cout << left << setw(6) << kEngines[e] << right << setw(12) << runs[e].ms << " ms";
+        if (e > 0 && runs[e].ms > 0) cout << "  " << setprecision(1) << runs[0].ms / runs[e].ms << "x" << setprecision(3);
+        if (!runs[e].fallback.empty()) cout << "  (ran in the VM: " << runs[e].fallback << ")";
+        cout << "\n";
+    }
+    // The C build is paid once per program; each run then saves the
+    // difference to the interpreter.
+    const EngineRun &vm = runs[1], &aot = runs[3];
+    if (aot.fallback.empty()) {
+        cout << "aot C build " << aot.buildMs << " ms: ";
+        double saved = vm.ms - aot.ms;
+        if (saved > 0) cout << "pays off after " << uint64_t(ceil(aot.buildMs / saved)) << " run(s) against vm\n";
+        else cout << "no faster than vm on this program\n";
+    }
+    return status;
+}
 
-    return tokens;
+// ---------- Pipeline scaling (--scale) ----------
+
+// Run parse, compile, optimize and C generation at 1, 2, 4 ... 64 threads
+// (best of three each) and print per-stage times and the speedup over one
+// thread. Compiling to bytecode stays serial: it fills the program-wide
+// symbol tables. The AST, optimized bytecode and C source must be the same
+// at every thread count.
+static int runScale(int argc, char **argv) {
+    string filename = argc > 2 ? argv[2] : "-";
+    const string shownName = filename == "-" ? "<stdin>" : filename;
+    string source;
+    if (!readSource(filename, source)) return 1;
+    Lexer lexer;
+    const vector<Token> &tokens = lexer.tokenize(source);
+
+    struct Stage {
+        const char *name;
+        double ms;
+    };
+    string reference[3];
+    double baseline = 0;
+    cout << "threads" << fixed << setprecision(3);
+    for (const char *name : {"parse", "compile", "optimize", "emit C", "total"}) cout << right << setw(12) << name;
+    cout << "  speedup\n";
+    for (unsigned threads = 1; threads <= 64; threads *= 2) {
+        WorkStealingPool pool(threads);
+        Stage stages[4] = {{"parse", 1e300}, {"compile", 1e300}, {"optimize", 1e300}, {"emit C", 1e300}};
+        string results[3];
+        for (int round = 0; round < 3; ++round) {
+            auto time = [&](Stage &stage, auto &&work) {
+                auto start = chrono::steady_clock::now();
+                work();
+                stage.ms = min(stage.ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            };
+            Ast ast;
+            vector<Diagnostic> diagnostics;
+            time(stages[0], [&] { parseParallel(tokens, ast, pool, diagnostics); });
+            Program program, optimized;
+            Compiler compiler;
+            bool compiled = false;
+            time(stages[1], [&] { compiled = diagnostics.empty() && compiler.compile(ast, tokens, program); });
+            if (!compiled) {
+                for (const Diagnostic &d : diagnostics.empty() ? compiler.diagnostics() : diagnostics)
+                    cerr << shownName << ":" << d.line << ": error: " << d.message << "\n";
+                return 1;
+            }
+            IrOptimizer optimizer;
+            time(stages[2], [&] { optimizer.optimize(program, optimized, nullptr, &pool); });
+            time(stages[3], [&] { results[2] = emitC(optimized, &pool); });
+            ostringstream astText, code;
+            dumpAst(ast, ast.root, tokens, astText);
+            dumpBytecode(optimized, code);
+            results[0] = astText.str();
+            results[1] = code.str();
+        }
+        if (threads == 1) copy(begin(results), end(results), begin(reference));
+        for (int k = 0; k < 3; ++k) {
+            if (results[k] != reference[k]) {
+                static const char *const what[] = {"AST", "optimized bytecode", "C source"};
+                cout.flush();
+                cerr << shownName << ": " << what[k] << " differs at " << threads << " threads\n";
+                return 1;
+            }
+        }
+        double total = 0;
+        cout << right << setw(7) << threads;
+        for (const Stage &stage : stages) {
+            cout << setw(12) << stage.ms;
+            total += stage.ms;
+        }
+        if (threads == 1) baseline = total;
+        cout << setw(12) << total << "  " << setprecision(2) << baseline / total << "x\n" << setprecision(3);
+    }
+    cout << "output identical at every thread count (" << thread::hardware_concurrency() << " hardware threads)\n";
+    return 0;
 }
 
 // ---------- Main: read file, tokenize, and print results ----------
@@ -313,48 +1006,128 @@ int main(int argc, char **argv) {
     // - If a filename is provided as first argument, read that file.
     // - If no arguments are provided, read source from stdin (so you can pipe or paste code directly).
 
-    string source;
-    if (argc > 1) {
-        string filename = argv[1];
-        if (filename == "-") {
-            // Read from stdin
-            stringstream buffer;
-            buffer << cin.rdbuf();
-            source = buffer.str();
-        } else {
-            ifstream in(filename);
-            if (!in) {
-                cerr << "Error: could not open '" << filename << "' for reading.\n";
-                return 1;
-            }
-            stringstream buffer;
-            buffer << in.rdbuf();
-            source = buffer.str();
-        }
-    } else {
-        // No filename -> read from stdin (useful for piping or here-strings)
-        stringstream buffer;
-        buffer << cin.rdbuf();
-        source = buffer.str();
+    // - `--match PATTERN [files...]` searches for a token sequence instead (see above).
+    // - `--parse [files...]` / `--ast [files...]` run the parser (see above).
+    // - `--defuse [files...]` prints declarations and their uses.
+    // - `--analyze [--threads] [files...]` runs the token analyses in one lexing pass.
+    // - `--frames [--nul] [--time] [file]` lexes a stream of framed documents.
+    // - `--arrow [--lexemes] [files...]` writes the tokens as an Arrow IPC stream.
+    // - `--visit-bench [file]` times fused visitor plugins against virtual ones.
+    // - `--ast-bench [file]` times saving, loading and walking the flat AST.
+    // - `--reuse-bench [file] [requests]` times a new Lexer per request against a reused one.
+    // - `--adversarial-bench [MB]` times the lexer on generated worst-case inputs.
+    // - `--startup-bench FILE [runs]` times whole runs of the token table on FILE.
+    // - `--run`, `--bytecode`, `--ir`, `--diff`, `--bench` compile and run the program.
+    // - `--scale [file]` times the parallel compile pipeline at 1 to 64 threads.
+
+    // TK_TRACE=FILE records a timeline of the run into FILE (see trace.h).
+    if (const char *trace = getenv("TK_TRACE"); trace && *trace) {
+        Trace::start(trace);
+        Trace::threadName("main");
     }
 
-    // Tokenize
-    auto tokens = tokenize(source);
+    if (argc > 1 && string(argv[1]) == "--match") return runMatch(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--parse") return runParse(argc, argv, false);
+    if (argc > 1 && string(argv[1]) == "--ast") return runParse(argc, argv, true);
+    if (argc > 1 && string(argv[1]) == "--defuse") return runDefUse(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--analyze") return runAnalyze(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--frames") return runFrames(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--arrow") return runArrow(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--visit-bench") return runVisitBench(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--ast-bench") return runAstBench(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--reuse-bench") return runReuseBench(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--adversarial-bench") return runAdversarialBench(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--startup-bench") return runStartupBench(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--run") return runProgram(argc, argv, RunMode::Run);
+    if (argc > 1 && string(argv[1]) == "--bytecode") return runProgram(argc, argv, RunMode::Bytecode);
+    if (argc > 1 && string(argv[1]) == "--ir") return runProgram(argc, argv, RunMode::Ir);
+    if (argc > 1 && string(argv[1]) == "--diff") return runProgram(argc, argv, RunMode::Diff);
+    if (argc > 1 && string(argv[1]) == "--bench") return runProgram(argc, argv, RunMode::Bench);
+    if (argc > 1 && string(argv[1]) == "--scale") return runScale(argc, argv);
+
+    // `--fold [file]` prints the table after constant folding (see folder.h).
+    bool fold = argc > 1 && string(argv[1]) == "--fold";
+    if (fold) {
+        --argc;
+        ++argv;
+    }
+
+    string source;
+    // No filename -> read from stdin (useful for piping or here-strings)
+    const char *filename = argc > 1 ? argv[1] : "-";
+    if (!readSource(filename, source)) return 1;
+    TK_PROBE2(file_start, filename, source.size());
+
+    // Tokenize. The table is printed from packed tokens (8 bytes each,
+    // lines looked up from a newline index); --fold needs full Tokens.
+    Lexer lexer;
+    PackedTokens packed;
+    vector<Token> folded;
+    if (fold) {
+        ConstantFolder().fold(lexer.tokenize(source), folded, lexer.arena());
+    } else if (!lexer.tokenizePacked(source, packed)) {
+        cerr << "Error: input too large (4 GB or more)\n";
+        return 1;
+    }
+    // The table is formatted by hand into one buffer and written with
+    // write(2): for a small input, stream formatting and its locale lookups
+    // would cost more than the lexing.
+    string text;
+    for (const LexWarning &d : lexer.diagnostics()) {
+        text += "Warning: line ";
+        text += to_string(d.line);
+        text += ": ";
+        text += d.message;
+        text += '\n';
+    }
+    // A failed write (e.g. a closed pipe) stops the table and exits with 1.
+    bool written = writeAll(2, text);
+    text.clear();
 
     // Print the required check lines
-    cout << "\u2714 Tokens found\n";       // ✔
-    cout << "\u2714 Type of token\n\n"; // ✔
+    text += "\u2714 Tokens found\n";     // ✔
+    text += "\u2714 Type of token\n\n"; // ✔
 
-    // Print table header: Token | Type | Line
-    const int tokWidth = 30;
-    const int typeWidth = 15;
-    const int lineWidth = 6;
-    cout << left << setw(tokWidth) << "Token" << " | " << left << setw(typeWidth) << "Type" << " | " << left << setw(lineWidth) << "Line" << "\n";
-    cout << string(tokWidth, '-') << "-|" << string(typeWidth, '-') << "-|" << string(lineWidth, '-') << "\n";
+    // Table columns: Token | Type | Line, each left-aligned and padded to
+    // its width (longer values are not cut).
+    const size_t tokWidth = 30;
+    const size_t typeWidth = 15;
+    const size_t lineWidth = 6;
+    auto cell = [&](string_view value, size_t width) {
+        text += value;
+        if (value.size() < width) text.append(width - value.size(), ' ');
+    };
+    auto row = [&](string_view lexeme, string_view type, string_view line) {
+        cell(lexeme, tokWidth);
+        text += " | ";
+        cell(type, typeWidth);
+        text += " | ";
+        cell(line, lineWidth);
+        text += '\n';
+        if (text.size() >= 64 * 1024) {
+            written = written && writeAll(1, text);
+            text.clear();
+        }
+    };
+    row("Token", "Type", "Line");
+    text.append(tokWidth, '-') += "-|";
+    text.append(typeWidth, '-') += "-|";
+    text.append(lineWidth, '-') += '\n';
 
-    for (auto &t : tokens) {
-        cout << left << setw(tokWidth) << t.lexeme << " | " << left << setw(typeWidth) << tokenTypeToString(t.type) << " | " << left << setw(lineWidth) << t.line << "\n";
+    auto tokenRow = [&](string_view lexeme, TokenType type, int line) {
+        char digits[16];
+        row(lexeme, tokenTypeToString(type), string_view(digits, size_t(to_chars(digits, digits + sizeof digits, line).ptr - digits)));
+    };
+    if (fold) {
+        for (size_t i = 0; written && i < folded.size(); ++i) tokenRow(folded[i].lexeme, folded[i].type, folded[i].line);
+    } else {
+        for (size_t i = 0; written && i < packed.size(); ++i) tokenRow(packed.lexeme(i), packed.type(i), packed.line(i));
+    }
+    if (!written || !writeAll(1, text)) {
+        cerr << "Error: could not write the token table\n";
+        return 1;
     }
+    TK_PROBE1(file_end, filename);
 
     return 0;
 }
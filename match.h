@@ -0,0 +1,281 @@
+// match.h
+// Token pattern search for --match. A pattern is a whitespace-separated
+// sequence of elements:
+//   Identifier, Number, ...   any token of that TokenType
+//   _                         any single token
+//   ( while "quoted"          a token whose lexeme is exactly this text
+// A type, `_` or quoted element may carry a suffix * + or ? for repetition,
+// e.g. `Identifier ( _* )`. Bare operator text such as `*` is a literal.
+// The pattern is compiled into a small Thompson NFA over tokens, which
+// TokenMatcher runs in one pass over the token stream.
+
+#pragma once
+
+#include "lexer.h"
+
+struct PatternAtom {
+    enum Kind { Any, OfType, Literal } kind;
+    TokenType type;
+    string lexeme;
+    TokenKind token = TokenKind::Unknown; // a keyword, operator or delimiter literal is matched by kind
+
+    bool matches(const Token &t) const {
+        switch (kind) {
+            case Any: return true;
+            case OfType: return t.type == type;
+            default: return token != TokenKind::Unknown ? t.kind == token : t.lexeme == lexeme;
+        }
+    }
+};
+
+struct NfaState {
+    enum Op { Atom, Split, Accept } op;
+    PatternAtom atom;
+    int out = -1;  // next state (Atom) or first branch (Split)
+    int out1 = -1; // second branch (Split)
+};
+
+struct TokenPattern {
+    vector<NfaState> states;
+    int start = -1;
+    // Lexemes every match must contain: used to skip files before lexing them.
+    vector<string> requiredLiterals;
+};
+
+inline bool parseTokenType(const string &s, TokenType &out) {
+    static const TokenType all[] = {
+        TokenType::Keyword, TokenType::Identifier, TokenType::Number, TokenType::Operator,
+        TokenType::Delimiter, TokenType::String, TokenType::Char, TokenType::Unknown
+    };
+    for (TokenType t : all) {
+        if (tokenTypeToString(t) == s) { out = t; return true; }
+    }
+    return false;
+}
+
+// Parse one element without its quantifier. Returns false if `w` is only
+// usable as a bare literal (so a trailing * + ? belongs to the lexeme).
+inline bool parsePatternElement(const string &w, PatternAtom &atom) {
+    TokenType type;
+    if (w == "_") {
+        atom = {PatternAtom::Any, TokenType::Unknown, ""};
+        return true;
+    }
+    if (parseTokenType(w, type)) {
+        atom = {PatternAtom::OfType, type, ""};
+        return true;
+    }
+    if (w.size() > 2 && (w[0] == '\'' || w[0] == '"') && w.back() == w[0]) {
+        atom = {PatternAtom::Literal, TokenType::Unknown, w.substr(1, w.size() - 2)};
+        return true;
+    }
+    return false;
+}
+
+// Compile a pattern string. On failure returns false and sets `error`.
+inline bool compilePattern(const string &text, TokenPattern &pattern, string &error) {
+    vector<pair<PatternAtom, char>> elems; // atom + quantifier ('\0' if none)
+    istringstream words(text);
+    string w;
+    while (words >> w) {
+        PatternAtom atom;
+        char quant = '\0';
+        char last = w.back();
+        if (w.size() > 1 && (last == '*' || last == '+' || last == '?') &&
+            parsePatternElement(w.substr(0, w.size() - 1), atom)) {
+            quant = last;
+        } else if (!parsePatternElement(w, atom)) {
+            atom = {PatternAtom::Literal, TokenType::Unknown, w};
+        }
+        for (uint16_t k = 0; atom.kind == PatternAtom::Literal && k < uint16_t(TokenKind::Count); ++k) {
+            if (*tokenKindText(TokenKind(k)) && atom.lexeme == tokenKindText(TokenKind(k))) atom.token = TokenKind(k);
+        }
+        elems.push_back({atom, quant});
+    }
+    if (elems.empty()) {
+        error = "empty pattern";
+        return false;
+    }
+
+    // Build the NFA back to front so every state knows its successor.
+    auto &st = pattern.states;
+    st.clear();
+    pattern.requiredLiterals.clear();
+    st.push_back({NfaState::Accept, {}, -1, -1});
+    int next = 0;
+    for (size_t k = elems.size(); k-- > 0;) {
+        const PatternAtom &atom = elems[k].first;
+        int a = (int)st.size();
+        st.push_back({NfaState::Atom, atom, next, -1});
+        switch (elems[k].second) {
+            case '?':
+                st.push_back({NfaState::Split, {}, a, next});
+                next = (int)st.size() - 1;
+                break;
+            case '*':
+                st.push_back({NfaState::Split, {}, a, next});
+                st[a].out = (int)st.size() - 1;
+                next = (int)st.size() - 1;
+                break;
+            case '+':
+                st.push_back({NfaState::Split, {}, a, next});
+                st[a].out = (int)st.size() - 1;
+                next = a;
+                break;
+            default:
+                next = a;
+                break;
+        }
+        if (atom.kind == PatternAtom::Literal && elems[k].second != '?' && elems[k].second != '*')
+            pattern.requiredLiterals.push_back(atom.lexeme);
+    }
+    pattern.start = next;
+    return true;
+}
+
+// Cheap byte-level prefilter: a lexeme is always a substring of the source,
+// so a file lacking any required literal cannot match and is never lexed.
+inline bool mayMatch(const TokenPattern &pattern, string_view source) {
+    for (const string &lit : pattern.requiredLiterals) {
+        if (source.find(lit) == string_view::npos) return false;
+    }
+    return true;
+}
+
+// Runs a compiled pattern over tokens as they are pushed in, as a Pike VM:
+// one thread per live NFA state, each remembering the token index its
+// attempt started at. Every token advances all threads at once and starts
+// a new one, so each token is looked at once, whatever the pattern.
+//
+// Matches are leftmost-shortest and do not overlap: a match is reported as
+// soon as a thread accepts and no thread that started earlier is still
+// alive, and the attempts it overlaps are dropped. Repetition is therefore
+// lazy: `Identifier ( _* )` stops at the first `)`. When two threads reach
+// the same state the earlier start wins, since both have the same future.
+//
+// Tokens are buffered from the oldest live start on. A match spans at most
+// kMaxMatchTokens tokens; older attempts are given up (with any later one
+// that had merged into them), which bounds the buffer when something like
+// `( _* )` never finds its `)`.
+class TokenMatcher {
+public:
+    static constexpr size_t kMaxMatchTokens = 4096;
+
+    using MatchFn = function<void(const vector<Token> &)>;
+
+    TokenMatcher(const TokenPattern &pattern, MatchFn onMatch)
+        : pattern_(pattern), onMatch_(move(onMatch)), mark_(pattern.states.size(), 0) {
+        ++gen_;
+        addClosure(pattern_.start);
+        startStates_ = closure_;
+    }
+
+    void push(const Token &t) {
+        size_t index = base_ + window_.size();
+        window_.push_back(t);
+        // Attempts too long to ever be reported are given up.
+        if (index + 1 > kMaxMatchTokens) {
+            size_t oldest = index + 1 - kMaxMatchTokens;
+            threads_.erase(remove_if(threads_.begin(), threads_.end(), [&](const Thread &th) { return th.start < oldest; }),
+                           threads_.end());
+        }
+
+        // Step every thread over `t`, oldest start first, then the attempt
+        // starting at `t`, so next_ stays ordered by start.
+        ++gen_;
+        next_.clear();
+        for (const Thread &th : threads_) {
+            const NfaState &state = pattern_.states[th.state];
+            if (state.atom.matches(t)) add(state.out, th.start, index + 1);
+        }
+        for (int s : startStates_) {
+            const NfaState &state = pattern_.states[s];
+            if (state.op == NfaState::Atom && state.atom.matches(t)) add(state.out, index, index + 1);
+        }
+        swap(threads_, next_);
+
+        if (found_ && (threads_.empty() || threads_.front().start > match_.start)) report();
+        trim();
+    }
+
+    // End of input: no live attempt can finish any more.
+    void finish() {
+        if (found_) report();
+        threads_.clear();
+        window_.clear();
+    }
+
+private:
+    struct Thread {
+        int state;     // an Atom state waiting for its token
+        size_t start;  // index of the attempt's first token
+    };
+    struct Span {
+        size_t start, end; // token indices, end exclusive
+    };
+
+    const TokenPattern &pattern_;
+    MatchFn onMatch_;
+    deque<Token> window_;     // tokens from index base_ on
+    size_t base_ = 0;
+    vector<Thread> threads_, next_;
+    vector<int> closure_, startStates_; // startStates_: the closure of the start state
+    vector<unsigned> mark_;   // per-state generation, avoids duplicates in a step
+    unsigned gen_ = 0;
+    bool found_ = false;
+    Span match_{0, 0};        // the leftmost accepted attempt not yet reported
+
+    // Follow Split states from `s`, collecting the Atom and Accept states.
+    void addClosure(int s) {
+        if (mark_[s] == gen_) return;
+        mark_[s] = gen_;
+        const NfaState &state = pattern_.states[s];
+        if (state.op == NfaState::Split) {
+            addClosure(state.out);
+            addClosure(state.out1);
+        } else {
+            closure_.push_back(s);
+        }
+    }
+
+    // Add the closure of `s` to next_ for an attempt over [start, end).
+    void add(int s, size_t start, size_t end) {
+        if (found_ && start >= match_.start) return;
+        closure_.clear();
+        addClosure(s);
+        for (int c : closure_) {
+            if (pattern_.states[c].op == NfaState::Atom) {
+                next_.push_back({c, start});
+            } else if (!found_ || start < match_.start) {
+                // The shortest match for this start; it overlaps every
+                // attempt that started after it.
+                found_ = true;
+                match_ = {start, end};
+            }
+        }
+        if (found_) {
+            next_.erase(remove_if(next_.begin(), next_.end(), [&](const Thread &th) { return th.start >= match_.start; }),
+                        next_.end());
+        }
+    }
+
+    void report() {
+        vector<Token> tokens(window_.begin() + (match_.start - base_), window_.begin() + (match_.end - base_));
+        onMatch_(tokens);
+        found_ = false;
+        // Attempts may not overlap the match.
+        threads_.erase(remove_if(threads_.begin(), threads_.end(), [&](const Thread &th) { return th.start < match_.end; }),
+                       threads_.end());
+    }
+
+    // Drop the tokens no live attempt or pending match can use.
+    void trim() {
+        size_t keep = base_ + window_.size();
+        if (!threads_.empty()) keep = min(keep, threads_.front().start);
+        if (found_) keep = min(keep, match_.start);
+        while (base_ < keep) {
+            window_.pop_front();
+            ++base_;
+        }
+    }
+};
@@ -0,0 +1,504 @@
+// parser.h
+// Recursive-descent parser for the C-like subset. It reads the Lexer's token
+// vector directly (lexemes stay views into the source, nothing is copied)
+// and fills a flat Ast (see ast.h).
+// Expressions use Pratt-style precedence climbing: operator chains are
+// parsed in a loop, and the remaining recursion (parentheses, right
+// associative assignment, nested statements) is capped by kMaxDepth.
+// Loops still build deep trees (`y+y+...` is a left-deep chain), and every
+// later pass walks the tree recursively, so the height of the tree is
+// capped too, at kMaxTreeDepth (ast.h): past it the parse stops with an
+// error.
+
+#pragma once
+
+#include "ast.h"
+
+// Binding power of a binary operator, 0 if `op` is not one:
+//   1 assignment (right-associative)  2 ||  3 &&  4 |  5 ^  6 &
+//   7 == !=  8 < > <= >=  9 << >>  10 + -  11 * / %
+constexpr int kAssignPrecedence = 1;
+
+inline int binaryPrecedence(TokenKind op) {
+    using K = TokenKind;
+    switch (op) {
+        case K::OpAssign: case K::OpAddAssign: case K::OpSubAssign: case K::OpMulAssign: case K::OpDivAssign:
+        case K::OpModAssign: case K::OpShlAssign: case K::OpShrAssign:
+            return 1;
+        case K::OpOrOr: return 2;
+        case K::OpAndAnd: return 3;
+        case K::OpOr: return 4;
+        case K::OpXor: return 5;
+        case K::OpAnd: return 6;
+        case K::OpEq: case K::OpNe: return 7;
+        case K::OpLt: case K::OpGt: case K::OpLe: case K::OpGe: return 8;
+        case K::OpShl: case K::OpShr: return 9;
+        case K::OpAdd: case K::OpSub: return 10;
+        case K::OpMul: case K::OpDiv: case K::OpMod: return 11;
+        default: return 0;
+    }
+}
+
+inline bool isTypeKeyword(TokenKind k) { return k <= TokenKind::KwVoid; }
+
+// ---------- Parser ----------
+
+class Parser {
+    using K = TokenKind;
+
+public:
+    static constexpr int kMaxDepth = 256;
+
+    // `tokens` must outlive `ast`, whose nodes refer to them by index. The
+    // Ast is cleared first, so one Ast can be reused across files.
+    Parser(const vector<Token> &tokens, Ast &ast) : tokens_(tokens), ast_(ast), end_(tokens.size()) {
+        ast_.clear();
+    }
+
+    NodeId parseProgram() { return parseProgram(0, tokens_.size()); }
+
+    // Parse only tokens [begin, end) as if they were the whole file; node
+    // token indices stay relative to the full buffer. pipeline.h parses
+    // top-level functions in parallel this way.
+    NodeId parseProgram(size_t begin, size_t end) {
+        pos_ = begin;
+        end_ = min(end, tokens_.size());
+        ast_.nodes.reserve(ast_.nodes.size() + (end_ - pos_) / 2 + 1); // typical code has ~0.6 nodes per token
+        size_t mark = scratch_.size();
+        while (!atEnd()) {
+            size_t before = pos_;
+            if (NodeId d = parseTopLevel()) scratch_.push_back(d);
+            if (pos_ == before) ++pos_; // always make progress
+        }
+        NodeId program = makeNode(NodeKind::Program, 0);
+        takeList(program, mark);
+        ast_.root = program;
+        return program;
+    }
+
+    const vector<Diagnostic> &diagnostics() const { return diagnostics_; }
+    size_t nodeCount() const { return ast_.nodes.size() - 1; }
+
+private:
+    const vector<Token> &tokens_;
+    Ast &ast_;
+    size_t end_;
+    size_t pos_ = 0;
+    int depth_ = 0;
+    bool aborted_ = false;
+    vector<NodeId> scratch_; // pending list elements, shared by nested lists
+    vector<uint32_t> height_; // levels in each node's subtree, by NodeId (0: kNoNode)
+    vector<Diagnostic> diagnostics_;
+
+    // ----- token access -----
+
+    bool atEnd() const { return pos_ >= end_; }
+
+    const Token &peek(size_t k = 0) const {
+        static const Token eof{"", TokenType::Unknown, 0};
+        return pos_ + k < end_ ? tokens_[pos_ + k] : eof;
+    }
+
+    bool check(TokenKind kind, size_t k = 0) const {
+        return pos_ + k < end_ && tokens_[pos_ + k].kind == kind;
+    }
+
+    bool accept(TokenKind kind) {
+        if (!check(kind)) return false;
+        ++pos_;
+        return true;
+    }
+
+    bool expect(TokenKind kind) {
+        if (accept(kind)) return true;
+        error(string("expected '") + tokenKindText(kind) + "'");
+        return false;
+    }
+
+    void error(const string &message) {
+        if (aborted_) return;
+        int line = atEnd() ? (end_ == 0 ? 1 : tokens_[end_ - 1].line) : peek().line;
+        string found = atEnd() ? "end of input" : "'" + string(peek().lexeme) + "'";
+        diagnostics_.push_back({line, message + ", found " + found});
+    }
+
+    // Skip to just after the next ';' (or up to a '}') after an error.
+    void synchronize() {
+        while (!atEnd() && !check(K::DelimRBrace)) {
+            if (accept(K::DelimSemicolon)) return;
+            ++pos_;
+        }
+    }
+
+    // ----- node construction -----
+
+    // Nodes are appended to ast_.nodes, so a reference from at() is only
+    // valid until the next makeNode(): children are always parsed into a
+    // local NodeId before being stored.
+    NodeId makeNode(NodeKind kind, size_t token, NodeId a = kNoNode, NodeId b = kNoNode) {
+        ast_.nodes.push_back(AstNode{kind, static_cast<uint32_t>(token), 0, a, b, kNoNode, kNoNode, 0, 0});
+        NodeId id = static_cast<NodeId>(ast_.nodes.size() - 1);
+        height_.resize(ast_.nodes.size(), 0);
+        height_[id] = 1;
+        raise(id, a);
+        raise(id, b);
+        return id;
+    }
+
+    AstNode &at(NodeId id) { return ast_.nodes[id]; }
+
+    // Set a child slot after the node was made, e.g. link(n, &AstNode::c, e).
+    void link(NodeId n, NodeId AstNode::*slot, NodeId child) {
+        at(n).*slot = child;
+        raise(n, child);
+    }
+
+    // Account for `child` in the height of `n`. Past kMaxTreeDepth the rest
+    // of the input is abandoned with one error, as for kMaxDepth.
+    void raise(NodeId n, NodeId child) {
+        uint32_t h = child < height_.size() ? height_[child] + 1 : 1;
+        if (h <= height_[n]) return;
+        height_[n] = h;
+        if (h > kMaxTreeDepth && !aborted_) {
+            error("expression nested too deeply, parsing stopped");
+            aborted_ = true;
+            pos_ = end_;
+        }
+    }
+
+    // Move scratch_[mark..] to the end of ast_.lists as the children of `n`.
+    // Nested lists are always finished first, so each list stays contiguous.
+    void takeList(NodeId n, size_t mark) {
+        // An empty list starts at 0, like a node that never takes one, so
+        // pipeline.h can shift list offsets without telling the two apart.
+        at(n).count = static_cast<uint32_t>(scratch_.size() - mark);
+        at(n).first = at(n).count ? static_cast<uint32_t>(ast_.lists.size()) : 0;
+        for (size_t k = mark; k < scratch_.size(); ++k) raise(n, scratch_[k]);
+        ast_.lists.insert(ast_.lists.end(), scratch_.begin() + mark, scratch_.end());
+        scratch_.resize(mark);
+    }
+
+    // Past kMaxDepth the rest of the input is abandoned with one error,
+    // instead of risking the stack or reporting every unwound level.
+    struct DepthGuard {
+        Parser &p;
+        bool ok;
+        explicit DepthGuard(Parser &parser) : p(parser), ok(++p.depth_ <= kMaxDepth) {
+            if (!ok && !p.aborted_) {
+                p.error("nesting too deep, parsing stopped");
+                p.aborted_ = true;
+                p.pos_ = p.end_;
+            }
+        }
+        ~DepthGuard() { --p.depth_; }
+    };
+
+    // ----- declarations -----
+
+    bool atTypeStart() const {
+        const Token &t = peek();
+        if (t.type == TokenType::Keyword) return isTypeKeyword(t.kind);
+        // `Name name` declares a variable of a named type (e.g. string s).
+        return t.type == TokenType::Identifier && peek(1).type == TokenType::Identifier;
+    }
+
+    // Consume a type (`int`, `long long`, `string`) and return its first token.
+    size_t parseType() {
+        size_t first = pos_;
+        if (peek().type == TokenType::Identifier) {
+            ++pos_;
+        } else {
+            while (isTypeKeyword(peek().kind)) ++pos_;
+        }
+        return first;
+    }
+
+    NodeId parseTopLevel() {
+        const Token &t = peek();
+        // Preprocessor lines (#include <...>) are skipped whole.
+        if (t.lexeme == "#" && t.type == TokenType::Unknown) {
+            int line = t.line;
+            while (!atEnd() && peek().line == line) ++pos_;
+            return kNoNode;
+        }
+        if (t.kind == K::KwUsing) {
+            synchronize();
+            return kNoNode;
+        }
+        // Scripts may have statements at top level, like input.code.
+        if (!atTypeStart()) return parseStatement();
+
+        size_t type = parseType();
+        if (peek().type != TokenType::Identifier) {
+            error("expected a name");
+            synchronize();
+            return kNoNode;
+        }
+        if (check(K::DelimLParen, 1)) return parseFunction(type);
+        return parseDeclarators(type);
+    }
+
+    NodeId parseFunction(size_t type) {
+        NodeId fn = makeNode(NodeKind::Function, pos_++);
+        at(fn).typeToken = static_cast<uint32_t>(type);
+        expect(K::DelimLParen);
+
+        size_t mark = scratch_.size();
+        if (check(K::KwVoid) && check(K::DelimRParen, 1)) ++pos_;
+        if (!check(K::DelimRParen)) {
+            do {
+                if (!atTypeStart() && peek().type != TokenType::Identifier) {
+                    error("expected a parameter");
+                    break;
+                }
+                size_t ptype = parseType();
+                if (peek().type != TokenType::Identifier) {
+                    error("expected a parameter name");
+                    break;
+                }
+                NodeId param = makeNode(NodeKind::Param, pos_++);
+                at(param).typeToken = static_cast<uint32_t>(ptype);
+                if (accept(K::DelimLBracket)) expect(K::DelimRBracket);
+                scratch_.push_back(param);
+            } while (accept(K::DelimComma));
+        }
+        takeList(fn, mark);
+        if (!expect(K::DelimRParen)) synchronize();
+
+        if (!accept(K::DelimSemicolon)) {
+            NodeId body = parseBlock();
+            link(fn, &AstNode::a, body);
+        }
+        return fn;
+    }
+
+    // After the type: `a = 1, b[10], c;`
+    NodeId parseDeclarators(size_t type) {
+        NodeId decl = makeNode(NodeKind::DeclStmt, type);
+        size_t mark = scratch_.size();
+        do {
+            if (peek().type != TokenType::Identifier) {
+                error("expected a name");
+                break;
+            }
+            NodeId var = makeNode(NodeKind::VarDecl, pos_++);
+            at(var).typeToken = static_cast<uint32_t>(type);
+            if (accept(K::DelimLBracket)) {
+                if (!check(K::DelimRBracket)) {
+                    NodeId size = parseExpression();
+                    link(var, &AstNode::b, size);
+                }
+                expect(K::DelimRBracket);
+            }
+            if (accept(K::OpAssign)) {
+                NodeId init = parseAssignment();
+                link(var, &AstNode::a, init);
+            }
+            scratch_.push_back(var);
+        } while (accept(K::DelimComma));
+        takeList(decl, mark);
+        if (!expect(K::DelimSemicolon)) synchronize();
+        return decl;
+    }
+
+    // ----- statements -----
+
+    NodeId parseBlock() {
+        NodeId block = makeNode(NodeKind::Block, pos_);
+        if (!expect(K::DelimLBrace)) return block;
+        size_t mark = scratch_.size();
+        while (!atEnd() && !check(K::DelimRBrace)) {
+            size_t before = pos_;
+            scratch_.push_back(parseStatement());
+            if (pos_ == before) ++pos_;
+        }
+        takeList(block, mark);
+        expect(K::DelimRBrace);
+        return block;
+    }
+
+    NodeId parseStatement() {
+        DepthGuard guard(*this);
+        if (!guard.ok) {
+            synchronize();
+            return makeNode(NodeKind::Error, pos_);
+        }
+
+        if (check(K::DelimLBrace)) return parseBlock();
+        if (accept(K::DelimSemicolon)) return makeNode(NodeKind::Empty, pos_ - 1);
+
+        size_t kw = pos_;
+        switch (peek().kind) {
+            case K::KwIf: {
+                ++pos_;
+                NodeId cond = parseCondition();
+                NodeId then = parseStatement();
+                NodeId otherwise = accept(K::KwElse) ? parseStatement() : kNoNode;
+                NodeId n = makeNode(NodeKind::If, kw, cond, then);
+                link(n, &AstNode::c, otherwise);
+                return n;
+            }
+            case K::KwWhile: {
+                ++pos_;
+                NodeId cond = parseCondition();
+                NodeId body = parseStatement();
+                return makeNode(NodeKind::While, kw, cond, body);
+            }
+            case K::KwDo: {
+                ++pos_;
+                NodeId body = parseStatement();
+                expect(K::KwWhile);
+                NodeId cond = parseCondition();
+                NodeId n = makeNode(NodeKind::DoWhile, kw, cond, body);
+                if (!expect(K::DelimSemicolon)) synchronize();
+                return n;
+            }
+            case K::KwFor: return parseFor();
+            case K::KwReturn: {
+                ++pos_;
+                NodeId value = check(K::DelimSemicolon) ? kNoNode : parseExpression();
+                if (!expect(K::DelimSemicolon)) synchronize();
+                return makeNode(NodeKind::Return, kw, value);
+            }
+            case K::KwBreak:
+            case K::KwContinue: {
+                NodeKind kind = peek().kind == K::KwBreak ? NodeKind::Break : NodeKind::Continue;
+                ++pos_;
+                if (!expect(K::DelimSemicolon)) synchronize();
+                return makeNode(kind, kw);
+            }
+            default: break;
+        }
+
+        if (atTypeStart()) {
+            size_t type = parseType();
+            return parseDeclarators(type);
+        }
+
+        size_t start = pos_;
+        NodeId e = parseExpression();
+        if (!expect(K::DelimSemicolon)) synchronize();
+        return makeNode(NodeKind::ExprStmt, start, e);
+    }
+
+    // `( expr )` after if/while.
+    NodeId parseCondition() {
+        expect(K::DelimLParen);
+        NodeId cond = parseExpression();
+        expect(K::DelimRParen);
+        return cond;
+    }
+
+    NodeId parseFor() {
+        size_t kw = pos_++;
+        NodeId init = kNoNode, cond = kNoNode, step = kNoNode;
+        expect(K::DelimLParen);
+        if (atTypeStart()) {
+            size_t type = parseType();
+            init = parseDeclarators(type); // consumes ';'
+        } else if (!accept(K::DelimSemicolon)) {
+            size_t start = pos_;
+            NodeId e = parseExpression();
+            init = makeNode(NodeKind::ExprStmt, start, e);
+            expect(K::DelimSemicolon);
+        }
+        if (!check(K::DelimSemicolon)) cond = parseExpression();
+        expect(K::DelimSemicolon);
+        if (!check(K::DelimRParen)) step = parseExpression();
+        expect(K::DelimRParen);
+        NodeId body = parseStatement();
+        NodeId n = makeNode(NodeKind::For, kw, init, cond);
+        link(n, &AstNode::c, step);
+        link(n, &AstNode::d, body);
+        return n;
+    }
+
+    // ----- expressions -----
+
+    NodeId parseExpression() { return parseBinary(kAssignPrecedence); }
+
+    // Initializers and call arguments stop at ',' (there is no comma operator).
+    NodeId parseAssignment() { return parseBinary(kAssignPrecedence); }
+
+    // Precedence climbing: operators at or above `minPrec` are folded into
+    // `lhs` in a loop; recursion only happens for a tighter right operand.
+    NodeId parseBinary(int minPrec) {
+        DepthGuard guard(*this);
+        if (!guard.ok) return makeNode(NodeKind::Error, pos_);
+
+        NodeId lhs = parseUnary();
+        for (;;) {
+            const Token &t = peek();
+            int prec = binaryPrecedence(t.kind);
+            if (prec == 0 || prec < minPrec) break;
+            size_t op = pos_++;
+            bool assign = prec == kAssignPrecedence;
+            NodeId rhs = parseBinary(assign ? prec : prec + 1);
+            lhs = makeNode(assign ? NodeKind::Assign : NodeKind::Binary, op, lhs, rhs);
+        }
+        return lhs;
+    }
+
+    // Prefix operators are collected iteratively, then applied innermost first.
+    NodeId parseUnary() {
+        size_t first = pos_;
+        for (;; ++pos_) {
+            K k = peek().kind;
+            if (k != K::OpSub && k != K::OpAdd && k != K::OpNot && k != K::OpTilde && k != K::OpInc && k != K::OpDec) break;
+        }
+        size_t last = pos_;
+        NodeId operand = parsePostfix();
+        for (size_t op = last; op-- > first;) operand = makeNode(NodeKind::Unary, op, operand);
+        return operand;
+    }
+
+    NodeId parsePostfix() {
+        NodeId e = parsePrimary();
+        for (;;) {
+            if (check(K::DelimLParen)) {
+                NodeId call = makeNode(NodeKind::Call, pos_++, e);
+                size_t mark = scratch_.size();
+                if (!check(K::DelimRParen)) {
+                    do scratch_.push_back(parseAssignment());
+                    while (accept(K::DelimComma));
+                }
+                takeList(call, mark);
+                expect(K::DelimRParen);
+                e = call;
+            } else if (check(K::DelimLBracket)) {
+                size_t open = pos_++;
+                NodeId index = parseExpression();
+                e = makeNode(NodeKind::Index, open, e, index);
+                expect(K::DelimRBracket);
+            } else if (check(K::OpInc) || check(K::OpDec)) {
+                e = makeNode(NodeKind::Postfix, pos_++, e);
+            } else {
+                return e;
+            }
+        }
+    }
+
+    NodeId parsePrimary() {
+        const Token &t = peek();
+        if (atEnd()) {
+            error("expected an expression");
+            return makeNode(NodeKind::Error, pos_);
+        }
+        switch (t.type) {
+            case TokenType::Number: return makeNode(NodeKind::Number, pos_++);
+            case TokenType::String: return makeNode(NodeKind::String, pos_++);
+            case TokenType::Char: return makeNode(NodeKind::Char, pos_++);
+            case TokenType::Identifier:
+                if (t.lexeme == "true" || t.lexeme == "false") return makeNode(NodeKind::Bool, pos_++);
+                return makeNode(NodeKind::Name, pos_++);
+            default: break;
+        }
+        if (accept(K::DelimLParen)) {
+            NodeId e = parseExpression();
+            expect(K::DelimRParen);
+            return e;
+        }
+        error("expected an expression");
+        return makeNode(NodeKind::Error, pos_);
+    }
+};
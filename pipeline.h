@@ -0,0 +1,167 @@
+// pipeline.h
+// Parallel front end. A bracket index pairs every ( [ { with its closer, so
+// a scan of the top level can jump over whole bodies: it finds each
+// function definition (`type name ( ... ) { ... }`) in time proportional to
+// the number of top-level tokens. Each definition, and each run of other
+// top-level code between two of them, is then parsed as a separate task
+// into its own Ast, and the pieces are spliced together in source order.
+// The merged tree is node-for-node the one a serial parse builds.
+
+#pragma once
+
+#include "parser.h"
+#include "pool.h"
+
+// ---------- Bracket index ----------
+
+// match[i] is the index of the bracket paired with the one at i (an opener
+// points at its closer and back); other tokens map to themselves. Returns
+// false if the brackets do not balance.
+inline bool bracketIndex(const vector<Token> &tokens, vector<uint32_t> &match) {
+    match.resize(tokens.size());
+    vector<uint32_t> open;
+    for (uint32_t i = 0; i < tokens.size(); ++i) {
+        match[i] = i;
+        TokenKind k = tokens[i].kind;
+        if (k == TokenKind::DelimLParen || k == TokenKind::DelimLBracket || k == TokenKind::DelimLBrace) {
+            open.push_back(i);
+        } else if (k == TokenKind::DelimRParen || k == TokenKind::DelimRBracket || k == TokenKind::DelimRBrace) {
+            if (open.empty()) return false;
+            uint32_t o = open.back();
+            open.pop_back();
+            // Each closer directly follows its opener in TokenKind.
+            if (uint16_t(tokens[o].kind) + 1 != uint16_t(k)) return false;
+            match[o] = i;
+            match[i] = o;
+        }
+    }
+    return open.empty();
+}
+
+// ---------- Top-level scan ----------
+
+// Token ranges [begin, end) that can be parsed independently: each function
+// definition, and the top-level code between them.
+using ParseChunks = vector<pair<uint32_t, uint32_t>>;
+
+// A function definition starting at `i` ends at `end` (one past its '}').
+// The type is read the way Parser::parseType does.
+inline bool functionAt(const vector<Token> &tokens, const vector<uint32_t> &match, size_t i, size_t &end) {
+    auto is = [&](size_t k, TokenKind kind) { return k < tokens.size() && tokens[k].kind == kind; };
+    size_t k = i;
+    if (tokens[k].type == TokenType::Identifier) {
+        ++k;
+    } else {
+        while (k < tokens.size() && isTypeKeyword(tokens[k].kind)) ++k;
+    }
+    if (k == i || k >= tokens.size() || tokens[k].type != TokenType::Identifier || !is(k + 1, TokenKind::DelimLParen)) return false;
+    size_t close = match[k + 1];
+    if (!is(close + 1, TokenKind::DelimLBrace)) return false;
+    end = match[close + 1] + 1;
+    return true;
+}
+
+// True if a serial parse would start a new top-level item at `i`: it is the
+// first token, follows a ';' or '}', or starts the line after a
+// preprocessor line (which the parser skips whole).
+inline bool itemBoundary(const vector<Token> &tokens, size_t i) {
+    if (i == 0) return true;
+    const Token &prev = tokens[i - 1];
+    if (prev.kind == TokenKind::DelimSemicolon || prev.kind == TokenKind::DelimRBrace) return true;
+    if (prev.line == tokens[i].line) return false;
+    size_t first = i - 1;
+    while (first > 0 && tokens[first - 1].line == prev.line) --first;
+    return tokens[first].lexeme == "#" && tokens[first].type == TokenType::Unknown;
+}
+
+inline ParseChunks topLevelChunks(const vector<Token> &tokens, const vector<uint32_t> &match) {
+    ParseChunks chunks;
+    size_t gap = 0, i = 0, end;
+    while (i < tokens.size()) {
+        if (itemBoundary(tokens, i) && functionAt(tokens, match, i, end)) {
+            if (gap < i) chunks.push_back({uint32_t(gap), uint32_t(i)});
+            chunks.push_back({uint32_t(i), uint32_t(end)});
+            gap = i = end;
+        } else {
+            i = match[i] > i ? match[i] + 1 : i + 1;
+        }
+    }
+    if (gap < tokens.size()) chunks.push_back({uint32_t(gap), uint32_t(tokens.size())});
+    return chunks;
+}
+
+// ---------- Parallel parse ----------
+
+// Below this many tokens starting threads costs more than it saves.
+constexpr size_t kMinParallelTokens = 4096;
+
+// Parse `tokens` into `ast` using `pool`, with the diagnostics of the parse
+// in `diagnostics`. When anything goes wrong (unbalanced brackets, a syntax
+// error in any chunk) the whole file is parsed again serially, so messages
+// and error recovery are exactly the serial parser's.
+inline NodeId parseParallel(const vector<Token> &tokens, Ast &ast, WorkStealingPool &pool,
+                            vector<Diagnostic> &diagnostics) {
+    auto serial = [&] {
+        Parser parser(tokens, ast);
+        NodeId root = parser.parseProgram();
+        diagnostics = parser.diagnostics();
+        return root;
+    };
+    vector<uint32_t> match;
+    if (pool.threads() <= 1 || tokens.size() < kMinParallelTokens) return serial();
+    ParseChunks chunks;
+    {
+        TraceScope scan("bracket index and top-level scan", "parse");
+        if (bracketIndex(tokens, match)) chunks = topLevelChunks(tokens, match);
+    }
+    if (chunks.size() <= 1) return serial();
+
+    vector<Ast> pieces(chunks.size());
+    vector<uint8_t> failed(chunks.size(), 0);
+    pool.run(chunks.size(), [&](size_t k) {
+        TK_PROBE3(parse_chunk_start, k, chunks[k].first, chunks[k].second);
+        TraceScope span("parse chunk", "parse");
+        span.arg("tokens", chunks[k].second - chunks[k].first);
+        Parser parser(tokens, pieces[k]);
+        parser.parseProgram(chunks[k].first, chunks[k].second);
+        failed[k] = !parser.diagnostics().empty();
+        TK_PROBE3(parse_chunk_end, k, pieces[k].nodes.size(), !failed[k]);
+    });
+    if (find(failed.begin(), failed.end(), 1) != failed.end()) return serial();
+
+    TraceScope merge("merge chunks", "parse");
+    // Each piece is [placeholder, items..., its Program node], with the
+    // Program's list last. Everything but the placeholder and the Program
+    // is appended with node and list indices shifted past what came before;
+    // empty lists stay at 0, as the serial parser leaves them.
+    ast.clear();
+    size_t nodes = 1, lists = 0;
+    for (const Ast &p : pieces) {
+        nodes += p.nodes.size() - 2;
+        lists += p.lists.size();
+    }
+    ast.nodes.reserve(nodes + 1);
+    ast.lists.reserve(lists);
+    vector<NodeId> items;
+    for (const Ast &p : pieces) {
+        const AstNode &root = p[p.root];
+        NodeId nodeBase = NodeId(ast.nodes.size() - 1);
+        uint32_t listBase = uint32_t(ast.lists.size());
+        auto shift = [&](NodeId id) { return id == kNoNode ? kNoNode : id + nodeBase; };
+        for (NodeId id = 1; id < p.root; ++id) {
+            AstNode n = p.nodes[id];
+            n.a = shift(n.a), n.b = shift(n.b), n.c = shift(n.c), n.d = shift(n.d);
+            if (n.count) n.first += listBase;
+            ast.nodes.push_back(n);
+        }
+        for (size_t k = 0; k < p.lists.size() - root.count; ++k) ast.lists.push_back(shift(p.lists[k]));
+        for (uint32_t k = 0; k < root.count; ++k) items.push_back(shift(p.child(root, k)));
+    }
+    AstNode program{NodeKind::Program, 0, 0, kNoNode, kNoNode, kNoNode, kNoNode,
+                    uint32_t(ast.lists.size()), uint32_t(items.size())};
+    ast.lists.insert(ast.lists.end(), items.begin(), items.end());
+    ast.nodes.push_back(program);
+    ast.root = NodeId(ast.nodes.size() - 1);
+    diagnostics.clear();
+    return ast.root;
+}
@@ -0,0 +1,80 @@
+// pool.h
+// Work-stealing task pool for the compile pipeline (see pipeline.h). A run
+// hands out task indices [0, count) in contiguous blocks, one deque per
+// worker; a worker takes its own tasks from the back (the most recently
+// queued, still warm) and, when it runs dry, steals from the front of
+// another worker's deque (the oldest, the largest share left). Tasks write
+// their results into their own slots, so what the pool computes does not
+// depend on which thread ran what, or on how many there were.
+
+#pragma once
+
+#include "trace.h"
+
+class WorkStealingPool {
+public:
+    // 0 threads means one per hardware thread.
+    explicit WorkStealingPool(unsigned threads = 0)
+        : threads_(threads ? threads : max(1u, thread::hardware_concurrency())) {}
+
+    unsigned threads() const { return threads_; }
+
+    // Run task(i) for every i in [0, count) and return when all are done.
+    // The calling thread is worker 0; the others exist only during the run.
+    template <class F>
+    void run(size_t count, F &&task) {
+        unsigned workers = unsigned(min<size_t>(threads_, count));
+        if (workers <= 1) {
+            for (size_t i = 0; i < count; ++i) task(i);
+            return;
+        }
+        vector<Queue> queues(workers);
+        for (unsigned w = 0; w < workers; ++w) {
+            size_t from = count * w / workers, to = count * (w + 1) / workers;
+            for (size_t i = from; i < to; ++i) queues[w].tasks.push_back(i);
+        }
+        auto work = [&](unsigned self) {
+            if (self && Trace::enabled()) Trace::threadName("pool worker " + to_string(self));
+            size_t i;
+            while (take(queues, self, i)) task(i);
+        };
+        vector<thread> helpers;
+        helpers.reserve(workers - 1);
+        for (unsigned w = 1; w < workers; ++w) helpers.emplace_back(work, w);
+        work(0);
+        TraceScope wait("wait for workers", "pool", Trace::kMinWaitNs);
+        for (thread &t : helpers) t.join();
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    unsigned threads_;
+
+    // Next task for worker `self`: its own newest, else the oldest task of
+    // the first other worker that has one. No task is ever added during a
+    // run, so finding every deque empty once means the run is finished.
+    static bool take(vector<Queue> &queues, unsigned self, size_t &task) {
+        {
+            lock_guard<mutex> hold(queues[self].lock);
+            if (!queues[self].tasks.empty()) {
+                task = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue &victim = queues[(self + k) % queues.size()];
+            lock_guard<mutex> hold(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
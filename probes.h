@@ -0,0 +1,79 @@
+// probes.h
+// Static tracepoints (USDT) for tracing a running process with bpftrace,
+// perf or SystemTap, e.g.
+//
+//   bpftrace -e 'usdt:./tokenizer:tokenizer:tokenize_exit { @[arg1] = count(); }' -p PID
+//   perf buildid-cache --add ./tokenizer && perf list sdt_tokenizer:*
+//
+// Each probe site is a single nop plus an entry in the .note.stapsdt ELF
+// section, in the layout <sys/sdt.h> writes: the nop's address, provider
+// and probe names, and where to find each argument ("8@%rax -4@$2"). An
+// attached tracer patches the nop into a trap; otherwise it is all the site
+// costs, as arguments are only ever registers, memory or constants the code
+// has at hand. The notes are written here rather than by including
+// <sys/sdt.h>, so probes need no systemtap headers to build and nothing at
+// run time. Build with -DTK_NO_PROBES, or for a target other than ELF
+// x86-64, and they compile to nothing.
+//
+// Probes (provider "tokenizer"):
+//   file_start(name, bytes)              a driver starts on a file
+//   file_end(name)                       ... and is done with it
+//   document_start(id, bytes)            --frames starts on a document
+//   document_end(id)                     ... and is done with it
+//   tokenize_entry(size, pos)            Lexer::tokenizeStream starts at pos
+//   tokenize_exit(tokens, status, pos)   ... returns (status: a LexStatus)
+//   parse_chunk_start(index, begin, end) a parallel parse task starts
+//   parse_chunk_end(index, nodes, ok)    ... and ends (see pipeline.h)
+//   fanout_batch(tokens, consumers)      a TokenFanout hands out a batch
+//   aot_cache_hit(path)                  an AOT module is found on disk
+//   aot_cache_miss(path)                 ... or has to be compiled
+
+#pragma once
+
+#include <type_traits>
+
+#if !defined(TK_NO_PROBES) && defined(__ELF__) && defined(__GNUC__) && defined(__x86_64__)
+#define TK_PROBES 1
+
+// An argument's size in the note: bytes, negative if signed.
+#define TK_PROBE_SIZE(x) \
+    ((std::is_signed<std::decay_t<decltype(x)>>::value ? -1 : 1) * int(sizeof(std::decay_t<decltype(x)>)))
+
+// %n prints the negated constant, hence the -.
+#define TK_PROBE_OPERAND(k, x) [s##k] "n"(-TK_PROBE_SIZE(x)), [a##k] "nor"(x)
+#define TK_PROBE_FORMAT0 ""
+#define TK_PROBE_FORMAT1 "%n[s1]@%[a1]"
+#define TK_PROBE_FORMAT2 TK_PROBE_FORMAT1 " %n[s2]@%[a2]"
+#define TK_PROBE_FORMAT3 TK_PROBE_FORMAT2 " %n[s3]@%[a3]"
+
+#define TK_PROBE_NOTE(name, format, ...)                         \
+    __asm__ __volatile__("990: nop\n"                            \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+                         ".balign 4\n"                           \
+                         ".4byte 992f-991f, 994f-993f, 3\n"      \
+                         "991: .asciz \"stapsdt\"\n"             \
+                         "992: .balign 4\n"                      \
+                         "993: .8byte 990b\n"                    \
+                         ".8byte 0\n" /* base address */         \
+                         ".8byte 0\n" /* semaphore: none */      \
+                         ".asciz \"tokenizer\"\n"                \
+                         ".asciz \"" #name "\"\n"                \
+                         ".asciz \"" format "\"\n"               \
+                         "994: .balign 4\n"                      \
+                         ".popsection\n" ::__VA_ARGS__)
+
+#define TK_PROBE0(name) TK_PROBE_NOTE(name, TK_PROBE_FORMAT0)
+#define TK_PROBE1(name, a) TK_PROBE_NOTE(name, TK_PROBE_FORMAT1, TK_PROBE_OPERAND(1, a))
+#define TK_PROBE2(name, a, b) \
+    TK_PROBE_NOTE(name, TK_PROBE_FORMAT2, TK_PROBE_OPERAND(1, a), TK_PROBE_OPERAND(2, b))
+#define TK_PROBE3(name, a, b, c) \
+    TK_PROBE_NOTE(name, TK_PROBE_FORMAT3, TK_PROBE_OPERAND(1, a), TK_PROBE_OPERAND(2, b), TK_PROBE_OPERAND(3, c))
+
+#else
+
+#define TK_PROBE0(name) ((void)0)
+#define TK_PROBE1(name, a) ((void)0)
+#define TK_PROBE2(name, a, b) ((void)0)
+#define TK_PROBE3(name, a, b, c) ((void)0)
+
+#endif
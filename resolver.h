@@ -0,0 +1,274 @@
+// resolver.h
+// Scope resolution for a parsed file: decides which identifier tokens
+// declare a symbol and which use one, and links every use to its
+// declaration. Identifiers are interned to dense IDs (reusing the hash the
+// lexer computed while scanning them) and each scope is a flat
+// open-addressing map from ID to symbol; maps are pooled and reused as
+// scopes open and close, so the pass allocates little beyond its output.
+
+#pragma once
+
+#include "ast.h"
+#include "interner.h"
+
+// ---------- Per-scope symbol map ----------
+
+// Open-addressing map from interned ID to symbol index. clear() only
+// touches the slots that were filled, so a large map can be recycled for a
+// small scope cheaply.
+class ScopeMap {
+public:
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+
+    uint32_t find(uint32_t key) const {
+        if (slots_.empty()) return kEmpty;
+        size_t mask = slots_.size() - 1;
+        for (size_t i = mix(key) & mask;; i = (i + 1) & mask) {
+            if (slots_[i].key == key) return slots_[i].value;
+            if (slots_[i].key == kEmpty) return kEmpty;
+        }
+    }
+
+    // Insert or overwrite.
+    void put(uint32_t key, uint32_t value) {
+        if ((used_.size() + 1) * 2 > slots_.size()) grow();
+        size_t i = probe(key);
+        if (slots_[i].key == kEmpty) used_.push_back(static_cast<uint32_t>(i));
+        slots_[i] = {key, value};
+    }
+
+    void clear() {
+        for (uint32_t i : used_) slots_[i] = {kEmpty, kEmpty};
+        used_.clear();
+    }
+
+private:
+    struct Slot {
+        uint32_t key;
+        uint32_t value;
+    };
+    vector<Slot> slots_;
+    vector<uint32_t> used_; // filled slot indices
+
+    static uint32_t mix(uint32_t key) { return key * 2654435761u; }
+
+    size_t probe(uint32_t key) const {
+        size_t mask = slots_.size() - 1;
+        size_t i = mix(key) & mask;
+        while (slots_[i].key != kEmpty && slots_[i].key != key) i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        vector<Slot> old = move(slots_);
+        slots_.assign(max<size_t>(old.size() * 2, 16), Slot{kEmpty, kEmpty});
+        used_.clear();
+        for (const Slot &slot : old) {
+            if (slot.key == kEmpty) continue;
+            size_t i = probe(slot.key);
+            slots_[i] = slot;
+            used_.push_back(static_cast<uint32_t>(i));
+        }
+    }
+};
+
+// ---------- Resolution ----------
+
+enum class SymbolKind : uint8_t { Global, Function, Param, Local };
+
+inline const char *symbolKindName(SymbolKind k) {
+    switch (k) {
+        case SymbolKind::Global: return "global";
+        case SymbolKind::Function: return "function";
+        case SymbolKind::Param: return "param";
+        default: return "local";
+    }
+}
+
+struct Symbol {
+    uint32_t name;  // interned ID
+    uint32_t token; // declaring token
+    SymbolKind kind;
+};
+
+// A use of an identifier: the token and the symbol it resolves to
+// (Resolver::kUnresolved if no declaration is in scope).
+struct SymbolUse {
+    uint32_t token;
+    uint32_t symbol;
+};
+
+// The def-use table of one file.
+struct DefUseTable {
+    vector<Symbol> symbols; // in declaration order
+    vector<SymbolUse> uses; // in source order
+};
+
+class Resolver {
+public:
+    static constexpr uint32_t kUnresolved = UINT32_MAX;
+
+    // Resolve one parsed file into `out`. The Resolver keeps its interner
+    // and scope maps between calls; interned IDs are only stable per call.
+    void resolve(const Ast &ast, const vector<Token> &tokens, DefUseTable &out) {
+        ast_ = &ast;
+        tokens_ = &tokens;
+        out_ = &out;
+        out.symbols.clear();
+        out.uses.clear();
+        interner_.clear();
+        diagnostics_.clear();
+        depth_ = 0;
+
+        pushScope(); // globals
+        // Functions are visible from the whole file, so calls may precede
+        // the definition.
+        const AstNode &program = ast[ast.root];
+        for (uint32_t k = 0; k < program.count; ++k) {
+            const AstNode &n = ast[ast.child(program, k)];
+            if (n.kind == NodeKind::Function) declareFunction(n.token);
+        }
+        for (uint32_t k = 0; k < program.count; ++k) visit(ast.child(program, k));
+        popScope();
+    }
+
+    const Interner &interner() const { return interner_; }
+    const vector<Diagnostic> &diagnostics() const { return diagnostics_; }
+
+private:
+    const Ast *ast_ = nullptr;
+    const vector<Token> *tokens_ = nullptr;
+    DefUseTable *out_ = nullptr;
+    Interner interner_;
+    vector<ScopeMap> scopes_; // scopes_[0 .. depth_) are open; the rest are spares
+    size_t depth_ = 0;
+    vector<Diagnostic> diagnostics_;
+
+    void pushScope() {
+        if (depth_ == scopes_.size()) scopes_.emplace_back();
+        ++depth_;
+    }
+
+    void popScope() { scopes_[--depth_].clear(); }
+
+    uint32_t addSymbol(uint32_t token, SymbolKind kind) {
+        uint32_t name = interner_.intern((*tokens_)[token]);
+        ScopeMap &scope = scopes_[depth_ - 1];
+        if (scope.find(name) != ScopeMap::kEmpty) {
+            diagnostics_.push_back({(*tokens_)[token].line,
+                                    "redeclaration of '" + string((*tokens_)[token].lexeme) + "'"});
+        }
+        uint32_t id = static_cast<uint32_t>(out_->symbols.size());
+        out_->symbols.push_back({name, token, kind});
+        scope.put(name, id);
+        return id;
+    }
+
+    // A prototype and its definition share one symbol.
+    void declareFunction(uint32_t token) {
+        uint32_t name = interner_.intern((*tokens_)[token]);
+        if (scopes_[0].find(name) == ScopeMap::kEmpty) addSymbol(token, SymbolKind::Function);
+    }
+
+    void use(uint32_t token) {
+        uint32_t name = interner_.intern((*tokens_)[token]);
+        uint32_t symbol = ScopeMap::kEmpty;
+        for (size_t d = depth_; symbol == ScopeMap::kEmpty && d-- > 0;) symbol = scopes_[d].find(name);
+        out_->uses.push_back({token, symbol == ScopeMap::kEmpty ? kUnresolved : symbol});
+    }
+
+    // The walk keeps its own stack of pending steps instead of recursing,
+    // so the depth of the tree does not matter: a left-deep chain of a
+    // million operators resolves like any other expression. Steps run in
+    // source order; a node's children are pushed last first.
+    struct Step {
+        enum Op : uint8_t { Visit, Declare, PopScope } op;
+        uint32_t id; // Visit: a node; Declare: a VarDecl node
+    };
+    vector<Step> stack_;
+
+    void push(NodeId id) {
+        if (id != kNoNode) stack_.push_back({Step::Visit, id});
+    }
+
+    void pushList(const AstNode &n) {
+        for (uint32_t k = n.count; k-- > 0;) push(ast_->child(n, k));
+    }
+
+    void visit(NodeId root) {
+        push(root);
+        while (!stack_.empty()) {
+            Step step = stack_.back();
+            stack_.pop_back();
+            const AstNode &n = (*ast_)[step.id];
+            if (step.op == Step::PopScope) {
+                popScope();
+                continue;
+            }
+            if (step.op == Step::Declare) {
+                addSymbol(n.token, depth_ == 1 ? SymbolKind::Global : SymbolKind::Local);
+                continue;
+            }
+            switch (n.kind) {
+                case NodeKind::Function:
+                    pushScope();
+                    for (uint32_t k = 0; k < n.count; ++k) addSymbol((*ast_)[ast_->child(n, k)].token, SymbolKind::Param);
+                    // The body's outermost block shares the parameters' scope.
+                    stack_.push_back({Step::PopScope, step.id});
+                    if (n.a != kNoNode) pushList((*ast_)[n.a]);
+                    break;
+                case NodeKind::VarDecl:
+                    push(n.a);                                  // the initializer sees the new name, as in C
+                    stack_.push_back({Step::Declare, step.id});
+                    push(n.b);                                  // array size
+                    break;
+                case NodeKind::Block:
+                    pushScope();
+                    stack_.push_back({Step::PopScope, step.id});
+                    pushList(n);
+                    break;
+                case NodeKind::For:
+                    pushScope(); // for-init declarations are local to the loop
+                    stack_.push_back({Step::PopScope, step.id});
+                    push(n.d);
+                    push(n.c);
+                    push(n.b);
+                    push(n.a);
+                    break;
+                case NodeKind::Name:
+                    use(n.token);
+                    break;
+                default:
+                    pushList(n);
+                    push(n.d);
+                    push(n.c);
+                    push(n.b);
+                    push(n.a);
+                    break;
+            }
+        }
+    }
+};
+
+// Print a def-use table: one line per symbol with the lines of its uses,
+// then the identifiers that did not resolve.
+inline void printDefUse(const DefUseTable &table, const vector<Token> &tokens, ostream &out) {
+    vector<vector<int>> useLines(table.symbols.size());
+    vector<const SymbolUse *> unresolved;
+    for (const SymbolUse &u : table.uses) {
+        if (u.symbol == Resolver::kUnresolved) unresolved.push_back(&u);
+        else useLines[u.symbol].push_back(tokens[u.token].line);
+    }
+    for (size_t s = 0; s < table.symbols.size(); ++s) {
+        const Symbol &sym = table.symbols[s];
+        const Token &decl = tokens[sym.token];
+        out << "  " << left << setw(7) << decl.line << " " << setw(11) << symbolKindName(sym.kind)
+            << setw(20) << decl.lexeme << " uses:";
+        for (int line : useLines[s]) out << " " << line;
+        out << "\n";
+    }
+    for (const SymbolUse *u : unresolved) {
+        out << "  " << left << setw(7) << tokens[u->token].line << " " << setw(11) << "unresolved"
+            << tokens[u->token].lexeme << "\n";
+    }
+}
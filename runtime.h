@@ -0,0 +1,234 @@
+// runtime.h
+// Value model shared by the execution engines for the C-like subset: the
+// static types a variable can have, the 8-byte Value that holds any of them,
+// and the arithmetic and conversion rules. Every engine goes through these
+// helpers, so they agree on results bit for bit.
+//
+// Semantics, where C leaves things undefined:
+// - Integer arithmetic wraps (int in 32 bits, long in 64). Shift counts are
+//   taken modulo the width, and INT_MIN / -1 wraps to INT_MIN.
+// - Integer division or remainder by zero is a runtime error.
+// - Converting a double to an integer truncates and saturates; NaN gives 0.
+// - Uninitialized variables start at zero.
+
+#pragma once
+
+#include "lexer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+enum class ValueType : uint8_t { Void, Bool, Char, Short, Int, Long, Float, Double, String };
+
+inline const char *valueTypeName(ValueType t) {
+    static const char *const names[] = {"void", "bool", "char", "short", "int", "long", "float", "double", "string"};
+    return names[static_cast<int>(t)];
+}
+
+// The type named by a declaration's type tokens (`long long` is one
+// `long`), or Void with ok = false for types the engines do not support.
+inline ValueType valueTypeOf(string_view name, bool &ok) {
+    ok = true;
+    if (name == "int") return ValueType::Int;
+    if (name == "long") return ValueType::Long;
+    if (name == "short") return ValueType::Short;
+    if (name == "char") return ValueType::Char;
+    if (name == "bool") return ValueType::Bool;
+    if (name == "float") return ValueType::Float;
+    if (name == "double") return ValueType::Double;
+    if (name == "string") return ValueType::String;
+    ok = name == "void";
+    return ValueType::Void;
+}
+
+inline bool isIntegerType(ValueType t) { return t >= ValueType::Bool && t <= ValueType::Long; }
+inline bool isFloatingType(ValueType t) { return t == ValueType::Float || t == ValueType::Double; }
+inline bool isArithmeticType(ValueType t) { return isIntegerType(t) || isFloatingType(t); }
+
+// The type both operands of an arithmetic operator are converted to (the
+// usual arithmetic conversions; everything narrower than int becomes int).
+inline ValueType commonType(ValueType a, ValueType b) {
+    if (a == ValueType::Double || b == ValueType::Double) return ValueType::Double;
+    if (a == ValueType::Float || b == ValueType::Float) return ValueType::Float;
+    if (a == ValueType::Long || b == ValueType::Long) return ValueType::Long;
+    return ValueType::Int;
+}
+
+// One value: integers of every width are kept sign-extended in `i`,
+// float and double in `f`, strings as an index into the string table.
+union Value {
+    int64_t i;
+    double f;
+};
+
+static_assert(sizeof(Value) == 8, "values are 8 bytes");
+
+// ---------- Arithmetic ----------
+
+inline int64_t wrapInt32(int64_t v) { return static_cast<int32_t>(static_cast<uint32_t>(v)); }
+
+inline int64_t wrapAdd(int64_t a, int64_t b) { return static_cast<int64_t>(uint64_t(a) + uint64_t(b)); }
+inline int64_t wrapSub(int64_t a, int64_t b) { return static_cast<int64_t>(uint64_t(a) - uint64_t(b)); }
+inline int64_t wrapMul(int64_t a, int64_t b) { return static_cast<int64_t>(uint64_t(a) * uint64_t(b)); }
+
+// Quotient and remainder with a nonzero divisor (callers check for zero).
+inline int64_t wrapDiv(int64_t a, int64_t b) { return b == -1 ? wrapSub(0, a) : a / b; }
+inline int64_t wrapMod(int64_t a, int64_t b) { return b == -1 ? 0 : a % b; }
+
+inline int64_t shiftLeft(int64_t a, int64_t count, int bits) {
+    return static_cast<int64_t>(uint64_t(a) << (count & (bits - 1)));
+}
+
+inline int64_t shiftRight(int64_t a, int64_t count, int bits) { return a >> (count & (bits - 1)); }
+
+inline double roundToFloat(double v) { return static_cast<float>(v); }
+
+inline int64_t doubleToInteger(double v) {
+    if (v != v) return 0;
+    if (v >= 9223372036854775807.0) return INT64_MAX;
+    if (v <= -9223372036854775808.0) return INT64_MIN;
+    return static_cast<int64_t>(v);
+}
+
+// Narrow a sign-extended integer to the range of integer type `t`.
+inline int64_t narrowInteger(int64_t v, ValueType t) {
+    switch (t) {
+        case ValueType::Bool: return v != 0;
+        case ValueType::Char: return static_cast<int8_t>(static_cast<uint8_t>(v));
+        case ValueType::Short: return static_cast<int16_t>(static_cast<uint16_t>(v));
+        case ValueType::Int: return wrapInt32(v);
+        default: return v;
+    }
+}
+
+// Convert a value of arithmetic type `from` to arithmetic type `to`.
+inline Value convertValue(Value v, ValueType from, ValueType to) {
+    Value r;
+    if (isFloatingType(to)) {
+        double d = isFloatingType(from) ? v.f : static_cast<double>(v.i);
+        r.f = to == ValueType::Float ? roundToFloat(d) : d;
+    } else if (isFloatingType(from)) {
+        r.i = to == ValueType::Bool ? v.f != 0 : narrowInteger(doubleToInteger(v.f), to);
+    } else {
+        r.i = narrowInteger(v.i, to);
+    }
+    return r;
+}
+
+// ---------- Literals and printing ----------
+
+// The value of a char literal's lexeme ('a', '\n', ...).
+inline int64_t decodeCharLiteral(string_view lexeme) {
+    string_view body = lexeme.substr(1, lexeme.size() >= 2 && lexeme.back() == '\'' ? lexeme.size() - 2 : string_view::npos);
+    if (body.empty()) return 0;
+    if (body[0] != '\\' || body.size() < 2) return static_cast<int8_t>(body[0]);
+    switch (body[1]) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return 0;
+        case 'a': return '\a';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default: return static_cast<int8_t>(body[1]);
+    }
+}
+
+// The text of a string literal's lexeme, with escapes decoded.
+inline string decodeStringLiteral(string_view lexeme) {
+    string_view body = lexeme.substr(1, lexeme.size() >= 2 && lexeme.back() == '"' ? lexeme.size() - 2 : string_view::npos);
+    string out;
+    out.reserve(body.size());
+    for (size_t i = 0; i < body.size(); ++i) {
+        if (body[i] != '\\' || i + 1 == body.size()) {
+            out += body[i];
+            continue;
+        }
+        char e = body[++i];
+        switch (e) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case '0': out += '\0'; break;
+            default: out += e; break;
+        }
+    }
+    return out;
+}
+
+// Append `v` as print() shows it. With `quoted`, chars and strings are
+// written as literals instead (for dumps, where raw text would be ambiguous).
+inline void appendValue(string &out, Value v, ValueType t, const vector<string> &strings, bool quoted = false) {
+    char buf[64];
+    to_chars_result r{buf, errc()};
+    switch (t) {
+        case ValueType::Void: return;
+        case ValueType::Bool: out += v.i ? "true" : "false"; return;
+        case ValueType::Char:
+            if (!quoted) {
+                out += static_cast<char>(v.i);
+            } else if (v.i == '\n') {
+                out += "'\\n'";
+            } else if (v.i == '\'' || v.i == '\\') {
+                ((out += "'\\") += static_cast<char>(v.i)) += '\'';
+            } else if (v.i >= 32 && v.i < 127) {
+                ((out += '\'') += static_cast<char>(v.i)) += '\'';
+            } else {
+                r = to_chars(buf, buf + sizeof(buf), v.i);
+                break;
+            }
+            return;
+        case ValueType::Float: r = to_chars(buf, buf + sizeof(buf), static_cast<float>(v.f)); break;
+        case ValueType::Double: r = to_chars(buf, buf + sizeof(buf), v.f); break;
+        case ValueType::String: {
+            const string &s = size_t(v.i) < strings.size() ? strings[v.i] : strings.front();
+            if (!quoted) {
+                out += s;
+                return;
+            }
+            out += '"';
+            for (char c : s) {
+                if (c == '\n') out += "\\n";
+                else if (c == '"' || c == '\\') (out += '\\') += c;
+                else out += c;
+            }
+            out += '"';
+            return;
+        }
+        default: r = to_chars(buf, buf + sizeof(buf), v.i); break;
+    }
+    out.append(buf, r.ptr);
+}
+
+// ---------- Native stack ----------
+
+// Run f() on a thread with a stack of `bytes`, for engines that recurse on
+// the native stack once per interpreted call, so maxCallDepth rather than
+// the process's stack limit decides how deep a program may go. Returns
+// false if f() had to run on the current stack instead: without POSIX
+// threads, or when the thread could not be started.
+template <class F>
+inline bool runWithStack(size_t bytes, F &&f) {
+#if defined(__unix__) || defined(__APPLE__)
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, bytes);
+    pthread_t thread;
+    auto start = [](void *p) -> void * {
+        (*static_cast<remove_reference_t<F> *>(p))();
+        return nullptr;
+    };
+    bool started = pthread_create(&thread, &attr, start, &f) == 0;
+    pthread_attr_destroy(&attr);
+    if (started) {
+        pthread_join(thread, nullptr);
+        return true;
+    }
+#else
+    (void)bytes;
+#endif
+    f();
+    return false;
+}
@@ -0,0 +1,111 @@
+// ast_test.cpp
+// Ast::save() and Ast::load() round-trip a parsed tree byte for byte, an
+// AstView walks a mapped file in place, and both reject files whose indices
+// could send a walk out of bounds.
+
+#include <sys/mman.h>
+
+#include "../parser.h"
+#include "check.h"
+
+static string saved(const Ast &ast) {
+    ostringstream out;
+    ast.save(out);
+    return move(out).str();
+}
+
+template <typename Tree>
+static string dumped(const Tree &ast, const vector<Token> &tokens) {
+    ostringstream out;
+    dumpAst(ast, ast.root, tokens, out);
+    return move(out).str();
+}
+
+int main() {
+    Lexer lexer;
+    const vector<Token> &tokens = lexer.tokenize(
+        "int f(int a, long b) { for (int i = 0; i < a; ++i) b += g(i, a[i]); if (b > 0) return 1; return 0; }\n"
+        "string s = \"x\"; if (f(1, 2)) s = s; else { while (1) break; }\n");
+    Ast ast;
+    Parser parser(tokens, ast);
+    parser.parseProgram();
+    CHECK(parser.diagnostics().empty());
+    CHECK(ast.nodes.size() > 40);
+
+    // Round trip: the same bytes, the same tree.
+    string file = saved(ast);
+    CHECK(file.size() == sizeof(AstFileHeader) + ast.nodes.size() * sizeof(AstNode) + ast.lists.size() * sizeof(NodeId));
+    Ast loaded;
+    CHECK(loaded.load(file.data(), file.size(), tokens.size()));
+    CHECK(loaded.root == ast.root && loaded.lists == ast.lists && loaded.nodes.size() == ast.nodes.size());
+    CHECK(memcmp(loaded.nodes.data(), ast.nodes.data(), ast.nodes.size() * sizeof(AstNode)) == 0);
+    CHECK(dumped(loaded, tokens) == dumped(ast, tokens));
+    CHECK(saved(loaded) == file);
+
+    // The same file mapped and used where it lies.
+    char path[] = "/tmp/ast_test-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0 && write(fd, file.data(), file.size()) == ssize_t(file.size()));
+    unlink(path);
+    void *mapped = mmap(nullptr, file.size(), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CHECK(mapped != MAP_FAILED);
+    AstView view;
+    CHECK(view.open(static_cast<const char *>(mapped), file.size(), tokens.size()));
+    CHECK(static_cast<const void *>(view.nodes) == static_cast<const char *>(mapped) + sizeof(AstFileHeader));
+    CHECK(view.root == ast.root && view.nodeCount == ast.nodes.size() && view.listCount == ast.lists.size());
+    CHECK(dumped(view, tokens) == dumped(ast, tokens));
+    munmap(mapped, file.size());
+
+    // A view needs the arrays 4-byte aligned.
+    vector<uint32_t> words(file.size() / 4 + 2);
+    char *odd = reinterpret_cast<char *>(words.data()) + 1;
+    memcpy(odd, file.data(), file.size());
+    CHECK(!view.open(odd, file.size(), tokens.size()) && !view.nodes);
+    CHECK(loaded.load(odd, file.size(), tokens.size()));
+
+    // Nodes have no padding, so the file depends only on the tree: a node
+    // built over garbage memory saves the same as one built over zeros.
+    alignas(AstNode) unsigned char dirty[sizeof(AstNode)];
+    memset(dirty, 0xAB, sizeof dirty);
+    AstNode *n = new (dirty) AstNode;
+    *n = AstNode{NodeKind::Name, 3, 0, kNoNode, kNoNode, kNoNode, kNoNode, 0, 0};
+    Ast one;
+    one.nodes.push_back(*n);
+    Ast other;
+    other.nodes.push_back(AstNode{NodeKind::Name, 3, 0, kNoNode, kNoNode, kNoNode, kNoNode, 0, 0});
+    CHECK(saved(one) == saved(other));
+
+    // Damaged files are refused by both, and leave an empty tree.
+    auto refused = [&](string bad) {
+        Ast a;
+        AstView v;
+        vector<uint32_t> aligned(bad.size() / 4 + 1);
+        memcpy(aligned.data(), bad.data(), bad.size());
+        return !a.load(bad.data(), bad.size(), tokens.size()) && a.nodes.size() == 1 &&
+               !v.open(reinterpret_cast<const char *>(aligned.data()), bad.size(), tokens.size()) && !v.nodes;
+    };
+    CHECK(refused(file.substr(0, file.size() - 1)));
+    CHECK(refused("TKAST999" + file.substr(8)));
+    size_t nodes = sizeof(AstFileHeader);
+    auto withNode = [&](NodeId id, const AstNode &node) {
+        string bad = file;
+        memcpy(&bad[nodes + id * sizeof(AstNode)], &node, sizeof node);
+        return bad;
+    };
+    AstNode root = ast[ast.root];
+    AstNode outside = root;
+    outside.a = NodeId(ast.nodes.size());
+    CHECK(refused(withNode(ast.root, outside)));
+    AstNode cycle = root;
+    cycle.a = ast.root;
+    CHECK(refused(withNode(ast.root, cycle)));
+    AstNode badToken = root;
+    badToken.token = uint32_t(tokens.size());
+    CHECK(refused(withNode(ast.root, badToken)));
+    AstNode badKind = root;
+    badKind.kind = NodeKind(uint32_t(NodeKind::Error) + 1);
+    CHECK(refused(withNode(ast.root, badKind)));
+
+    return checkResult("ast_test");
+}
@@ -0,0 +1,30 @@
+// check.h
+// The assertion the tests share: a failed CHECK prints where and what, and
+// marks the run as failed without stopping it.
+
+#pragma once
+
+#include <cstdio>
+
+inline int &checkFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++checkFailures();                                                 \
+        }                                                                      \
+    } while (0)
+
+// Return value for main().
+inline int checkResult(const char *name) {
+    if (checkFailures()) {
+        fprintf(stderr, "%s: %d check(s) failed\n", name, checkFailures());
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
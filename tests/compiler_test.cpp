@@ -0,0 +1,62 @@
+// compiler_test.cpp
+// The bytecode compiler recurses per level of an expression, so it checks
+// kMaxTreeDepth itself: a tree deeper than the parser allows is one error,
+// not a stack overflow.
+
+#include "../parser.h"
+#include "../bytecode.h"
+#include "check.h"
+
+// `int y = 1; y + y + ... ;` with `levels` operators, over the tokens of
+// `int y = 1; y + y;`, built by hand so it can go past what the parser
+// accepts.
+static void chainAst(Ast &ast, size_t levels) {
+    ast.nodes.assign(1, AstNode{});
+    ast.lists.clear();
+    auto node = [&](NodeKind kind, uint32_t token, NodeId a = kNoNode, NodeId b = kNoNode) {
+        ast.nodes.push_back(AstNode{kind, token, 0, a, b, kNoNode, kNoNode, 0, 0});
+        return NodeId(ast.nodes.size() - 1);
+    };
+    auto list = [&](NodeId n, vector<NodeId> children) {
+        ast.nodes[n].first = uint32_t(ast.lists.size());
+        ast.nodes[n].count = uint32_t(children.size());
+        ast.lists.insert(ast.lists.end(), children.begin(), children.end());
+    };
+    NodeId var = node(NodeKind::VarDecl, 1, node(NodeKind::Number, 3));
+    ast.nodes[var].typeToken = 0;
+    NodeId decl = node(NodeKind::DeclStmt, 0);
+    list(decl, {var});
+    NodeId chain = node(NodeKind::Name, 5);
+    for (size_t i = 0; i < levels; ++i) chain = node(NodeKind::Binary, 6, chain, node(NodeKind::Name, 7));
+    NodeId program = node(NodeKind::Program, 0);
+    list(program, {decl, node(NodeKind::ExprStmt, 5, chain)});
+    ast.root = program;
+}
+
+int main() {
+    Lexer lexer;
+    const vector<Token> &tokens = lexer.tokenize("int y = 1; y + y;");
+    CHECK(tokens.size() == 9);
+
+    Ast ast;
+    Program program;
+    Compiler compiler;
+
+    // Just under the cap compiles cleanly.
+    chainAst(ast, kMaxTreeDepth - 10);
+    CHECK(compiler.compile(ast, tokens, program));
+    CHECK(compiler.diagnostics().empty());
+
+    // A million levels: one diagnostic, on the default stack.
+    chainAst(ast, 1000000);
+    CHECK(!compiler.compile(ast, tokens, program));
+    CHECK(compiler.diagnostics().size() == 1);
+    CHECK(!compiler.diagnostics().empty() && compiler.diagnostics()[0].message == "expression nested too deeply");
+
+    // The flag is per compile: the next program is fine again.
+    chainAst(ast, 100);
+    CHECK(compiler.compile(ast, tokens, program));
+    CHECK(compiler.diagnostics().empty());
+
+    return checkResult("compiler_test");
+}
@@ -0,0 +1,43 @@
+// fold_test.cpp
+// The folder computes what the engines would: int wraps at 32 bits, long at
+// 64. Long chains of literals fold without deep recursion.
+
+#include "../folder.h"
+#include "check.h"
+
+static string folded(Lexer &lexer, const string &source) {
+    vector<Token> out;
+    ConstantFolder().fold(lexer.tokenize(source), out, lexer.arena());
+    string text;
+    for (const Token &t : out) text += (text.empty() ? "" : " ") + string(t.lexeme);
+    return text;
+}
+
+int main() {
+    Lexer lexer;
+
+    // The int overflow boundary.
+    CHECK(folded(lexer, "x = 2147483647 + 1;") == "x = -2147483648 ;");
+    CHECK(folded(lexer, "x = -2147483647 - 1 - 1;") == "x = 2147483647 ;");
+    CHECK(folded(lexer, "x = 65536 * 65536;") == "x = 0 ;");
+    CHECK(folded(lexer, "x = (-2147483647 - 1) / -1;") == "x = -2147483648 ;");
+    CHECK(folded(lexer, "x = (-2147483647 - 1) % -1;") == "x = 0 ;");
+    // A long operand makes the arithmetic long.
+    CHECK(folded(lexer, "x = 2147483648 + 1;") == "x = 2147483649 ;");
+    CHECK(folded(lexer, "x = 9223372036854775807 + 1;") == "x = -9223372036854775808 ;");
+    // A long result in int range would read back as an int: not folded.
+    CHECK(folded(lexer, "x = 4294967296 - 4294967295;") == "x = 4294967296 - 4294967295 ;");
+    CHECK(folded(lexer, "x = -2147483648;") == "x = - 2147483648 ;");
+    // Division by zero is left for the engines to report.
+    CHECK(folded(lexer, "x = 7 / 0;") == "x = 7 / 0 ;");
+    CHECK(folded(lexer, "x = 1.5 * 2 + 1;") == "x = 4.0 ;");
+
+    // 300000 terms: folded up to kMaxTreeDepth levels, the rest left alone.
+    string chain = "x = 1";
+    for (int i = 1; i < 300000; ++i) chain += "+1";
+    string expected = "x = " + to_string(kMaxTreeDepth);
+    for (uint32_t i = kMaxTreeDepth; i < 300000; ++i) expected += " + 1";
+    CHECK(folded(lexer, chain + ";") == expected + " ;");
+
+    return checkResult("fold_test");
+}
@@ -0,0 +1,45 @@
+// frames_test.cpp
+// Length framing trusts a header only up to kMaxFrameSize, and only
+// allocates for bytes that have arrived.
+
+#include "../frames.h"
+#include "check.h"
+
+// Read every document of `input`; returns the documents, and the reader's
+// error in `error`.
+static vector<string> readAll(const string &input, string &error) {
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    vector<string> docs;
+    thread writer([&] {
+        CHECK(write(fds[1], input.data(), input.size()) == ssize_t(input.size()));
+        close(fds[1]);
+    });
+    FrameReader reader(fds[0], Framing::Length);
+    string_view doc;
+    while (reader.next(doc)) docs.emplace_back(doc);
+    writer.join();
+    close(fds[0]);
+    error = reader.error();
+    return docs;
+}
+
+int main() {
+    string error;
+    CHECK(readAll("11\nint x = 1;\n\n3\na;b", error) == vector<string>({"int x = 1;\n", "a;b"}));
+    CHECK(error.empty());
+
+    // A 10 GB header is refused before anything is allocated for it.
+    CHECK(readAll("9999999999\nint x;", error).empty());
+    CHECK(error == "frame too large (the limit is 256 MB)");
+
+    // A header at the limit with six bytes behind it: the buffer grows
+    // with the input, and the document is reported as truncated.
+    CHECK(readAll(to_string(FrameReader::kMaxFrameSize) + "\nint x;", error).empty());
+    CHECK(error == "truncated document");
+
+    CHECK(readAll("12x\n", error).empty());
+    CHECK(error == "bad frame header (expected a byte count and a newline)");
+
+    return checkResult("frames_test");
+}
@@ -0,0 +1,52 @@
+// lexer_concurrency_test.cpp
+// One Lexer per thread, shared keyword and operator tables: threads lexing
+// at the same time get exactly the results of a single thread. `make -C
+// tests tsan` runs this under ThreadSanitizer.
+
+#include <thread>
+
+#include "../lexer.h"
+#include "check.h"
+
+// Everything a request returns, flattened to compare across threads.
+static string summary(Lexer &lexer, string_view source) {
+    string out;
+    for (const Token &t : lexer.tokenize(source)) {
+        out += to_string(t.line) + ' ' + to_string(int(t.kind)) + ' ';
+        out.append(t.lexeme.data(), t.lexeme.size());
+        out += '\n';
+    }
+    for (const LexWarning &d : lexer.diagnostics()) out += "! " + to_string(d.line) + ' ' + d.message + '\n';
+    return out;
+}
+
+int main() {
+    const vector<string> sources = {
+        "int main() { return 0; }",
+        "while (x <= 10) { x += .45e-1; s = \"a\\tb\"; c = '\\n'; }",
+        "a >>= b << 2; p->q++ != --r && !t || u ? v : w;",
+        "x = 1; /* never closed",
+        "s = \"unterminated\nc = 'z",
+        "for (long i = 0x1F; i < 077; ++i) f(i, 1.5e+3, 2.);",
+    };
+    Lexer single;
+    vector<string> expected;
+    for (const string &s : sources) expected.push_back(summary(single, s));
+
+    const int kThreads = 8, kRounds = 2000;
+    vector<int> mismatches(kThreads, 0);
+    vector<thread> threads;
+    for (int k = 0; k < kThreads; ++k) {
+        threads.emplace_back([&, k] {
+            Lexer lexer; // reused across this thread's requests
+            for (int round = 0; round < kRounds; ++round) {
+                size_t i = size_t(round + k) % sources.size();
+                if (summary(lexer, sources[i]) != expected[i]) ++mismatches[k];
+            }
+        });
+    }
+    for (thread &t : threads) t.join();
+    for (int k = 0; k < kThreads; ++k) CHECK(mismatches[k] == 0);
+
+    return checkResult("lexer_concurrency_test");
+}
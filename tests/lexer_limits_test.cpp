@@ -0,0 +1,89 @@
+// lexer_limits_test.cpp
+// LexerOptions and LexState: a run cut into maxTokens slices and resumed
+// gives exactly the tokens, lines and warnings of one full run, and a
+// cancel or an expired deadline stops the lex at its first checkpoint.
+
+#include "../lexer.h"
+#include "check.h"
+
+struct Run {
+    vector<tuple<string, int, TokenKind>> tokens;
+    vector<pair<int, string>> warnings;
+    bool operator==(const Run &o) const { return tokens == o.tokens && warnings == o.warnings; }
+};
+
+static void collect(Run &run, const vector<Token> &tokens) {
+    for (const Token &t : tokens) run.tokens.emplace_back(string(t.lexeme), t.line, t.kind);
+}
+
+int main() {
+    // Snippets with newlines inside tokens, comments and unterminated
+    // literals, so line counting and warnings carry across slices.
+    const char *const pieces[] = {
+        "int x = 42;\n", "s = \"two\\nlines\";\n", "/* a\ncomment */ y >>= 2;", "c = 'q;\n",
+        "// to the end\n", "f(.5e-3, 0x1F, a<=b);", "\"open\n", "  \t\n\n", "while (i--) {}\n",
+    };
+    mt19937 random(7);
+    string source;
+    while (source.size() < 200000) source += pieces[random() % size(pieces)];
+    source += "/* never closed";
+
+    Lexer lexer;
+    Run full;
+    collect(full, lexer.tokenize(source));
+    for (const LexWarning &w : lexer.diagnostics()) full.warnings.emplace_back(w.line, w.message);
+    CHECK(full.tokens.size() > 10000 && full.warnings.size() > 100);
+
+    // The same input in slices of every size from 1 to 50 tokens.
+    for (size_t slice : {1, 2, 3, 7, 50}) {
+        LexerOptions options;
+        options.maxTokens = slice;
+        lexer.setOptions(options);
+        Run sliced;
+        LexState state;
+        size_t calls = 0;
+        do {
+            const vector<Token> &part = lexer.tokenize(source, state);
+            CHECK(part.size() <= slice);
+            collect(sliced, part);
+            ++calls;
+        } while (state.status == LexStatus::TokenLimit);
+        CHECK(state.status == LexStatus::Complete && state.pos == source.size());
+        for (const LexWarning &w : lexer.diagnostics()) sliced.warnings.emplace_back(w.line, w.message);
+        CHECK(sliced == full);
+        CHECK(calls >= full.tokens.size() / slice);
+    }
+
+    // Cancelled before the call: the lex stops at the first checkpoint,
+    // checkInterval bytes in (finishing the token it is in).
+    CancelToken cancel;
+    cancel.cancel();
+    LexerOptions options;
+    options.cancel = &cancel;
+    options.checkInterval = 256;
+    lexer.setOptions(options);
+    LexState state;
+    const vector<Token> &cancelled = lexer.tokenize(source, state);
+    CHECK(state.status == LexStatus::Cancelled);
+    CHECK(state.pos >= 256 && state.pos < 256 + 64);
+    CHECK(!cancelled.empty() && cancelled.size() < 100);
+
+    // An expired deadline stops it the same way.
+    options = LexerOptions{};
+    options.deadline = chrono::steady_clock::now() - chrono::seconds(1);
+    options.checkInterval = 256;
+    lexer.setOptions(options);
+    state = LexState{};
+    Run resumed;
+    collect(resumed, lexer.tokenize(source, state));
+    CHECK(state.status == LexStatus::DeadlineExceeded);
+    CHECK(state.pos >= 256 && state.pos < 256 + 64);
+
+    // Lifting the deadline and resuming from the same state finishes the run.
+    lexer.setOptions(LexerOptions{});
+    collect(resumed, lexer.tokenize(source, state));
+    CHECK(state.status == LexStatus::Complete);
+    CHECK(resumed.tokens == full.tokens);
+
+    return checkResult("lexer_limits_test");
+}
@@ -0,0 +1,54 @@
+// lexer_reuse_test.cpp
+// A warm Lexer allocates nothing per request, warnings included: its token
+// buffer, warnings and arena are kept from the previous one. Allocations are
+// counted by replacing the global operator new.
+
+#include "../lexer.h"
+#include "check.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    ++allocations;
+    if (void *p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+int main() {
+    string source;
+    for (int i = 0; i < 200; ++i)
+        source += "int f" + to_string(i) + "(int a) { while (a >= 10) a -= .5e1; return a * 2; } // done\n";
+
+    // A fresh Lexer per request allocates on every request.
+    size_t before = allocations;
+    for (int i = 0; i < 10; ++i) {
+        Lexer fresh;
+        fresh.tokenize(source);
+    }
+    CHECK(allocations - before >= 10);
+
+    // One Lexer reused: the first request sizes the buffers, the rest
+    // allocate nothing.
+    Lexer lexer;
+    size_t tokens = lexer.tokenize(source).size();
+    before = allocations;
+    for (int i = 0; i < 100; ++i) CHECK(lexer.tokenize(source).size() == tokens);
+    CHECK(allocations == before);
+
+    // Warnings are static text: a run of them costs no allocation either.
+    string warnings;
+    for (int i = 0; i < 1000; ++i) warnings += "'ab'ab";
+    warnings += "\n\"open /* still open";
+    size_t count = lexer.tokenize(warnings).size(), warned = lexer.diagnostics().size();
+    CHECK(warned > 1000);
+    before = allocations;
+    for (int i = 0; i < 100; ++i) {
+        CHECK(lexer.tokenize(warnings).size() == count);
+        CHECK(lexer.diagnostics().size() == warned);
+    }
+    CHECK(allocations == before);
+
+    return checkResult("lexer_reuse_test");
+}
@@ -0,0 +1,55 @@
+// match_test.cpp
+// --match semantics: leftmost-shortest, non-overlapping matches found in one
+// pass, whatever the pattern.
+
+#include "../match.h"
+#include "check.h"
+
+static vector<string> matchAll(Lexer &lexer, const string &pattern, const string &source) {
+    TokenPattern compiled;
+    string error;
+    CHECK(compilePattern(pattern, compiled, error));
+    vector<string> found;
+    TokenMatcher matcher(compiled, [&](const vector<Token> &m) {
+        string text;
+        for (const Token &t : m) text += (text.empty() ? "" : " ") + string(t.lexeme);
+        found.push_back(text);
+    });
+    lexer.tokenizeStream(source, [&](Token &&t) { matcher.push(t); });
+    matcher.finish();
+    return found;
+}
+
+int main() {
+    Lexer lexer;
+
+    // The README example, on several calls in a row: `_*` stops at the
+    // first `)`, and nothing carries over from one call to the next.
+    const string calls = "foo(\"a\"); bar(x); baz(\"b\");";
+    const vector<string> expected = {"foo ( \"a\" )", "bar ( x )", "baz ( \"b\" )"};
+    for (int round = 0; round < 3; ++round) CHECK(matchAll(lexer, "Identifier ( _* )", calls) == expected);
+
+    // Leftmost start wins, then the shortest match from it.
+    CHECK(matchAll(lexer, "_* )", "a ( b ) c )") == vector<string>({"a ( b )", "c )"}));
+    CHECK(matchAll(lexer, "Identifier+", "a b 1 c") == vector<string>({"a", "b", "c"}));
+    CHECK(matchAll(lexer, "Number Operator? Number", "1 2 3 + 4") == vector<string>({"1 2", "3 + 4"}));
+    CHECK(matchAll(lexer, "while ( Identifier", "while (x) while (1)") == vector<string>({"while ( x"}));
+
+    // An attempt that never finishes is given up after kMaxMatchTokens,
+    // and later matches are still found.
+    string unclosed = "f(";
+    for (size_t i = 0; i < 2 * TokenMatcher::kMaxMatchTokens; ++i) unclosed += " x";
+    unclosed += "; g(y)";
+    CHECK(matchAll(lexer, "Identifier ( _* )", unclosed) == vector<string>({"g ( y )"}));
+
+    // `_* foo` where foo only occurs inside identifiers: no match, and one
+    // pass over 80k tokens (this took a minute when every failed attempt
+    // was replayed).
+    string big;
+    for (int i = 0; i < 20000; ++i) big += "int food" + to_string(i) + " = barfoo(x);\n";
+    auto start = chrono::steady_clock::now();
+    CHECK(matchAll(lexer, "_* foo", big).empty());
+    CHECK(chrono::steady_clock::now() - start < chrono::seconds(5));
+
+    return checkResult("match_test");
+}
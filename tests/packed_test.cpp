@@ -0,0 +1,71 @@
+// packed_test.cpp
+// PackedTokens and Segmented: random inputs packed and unpacked give the
+// kind, lexeme and line Lexer::tokenize gives, across 64 KB block
+// boundaries, and blocks a container releases are the ones the next
+// container takes.
+
+#include "../lexer.h"
+#include "check.h"
+
+#include <set>
+
+int main() {
+    // Snippets with newlines inside tokens, comments and unterminated
+    // literals, so the lazily indexed lines have something to get wrong.
+    const char *const pieces[] = {
+        "int x = 42;\n", "s = \"two\\nlines\";\n", "/* a\ncomment */ y >>= 2;", "c = 'q;\n",
+        "// to the end\n", "f(.5e-3, 0x1F, a<=b);", "\"open\n", "  \t\n\n", "while (i--) {}\n",
+    };
+    mt19937 random(11);
+    Lexer lexer;
+    PackedTokens packed;
+    for (int round = 0; round < 20; ++round) {
+        string source;
+        size_t target = random() % 100000;
+        while (source.size() < target) source += pieces[random() % size(pieces)];
+        // One lexeme too long for the 16-bit length field.
+        if (round % 4 == 0) source += "\nname" + string(70000 + random() % 100, 'z') + " = 1;\n";
+
+        CHECK(lexer.tokenizePacked(source, packed));
+        const vector<Token> &tokens = lexer.tokenize(source);
+        CHECK(packed.size() == tokens.size());
+        size_t mismatches = 0;
+        for (size_t i = 0; i < min(packed.size(), tokens.size()); ++i) {
+            const Token &t = tokens[i];
+            string_view lexeme = packed.lexeme(i);
+            mismatches += packed.kind(i) != t.kind || lexeme.data() != t.lexeme.data() ||
+                          lexeme.size() != t.lexeme.size() || packed.line(i) != t.line;
+        }
+        CHECK(mismatches == 0);
+        if (target > 80000) CHECK(packed.raw().blockCount() > 1);
+    }
+
+    // Tokens lexed straight into Segmented storage, many blocks of them.
+    string source;
+    while (source.size() < 300000) source += pieces[random() % size(pieces)];
+    const vector<Token> &tokens = lexer.tokenize(source);
+    Segmented<Token> segmented;
+    LexState state;
+    CHECK(lexer.tokenize(source, segmented, state) == LexStatus::Complete);
+    CHECK(segmented.blockCount() > 2 && segmented.size() == tokens.size());
+    CHECK(equal(segmented.begin(), segmented.end(), tokens.begin(), tokens.end(), [](const Token &x, const Token &y) {
+        return x.lexeme.data() == y.lexeme.data() && x.lexeme.size() == y.lexeme.size() && x.line == y.line &&
+               x.kind == y.kind;
+    }));
+
+    // Released blocks go back to the pool and are handed out again.
+    Segmented<uint32_t> first;
+    for (uint32_t i = 0; i < 3 * Segmented<uint32_t>::kPerBlock + 5; ++i) first.push_back(i);
+    CHECK(first.blockCount() == 4);
+    CHECK(first[Segmented<uint32_t>::kPerBlock] == Segmented<uint32_t>::kPerBlock && first.back() == first.size() - 1);
+    set<const uint32_t *> released;
+    for (size_t b = 0; b < first.blockCount(); ++b) released.insert(first.blockData(b));
+    first.clear();
+    Segmented<uint32_t> second;
+    for (uint32_t i = 0; i < 3 * Segmented<uint32_t>::kPerBlock + 5; ++i) second.push_back(i);
+    set<const uint32_t *> reused;
+    for (size_t b = 0; b < second.blockCount(); ++b) reused.insert(second.blockData(b));
+    CHECK(reused == released);
+
+    return checkResult("packed_test");
+}
@@ -0,0 +1,73 @@
+// parser_test.cpp
+// Trees deep enough to overflow a recursive walk: the parser stops at
+// kMaxTreeDepth with one error, and dumpAst prints any depth.
+
+#include "../parser.h"
+#include "../runtime.h"
+#include "check.h"
+
+// `int x = y+y+...+y;` with `terms` terms: a left-deep chain of Binary nodes.
+static string chain(size_t terms) {
+    string s = "int y = 1;\nint x = y";
+    for (size_t i = 1; i < terms; ++i) s += "+y";
+    return s + ";\n";
+}
+
+static vector<Diagnostic> parse(Lexer &lexer, const string &source, Ast &ast) {
+    Parser parser(lexer.tokenize(source), ast);
+    parser.parseProgram();
+    return parser.diagnostics();
+}
+
+int main() {
+    Lexer lexer;
+    Ast ast;
+
+    // Just under the cap: no error.
+    CHECK(parse(lexer, chain(kMaxTreeDepth - 10), ast).empty());
+
+    // Over it, as a chain, as nested unary operators and as postfix
+    // indexing: one error each, and the parse stops.
+    for (const string &source : {chain(300000), "int x = " + string(2 * kMaxTreeDepth, '-') + "y;",
+                                 "int x = a" + [] {
+                                     string s;
+                                     for (uint32_t i = 0; i < 2 * kMaxTreeDepth; ++i) s += "[0]";
+                                     return s;
+                                 }() + ";"}) {
+        vector<Diagnostic> diagnostics = parse(lexer, source, ast);
+        CHECK(diagnostics.size() == 1);
+        CHECK(!diagnostics.empty() && diagnostics[0].message.find("nested too deeply") != string::npos);
+    }
+
+    // Heights add up across nesting: two chains under the cap, one as the
+    // left operand of the other, go over it.
+    string half(kMaxTreeDepth * 3 / 4, ' ');
+    string inner = "(y", outer;
+    for (size_t i = 1; i < half.size(); ++i) inner += "+y";
+    inner += ")";
+    for (size_t i = 1; i < half.size(); ++i) outer += "+y";
+    CHECK(parse(lexer, "int x = " + inner + outer + ";", ast).size() == 1);
+
+    // dumpAst does not recurse: it prints a 5000-level chain on a thread
+    // with a 128 KB stack, about 26 bytes a level.
+    const vector<Token> &tokens = lexer.tokenize("y + y");
+    Ast deep;
+    deep.nodes.push_back(AstNode{NodeKind::Name, 0, 0, kNoNode, kNoNode, kNoNode, kNoNode, 0, 0});
+    const size_t levels = 5000;
+    for (size_t i = 0; i < levels; ++i) {
+        NodeId left = NodeId(deep.nodes.size() - 1);
+        deep.nodes.push_back(AstNode{NodeKind::Name, 2, 0, kNoNode, kNoNode, kNoNode, kNoNode, 0, 0});
+        deep.nodes.push_back(AstNode{NodeKind::Binary, 1, 0, left, NodeId(deep.nodes.size() - 1), kNoNode, kNoNode, 0, 0});
+    }
+    deep.root = NodeId(deep.nodes.size() - 1);
+    string text;
+    CHECK(runWithStack(128 * 1024, [&] {
+        ostringstream out;
+        dumpAst(deep, deep.root, tokens, out);
+        text = out.str();
+    }));
+    CHECK(size_t(count(text.begin(), text.end(), '\n')) == 2 * levels + 1);
+    CHECK(text.compare(0, 9, "Binary +\n") == 0);
+
+    return checkResult("parser_test");
+}
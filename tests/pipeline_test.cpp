@@ -0,0 +1,82 @@
+// pipeline_test.cpp
+// parseParallel builds node for node the tree a serial parse builds, at
+// any thread count, and falls back to the serial parse (and its
+// diagnostics) when a chunk has a syntax error.
+
+#include "../pipeline.h"
+#include "check.h"
+
+struct Parsed {
+    Ast ast;
+    vector<pair<int, string>> diagnostics;
+};
+
+static bool sameTree(const Ast &x, const Ast &y) {
+    return x.root == y.root && x.lists == y.lists && x.nodes.size() == y.nodes.size() &&
+           memcmp(x.nodes.data(), y.nodes.data(), x.nodes.size() * sizeof(AstNode)) == 0;
+}
+
+static void serial(const vector<Token> &tokens, Parsed &out) {
+    Parser parser(tokens, out.ast);
+    parser.parseProgram();
+    out.diagnostics.clear();
+    for (const Diagnostic &d : parser.diagnostics()) out.diagnostics.emplace_back(d.line, d.message);
+}
+
+static void parallel(const vector<Token> &tokens, unsigned threads, Parsed &out) {
+    WorkStealingPool pool(threads);
+    vector<Diagnostic> diagnostics;
+    parseParallel(tokens, out.ast, pool, diagnostics);
+    out.diagnostics.clear();
+    for (const Diagnostic &d : diagnostics) out.diagnostics.emplace_back(d.line, d.message);
+}
+
+// Functions with top-level statements between them, a preprocessor line
+// before some, and `broken` spliced into function `brokenAt` if given.
+static string program(int functions, int brokenAt = -1, const string &broken = "") {
+    string s = "#include <stdio.h>\nint counter = 0;\n";
+    for (int i = 0; i < functions; ++i) {
+        if (i % 5 == 0) s += "#define STEP" + to_string(i) + " 1\n";
+        s += "int f" + to_string(i) + "(int a, int b) {\n  int t = a * " + to_string(i) + ";\n";
+        s += "  for (int k = 0; k < b; ++k) { t += k; if (t > 100) break; }\n";
+        if (i == brokenAt) s += broken;
+        s += "  return t + counter;\n}\n";
+        if (i % 3 == 0) s += "counter = counter + " + to_string(i) + ";\nprint(counter);\n";
+    }
+    return s + "print(f1(2, 3));\n";
+}
+
+int main() {
+    Lexer lexer;
+    const string good = program(300);
+    const vector<Token> &tokens = lexer.tokenize(good);
+    CHECK(tokens.size() > 4 * kMinParallelTokens);
+
+    vector<uint32_t> match;
+    CHECK(bracketIndex(tokens, match));
+    // Functions and the code between them: more chunks than functions.
+    CHECK(topLevelChunks(tokens, match).size() > 300);
+
+    Parsed expected, got;
+    serial(tokens, expected);
+    CHECK(expected.diagnostics.empty());
+    for (unsigned threads : {1u, 2u, 8u}) {
+        parallel(tokens, threads, got);
+        CHECK(sameTree(got.ast, expected.ast));
+        CHECK(got.diagnostics.empty());
+    }
+
+    // A syntax error inside one function: the serial parse's tree and
+    // diagnostics, at every thread count.
+    const string bad = program(300, 150, "  t = (a + ;\n");
+    const vector<Token> &badTokens = lexer.tokenize(bad);
+    serial(badTokens, expected);
+    CHECK(!expected.diagnostics.empty());
+    for (unsigned threads : {1u, 2u, 8u}) {
+        parallel(badTokens, threads, got);
+        CHECK(sameTree(got.ast, expected.ast));
+        CHECK(got.diagnostics == expected.diagnostics);
+    }
+
+    return checkResult("pipeline_test");
+}
@@ -0,0 +1,60 @@
+// resolver_test.cpp
+// The resolver walks with its own stack: a million-level expression
+// resolves on a thread with a 128 KB stack.
+
+#include "../parser.h"
+#include "../resolver.h"
+#include "../runtime.h"
+#include "check.h"
+
+int main() {
+    Lexer lexer;
+    // Tokens: int y = 1 ; y + y ;
+    const vector<Token> &tokens = lexer.tokenize("int y = 1; y + y;");
+    CHECK(tokens.size() == 9);
+
+    Ast ast;
+    auto node = [&](NodeKind kind, uint32_t token, NodeId a = kNoNode, NodeId b = kNoNode) {
+        ast.nodes.push_back(AstNode{kind, token, 0, a, b, kNoNode, kNoNode, 0, 0});
+        return NodeId(ast.nodes.size() - 1);
+    };
+    auto list = [&](NodeId n, vector<NodeId> children) {
+        ast.nodes[n].first = uint32_t(ast.lists.size());
+        ast.nodes[n].count = uint32_t(children.size());
+        ast.lists.insert(ast.lists.end(), children.begin(), children.end());
+    };
+    NodeId var = node(NodeKind::VarDecl, 1, node(NodeKind::Number, 3));
+    ast.nodes[var].typeToken = 0;
+    NodeId decl = node(NodeKind::DeclStmt, 0);
+    list(decl, {var});
+    // y + y + ... with a million operators, far past kMaxTreeDepth.
+    const size_t levels = 1000000;
+    NodeId chain = node(NodeKind::Name, 5);
+    for (size_t i = 0; i < levels; ++i) chain = node(NodeKind::Binary, 6, chain, node(NodeKind::Name, 7));
+    NodeId program = node(NodeKind::Program, 0);
+    list(program, {decl, node(NodeKind::ExprStmt, 5, chain)});
+    ast.root = program;
+
+    Resolver resolver;
+    DefUseTable table;
+    CHECK(runWithStack(128 * 1024, [&] { resolver.resolve(ast, tokens, table); }));
+    CHECK(table.symbols.size() == 1);
+    CHECK(table.uses.size() == levels + 1);
+    CHECK(all_of(table.uses.begin(), table.uses.end(), [](const SymbolUse &u) { return u.symbol == 0; }));
+    // Uses are in source order: the chain's leftmost name first.
+    CHECK(!table.uses.empty() && table.uses.front().token == 5 && table.uses.back().token == 7);
+
+    // Scopes still open and close in order around the explicit stack.
+    // Symbols: f (functions are declared first), the global a, the
+    // parameter a, the block's a.
+    const vector<Token> &scoped = lexer.tokenize("int a; void f(int a) { { int a; a; } a; } a;");
+    Parser parser(scoped, ast);
+    parser.parseProgram();
+    CHECK(parser.diagnostics().empty());
+    resolver.resolve(ast, scoped, table);
+    CHECK(table.symbols.size() == 4);
+    CHECK(table.uses.size() == 3 && table.uses[0].symbol == 3 && table.uses[1].symbol == 2 && table.uses[2].symbol == 1);
+    CHECK(resolver.diagnostics().empty());
+
+    return checkResult("resolver_test");
+}
@@ -0,0 +1,218 @@
+// trace.h
+// Timeline tracing for the batch and parallel modes: where each thread
+// spends its time reading input, lexing, parsing, waiting for a ring slot
+// or for its turn to write. Set TK_TRACE=FILE and, at exit, FILE gets the
+// events in Chrome trace JSON, which ui.perfetto.dev and chrome://tracing
+// open directly.
+//
+// Every thread appends to its own buffer (Segmented blocks, so appending
+// never moves an event), found through a thread_local pointer: recording
+// takes no lock and touches no shared cache line. The list of buffers is
+// locked only when a thread records its first event. Events are complete
+// spans ("ph": "X") recorded by a TraceScope around work of at least a
+// batch or a file, never a single token, and waits are kept only when they
+// are long enough to matter, so tracing costs little even when on; when
+// off, a scope is a test of one flag.
+
+#pragma once
+
+#include "lexer.h"
+
+class Trace {
+public:
+    // Waits shorter than this are not worth an event.
+    static constexpr int64_t kMinWaitNs = 20000;
+
+    struct Event {
+        const char *name;     // string literals only: events keep the pointer
+        const char *category;
+        int64_t start, duration; // ns since the trace started
+        const char *argName;  // null: no argument
+        int64_t arg;
+    };
+
+    static bool enabled() { return enabled_; }
+
+    // Record from now on and write the trace to `path` at exit.
+    static void start(string path) {
+        origin_ = chrono::steady_clock::now();
+        path_ = move(path);
+        enabled_ = true;
+        atexit([] {
+            if (!write(path_)) fprintf(stderr, "Error: could not write the trace to '%s'\n", path_.c_str());
+        });
+    }
+
+    static int64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin_).count();
+    }
+
+    // Name the calling thread in the timeline.
+    static void threadName(string name) {
+        if (enabled_) buffer().name = move(name);
+    }
+
+    static void record(const Event &e) { buffer().events.push_back(e); }
+
+    // Write every thread's events. Call only when no thread is recording.
+    static bool write(const string &path) {
+        FILE *out = fopen(path.c_str(), "w");
+        if (!out) return false;
+        lock_guard<mutex> hold(lock());
+        Json json(out);
+        json.put("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        const char *sep = "";
+        for (const auto &b : buffers()) {
+            json.put(sep);
+            sep = ",\n";
+            json.put("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":");
+            json.number(b->tid);
+            json.put(",\"args\":{\"name\":\"");
+            json.escape(b->name.empty() ? "thread " + to_string(b->tid) : b->name);
+            json.put("\"}}");
+            // Names are string literals from this code base, with nothing
+            // to escape; only the thread's tid differs between buffers.
+            string tid = ",\"pid\":1,\"tid\":" + to_string(b->tid) + ",\"ts\":";
+            for (const Event &e : b->events) {
+                json.put(",\n{\"ph\":\"X\",\"name\":\"");
+                json.put(e.name);
+                json.put("\",\"cat\":\"");
+                json.put(e.category);
+                json.put("\"");
+                json.put(tid);
+                json.micros(e.start);
+                json.put(",\"dur\":");
+                json.micros(e.duration);
+                if (e.argName) {
+                    json.put(",\"args\":{\"");
+                    json.put(e.argName);
+                    json.put("\":");
+                    json.number(e.arg);
+                    json.put("}");
+                }
+                json.put("}");
+            }
+        }
+        json.put("\n]}\n");
+        bool ok = json.flush();
+        return fclose(out) == 0 && ok;
+    }
+
+private:
+    struct Buffer {
+        uint32_t tid;
+        string name;
+        Segmented<Event> events;
+    };
+
+    static inline bool enabled_ = false;
+    static inline chrono::steady_clock::time_point origin_;
+    static inline string path_;
+
+    // Buffers outlive their threads, so events of finished workers are kept.
+    static mutex &lock() {
+        static mutex *m = new mutex;
+        return *m;
+    }
+    static vector<unique_ptr<Buffer>> &buffers() {
+        static auto *all = new vector<unique_ptr<Buffer>>;
+        return *all;
+    }
+
+    static Buffer &buffer() {
+        thread_local Buffer *mine = nullptr;
+        if (!mine) {
+            lock_guard<mutex> hold(lock());
+            auto &all = buffers();
+            all.push_back(make_unique<Buffer>());
+            mine = all.back().get();
+            mine->tid = uint32_t(all.size());
+        }
+        return *mine;
+    }
+
+    // JSON text built in a fixed buffer and written out a chunk at a time,
+    // so the buffer stays in cache. Every piece is copied with memcpy; a
+    // std::string append per piece costs twice as much over a million events.
+    class Json {
+    public:
+        explicit Json(FILE *out) : out_(out), text_(kChunk + kSlack), end_(text_.data()) {}
+
+        void put(string_view s) {
+            if (s.size() > kSlack) {
+                flush();
+                ok_ &= fwrite(s.data(), 1, s.size(), out_) == s.size();
+                return;
+            }
+            memcpy(end_, s.data(), s.size());
+            end_ += s.size();
+            if (size_t(end_ - text_.data()) >= kChunk) flush();
+        }
+
+        void number(int64_t n) {
+            char text[24];
+            put(string_view(text, size_t(to_chars(text, text + sizeof text, n).ptr - text)));
+        }
+
+        // Nanoseconds as microseconds, the unit of "ts" and "dur".
+        void micros(int64_t ns) {
+            number(ns / 1000);
+            char frac[4] = {'.', char('0' + ns / 100 % 10), char('0' + ns / 10 % 10), char('0' + ns % 10)};
+            put(string_view(frac, 4));
+        }
+
+        // Quotes and backslashes escaped, control characters dropped.
+        void escape(string_view s) {
+            size_t run = 0;
+            for (size_t i = 0; i < s.size(); ++i) {
+                char c = s[i];
+                if (c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20) continue;
+                put(s.substr(run, i - run));
+                if (c == '"' || c == '\\') put(c == '"' ? "\\\"" : "\\\\");
+                run = i + 1;
+            }
+            put(s.substr(run));
+        }
+
+        bool flush() {
+            size_t size = size_t(end_ - text_.data());
+            ok_ &= fwrite(text_.data(), 1, size, out_) == size;
+            end_ = text_.data();
+            return ok_;
+        }
+
+    private:
+        static constexpr size_t kChunk = 1 << 20, kSlack = 4096;
+        FILE *out_;
+        vector<char> text_;
+        char *end_;
+        bool ok_ = true;
+    };
+};
+
+// A span from construction to destruction, recorded if tracing is on and
+// it lasted at least `minNs` (so waits that end at once are left out).
+class TraceScope {
+public:
+    TraceScope(const char *name, const char *category, int64_t minNs = 0)
+        : name_(name), category_(category), start_(Trace::enabled() ? Trace::now() : -1), minNs_(minNs) {}
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+    ~TraceScope() {
+        if (start_ < 0) return;
+        int64_t duration = Trace::now() - start_;
+        if (duration >= minNs_) Trace::record({name_, category_, start_, duration, argName_, arg_});
+    }
+
+    // Attach one number to the span (a size, a count, an index).
+    void arg(const char *name, int64_t value) {
+        argName_ = name;
+        arg_ = value;
+    }
+
+private:
+    const char *name_, *category_;
+    int64_t start_, minNs_;
+    const char *argName_ = nullptr;
+    int64_t arg_ = 0;
+};
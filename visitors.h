@@ -0,0 +1,147 @@
+// visitors.h
+// Token analysis plugins fused at compile time. A plugin is a plain class
+// with handlers for the tokens it cares about:
+//
+//   void onToken(const Token &t);                         every token
+//   void on(KindTag<TokenKind::Identifier>, const Token &t);  one kind
+//
+// FusedVisitor<P1, P2, ...> calls every onToken() handler inline, then
+// branches once on the token's kind to the handlers for that kind: the
+// kinds some plugin handles are folded at compile time into one chain of
+// constant compares, which the compiler turns into a single switch. N
+// plugins thus cost one dispatch per token, with every handler inlined.
+// The DynamicVisitor below is the runtime-registered alternative, for
+// comparison: one virtual call per plugin per token.
+
+#pragma once
+
+#include "fanout.h"
+#include "interner.h"
+
+template <TokenKind K>
+struct KindTag {};
+
+template <class P, TokenKind K, class = void>
+struct HandlesKind : false_type {};
+template <class P, TokenKind K>
+struct HandlesKind<P, K, void_t<decltype(declval<P &>().on(KindTag<K>{}, declval<const Token &>()))>> : true_type {};
+
+template <class P, class = void>
+struct HandlesEveryToken : false_type {};
+template <class P>
+struct HandlesEveryToken<P, void_t<decltype(declval<P &>().onToken(declval<const Token &>()))>> : true_type {};
+
+template <class... Plugins>
+class FusedVisitor {
+public:
+    void visit(const Token &t) {
+        (every(std::get<Plugins>(plugins_), t), ...);
+        dispatch(t, make_index_sequence<size_t(TokenKind::Count)>{});
+    }
+    void visit(const Token *tokens, size_t count) {
+        for (size_t i = 0; i < count; ++i) visit(tokens[i]);
+    }
+
+    template <class P>
+    P &get() { return std::get<P>(plugins_); }
+    template <class P>
+    const P &get() const { return std::get<P>(plugins_); }
+
+private:
+    tuple<Plugins...> plugins_;
+
+    template <class P>
+    static void every(P &p, const Token &t) {
+        if constexpr (HandlesEveryToken<P>::value) p.onToken(t);
+    }
+
+    template <TokenKind K>
+    static constexpr bool handled() { return (HandlesKind<Plugins, K>::value || ...); }
+
+    template <class P, TokenKind K>
+    static void one(P &p, const Token &t) {
+        if constexpr (HandlesKind<P, K>::value) p.on(KindTag<K>{}, t);
+    }
+
+    template <TokenKind K>
+    bool handle(const Token &t) {
+        (one<Plugins, K>(std::get<Plugins>(plugins_), t), ...);
+        return true;
+    }
+
+    // `handled<K>() && t.kind == K && handle<K>(t)` for each kind: kinds no
+    // plugin handles drop out at compile time.
+    template <size_t... Ks>
+    void dispatch(const Token &t, index_sequence<Ks...>) {
+        (void)((handled<TokenKind(Ks)>() && t.kind == TokenKind(Ks) && handle<TokenKind(Ks)>(t)) || ...);
+    }
+};
+
+// Feeds a TokenFanout's batches to a FusedVisitor, so fused plugins count
+// as one consumer.
+template <class... Plugins>
+class FusedConsumer : public TokenConsumer {
+public:
+    FusedVisitor<Plugins...> visitor;
+
+    void consume(const Token *tokens, size_t count) override { visitor.visit(tokens, count); }
+};
+
+// ---------- Runtime registration ----------
+
+class TokenVisitor {
+public:
+    virtual ~TokenVisitor() = default;
+    virtual void visit(const Token &t) = 0;
+};
+
+// A plugin behind the virtual interface: the same handlers, plus one
+// virtual call per token.
+template <class P>
+class VirtualPlugin : public TokenVisitor {
+public:
+    P &plugin() { return visitor_.template get<P>(); }
+    void visit(const Token &t) override { visitor_.visit(t); }
+
+private:
+    FusedVisitor<P> visitor_;
+};
+
+class DynamicVisitor {
+public:
+    void add(TokenVisitor &v) { visitors_.push_back(&v); }
+    void visit(const Token &t) {
+        for (TokenVisitor *v : visitors_) v->visit(t);
+    }
+
+private:
+    vector<TokenVisitor *> visitors_;
+};
+
+// ---------- Built-in plugins ----------
+
+struct TokenCounter {
+    size_t tokens = 0;
+    void onToken(const Token &) { ++tokens; }
+};
+
+// Lines that hold at least one token.
+struct LineCounter {
+    size_t lines = 0;
+    int last = 0;
+    void onToken(const Token &t) {
+        lines += t.line != last;
+        last = t.line;
+    }
+};
+
+// Occurrences of each identifier, by its ID in `names`.
+struct IdentifierHistogram {
+    Interner names;
+    vector<size_t> counts;
+    void on(KindTag<TokenKind::Identifier>, const Token &t) {
+        uint32_t id = names.intern(t);
+        if (id == counts.size()) counts.push_back(0);
+        ++counts[id];
+    }
+};
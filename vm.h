@@ -0,0 +1,313 @@
+// vm.h
+// Interpreter for the register bytecode in bytecode.h. The dispatch loop
+// uses computed goto (GCC/Clang labels as values): every handler ends with
+// its own indirect jump to the next one, which predicts far better than a
+// single shared switch. Other compilers, or a build with -DTK_VM_SWITCH,
+// get the same handlers as switch cases. With VmOptions::jit, hot functions
+// and loops continue in native code (see jit.h).
+
+#pragma once
+
+#include "jit.h"
+
+#if defined(__GNUC__) && !defined(TK_VM_SWITCH)
+#define TK_VM_COMPUTED_GOTO 1
+#endif
+
+struct VmOptions {
+    // A step is one call or one jump back to the top of a loop; running
+    // past maxSteps stops the program (RunStatus::StepLimit).
+    uint64_t maxSteps = UINT64_MAX;
+    uint32_t maxCallDepth = 10000;
+    // Compile functions to native code once their entry or a loop header
+    // has been reached jitThreshold times (where Jit::available()).
+    bool jit = false;
+    uint32_t jitThreshold = 1000;
+};
+
+enum class RunStatus { Ok, RuntimeError, StepLimit };
+
+class VM {
+public:
+    explicit VM(VmOptions options = {}) : options_(options) {}
+
+    // Run the program's top level, then main() if it defines one. print()
+    // output goes to `out`. On failure error() has the line and reason.
+    RunStatus run(const Program &program, ostream &out) {
+        program_ = &program;
+        sink_ = &out;
+        output_.clear();
+        globals_.assign(program.globals.size(), Value{0});
+        steps_ = 0;
+        exitCode_ = 0;
+        error_ = {0, ""};
+        jit_.reset();
+        if (options_.jit && Jit::available())
+            jit_ = make_unique<Jit>(program, options_.jitThreshold, options_.maxCallDepth);
+
+        RunStatus status = execute(0);
+        if (status == RunStatus::Ok && program.mainFunction >= 0) {
+            status = execute(static_cast<uint32_t>(program.mainFunction));
+            if (status == RunStatus::Ok && program.functions[program.mainFunction].returnType != ValueType::Void)
+                exitCode_ = result_.i;
+        }
+        flush();
+        return status;
+    }
+
+    const Diagnostic &error() const { return error_; }
+    int64_t exitCode() const { return exitCode_; }
+    const vector<Value> &globals() const { return globals_; }
+    uint64_t steps() const { return steps_; }
+    const Jit *jit() const { return jit_.get(); }
+
+private:
+    struct Frame {
+        const Instr *ret; // where the caller resumes
+        size_t base;      // the caller's first register in stack_
+    };
+
+    VmOptions options_;
+    const Program *program_ = nullptr;
+    ostream *sink_ = nullptr;
+    string output_; // print() output, flushed to sink_ in large chunks
+    vector<Value> globals_;
+    vector<Value> stack_; // register windows of all active calls
+    vector<Frame> frames_;
+    uint64_t steps_ = 0;
+    int64_t exitCode_ = 0;
+    Value result_{0};
+    Diagnostic error_{0, ""};
+    unique_ptr<Jit> jit_;
+
+    void flush() {
+        sink_->write(output_.data(), output_.size());
+        output_.clear();
+    }
+
+    RunStatus fail(RunStatus status, const Instr *ip, const char *message) {
+        error_ = {program_->lines[ip - program_->code.data()], message};
+        return status;
+    }
+
+    // Run function `index` (taking no arguments) to completion.
+    RunStatus execute(uint32_t index) {
+        const Program &program = *program_;
+        const Instr *const code = program.code.data();
+        const Value *const constants = program.constants.data();
+        Value *const globals = globals_.data();
+        const uint64_t maxSteps = options_.maxSteps;
+        Jit *const jit = jit_.get();
+
+        const BytecodeFunction &entry = program.functions[index];
+        if (stack_.size() < entry.numRegs) stack_.resize(max<size_t>(entry.numRegs, 1024));
+        frames_.clear();
+        frames_.push_back({nullptr, 0});
+        Value *regs = stack_.data();
+        const Instr *ip = code + entry.entry;
+
+#define A regs[ip->a]
+#define B regs[ip->b]
+#define C regs[ip->c]
+#ifdef TK_VM_COMPUTED_GOTO
+        static const void *const labels[] = {
+#define TK_OP_LABEL(name) &&op_##name,
+            TK_OPCODES(TK_OP_LABEL)
+#undef TK_OP_LABEL
+        };
+#define DISPATCH() goto *labels[static_cast<int>(ip->op)]
+#define CASE(name) op_##name:
+#else
+#define DISPATCH() goto dispatch
+#define CASE(name) case Op::name:
+#endif
+#define NEXT()     \
+    {              \
+        ++ip;      \
+        DISPATCH(); \
+    }
+
+        if (jit) goto native;
+#ifdef TK_VM_COMPUTED_GOTO
+        DISPATCH();
+#else
+    dispatch:
+        switch (ip->op) {
+#endif
+        CASE(Move) A = B; NEXT();
+        CASE(LoadI) A.i = int32_t(ip->wide()); NEXT();
+        CASE(LoadK) A = constants[ip->wide()]; NEXT();
+        CASE(LoadG) A = globals[ip->b]; NEXT();
+        CASE(StoreG) globals[ip->b] = A; NEXT();
+
+        CASE(AddI) A.i = wrapInt32(B.i + C.i); NEXT();
+        CASE(AddL) A.i = wrapAdd(B.i, C.i); NEXT();
+        CASE(AddF) A.f = roundToFloat(B.f + C.f); NEXT();
+        CASE(AddD) A.f = B.f + C.f; NEXT();
+        CASE(SubI) A.i = wrapInt32(B.i - C.i); NEXT();
+        CASE(SubL) A.i = wrapSub(B.i, C.i); NEXT();
+        CASE(SubF) A.f = roundToFloat(B.f - C.f); NEXT();
+        CASE(SubD) A.f = B.f - C.f; NEXT();
+        CASE(MulI) A.i = wrapInt32(B.i * C.i); NEXT();
+        CASE(MulL) A.i = wrapMul(B.i, C.i); NEXT();
+        CASE(MulF) A.f = roundToFloat(B.f * C.f); NEXT();
+        CASE(MulD) A.f = B.f * C.f; NEXT();
+        CASE(DivI)
+            if (C.i == 0) return fail(RunStatus::RuntimeError, ip, "division by zero");
+            A.i = wrapInt32(B.i / C.i);
+            NEXT();
+        CASE(DivL)
+            if (C.i == 0) return fail(RunStatus::RuntimeError, ip, "division by zero");
+            A.i = wrapDiv(B.i, C.i);
+            NEXT();
+        CASE(DivF) A.f = roundToFloat(B.f / C.f); NEXT();
+        CASE(DivD) A.f = B.f / C.f; NEXT();
+        CASE(ModI)
+            if (C.i == 0) return fail(RunStatus::RuntimeError, ip, "division by zero");
+            A.i = B.i % C.i;
+            NEXT();
+        CASE(ModL)
+            if (C.i == 0) return fail(RunStatus::RuntimeError, ip, "division by zero");
+            A.i = wrapMod(B.i, C.i);
+            NEXT();
+        CASE(ShlI) A.i = wrapInt32(shiftLeft(B.i, C.i, 32)); NEXT();
+        CASE(ShlL) A.i = shiftLeft(B.i, C.i, 64); NEXT();
+        CASE(ShrI) A.i = shiftRight(B.i, C.i, 32); NEXT();
+        CASE(ShrL) A.i = shiftRight(B.i, C.i, 64); NEXT();
+        CASE(And) A.i = B.i & C.i; NEXT();
+        CASE(Or) A.i = B.i | C.i; NEXT();
+        CASE(Xor) A.i = B.i ^ C.i; NEXT();
+
+        CASE(Lt) A.i = B.i < C.i; NEXT();
+        CASE(Le) A.i = B.i <= C.i; NEXT();
+        CASE(Eq) A.i = B.i == C.i; NEXT();
+        CASE(Ne) A.i = B.i != C.i; NEXT();
+        CASE(LtD) A.i = B.f < C.f; NEXT();
+        CASE(LeD) A.i = B.f <= C.f; NEXT();
+        CASE(EqD) A.i = B.f == C.f; NEXT();
+        CASE(NeD) A.i = B.f != C.f; NEXT();
+
+        CASE(NegI) A.i = wrapInt32(wrapSub(0, B.i)); NEXT();
+        CASE(NegL) A.i = wrapSub(0, B.i); NEXT();
+        CASE(NegD) A.f = -B.f; NEXT();
+        CASE(Not) A.i = B.i == 0; NEXT();
+        CASE(NotD) A.i = B.f == 0; NEXT();
+        CASE(BitNot) A.i = ~B.i; NEXT();
+        CASE(IncI) A.i = wrapInt32(A.i + int16_t(ip->b)); NEXT();
+        CASE(IncL) A.i = wrapAdd(A.i, int16_t(ip->b)); NEXT();
+
+        CASE(ToBool) A.i = B.i != 0; NEXT();
+        CASE(ToBoolD) A.i = B.f != 0; NEXT();
+        CASE(Sext8) A.i = narrowInteger(B.i, ValueType::Char); NEXT();
+        CASE(Sext16) A.i = narrowInteger(B.i, ValueType::Short); NEXT();
+        CASE(Sext32) A.i = wrapInt32(B.i); NEXT();
+        CASE(I2F) A.f = roundToFloat(static_cast<double>(B.i)); NEXT();
+        CASE(I2D) A.f = static_cast<double>(B.i); NEXT();
+        CASE(D2F) A.f = roundToFloat(B.f); NEXT();
+        CASE(D2I) A.i = doubleToInteger(B.f); NEXT();
+
+        CASE(Jmp)
+            ip = code + ip->wide();
+            DISPATCH();
+        CASE(Loop)
+            if (++steps_ > maxSteps) return fail(RunStatus::StepLimit, ip, "step limit exceeded");
+            ip = code + ip->wide();
+            if (jit) goto native;
+            DISPATCH();
+        CASE(Jz)
+            ip = A.i == 0 ? code + ip->wide() : ip + 1;
+            DISPATCH();
+        CASE(Jnz)
+            ip = A.i != 0 ? code + ip->wide() : ip + 1;
+            DISPATCH();
+
+        CASE(Call) {
+            if (++steps_ > maxSteps) return fail(RunStatus::StepLimit, ip, "step limit exceeded");
+            if (frames_.size() >= options_.maxCallDepth)
+                return fail(RunStatus::RuntimeError, ip, "call stack overflow");
+            const BytecodeFunction &fn = program.functions[ip->b];
+            size_t callerBase = regs - stack_.data();
+            size_t base = callerBase + ip->a;
+            if (base + fn.numRegs > stack_.size()) stack_.resize(max(stack_.size() * 2, base + fn.numRegs));
+            frames_.push_back({ip + 1, callerBase});
+            regs = stack_.data() + base;
+            ip = code + fn.entry;
+            if (jit) goto native;
+            DISPATCH();
+        }
+        CASE(Ret) {
+            Value v = A;
+            Frame f = frames_.back();
+            frames_.pop_back();
+            if (frames_.empty()) {
+                result_ = v;
+                return RunStatus::Ok;
+            }
+            regs[0] = v; // the caller's base register
+            regs = stack_.data() + f.base;
+            ip = f.ret;
+            DISPATCH();
+        }
+        CASE(RetV) {
+            Frame f = frames_.back();
+            frames_.pop_back();
+            if (frames_.empty()) return RunStatus::Ok;
+            regs = stack_.data() + f.base;
+            ip = f.ret;
+            DISPATCH();
+        }
+        CASE(Print)
+            appendValue(output_, A, ValueType(ip->b), program.strings);
+            if (ValueType(ip->b) != ValueType::Void || ip->c) output_ += ip->c ? '\n' : ' ';
+            if (output_.size() >= 64 * 1024) flush();
+            NEXT();
+#ifndef TK_VM_COMPUTED_GOTO
+        }
+#endif
+
+    // At a function entry or loop header: continue in native code if the
+    // JIT has (or now makes) code for it. Native code uses the same
+    // registers, so it picks up exactly where the interpreter is.
+    native: {
+        uint32_t pc = uint32_t(ip - code);
+        const void *entry = jit->entry(pc);
+        if (!entry) DISPATCH();
+        size_t offset = regs - stack_.data();
+        size_t need = offset + jit->windowSize(pc, frames_.size());
+        if (need > stack_.size()) {
+            stack_.resize(need);
+            regs = stack_.data() + offset;
+        }
+        JitContext ctx{globals, steps_, maxSteps, frames_.size(), options_.maxCallDepth, 0};
+        JitExit exit = jit->run(entry, regs, ctx);
+        steps_ = ctx.steps;
+        ip = code + ctx.exitPc;
+        switch (exit) {
+            case JitExit::Return: {
+                // The function returned, its result already in regs[0].
+                Frame f = frames_.back();
+                frames_.pop_back();
+                if (frames_.empty()) {
+                    result_ = regs[0];
+                    return RunStatus::Ok;
+                }
+                regs = stack_.data() + f.base;
+                ip = f.ret;
+                DISPATCH();
+            }
+            case JitExit::SideExit: DISPATCH();
+            case JitExit::DivisionByZero: return fail(RunStatus::RuntimeError, ip, "division by zero");
+            case JitExit::CallStackOverflow: return fail(RunStatus::RuntimeError, ip, "call stack overflow");
+            case JitExit::StepLimit: return fail(RunStatus::StepLimit, ip, "step limit exceeded");
+        }
+        return RunStatus::Ok; // not reached
+    }
+
+#undef A
+#undef B
+#undef C
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+    }
+};